@@ -3,11 +3,17 @@
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <limits.h>
 
 #include <json.h>
 
 #include "dynarray.h"
+#include "nameindex.h"
+#include "dirtymap.h"
 #include "filesystem.h"
+#include "notify.h"
+#include "dedup.h"
 #include "log.h"
 
 #include "actions.h"
@@ -66,6 +72,10 @@ static void freeAction(Action* action)
 		free(action->content);
 	}
 
+	if (action->chunkEnds != NULL) {
+		free(action->chunkEnds);
+	}
+
 	free(action);
 }
 
@@ -74,16 +84,8 @@ static int doAction(Action* action)
 	logPrintf(LOG_VERBOSE_DEBUG, "do action\n");
 
 	if (action->actionType == ActionTypeAddFile) {
-		DynArray pathArray;
-		memset(&pathArray, 0, sizeof(DynArray));
-		const char *fileName = path_split(action->path, &pathArray);
-		if (fileName == NULL) {
-			logPrintf(LOG_ERROR, "doAction: path_split() failed\n");
-			return 1;
-		}
-
-		FilesystemDir *containingDir = findContainingDir(&pathArray);
-		path_free(&pathArray);
+		const char *fileName = NULL;
+		FilesystemDir *containingDir = findContainingDir(action->path, &fileName);
 
 		if (containingDir == NULL) {
 			logPrintf(LOG_ERROR, "doAction: path not found when adding file %s\n", action->path);
@@ -96,36 +98,31 @@ static int doAction(Action* action)
 			return 3;
 		}
 
-		FilesystemFile* newFile = malloc(sizeof(FilesystemFile));
+		FilesystemFile* newFile = newFilesystemFile(fileName, containingDir);
 		if (newFile == NULL) {
-			logPrintf(LOG_ERROR, "doAction: malloc(): %s\n", strerror(errno));
+			logPrintf(LOG_ERROR, "doAction: newFilesystemFile() failed\n");
 			return 4;
 		}
 
-		newFile->name = fileName;
 		newFile->atime = newFile->mtime = action->time;
 		newFile->content = action->content;
 		newFile->contentLen = action->contentLen;
 		newFile->size = action->size;
 		newFile->blockSize = action->blockSize;
-		newFile->dirtyFlags = 0;
-		memset(&newFile->pendingWrites, 0, sizeof(DynArray));
-		newFile->parentDir = containingDir;
+		newFile->tierBlocks = action->tierBlocks;
+		newFile->chunkEnds = action->chunkEnds;
 
-		addToDynArray(&containingDir->files, newFile);
+		if (addFileToDir(containingDir, newFile) != 0) {
+			logPrintf(LOG_ERROR, "doAction: addFileToDir() failed\n");
+			freeFilesystemFile(newFile);
+			return 18;
+		}
+		notifyChange(containingDir->ino, 0, action->path);
 		return 0;
 
 	} else if (action->actionType == ActionTypeEditFile) {
-		DynArray pathArray;
-		memset(&pathArray, 0, sizeof(DynArray));
-		const char *fileName = path_split(action->path, &pathArray);
-		if (fileName == NULL) {
-			logPrintf(LOG_ERROR, "doAction: path_split() failed\n");
-			return 4;
-		}
-
-		FilesystemDir *containingDir = findContainingDir(&pathArray);
-		path_free(&pathArray);
+		const char *fileName = NULL;
+		FilesystemDir *containingDir = findContainingDir(action->path, &fileName);
 
 		if (containingDir == NULL) {
 			logPrintf(LOG_ERROR, "doAction: path not found when editing file %s\n", action->path);
@@ -143,22 +140,17 @@ static int doAction(Action* action)
 		file->contentLen = action->contentLen;
 		file->size = action->size;
 		file->blockSize = action->blockSize;
+		file->tierBlocks = action->tierBlocks;
+		file->chunkEnds = action->chunkEnds;
 		file->dirtyFlags = 0;
-		memset(&file->pendingWrites, 0, sizeof(DynArray));
+		memset(&file->dirtyMap, 0, sizeof(DirtyMap));
 
+		notifyChange(containingDir->ino, file->ino, action->path);
 		return 0;
 
 	} else if (action->actionType == ActionTypeRemoveFile) {
-		DynArray pathArray;
-		memset(&pathArray, 0, sizeof(DynArray));
-		const char *fileName = path_split(action->path, &pathArray);
-		if (fileName == NULL) {
-			logPrintf(LOG_ERROR, "doAction: path_split() failed\n");
-			return 7;
-		}
-
-		FilesystemDir *containingDir = findContainingDir(&pathArray);
-		path_free(&pathArray);
+		const char *fileName = NULL;
+		FilesystemDir *containingDir = findContainingDir(action->path, &fileName);
 
 		if (containingDir == NULL) {
 			logPrintf(LOG_ERROR, "doAction: path not found when removing file %s\n", action->path);
@@ -171,55 +163,42 @@ static int doAction(Action* action)
 			return 9;
 		}
 
-		if (removeFromDynArrayUnordered(&containingDir->files, (void*)file) != 0) {
-			logPrintf(LOG_ERROR, "doAction: removeFromDynArrayUnordered() failed\n");
+		if (removeFileFromDir(containingDir, file) != 0) {
+			logPrintf(LOG_ERROR, "doAction: removeFileFromDir() failed\n");
 			return 10;
 		}
-		free(file);
+		notifyChange(containingDir->ino, file->ino, action->path);
+		dropFilesystemFile(file);
 		return 0;
 
 	} else if (action->actionType == ActionTypeAddDirectory) {
-		DynArray pathArray;
-		memset(&pathArray, 0, sizeof(DynArray));
-		const char *dirName = path_split(action->path, &pathArray);
-		if (dirName == NULL) {
-			logPrintf(LOG_ERROR, "doAction: path_split() failed\n");
-			return 11;
-		}
-
-		FilesystemDir *containingDir = findContainingDir(&pathArray);
-		path_free(&pathArray);
+		const char *dirName = NULL;
+		FilesystemDir *containingDir = findContainingDir(action->path, &dirName);
 
 		if (containingDir == NULL) {
 			logPrintf(LOG_ERROR, "doAction: path not found when adding directory %s\n", action->path);
 			return 12;
 		}
 
-		FilesystemDir* newDir = malloc(sizeof(FilesystemDir));
+		FilesystemDir* newDir = newFilesystemDir(dirName, containingDir);
 		if (newDir == NULL) {
-			logPrintf(LOG_ERROR, "doAction: malloc(): %s\n", strerror(errno));
+			logPrintf(LOG_ERROR, "doAction: newFilesystemDir() failed\n");
 			return 13;
 		}
-		memset(newDir, 0, sizeof(FilesystemDir));
 
-		newDir->name = dirName;
 		newDir->atime = newDir->mtime = action->time;
-		newDir->parentDir = containingDir;
 
-		addToDynArray(&containingDir->dirs, newDir);
+		if (addDirToDir(containingDir, newDir) != 0) {
+			logPrintf(LOG_ERROR, "doAction: addDirToDir() failed\n");
+			freeFilesystemDir(newDir);
+			return 19;
+		}
+		notifyChange(containingDir->ino, 0, action->path);
 		return 0;
 
 	} else if (action->actionType == ActionTypeRemoveDirectory) {
-		DynArray pathArray;
-		memset(&pathArray, 0, sizeof(DynArray));
-		const char *dirName = path_split(action->path, &pathArray);
-		if (dirName == NULL) {
-			logPrintf(LOG_ERROR, "doAction: path_split() failed\n");
-			return 14;
-		}
-
-		FilesystemDir *containingDir = findContainingDir(&pathArray);
-		path_free(&pathArray);
+		const char *dirName = NULL;
+		FilesystemDir *containingDir = findContainingDir(action->path, &dirName);
 
 		if (containingDir == NULL) {
 			logPrintf(LOG_ERROR, "doAction: path not found when adding directory %s\n", action->path);
@@ -232,13 +211,12 @@ static int doAction(Action* action)
 			return 16;
 		}
 
-		if (removeFromDynArrayUnordered(&containingDir->dirs, (void*)dir) != 0) {
-			logPrintf(LOG_ERROR, "doAction: removeFromDynArrayUnordered() failed\n");
+		if (removeDirFromDir(containingDir, dir) != 0) {
+			logPrintf(LOG_ERROR, "doAction: removeDirFromDir() failed\n");
 			return 17;
 		}
-		freeDynArray(&dir->dirs);
-		freeDynArray(&dir->files);
-		free(dir);
+		notifyChange(containingDir->ino, dir->ino, action->path);
+		freeFilesystemDir(dir);
 		return 0;
 
 	} else {
@@ -260,6 +238,10 @@ static int undoAction(Action* action)
 static DynArray actions;
 static DynArray actionsPending;
 
+// addAction() is called by flushes running concurrently under a shared tree
+// lock, so appending to actions needs its own lock
+static pthread_mutex_t actionsMutex = PTHREAD_MUTEX_INITIALIZER;
+
 // parses actions json document and appends actionsPending array with the results
 static void parseAction(char* buf, size_t size)
 {
@@ -322,6 +304,24 @@ static void parseAction(char* buf, size_t size)
 			blockSize = json_object_get_int64(blockSizeField);
 		}
 
+		// parse tierBlocks, files without it have blocks of the same size
+		json_object* tierBlocksField;
+		int64_t tierBlocks = 0;
+		if (json_object_object_get_ex(actionObj, "tierBlocks", &tierBlocksField) != 0) {
+			if (json_object_get_type(tierBlocksField) != json_type_int) {
+				logPrintf(LOG_ERROR, "parseAction: 'tierBlocks' field is not an integer\n");
+				continue;
+			}
+			tierBlocks = json_object_get_int64(tierBlocksField);
+		}
+		// the block layout walks the tiers until the blocks are big enough,
+		// which never happens with blocks of 0 bytes
+		if (blockSize < 0 || blockSize > INT_MAX || tierBlocks < 0 || tierBlocks > INT_MAX
+				|| (tierBlocks > 0 && blockSize == 0)) {
+			logPrintf(LOG_ERROR, "parseAction: 'blockSize' and 'tierBlocks' are not a valid block layout\n");
+			continue;
+		}
+
 		// parse action
 		json_object* actionTypeField;
 		if (json_object_object_get_ex(actionObj, "action", &actionTypeField) == 0) {
@@ -392,11 +392,54 @@ static void parseAction(char* buf, size_t size)
 			free(content);
 			continue;
 		}
+		if (contentLen > 0 && blockSize == 0) {
+			logPrintf(LOG_ERROR, "parseAction: 'content' without a 'blockSize'\n");
+			free(content);
+			continue;
+		}
+
+		// parse chunks, the lengths of the blocks of a chunked file
+		json_object* chunksField;
+		size_t* chunkEnds = NULL;
+		if (json_object_object_get_ex(actionObj, "chunks", &chunksField) != 0) {
+			if (json_object_get_type(chunksField) != json_type_array
+					|| json_object_array_length(chunksField) != contentLen) {
+				logPrintf(LOG_ERROR, "parseAction: 'chunks' field is not an array of the content length\n");
+				free(content);
+				continue;
+			}
+			chunkEnds = malloc(contentLen * sizeof(size_t));
+			if (chunkEnds == NULL) {
+				logPrintf(LOG_ERROR, "parseAction: malloc(): %s\n", strerror(errno));
+				free(content);
+				continue;
+			}
+			size_t end = 0;
+			for (j=0; j<contentLen; j++) {
+				json_object* chunkField = json_object_array_get_idx(chunksField, j);
+				if (json_object_get_type(chunkField) != json_type_int
+						|| json_object_get_int64(chunkField) <= 0) {
+					logPrintf(LOG_ERROR, "parseAction: 'chunks' contents is not a positive integer\n");
+					break;
+				}
+				end += json_object_get_int64(chunkField);
+				chunkEnds[j] = end;
+			}
+			if (j != contentLen || end != size) {
+				if (j == contentLen) {
+					logPrintf(LOG_ERROR, "parseAction: 'chunks' don't add up to 'size'\n");
+				}
+				free(chunkEnds);
+				free(content);
+				continue;
+			}
+		}
 
 		// create new action object
 		Action* newAction = malloc(sizeof(Action));
 		if (newAction == NULL) {
 			logPrintf(LOG_ERROR, "parseAction: malloc(): %s\n", strerror(errno));
+			free(chunkEnds);
 			free(content);
 			continue;
 		}
@@ -405,6 +448,7 @@ static void parseAction(char* buf, size_t size)
 		newAction->path = malloc(strlen(path) + 1);
 		if (newAction->path == NULL) {
 			logPrintf(LOG_ERROR, "parseAction: malloc(): %s\n", strerror(errno));
+			free(chunkEnds);
 			free(content);
 			free(newAction);
 			continue;
@@ -414,6 +458,8 @@ static void parseAction(char* buf, size_t size)
 		newAction->contentLen = contentLen;
 		newAction->size = size;
 		newAction->blockSize = blockSize;
+		newAction->tierBlocks = tierBlocks;
+		newAction->chunkEnds = chunkEnds;
 
 		addToDynArray(&actionsPending, newAction);
 	}
@@ -519,8 +565,10 @@ void actionAdded(char* actionName, char* buf, size_t size, int moreInThisBatch)
 
 	// move actions from actinsPending to actions, acting on them
 	for (int i=0; i<actionsPending.len; i++) {
-		addToDynArray(&actions, actionsPending.objects[i]);
-		doAction(actionsPending.objects[i]);
+		Action* action = actionsPending.objects[i];
+		addToDynArray(&actions, action);
+		dedupAddStored(action->content, action->contentLen);
+		doAction(action);
 	}
 	freeDynArray(&actionsPending);
 }
@@ -588,6 +636,24 @@ char* serializeAction(Action* action)
 		"size", json_object_new_int64(action->size));
 	json_object_object_add(jsonNewAction,
 		"blockSize", json_object_new_int(action->blockSize));
+	if (action->tierBlocks != 0) {
+		json_object_object_add(jsonNewAction,
+			"tierBlocks", json_object_new_int(action->tierBlocks));
+	}
+	if (action->chunkEnds != NULL) {
+		json_object* jsonChunks = json_object_new_array();
+		if (!jsonChunks) {
+			json_object_put(jsonNewActions);
+			json_object_put(jsonNewAction);
+			return NULL;
+		}
+		for (int i=0; i<action->contentLen; i++) {
+			size_t start = i > 0 ? action->chunkEnds[i - 1] : 0;
+			json_object_array_add(jsonChunks,
+				json_object_new_int64(action->chunkEnds[i] - start));
+		}
+		json_object_object_add(jsonNewAction, "chunks", jsonChunks);
+	}
 
 	json_object_array_add(jsonNewActions, jsonNewAction);
 
@@ -609,5 +675,7 @@ char* serializeAction(Action* action)
 
 void addAction(Action *newAction)
 {
+	pthread_mutex_lock(&actionsMutex);
 	addToDynArray(&actions, newAction);
+	pthread_mutex_unlock(&actionsMutex);
 }
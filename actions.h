@@ -16,6 +16,8 @@ typedef struct {
 	int contentLen;
 	size_t size;
 	int blockSize;
+	int tierBlocks; // see blocklayout.h, 0 when the action has no such field
+	size_t* chunkEnds; // contentLen chunk ends, NULL unless the file is chunked
 } Action;
 
 void actionAdded(char* actionName, char* buf, size_t size, int moreInThisBatch);
@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "../random.h"
+
+// Compares getRandomBytes() with reading /dev/urandom for every name, as
+// the names and the aes salts were made before random.c.
+
+#define NAME_BYTES 20
+#define DEFAULT_ITERATIONS 200000
+
+static int64_t getNanoseconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int readUrandom(unsigned char* buf, size_t size)
+{
+	FILE* file = fopen("/dev/urandom", "rb");
+	if (file == NULL) {
+		return 1;
+	}
+	size_t bytesRead = fread(buf, 1, size, file);
+	fclose(file);
+	return (bytesRead == size) ? 0 : 2;
+}
+
+int main(int argc, char** argv)
+{
+	int iterations = (argc > 1) ? atoi(argv[1]) : DEFAULT_ITERATIONS;
+	if (iterations <= 0) {
+		fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+		return 1;
+	}
+
+	unsigned char name[NAME_BYTES];
+
+	int64_t start = getNanoseconds();
+	for (int i=0; i<iterations; i++) {
+		if (readUrandom(name, NAME_BYTES) != 0) {
+			fprintf(stderr, "reading /dev/urandom failed\n");
+			return 2;
+		}
+	}
+	int64_t urandomTime = getNanoseconds() - start;
+
+	start = getNanoseconds();
+	for (int i=0; i<iterations; i++) {
+		if (getRandomBytes(name, NAME_BYTES) != 0) {
+			fprintf(stderr, "getRandomBytes failed\n");
+			return 3;
+		}
+	}
+	int64_t getRandomBytesTime = getNanoseconds() - start;
+
+	printf("%d %d-byte names\n", iterations, NAME_BYTES);
+	printf("  fopen/fread/fclose of /dev/urandom: %lld ns per name\n",
+		(long long)(urandomTime / iterations));
+	printf("  getRandomBytes():                   %lld ns per name\n",
+		(long long)(getRandomBytesTime / iterations));
+	return 0;
+}
@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+#include "blocklayout.h"
+
+static int nextTierBlockSize(int blockSize)
+{
+	if (blockSize >= MAX_TIER_BLOCK_SIZE / 2) {
+		return MAX_TIER_BLOCK_SIZE;
+	}
+	return blockSize * 2;
+}
+
+off_t blockLayoutStart(const BlockLayout* layout, int i)
+{
+	if (layout->chunkEnds != NULL) {
+		if (i == 0) {
+			return 0;
+		}
+		if (i > layout->chunks) {
+			i = layout->chunks;
+		}
+		return layout->chunkEnds[i - 1];
+	}
+
+	int blockSize = layout->blockSize;
+	if (layout->tierBlocks == 0) {
+		return (off_t)i * blockSize;
+	}
+
+	off_t start = 0;
+	while (i >= layout->tierBlocks && blockSize < MAX_TIER_BLOCK_SIZE) {
+		start += (off_t)blockSize * layout->tierBlocks;
+		i -= layout->tierBlocks;
+		blockSize = nextTierBlockSize(blockSize);
+	}
+	return start + (off_t)i * blockSize;
+}
+
+int blockLayoutSize(const BlockLayout* layout, int i)
+{
+	if (layout->chunkEnds != NULL) {
+		if (i >= layout->chunks) {
+			return layout->blockSize;
+		}
+		return layout->chunkEnds[i] - blockLayoutStart(layout, i);
+	}
+
+	int blockSize = layout->blockSize;
+	if (layout->tierBlocks == 0) {
+		return blockSize;
+	}
+
+	while (i >= layout->tierBlocks && blockSize < MAX_TIER_BLOCK_SIZE) {
+		i -= layout->tierBlocks;
+		blockSize = nextTierBlockSize(blockSize);
+	}
+	return blockSize;
+}
+
+size_t blockLayoutBytes(const BlockLayout* layout, int i, size_t fileSize)
+{
+	off_t start = blockLayoutStart(layout, i);
+	if (fileSize <= start) {
+		return 0;
+	}
+	size_t bytes = fileSize - start;
+	size_t size = blockLayoutSize(layout, i);
+	return bytes < size ? bytes : size;
+}
+
+int blockLayoutIndex(const BlockLayout* layout, off_t offset)
+{
+	if (layout->chunkEnds != NULL) {
+		// the first chunk that ends past offset
+		int low = 0;
+		int high = layout->chunks;
+		while (low < high) {
+			int middle = low + (high - low) / 2;
+			if (layout->chunkEnds[middle] <= offset) {
+				low = middle + 1;
+			} else {
+				high = middle;
+			}
+		}
+		return low;
+	}
+
+	int blockSize = layout->blockSize;
+	if (layout->tierBlocks == 0) {
+		return offset / blockSize;
+	}
+
+	int first = 0;
+	while (blockSize < MAX_TIER_BLOCK_SIZE && offset >= (off_t)blockSize * layout->tierBlocks) {
+		offset -= (off_t)blockSize * layout->tierBlocks;
+		first += layout->tierBlocks;
+		blockSize = nextTierBlockSize(blockSize);
+	}
+	return first + offset / blockSize;
+}
+
+int blockLayoutCount(const BlockLayout* layout, size_t fileSize)
+{
+	if (fileSize == 0 || layout->blockSize == 0) {
+		return 0;
+	}
+	return blockLayoutIndex(layout, fileSize - 1) + 1;
+}
@@ -0,0 +1,25 @@
+// Block layout of a file. With tierBlocks 0 all blocks have blockSize bytes.
+// Otherwise the blocks come in tiers of tierBlocks blocks, each tier with
+// blocks twice as large as the one before, up to MAX_TIER_BLOCK_SIZE. Blocks
+// never move when a tiered file grows, so appending only rewrites its tail.
+// The blocks of a chunked file end where chunkEnds says, they are cut by
+// their content, see dedup.h, and hold up to blockSize bytes.
+#define MAX_TIER_BLOCK_SIZE (128 * 1024 * 1024)
+
+typedef struct {
+	int blockSize;
+	int tierBlocks;
+	const size_t* chunkEnds; // NULL unless the file is chunked
+	int chunks;
+} BlockLayout;
+
+// where block i starts
+off_t blockLayoutStart(const BlockLayout* layout, int i);
+// how many bytes block i can hold
+int blockLayoutSize(const BlockLayout* layout, int i);
+// how many bytes block i holds in a file of fileSize bytes
+size_t blockLayoutBytes(const BlockLayout* layout, int i, size_t fileSize);
+// the block that holds offset
+int blockLayoutIndex(const BlockLayout* layout, off_t offset);
+// the number of blocks of a file of fileSize bytes
+int blockLayoutCount(const BlockLayout* layout, size_t fileSize);
@@ -23,7 +23,7 @@ Destination *destination;
 Encryption *encryption;
 
 static int initRepo(char* repository, char* passphrase, char* encryptionStr,
-	char* name, char* comment)
+	char* blockLayoutStr, char* name, char* comment)
 {
 	char* realPath = NULL;
 	getDestinationByPathPrefix(&destination, &realPath, repository);
@@ -54,6 +54,23 @@ static int initRepo(char* repository, char* passphrase, char* encryptionStr,
 	json_object_object_add(jsonRepositoryJson,
 		"encryption", json_object_new_string(
 			encryptionStr ? encryptionStr : "none"));
+	// without it, older versions can still read the repository
+	if (blockLayoutStr != NULL) {
+		json_object_object_add(jsonRepositoryJson,
+			"blockLayout", json_object_new_string(blockLayoutStr));
+	}
+
+	if (encryption->createKey != NULL) {
+		char* keyJson = NULL;
+		if (encryption->createKey(passphrase, &keyJson) != 0) {
+			logPrintf(LOG_ERROR, "initRepo: createKey failed\n");
+			json_object_put(jsonRepositoryJson);
+			return 3;
+		}
+		json_object_object_add(jsonRepositoryJson,
+			"key", json_tokener_parse(keyJson));
+		free(keyJson);
+	}
 
 	char* jsonData = (char*)json_object_to_json_string_ext(
 		jsonRepositoryJson, JSON_C_TO_STRING_PRETTY);
@@ -114,6 +131,7 @@ int main(int argc, char *argv[])
 {
 	char *passphrase = NULL;
 	char *encryptionStr = NULL;
+	char *blockLayoutStr = NULL;
 	char *name = NULL;
 	char *comment = NULL;
 
@@ -122,7 +140,7 @@ int main(int argc, char *argv[])
 	confInit();
 
 	int c;
-	while ((c = getopt (argc, argv, "Vhp:e:n:c:")) != -1) {
+	while ((c = getopt (argc, argv, "Vhp:e:b:n:c:")) != -1) {
 		switch (c) {
 			case 'V':
 				fprintf(stdout, "bucse version %s\n", PACKAGE_VERSION);
@@ -137,7 +155,13 @@ int main(int argc, char *argv[])
 						"    -V                     print version\n"
 						"    -h                     print help\n"
 						"    -p STRING              target repository passphrase\n"
-						"    -e STRING              encryption, can be 'none' or 'aes'\n"
+						"    -e STRING              encryption, can be 'none', 'aes', 'aes-hkdf'\n"
+						"                           or 'aead'\n"
+						"    -b STRING              block layout, can be 'uniform' (default),\n"
+						"                           'tiered', which rewrites less of growing files,\n"
+						"                           or 'chunked', which also allows mounting with\n"
+						"                           -o dedup. Older versions can't read the latter\n"
+						"                           two\n"
 						"    -n STRING              repository name (default: 'unnamed')\n"
 						"    -c STRING              comment about repository\n"
 				       );
@@ -149,6 +173,9 @@ int main(int argc, char *argv[])
 			case 'e':
 				encryptionStr = optarg;
 				break;
+			case 'b':
+				blockLayoutStr = optarg;
+				break;
 			case 'n':
 				name = optarg;
 				break;
@@ -178,12 +205,18 @@ int main(int argc, char *argv[])
 			encryptionStr);
 		return 3;
 	}
+	if (blockLayoutStr != NULL && strcmp(blockLayoutStr, "uniform") != 0
+			&& strcmp(blockLayoutStr, "tiered") != 0
+			&& strcmp(blockLayoutStr, "chunked") != 0) {
+		logPrintf(LOG_ERROR, "Unsupported block layout: %s\n", blockLayoutStr);
+		return 4;
+	}
 
 	int index;
 	int ret = 0;
 	for (index = optind; index < argc; index++)
 		ret += initRepo(argv[index], passphrase, encryptionStr,
-			name, comment);
+			blockLayoutStr, name, comment);
 
 	return ret;
 }
@@ -20,7 +20,16 @@
 #include <pthread.h>
 
 #include "dynarray.h"
+#include "nameindex.h"
+#include "dirtymap.h"
 #include "filesystem.h"
+#include "dentrycache.h"
+#include "inodetable.h"
+#include "notify.h"
+#include "readahead.h"
+#include "workpool.h"
+#include "writeback.h"
+#include "dedup.h"
 #include "actions.h"
 
 #include "conf.h"
@@ -34,6 +43,7 @@
 #include "operations/operations.h" // TODO: remove?
 #include "operations/getattr.h"
 #include "operations/flush.h"
+#include "operations/fsync.h"
 #include "operations/readdir.h"
 #include "operations/open.h"
 #include "operations/create.h"
@@ -46,6 +56,7 @@
 #include "operations/truncate.h"
 #include "operations/rename.h"
 #include "operations/init.h"
+#include "operations/lowlevel.h"
 
 uid_t cachedUid;
 gid_t cachedGid;
@@ -56,18 +67,14 @@ static void recursivelyFreeFilesystem(FilesystemDir* dir) {
 	}
 	for (int i=0; i<dir->files.len; i++) {
 		flushFile((FilesystemFile*)dir->files.objects[i]);
-		free(dir->files.objects[i]);
+		freeFilesystemFile((FilesystemFile*)dir->files.objects[i]);
 	}
 	
-	freeDynArray(&dir->dirs);
-	freeDynArray(&dir->files);
-	free(dir);
+	freeFilesystemDir(dir);
 }
 
 extern Destination destinationLocal;
 extern Destination destinationSsh;
-extern Encryption encryptionNone;
-extern Encryption encryptionAes;
 
 Destination *destination;
 Encryption *encryption;
@@ -94,7 +101,12 @@ static void actionAddedDecryptOneAction(char* actionName, char* buf, size_t size
 		free(decryptedBuf);
 		return;
 	}
+
+	// replayed actions change the tree structure, the destination calls
+	// this without the lock, so fetching actions doesn't block the tree
+	pthread_rwlock_wrlock(&bucseTreeLock);
 	actionAdded(actionName, decryptedBuf, decryptedBufLen, moreInThisBatch);
+	pthread_rwlock_unlock(&bucseTreeLock);
 	free(decryptedBuf);
 }
 
@@ -135,9 +147,33 @@ struct fuse_operations bucse_oper = {
 	.truncate = bucse_truncate_guarded,
 	.rename = bucse_rename_guarded,
 	.flush = bucse_flush_guarded,
+	.fsync = bucse_fsync_guarded,
 	.init = bucse_init_guarded,
 };
 
+struct fuse_lowlevel_ops bucse_ll_oper = {
+	.init = bucse_ll_init,
+	.lookup = bucse_ll_lookup,
+	.forget = bucse_ll_forget,
+	.forget_multi = bucse_ll_forget_multi,
+	.getattr = bucse_ll_getattr,
+	.setattr = bucse_ll_setattr,
+	.open = bucse_ll_open,
+	.create = bucse_ll_create,
+	.release = bucse_ll_release,
+	.read = bucse_ll_read,
+	.opendir = bucse_ll_opendir,
+	.readdir = bucse_ll_readdir,
+	.releasedir = bucse_ll_releasedir,
+	.write = bucse_ll_write,
+	.unlink = bucse_ll_unlink,
+	.mkdir = bucse_ll_mkdir,
+	.rmdir = bucse_ll_rmdir,
+	.rename = bucse_ll_rename,
+	.flush = bucse_ll_flush,
+	.fsync = bucse_ll_fsync,
+};
+
 enum {
 	KEY_HELP,
 	KEY_VERSION,
@@ -155,6 +191,22 @@ static struct fuse_opt bucse_opts[] = {
 	BUCSE_OPT("ro", readOnly, 1),
 	BUCSE_OPT("-R", readOnly, 1),
 	BUCSE_OPT("--read_only", readOnly, 1),
+	BUCSE_OPT("lowlevel", lowLevel, 1),
+	BUCSE_OPT("attr_timeout=%lf", attrTimeout, 0),
+	BUCSE_OPT("entry_timeout=%lf", entryTimeout, 0),
+	BUCSE_OPT("negative_timeout=%lf", negativeTimeout, 0),
+	BUCSE_OPT("writeback_cache", writebackCache, 1),
+	BUCSE_OPT("cache_entries=%d", cacheEntries, 0),
+	BUCSE_OPT("cache_bytes=%lu", cacheBytes, 0),
+	BUCSE_OPT("cache_policy=%s", cachePolicy, 0),
+	BUCSE_OPT("disk_cache=%s", diskCache, 0),
+	BUCSE_OPT("disk_cache_bytes=%lu", diskCacheBytes, 0),
+	BUCSE_OPT("read_ahead=%d", readAheadBlocks, 0),
+	BUCSE_OPT("fetch_threads=%d", fetchThreads, 0),
+	BUCSE_OPT("dirty_bytes=%lu", dirtyBytes, 0),
+	BUCSE_OPT("dirty_expire=%d", dirtyExpire, 0),
+	BUCSE_OPT("lazy_close", lazyClose, 1),
+	BUCSE_OPT("dedup", dedup, 1),
 
 	FUSE_OPT_KEY("-V",             KEY_VERSION),
 	FUSE_OPT_KEY("--version",      KEY_VERSION),
@@ -187,7 +239,47 @@ static int bucse_opt_proc(void *data, const char *arg, int key, struct fuse_args
 				"    -p STRING              same as '-opassphrase=STRING'\n"
 				"    -o ro                  read only mode\n"
 				"    -R                     same as '-oro'\n"
-				"    --read_only            same as '-oro'\n");
+				"    --read_only            same as '-oro'\n"
+				"    -o lowlevel            use the low-level fuse interface, which\n"
+				"                           addresses files by inode numbers\n"
+				"    -o attr_timeout=T      how long the kernel caches attributes,\n"
+				"                           in seconds (default: 1.0)\n"
+				"    -o entry_timeout=T     how long the kernel caches names (default: 1.0)\n"
+				"    -o negative_timeout=T  how long the kernel caches names that\n"
+				"                           don't exist (default: 0.0)\n"
+				"                           remote changes invalidate these caches\n"
+				"    -o writeback_cache     let the kernel buffer writes and send them\n"
+				"                           in larger chunks\n"
+				"    -o cache_entries=N     how many decrypted blocks are kept in memory\n"
+				"                           (default: 1024)\n"
+				"    -o cache_bytes=N       how many bytes of decrypted blocks are kept\n"
+				"                           in memory (default: 262144000)\n"
+				"    -o cache_policy=NAME   how cached blocks are replaced: lru, or 2q,\n"
+				"                           which keeps large scans from evicting\n"
+				"                           frequently used blocks (default: lru)\n"
+				"    -o disk_cache=DIR      also keep fetched (still encrypted) blocks\n"
+				"                           in DIR, across mounts\n"
+				"    -o disk_cache_bytes=N  how many bytes the disk cache may take\n"
+				"                           (default: 1073741824)\n"
+				"    -o read_ahead=N        fetch up to N blocks ahead of sequential\n"
+				"                           reads, 0 disables it (default: 8)\n"
+				"    -o fetch_threads=N     threads fetching blocks ahead and the blocks\n"
+				"                           of large reads in parallel (default: 4)\n"
+				"    -o dirty_bytes=N       write out the oldest dirty files in the\n"
+				"                           background while there are more than N\n"
+				"                           bytes of written data; writers flush\n"
+				"                           themselves past 2*N (default: 268435456)\n"
+				"    -o dirty_expire=T      write out files whose data has been dirty\n"
+				"                           for T seconds, 0 waits for close\n"
+				"                           (default: 30)\n"
+				"    -o lazy_close          return from close() right away and write\n"
+				"                           the file out in the background; errors are\n"
+				"                           only reported by fsync()\n"
+				"    -o dedup               store the same data once: name blocks by a\n"
+				"                           keyed hash of their data and cut new files\n"
+				"                           into blocks by their content; needs a\n"
+				"                           repository created with -b chunked and the\n"
+				"                           aes-hkdf or aead encryption, or none\n");
 		exit(0);
 
 	case KEY_VERSION:
@@ -209,9 +301,11 @@ void* tickThreadFunc(void* param)
 		}
 		pthread_mutex_unlock(&shutdownMutex);
 
-		pthread_mutex_lock(&bucseMutex);
+		// tick() takes the tree lock only to replay the actions it fetched
 		int tickResult = destination->tick();
-		pthread_mutex_unlock(&bucseMutex);
+
+		// tell the kernel about the remote changes, without the lock held
+		notifyFlush();
 
 		if (tickResult != 0) {
 			break;
@@ -221,6 +315,43 @@ void* tickThreadFunc(void* param)
 	return 0;
 }
 
+// replays the repository (postInit), daemonizes and starts the read-ahead
+// workers and the destination thread, called once the filesystem is mounted
+static int startDestination(int foreground)
+{
+	// call postInit()
+	{
+		int tickResult = destination->postInit();
+		if (tickResult != 0) {
+			return 5;
+		}
+	}
+
+	if (fuse_daemonize(foreground) != 0) {
+		return 6;
+	}
+
+	// threads don't survive fuse_daemonize(), so they're started after it
+	if (workPoolInit(conf.fetchThreads) != 0) {
+		return 8;
+	}
+	if (writeBackInit() != 0) {
+		return 9;
+	}
+
+	// initialize destination thread
+	if (destination->isTickable())
+	{
+		int ret = pthread_create(&tickThread, NULL, tickThreadFunc, NULL);
+		if (ret != 0) {
+			fuse_log(FUSE_LOG_ERR, "startDestination: pthread_create: %d\n", ret);
+			return 7;
+		}
+	}
+
+	return 0;
+}
+
 int bucse_fuse_main(int argc, char *argv[], const struct fuse_operations *op,
 		size_t op_size, void *user_data)
 {
@@ -269,33 +400,12 @@ int bucse_fuse_main(int argc, char *argv[], const struct fuse_operations *op,
 		goto out2;
 	}
 
-	
-	// call postInit()
-	{
-		pthread_mutex_lock(&bucseMutex);
-		int tickResult = destination->postInit();
-		pthread_mutex_unlock(&bucseMutex);
-		if (tickResult != 0) {
-			res = 5;
-			goto out3;
-		}
-	}
-
-	if (fuse_daemonize(opts.foreground) != 0) {
-		res = 6;
+	res = startDestination(opts.foreground);
+	if (res != 0) {
 		goto out3;
 	}
-
-	// initialize destination thread
-	if (destination->isTickable())
-	{
-		int ret = pthread_create(&tickThread, NULL, tickThreadFunc, NULL);
-		if (ret != 0) {
-			fuse_log(FUSE_LOG_ERR, "bucse_fuse_main: pthread_create: %d\n", ret);
-			res = 7;
-			goto out3;
-		}
-	}
+	// the kernel has nothing cached before the initial replay is done
+	notifySetFuse(fuse);
 
 	struct fuse_session *se = fuse_get_session(fuse);
 	if (fuse_set_signal_handlers(se) != 0) {
@@ -315,6 +425,7 @@ int bucse_fuse_main(int argc, char *argv[], const struct fuse_operations *op,
 
 	fuse_remove_signal_handlers(se);
 out3:
+	notifySetFuse(NULL);
 	fuse_unmount(fuse);
 out2:
 	fuse_destroy(fuse);
@@ -324,6 +435,88 @@ out1:
 	return res;
 }
 
+int bucse_fuse_ll_main(int argc, char *argv[], const struct fuse_lowlevel_ops *op,
+		size_t op_size, void *user_data)
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_session *se;
+	struct fuse_cmdline_opts opts;
+	int res;
+	struct fuse_loop_config config;
+
+	if (fuse_parse_cmdline(&args, &opts) != 0)
+		return 1;
+
+	if (opts.show_version) {
+		printf("FUSE library version %s\n", PACKAGE_VERSION);
+		fuse_lowlevel_version();
+		res = 0;
+		goto out1;
+	}
+
+	if (opts.show_help) {
+		if(args.argv[0][0] != '\0')
+			printf("usage: %s [options] <mountpoint>\n\n",
+					args.argv[0]);
+		printf("FUSE options:\n");
+		fuse_cmdline_help();
+		fuse_lowlevel_help();
+		res = 0;
+		goto out1;
+	}
+
+	if (!opts.show_help &&
+			!opts.mountpoint) {
+		fuse_log(FUSE_LOG_ERR, "no mountpoint specified\n");
+		res = 2;
+		goto out1;
+	}
+
+	se = fuse_session_new(&args, op, op_size, user_data);
+	if (se == NULL) {
+		res = 3;
+		goto out1;
+	}
+
+	if (fuse_session_mount(se, opts.mountpoint) != 0) {
+		res = 4;
+		goto out2;
+	}
+
+	res = startDestination(opts.foreground);
+	if (res != 0) {
+		goto out3;
+	}
+	// the kernel has nothing cached before the initial replay is done
+	notifySetSession(se);
+
+	if (fuse_set_signal_handlers(se) != 0) {
+		res = 8;
+		goto out3;
+	}
+
+	if (opts.singlethread)
+		res = fuse_session_loop(se);
+	else {
+		config.clone_fd = opts.clone_fd;
+		config.max_idle_threads = opts.max_idle_threads;
+		res = fuse_session_loop_mt(se, &config);
+	}
+	if (res)
+		res = 9;
+
+	fuse_remove_signal_handlers(se);
+out3:
+	notifySetSession(NULL);
+	fuse_session_unmount(se);
+out2:
+	fuse_session_destroy(se);
+out1:
+	free(opts.mountpoint);
+	fuse_opt_free_args(&args);
+	return res;
+}
+
 #define MAX_REPOSITORY_JSON_LEN (1024 * 1024)
 int parseRepositoryJsonFile() {
 	char* repositoryJsonFileContents = malloc(MAX_REPOSITORY_JSON_LEN);
@@ -372,16 +565,47 @@ int parseRepositoryJsonFile() {
 
 	const char* encryptionFieldStr = json_object_get_string(encryptionField);
 
-	if (strcmp(encryptionFieldStr, "none") == 0) {
-		encryption = &encryptionNone;
-	} else if (strcmp(encryptionFieldStr, "aes") == 0) {
-		encryption = &encryptionAes;
-	} else {
-		logPrintf(LOG_ERROR, "Unsupported encryption: %s\n", encryptionFieldStr);
+	encryption = getEncryptionByName((char*)encryptionFieldStr);
+	if (encryption == NULL) {
 		json_object_put(repositoryJson);
 		return 6;
 	}
 
+	// the key is loaded once the passphrase is known
+	json_object* keyField;
+	if (json_object_object_get_ex(repositoryJson, "key", &keyField) != 0) {
+		conf.repositoryKey = strdup(json_object_to_json_string(keyField));
+		if (conf.repositoryKey == NULL) {
+			logPrintf(LOG_ERROR, "parseRepositoryJsonFile: strdup failed\n");
+			json_object_put(repositoryJson);
+			return 7;
+		}
+	}
+
+	// repositories without it are read by older versions too, their files
+	// keep uniform blocks
+	json_object* blockLayoutField;
+	if (json_object_object_get_ex(repositoryJson, "blockLayout", &blockLayoutField) != 0) {
+		if (json_object_get_type(blockLayoutField) != json_type_string) {
+			logPrintf(LOG_ERROR, "'blockLayout' field is not a string\n");
+			json_object_put(repositoryJson);
+			return 8;
+		}
+		const char* blockLayoutStr = json_object_get_string(blockLayoutField);
+		if (strcmp(blockLayoutStr, "uniform") == 0) {
+			conf.tieredBlocks = 0;
+		} else if (strcmp(blockLayoutStr, "tiered") == 0) {
+			conf.tieredBlocks = 1;
+		} else if (strcmp(blockLayoutStr, "chunked") == 0) {
+			conf.tieredBlocks = 1;
+			conf.chunkedBlocks = 1;
+		} else {
+			logPrintf(LOG_ERROR, "unsupported block layout: %s\n", blockLayoutStr);
+			json_object_put(repositoryJson);
+			return 9;
+		}
+	}
+
 	json_object_put(repositoryJson);
 	return 0;
 }
@@ -466,12 +690,11 @@ int main(int argc, char** argv)
 	cachedUid = geteuid();
 	cachedGid = getegid();
 
-	root = malloc(sizeof(FilesystemDir));
+	root = newFilesystemDir(NULL, NULL);
 	if (root == NULL) {
-		logPrintf(LOG_ERROR, "malloc(): %s\n", strerror(errno));
+		logPrintf(LOG_ERROR, "newFilesystemDir() failed\n");
 		return 1;
 	}
-	memset(root, 0, sizeof(FilesystemDir));
 
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
@@ -482,6 +705,7 @@ int main(int argc, char** argv)
 	if (conf.repository == NULL) {
 		logPrintf(LOG_ERROR, "no repository specified\n");
 		recursivelyFreeFilesystem(root);
+		dentryCacheCleanup();
 		fuse_opt_free_args(&args);
 		confCleanup();
 		return 2;
@@ -489,10 +713,20 @@ int main(int argc, char** argv)
 	if (cacheInit() != 0) {
 		logPrintf(LOG_ERROR, "cache initialization failed\n");
 		recursivelyFreeFilesystem(root);
+		dentryCacheCleanup();
 		fuse_opt_free_args(&args);
 		confCleanup();
 		return 3;
 	}
+	if (operationsInit() != 0) {
+		logPrintf(LOG_ERROR, "operations initialization failed\n");
+		cacheCleanup();
+		recursivelyFreeFilesystem(root);
+		dentryCacheCleanup();
+		fuse_opt_free_args(&args);
+		confCleanup();
+		return 9;
+	}
 
 	getDestinationByPathPrefix(&destination,
 		&conf.repositoryRealPath, conf.repository);
@@ -502,7 +736,9 @@ int main(int argc, char** argv)
 	{
 		logPrintf(LOG_ERROR, "destination->init(): %d\n", err);
 		cacheCleanup();
+		operationsCleanup();
 		recursivelyFreeFilesystem(root);
+		dentryCacheCleanup();
 		actionsCleanup();
 		fuse_opt_free_args(&args);
 		confCleanup();
@@ -514,7 +750,9 @@ int main(int argc, char** argv)
 		logPrintf(LOG_ERROR, "parseRepositoryJsonFile() failed\n");
 
 		cacheCleanup();
+		operationsCleanup();
 		recursivelyFreeFilesystem(root);
+		dentryCacheCleanup();
 		destination->shutdown();
 		actionsCleanup();
 		fuse_opt_free_args(&args);
@@ -543,7 +781,9 @@ int main(int argc, char** argv)
 				logPrintf(LOG_ERROR, "fgets() failed\n");
 
 				cacheCleanup();
+				operationsCleanup();
 				recursivelyFreeFilesystem(root);
+				dentryCacheCleanup();
 				destination->shutdown();
 				actionsCleanup();
 				fuse_opt_free_args(&args);
@@ -574,7 +814,9 @@ int main(int argc, char** argv)
 			logPrintf(LOG_ERROR, "Encryption needs a passphrase\n");
 
 			cacheCleanup();
+			operationsCleanup();
 			recursivelyFreeFilesystem(root);
+			dentryCacheCleanup();
 			destination->shutdown();
 			actionsCleanup();
 			fuse_opt_free_args(&args);
@@ -583,6 +825,34 @@ int main(int argc, char** argv)
 		}
 	}
 
+	if (encryption->loadKey != NULL && encryption->loadKey(conf.repositoryKey, conf.passphrase) != 0) {
+		logPrintf(LOG_ERROR, "Loading the repository key failed, is the passphrase correct?\n");
+
+		cacheCleanup();
+		operationsCleanup();
+		recursivelyFreeFilesystem(root);
+		dentryCacheCleanup();
+		destination->shutdown();
+		actionsCleanup();
+		fuse_opt_free_args(&args);
+		confCleanup();
+		return 10;
+	}
+
+	if (dedupInit() != 0) {
+		logPrintf(LOG_ERROR, "dedup initialization failed\n");
+
+		cacheCleanup();
+		operationsCleanup();
+		recursivelyFreeFilesystem(root);
+		dentryCacheCleanup();
+		destination->shutdown();
+		actionsCleanup();
+		fuse_opt_free_args(&args);
+		confCleanup();
+		return 11;
+	}
+
 	err = parseRepositoryFile();
 	if (err != 0) {
 		logPrintf(LOG_ERROR, "parseRepositoryFile() failed\n");
@@ -590,8 +860,11 @@ int main(int argc, char** argv)
 			logPrintf(LOG_ERROR, "Is the passphrase correct?\n");
 		}
 
+		dedupCleanup();
 		cacheCleanup();
+		operationsCleanup();
 		recursivelyFreeFilesystem(root);
+		dentryCacheCleanup();
 		destination->shutdown();
 		actionsCleanup();
 		fuse_opt_free_args(&args);
@@ -600,7 +873,11 @@ int main(int argc, char** argv)
 	}
 
 	int fuse_stat;
-	fuse_stat = bucse_fuse_main(args.argc, args.argv, &bucse_oper, sizeof(bucse_oper), NULL);
+	if (conf.lowLevel) {
+		fuse_stat = bucse_fuse_ll_main(args.argc, args.argv, &bucse_ll_oper, sizeof(bucse_ll_oper), NULL);
+	} else {
+		fuse_stat = bucse_fuse_main(args.argc, args.argv, &bucse_oper, sizeof(bucse_oper), NULL);
+	}
 	logPrintf(LOG_DEBUG, "fuse_main returned %d\n", fuse_stat);
 	pthread_mutex_lock(&shutdownMutex);
 	shutdownTicking = 1;
@@ -612,12 +889,20 @@ int main(int argc, char** argv)
 		logPrintf(LOG_ERROR, "pthread_join: %d\n", ret);
 	}
 
+	writeBackCleanup();
+	workPoolCleanup();
+	readAheadCleanup();
 	cacheCleanup();
+	operationsCleanup();
 	// free filesystem
 	recursivelyFreeFilesystem(root);
+	dentryCacheCleanup();
+	inodeTableCleanup();
+	notifyCleanup();
 	destination->shutdown();
 
 	actionsCleanup();
+	dedupCleanup();
 
 	fuse_opt_free_args(&args);
 	confCleanup();
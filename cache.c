@@ -3,221 +3,412 @@
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
 
 #include "log.h"
-#include "dynarray.h"
+#include "nameindex.h"
+#include "conf.h"
 
+#include "diskcache.h"
 #include "cache.h"
 
-typedef struct _BlockslistItem {
-	struct _BlockslistItem *prev;
-	struct _BlockslistItem *next;
-	const char* key;
-} BlockslistItem;
+typedef struct _CacheEntry {
+	struct _CacheEntry *prev; // more recently used or added
+	struct _CacheEntry *next; // less recently used or added
+	char* key;
+	CacheBuffer* buffer; // NULL for ghost entries
+	int inQueue; // the entry is in the 2Q in queue
+} CacheEntry;
 
 typedef struct {
-	BlockslistItem *first;
-	BlockslistItem *last;
-} Blockslist;
-
+	CacheEntry *first;
+	CacheEntry *last;
+} CacheList;
+
+// Replacement policies:
+// - lru: a single LRU list.
+// - 2q: new blocks go to a FIFO in queue, and hits there don't count, since a
+//   sequential read hits the same block many times in a row. When they leave
+//   it, their names are remembered in a FIFO of ghosts; a block that is
+//   fetched again while it's a ghost goes to the LRU main list. A scan over
+//   many files passes through the in queue without evicting the main list.
+typedef enum {
+	CachePolicyLru,
+	CachePolicy2Q,
+} CachePolicy;
+
+static const char* cachePolicyNames[] = {"lru", "2q"};
+
+// Every shard is a cache of its own with its own lock, so readers of
+// different blocks don't wait for each other. The limits are global.
 typedef struct {
-	const char* key;
-	size_t size;
-	char* data;
-	BlockslistItem *blockslistItem;
-} Block;
+	pthread_mutex_t mutex;
+	NameIndex entries;
+	NameIndex ghosts;
+	CacheList main;
+	CacheList in;
+	CacheList out; // ghosts
+	size_t bytes;
+	size_t inBytes;
+	int outCount;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t ghostHits;
+} CacheShard;
+
+// a power of 2, the shard is picked by the top bits of the key hash
+#define CACHE_SHARDS_COUNT_BITS 4
+#define CACHE_SHARDS_COUNT (1 << CACHE_SHARDS_COUNT_BITS)
+
+// the share of a shard's bytes the 2Q in queue may take, and the number of
+// ghosts relative to the number of cached blocks, as suggested by the paper
+#define CACHE_2Q_IN_SHARE 4
+#define CACHE_2Q_OUT_SHARE 2
+
+static CacheShard shards[CACHE_SHARDS_COUNT];
+static CachePolicy cachePolicy;
+
+static atomic_int cacheCount;
+static atomic_size_t cacheBytes;
+// the shard to evict from next, eviction goes round the shards so that
+// their least recently used entries go first
+static atomic_uint evictionCursor;
+
+static CacheShard* getShard(const char* block)
+{
+	uint32_t hash = nameIndexHash(block, strlen(block));
+	return &shards[hash >> (32 - CACHE_SHARDS_COUNT_BITS)];
+}
 
-#define HASH_TABLE_BUCKETS_COUNT_AS_HEX_CHARS 3
-#define HASH_TABLE_BUCKETS_COUNT (1 << (4*HASH_TABLE_BUCKETS_COUNT_AS_HEX_CHARS))
+static void unlinkEntry(CacheList* list, CacheEntry* entry)
+{
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		list->first = entry->next;
+	}
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		list->last = entry->prev;
+	}
+	entry->prev = entry->next = NULL;
+}
 
-#define HASH_TABLE_SIZE_COUNT 1024
-#define HASH_TABLE_SIZE_BYTES 250*1024*1024
+static void linkEntryFirst(CacheList* list, CacheEntry* entry)
+{
+	entry->prev = NULL;
+	entry->next = list->first;
+	if (list->first) {
+		list->first->prev = entry;
+	}
+	list->first = entry;
+	if (list->last == NULL) {
+		list->last = entry;
+	}
+}
 
-static DynArray hashTableBuckets[HASH_TABLE_BUCKETS_COUNT];
+static void freeEntry(CacheEntry* entry)
+{
+	if (entry->buffer) {
+		cacheBufferUnref(entry->buffer);
+	}
+	free(entry->key);
+	free(entry);
+}
 
-static Blockslist blockslist;
-int blockslistCount;
-size_t blockslistBytes;
+static void freeList(CacheList* list)
+{
+	while (list->first) {
+		CacheEntry* entry = list->first;
+		list->first = entry->next;
+		freeEntry(entry);
+	}
+	list->last = NULL;
+}
 
-static int hexStringToHashIndex(const char* hex)
+CacheBuffer* cacheBufferNew(char* data, size_t size)
 {
-	int stringLen = strlen(hex);
-	int result = 0;
-	for (int i=0; i<HASH_TABLE_BUCKETS_COUNT_AS_HEX_CHARS; i++) {
-		if (i >= stringLen) {
-			continue;
-		}
+	CacheBuffer* buffer = malloc(sizeof(CacheBuffer));
+	if (buffer == NULL) {
+		logPrintf(LOG_ERROR, "cacheBufferNew: malloc(): %s\n", strerror(errno));
+		return NULL;
+	}
+	buffer->data = data;
+	buffer->size = size;
+	atomic_init(&buffer->refs, 1);
+	return buffer;
+}
 
-		int charValue = 0;
-		if (hex[i] >= '0' && hex[i] <= '9') {
-			charValue = (int)(hex[i] - '0');
-		} else if (hex[i] >= 'a' && hex[i] <= 'f') {
-			charValue = (int)(hex[i] - 'a') + 10;
-		} else if (hex[i] >= 'A' && hex[i] <= 'F') {
-			charValue = (int)(hex[i] - 'A') + 10;
-		}
+void cacheBufferRef(CacheBuffer* buffer)
+{
+	atomic_fetch_add(&buffer->refs, 1);
+}
 
-		result += charValue * (1 << (4*(HASH_TABLE_BUCKETS_COUNT_AS_HEX_CHARS-1-i)));
+void cacheBufferUnref(CacheBuffer* buffer)
+{
+	if (atomic_fetch_sub(&buffer->refs, 1) == 1) {
+		free(buffer->data);
+		free(buffer);
 	}
-	return result;
 }
 
 int cacheInit()
 {
-	// should be zeroed at start, but let's clean everything anyway
-	memset(&hashTableBuckets, 0, sizeof(DynArray)*HASH_TABLE_BUCKETS_COUNT);
-	memset(&blockslist, 0, sizeof(Blockslist));
-	blockslistCount = 0;
-	blockslistBytes = 0;
+	cachePolicy = CachePolicyLru;
+	if (conf.cachePolicy != NULL) {
+		if (strcmp(conf.cachePolicy, cachePolicyNames[CachePolicyLru]) == 0) {
+			cachePolicy = CachePolicyLru;
+		} else if (strcmp(conf.cachePolicy, cachePolicyNames[CachePolicy2Q]) == 0) {
+			cachePolicy = CachePolicy2Q;
+		} else {
+			logPrintf(LOG_ERROR, "cacheInit: unknown cache policy %s\n", conf.cachePolicy);
+			return 1;
+		}
+	}
+
+	for (int i=0; i<CACHE_SHARDS_COUNT; i++) {
+		memset(&shards[i], 0, sizeof(CacheShard));
+		pthread_mutex_init(&shards[i].mutex, NULL);
+	}
+	atomic_store(&cacheCount, 0);
+	atomic_store(&cacheBytes, 0);
+	atomic_store(&evictionCursor, 0);
 
+	logPrintf(LOG_DEBUG, "cacheInit: up to %d blocks, %lu bytes, %s policy\n",
+		conf.cacheEntries, conf.cacheBytes, cachePolicyNames[cachePolicy]);
+
+	if (diskCacheInit() != 0) {
+		logPrintf(LOG_ERROR, "cacheInit: diskCacheInit() failed\n");
+		return 2;
+	}
 	return 0;
 }
 
-int cacheGet(const char* block, char* buf, size_t *size)
+int cacheGet(const char* block, CacheBuffer** buffer)
 {
-	int index = hexStringToHashIndex(block);
+	CacheShard* shard = getShard(block);
+
+	pthread_mutex_lock(&shard->mutex);
+	CacheEntry* entry = findInNameIndex(&shard->entries, block);
+	if (entry == NULL) {
+		shard->misses++;
+		pthread_mutex_unlock(&shard->mutex);
+		logPrintf(LOG_VERBOSE_DEBUG, "cacheGet: cache miss: %s\n", block);
+		return -1;
+	}
 
-	for (int i=0; i<hashTableBuckets[index].len; i++) {
-		Block* item = (Block*)hashTableBuckets[index].objects[i];
+	// the reader gets its own reference, so the buffer outlives an eviction
+	cacheBufferRef(entry->buffer);
+	*buffer = entry->buffer;
 
-		if (strcmp(item->key, block) != 0) {
-			continue;
-		}
+	// hits in the 2Q in queue keep its FIFO order
+	if (!entry->inQueue && entry != shard->main.first) {
+		unlinkEntry(&shard->main, entry);
+		linkEntryFirst(&shard->main, entry);
+	}
+	shard->hits++;
+	pthread_mutex_unlock(&shard->mutex);
 
-		// item is found in the hashtable
-
-		memcpy(buf, item->data, item->size);
-		*size = item->size;
-
-		// move item in the blockslist to the front
-		if (item->blockslistItem != blockslist.first) {
-			if (item->blockslistItem == blockslist.last)
-				blockslist.last = item->blockslistItem->prev;
-			if (item->blockslistItem->prev)
-				item->blockslistItem->prev->next = item->blockslistItem->next;
-			if (item->blockslistItem->next)
-				item->blockslistItem->next->prev = item->blockslistItem->prev;
-			if (blockslist.first)
-				blockslist.first->prev = item->blockslistItem;
-			item->blockslistItem->next = blockslist.first;
-			item->blockslistItem->prev = NULL;
-			blockslist.first = item->blockslistItem;
+	logPrintf(LOG_VERBOSE_DEBUG, "cacheGet: cache hit: %s\n", block);
+	return 0;
+}
 
+int cacheContains(const char* block)
+{
+	CacheShard* shard = getShard(block);
+
+	pthread_mutex_lock(&shard->mutex);
+	int result = (findInNameIndex(&shard->entries, block) != NULL);
+	pthread_mutex_unlock(&shard->mutex);
+	return result;
+}
+
+// remembers the name of a block evicted from the 2Q in queue, the shard's
+// mutex needs to be held
+static void addGhost(CacheShard* shard, const char* block)
+{
+	CacheEntry* ghost = malloc(sizeof(CacheEntry));
+	if (ghost == NULL) {
+		return;
+	}
+	memset(ghost, 0, sizeof(CacheEntry));
+	ghost->key = strdup(block);
+	if (ghost->key == NULL || addToNameIndex(&shard->ghosts, ghost->key, ghost) != 0) {
+		freeEntry(ghost);
+		return;
+	}
+	linkEntryFirst(&shard->out, ghost);
+	shard->outCount++;
+
+	int maxOutCount = conf.cacheEntries / CACHE_SHARDS_COUNT / CACHE_2Q_OUT_SHARE + 1;
+	while (shard->outCount > maxOutCount) {
+		CacheEntry* oldest = shard->out.last;
+		unlinkEntry(&shard->out, oldest);
+		removeFromNameIndex(&shard->ghosts, oldest->key);
+		shard->outCount--;
+		freeEntry(oldest);
+	}
+}
+
+// takes the entry to evict out of the shard according to the policy, the
+// shard's mutex needs to be held. Returns NULL if the shard is empty.
+static CacheEntry* evictEntryLocked(CacheShard* shard)
+{
+	CacheEntry* entry = NULL;
+	if (shard->in.last != NULL && (shard->main.last == NULL
+			|| shard->inBytes * CACHE_2Q_IN_SHARE > shard->bytes)) {
+		entry = shard->in.last;
+		unlinkEntry(&shard->in, entry);
+		shard->inBytes -= entry->buffer->size;
+		addGhost(shard, entry->key);
+	} else if (shard->main.last != NULL) {
+		entry = shard->main.last;
+		unlinkEntry(&shard->main, entry);
+	} else {
+		return NULL;
+	}
+
+	removeFromNameIndex(&shard->entries, entry->key);
+	shard->bytes -= entry->buffer->size;
+	shard->evictions++;
+	return entry;
+}
+
+static int overLimits()
+{
+	return atomic_load(&cacheCount) > conf.cacheEntries
+		|| atomic_load(&cacheBytes) > conf.cacheBytes;
+}
+
+// evicts entries until the cache fits its limits. Only one shard is locked
+// at a time.
+static void evictEntries()
+{
+	int emptyShards = 0;
+	while (overLimits() && emptyShards < CACHE_SHARDS_COUNT) {
+		CacheShard* shard = &shards[atomic_fetch_add(&evictionCursor, 1) % CACHE_SHARDS_COUNT];
+
+		pthread_mutex_lock(&shard->mutex);
+		CacheEntry* entry = evictEntryLocked(shard);
+		if (entry == NULL) {
+			pthread_mutex_unlock(&shard->mutex);
+			emptyShards++;
+			continue;
 		}
+		emptyShards = 0;
+		atomic_fetch_sub(&cacheCount, 1);
+		atomic_fetch_sub(&cacheBytes, entry->buffer->size);
+		pthread_mutex_unlock(&shard->mutex);
 
-		logPrintf(LOG_VERBOSE_DEBUG, "cacheGet: cache hit: %s\n", block);
-		return 0;
+		logPrintf(LOG_VERBOSE_DEBUG, "cachePut: cache item removed: %s\n", entry->key);
+		freeEntry(entry);
 	}
-	logPrintf(LOG_VERBOSE_DEBUG, "cacheGet: cache miss: %s\n", block);
-	return -1;
 }
 
-int cachePut(const char* block, char* buf, size_t size)
+int cachePut(const char* block, CacheBuffer* buffer)
 {
-	int index = hexStringToHashIndex(block);
-	Block* newItem = (Block*)malloc(sizeof(Block));
-	if (!newItem) {
+	// allocate before taking the lock
+	CacheEntry* newEntry = (CacheEntry*)malloc(sizeof(CacheEntry));
+	if (!newEntry) {
 		logPrintf(LOG_ERROR, "cachePut: malloc(): %s\n", strerror(errno));
 		return 1;
 	}
+	memset(newEntry, 0, sizeof(CacheEntry));
 
-	BlockslistItem* newBlockslistItem = (BlockslistItem*)malloc(sizeof(BlockslistItem));
-	if (!newBlockslistItem) {
-		logPrintf(LOG_ERROR, "cachePut: malloc(): %s\n", strerror(errno));
-		free(newItem);
+	// the key is copied, callers may pass names from temporary buffers
+	newEntry->key = strdup(block);
+	if (!newEntry->key) {
+		logPrintf(LOG_ERROR, "cachePut: strdup(): %s\n", strerror(errno));
+		free(newEntry);
 		return 2;
 	}
+	cacheBufferRef(buffer);
+	newEntry->buffer = buffer;
 
-	newItem->key = block;
-	newItem->size = size;
-	newItem->data = malloc(size);
-	if (!newItem->data) {
-		logPrintf(LOG_ERROR, "cachePut: malloc(): %s\n", strerror(errno));
-		free(newItem);
-		free(newBlockslistItem);
-		return 3;
-	}
-	memcpy(newItem->data, buf, size);
-	addToDynArray(&hashTableBuckets[index], newItem);
+	CacheShard* shard = getShard(block);
+	pthread_mutex_lock(&shard->mutex);
 
-	// add item to the front blockslist
-	newBlockslistItem->prev = NULL;
-	newBlockslistItem->next = blockslist.first;
-	newBlockslistItem->key = block;
-	blockslist.first = newBlockslistItem;
-	if (blockslist.first->next) {
-		blockslist.first->next->prev = blockslist.first;
+	// the block could have been put by another thread in the meantime
+	if (findInNameIndex(&shard->entries, block) != NULL) {
+		pthread_mutex_unlock(&shard->mutex);
+		freeEntry(newEntry);
+		return 0;
 	}
-	if (blockslist.last == NULL)
-		blockslist.last = blockslist.first;
 
-	newItem->blockslistItem = newBlockslistItem;
-	
-	blockslistCount ++;
-	blockslistBytes += size;
-
-	logPrintf(LOG_VERBOSE_DEBUG, "cachePut: cache item saved: %s\n", block);
+	if (addToNameIndex(&shard->entries, newEntry->key, newEntry) != 0) {
+		logPrintf(LOG_ERROR, "cachePut: addToNameIndex() failed\n");
+		pthread_mutex_unlock(&shard->mutex);
+		freeEntry(newEntry);
+		return 3;
+	}
 
-	// check blockslist count and bytes size and delete oldest entries if needed
-	while (blockslistCount > HASH_TABLE_SIZE_COUNT || blockslistBytes > HASH_TABLE_SIZE_BYTES) {
-		int indexToDelete = hexStringToHashIndex(blockslist.last->key);
-		Block* foundItemToDelete = NULL;
-		int foundItemToDeleteIndex = -1;
-		for (int i=0; i<hashTableBuckets[indexToDelete].len; i++) {
-			Block* itemToDelete = (Block*)hashTableBuckets[indexToDelete].objects[i];
-			if (strcmp(itemToDelete->key, blockslist.last->key) == 0) {
-				foundItemToDelete = itemToDelete;
-				foundItemToDeleteIndex = i;
-				break;
-			}
-		}
-		if (!foundItemToDelete) {
-			logPrintf(LOG_WARNING, "cachePut: block expected but not found in cache\n");
-			return 0;
+	if (cachePolicy == CachePolicy2Q) {
+		CacheEntry* ghost = findInNameIndex(&shard->ghosts, block);
+		if (ghost != NULL) {
+			// seen again after it left the in queue, so it's worth keeping
+			unlinkEntry(&shard->out, ghost);
+			removeFromNameIndex(&shard->ghosts, ghost->key);
+			shard->outCount--;
+			freeEntry(ghost);
+			shard->ghostHits++;
+			linkEntryFirst(&shard->main, newEntry);
+		} else {
+			newEntry->inQueue = 1;
+			shard->inBytes += buffer->size;
+			linkEntryFirst(&shard->in, newEntry);
 		}
-		blockslistCount --;
-		blockslistBytes -= foundItemToDelete->size;
-		free(foundItemToDelete->data);
-		removeFromDynArrayUnorderedByIndex(&hashTableBuckets[indexToDelete], foundItemToDeleteIndex);
-		free(foundItemToDelete);
-
-		BlockslistItem* toDelete = blockslist.last;
-		blockslist.last = blockslist.last->prev;
-		if (toDelete)
-		{
-			logPrintf(LOG_VERBOSE_DEBUG, "cachePut: cache item removed: %s\n", toDelete->key);
-			free(toDelete);
-		}
-		if (blockslist.last)
-			blockslist.last->next = NULL;
+	} else {
+		linkEntryFirst(&shard->main, newEntry);
 	}
+	shard->bytes += buffer->size;
+	atomic_fetch_add(&cacheCount, 1);
+	atomic_fetch_add(&cacheBytes, buffer->size);
+	pthread_mutex_unlock(&shard->mutex);
 
+	logPrintf(LOG_VERBOSE_DEBUG, "cachePut: cache item saved: %s\n", block);
+
+	evictEntries();
 	return 0;
 }
 
 void cacheCleanup()
 {
-	// free and clear the hash table
-	for (int index = 0; index < HASH_TABLE_BUCKETS_COUNT; index++) {
-		for (int i=0; i<hashTableBuckets[index].len; i++) {
-			Block* item = (Block*)hashTableBuckets[index].objects[i];
-			free(item->data);
-			free(item);
-		}
-		freeDynArray(&hashTableBuckets[index]);
+	uint64_t hits = 0;
+	uint64_t misses = 0;
+	uint64_t evictions = 0;
+	uint64_t ghostHits = 0;
+
+	for (int i=0; i<CACHE_SHARDS_COUNT; i++) {
+		CacheShard* shard = &shards[i];
+
+		pthread_mutex_lock(&shard->mutex);
+		hits += shard->hits;
+		misses += shard->misses;
+		evictions += shard->evictions;
+		ghostHits += shard->ghostHits;
+
+		freeList(&shard->main);
+		freeList(&shard->in);
+		freeList(&shard->out);
+		freeNameIndex(&shard->entries);
+		freeNameIndex(&shard->ghosts);
+		shard->bytes = shard->inBytes = 0;
+		shard->outCount = 0;
+		pthread_mutex_unlock(&shard->mutex);
 	}
+	atomic_store(&cacheCount, 0);
+	atomic_store(&cacheBytes, 0);
 
-	// free and clear the list
-	while (blockslist.first) {
-		BlockslistItem* toFree = blockslist.first;
-		blockslist.first = blockslist.first->next;
-		free(toFree);
-	}
+	logPrintf(LOG_NOTE, "block cache (%s): %llu hits, %llu misses, %llu evictions, %llu ghost hits\n",
+		cachePolicyNames[cachePolicy],
+		(unsigned long long)hits,
+		(unsigned long long)misses,
+		(unsigned long long)evictions,
+		(unsigned long long)ghostHits);
 
-	// zero everything just because why not
-	memset(&hashTableBuckets, 0, sizeof(DynArray)*HASH_TABLE_BUCKETS_COUNT);
-	memset(&blockslist, 0, sizeof(Blockslist));
-	blockslistCount = 0;
-	blockslistBytes = 0;
+	diskCacheCleanup();
 }
-
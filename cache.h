@@ -1,29 +1,65 @@
 /*
- * Prepares the cache mechanism.
+ * A decrypted block. Buffers are immutable once created, they're shared by the
+ * cache and its readers and freed when the last reference is dropped.
+ */
+typedef struct _CacheBuffer {
+	char* data;
+	size_t size;
+	_Atomic int refs;
+} CacheBuffer;
+
+/*
+ * Prepares the cache mechanism. The cache is limited by conf.cacheEntries
+ * and conf.cacheBytes. It also prepares the disk cache tier, see diskcache.h.
  *
  * @return 0 on success, error code on error
  */
 int cacheInit();
 
+/*
+ * Wraps data in a buffer with a single reference.
+ *
+ * @param data Data allocated with malloc, the buffer takes ownership of it on success.
+ * @param size Data size.
+ * @return the new buffer, NULL on error
+ */
+CacheBuffer* cacheBufferNew(char* data, size_t size);
+
+/*
+ * Adds a reference to a buffer.
+ */
+void cacheBufferRef(CacheBuffer* buffer);
+
+/*
+ * Drops a reference to a buffer, freeing it with the last one.
+ */
+void cacheBufferUnref(CacheBuffer* buffer);
+
 /*
  * Gets value from cache.
  *
  * @param block A block to get.
- * @param buf Buffer where data should be written to.
- * @param size Pointer to a variable that stores size of the buffer. In cache entry is found, the value will be set to the block size.
+ * @param buffer Set to the cached buffer when found. The caller gets a reference and drops it with cacheBufferUnref().
  * @return 0 when cache found, -1 when not found, positive error code on error
  */
-int cacheGet(const char* block, char* buf, size_t *size);
+int cacheGet(const char* block, CacheBuffer** buffer);
+
+/*
+ * Checks whether a block is cached, without counting it as a use.
+ *
+ * @param block A block to look for.
+ * @return 1 when cached, 0 otherwise
+ */
+int cacheContains(const char* block);
 
 /*
  * Puts value to cache.
  *
- * @param block A block to put.
- * @param buf Buffer that holds the data.
- * @param size Block size.
+ * @param block A block to put. The name is copied.
+ * @param buffer Buffer that holds the data. The cache takes its own reference, the caller keeps its one.
  * @return 0 on success, error code on error
  */
-int cachePut(const char* block, char* buf, size_t size);
+int cachePut(const char* block, CacheBuffer* buffer);
 
 /*
  * Cleans up the cache mechanism.
@@ -10,6 +10,17 @@ void confInit()
 	memset(&conf, 0, sizeof(conf));
 	conf.verbose = 2;
 	conf.readOnly = 0;
+	// the same defaults as libfuse uses
+	conf.attrTimeout = 1.0;
+	conf.entryTimeout = 1.0;
+	conf.negativeTimeout = 0.0;
+	conf.cacheEntries = 1024;
+	conf.cacheBytes = 250*1024*1024;
+	conf.diskCacheBytes = 1024*1024*1024;
+	conf.readAheadBlocks = 8;
+	conf.fetchThreads = 4;
+	conf.dirtyBytes = 256*1024*1024;
+	conf.dirtyExpire = 30;
 }
 
 void confCleanup()
@@ -26,6 +37,18 @@ void confCleanup()
 		free(conf.passphrase);
 		conf.passphrase = NULL;
 	}
+	if (conf.repositoryKey) {
+		free(conf.repositoryKey);
+		conf.repositoryKey = NULL;
+	}
+	if (conf.cachePolicy) {
+		free(conf.cachePolicy);
+		conf.cachePolicy = NULL;
+	}
+	if (conf.diskCache) {
+		free(conf.diskCache);
+		conf.diskCache = NULL;
+	}
 }
 
 int confIsReadOnly()
@@ -5,7 +5,26 @@ struct bucse_config {
 	int verbose;
 	char *passphrase;
 	char *repositoryRealPath;
+	char *repositoryKey; // the 'key' field of repository.json, as JSON text
+	int tieredBlocks; // the 'blockLayout' field of repository.json allows tiers
+	int chunkedBlocks; // and chunked files
 	int readOnly;
+	int lowLevel;
+	double attrTimeout;
+	double entryTimeout;
+	double negativeTimeout;
+	int writebackCache;
+	int cacheEntries;
+	unsigned long cacheBytes;
+	char *cachePolicy;
+	char *diskCache;
+	unsigned long diskCacheBytes;
+	int readAheadBlocks;
+	int fetchThreads;
+	unsigned long dirtyBytes;
+	int dirtyExpire;
+	int lazyClose;
+	int dedup;
 };
 
 extern struct bucse_config conf;
@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#include "nameindex.h"
+#include "actions.h"
+#include "log.h"
+#include "conf.h"
+#include "encryption/encr.h"
+#include "encryption/masterkey.h"
+
+#include "dedup.h"
+
+extern Encryption *encryption;
+
+// as many bytes as getRandomStorageFileName() uses, hex encoded
+#define DEDUP_NAME_BYTES 20
+#define NAME_KEY_SIZE 32
+
+// normalized chunking: a cut is less likely before the average size and more
+// likely after it, the gear hash has the most history in its high bits
+#define CHUNK_MASK_SMALL (((UINT64_C(1) << 22) - 1) << 42)
+#define CHUNK_MASK_LARGE (((UINT64_C(1) << 18) - 1) << 46)
+
+static unsigned char nameKey[NAME_KEY_SIZE];
+static uint64_t gear[256];
+
+typedef struct {
+	char name[MAX_STORAGE_NAME_LEN];
+	void* owner; // NULL once stored
+} DedupBlock;
+
+static NameIndex storedBlocks;
+static pthread_mutex_t storedBlocksMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t splitMix64(uint64_t* state)
+{
+	uint64_t z = (*state += UINT64_C(0x9e3779b97f4a7c15));
+	z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+	z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+	return z ^ (z >> 31);
+}
+
+int dedupInit()
+{
+	int haveKey = 0;
+	if (encryption->loadKey != NULL) {
+		if (masterKeyDerive("bucse block names", nameKey, NAME_KEY_SIZE) != 0) {
+			logPrintf(LOG_ERROR, "dedupInit: masterKeyDerive failed\n");
+			return 1;
+		}
+		haveKey = 1;
+	} else if (!encryption->needsPassphrase()) {
+		// nothing is secret without encryption
+		memset(nameKey, 0, NAME_KEY_SIZE);
+		haveKey = 1;
+	}
+	if (conf.dedup && !haveKey) {
+		logPrintf(LOG_ERROR, "dedupInit: dedup needs an encryption with a repository key\n");
+		return 2;
+	}
+	// older versions would misread chunked files
+	if (conf.dedup && !conf.chunkedBlocks) {
+		logPrintf(LOG_ERROR, "dedupInit: dedup needs a repository created with bucse-init -b chunked\n");
+		return 3;
+	}
+
+	// the gear table is keyed too, so the sizes of the stored blocks don't
+	// tell which data they hold. Chunked files stay readable without it,
+	// only the cuts would differ.
+	uint64_t seed = UINT64_C(0x6275637365636463);
+	if (haveKey) {
+		const char* purpose = "bucse chunk boundaries";
+		unsigned char digest[EVP_MAX_MD_SIZE];
+		if (HMAC(EVP_sha256(), nameKey, NAME_KEY_SIZE,
+				(const unsigned char*)purpose, strlen(purpose), digest, NULL) == NULL) {
+			logPrintf(LOG_ERROR, "dedupInit: HMAC failed\n");
+			return 4;
+		}
+		memcpy(&seed, digest, sizeof(seed));
+	}
+	for (int i=0; i<256; i++) {
+		gear[i] = splitMix64(&seed);
+	}
+	return 0;
+}
+
+void dedupCleanup()
+{
+	for (int i=0; i<storedBlocks.size; i++) {
+		if (storedBlocks.entries[i].object != NULL) {
+			free(storedBlocks.entries[i].object);
+		}
+	}
+	freeNameIndex(&storedBlocks);
+	memset(nameKey, 0, NAME_KEY_SIZE);
+}
+
+size_t dedupChunkSize(const char* buf, size_t size)
+{
+	if (size <= DEDUP_CHUNK_MIN_SIZE) {
+		return size;
+	}
+	if (size > DEDUP_CHUNK_MAX_SIZE) {
+		size = DEDUP_CHUNK_MAX_SIZE;
+	}
+	size_t normalSize = size < DEDUP_CHUNK_AVG_SIZE ? size : DEDUP_CHUNK_AVG_SIZE;
+
+	const unsigned char* bytes = (const unsigned char*)buf;
+	uint64_t hash = 0;
+	size_t i = DEDUP_CHUNK_MIN_SIZE;
+	for (; i < normalSize; i++) {
+		hash = (hash << 1) + gear[bytes[i]];
+		if ((hash & CHUNK_MASK_SMALL) == 0) {
+			return i + 1;
+		}
+	}
+	for (; i < size; i++) {
+		hash = (hash << 1) + gear[bytes[i]];
+		if ((hash & CHUNK_MASK_LARGE) == 0) {
+			return i + 1;
+		}
+	}
+	return size;
+}
+
+int dedupBlockName(const char* buf, size_t size, char* name)
+{
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	if (HMAC(EVP_sha256(), nameKey, NAME_KEY_SIZE,
+			(const unsigned char*)buf, size, digest, NULL) == NULL) {
+		logPrintf(LOG_ERROR, "dedupBlockName: HMAC failed\n");
+		return 1;
+	}
+	for (int i=0; i<DEDUP_NAME_BYTES; i++) {
+		snprintf(name + 2*i, 3, "%02x", digest[i]);
+	}
+	return 0;
+}
+
+// the caller needs to hold storedBlocksMutex
+static DedupBlock* addBlock(const char* name, void* owner)
+{
+	DedupBlock* block = malloc(sizeof(DedupBlock));
+	if (block == NULL) {
+		logPrintf(LOG_ERROR, "dedup: malloc(): %s\n", strerror(errno));
+		return NULL;
+	}
+	snprintf(block->name, MAX_STORAGE_NAME_LEN, "%s", name);
+	block->owner = owner;
+	if (addToNameIndex(&storedBlocks, block->name, block) != 0) {
+		free(block);
+		return NULL;
+	}
+	return block;
+}
+
+void dedupAddStored(const char* content, int contentLen)
+{
+	if (!conf.dedup) {
+		return;
+	}
+
+	pthread_mutex_lock(&storedBlocksMutex);
+	for (int i=0; i<contentLen; i++) {
+		const char* name = content + MAX_STORAGE_NAME_LEN * i;
+		DedupBlock* block = findInNameIndex(&storedBlocks, name);
+		if (block != NULL) {
+			// another mount stored it first
+			block->owner = NULL;
+		} else {
+			// a failure only costs storing the block again
+			addBlock(name, NULL);
+		}
+	}
+	pthread_mutex_unlock(&storedBlocksMutex);
+}
+
+DedupClaim dedupClaim(const char* name, void* owner)
+{
+	DedupClaim claim = DedupClaimed;
+
+	pthread_mutex_lock(&storedBlocksMutex);
+	DedupBlock* block = findInNameIndex(&storedBlocks, name);
+	if (block == NULL) {
+		if (addBlock(name, owner) == NULL) {
+			// without the entry, nobody else knows to wait for it
+			claim = DedupBusy;
+		}
+	} else if (block->owner == NULL || block->owner == owner) {
+		claim = DedupStored;
+	} else {
+		// storing it twice at once could mix up the two writes
+		claim = DedupBusy;
+	}
+	pthread_mutex_unlock(&storedBlocksMutex);
+	return claim;
+}
+
+void dedupFinish(const char* name, int stored)
+{
+	pthread_mutex_lock(&storedBlocksMutex);
+	DedupBlock* block = findInNameIndex(&storedBlocks, name);
+	if (block != NULL) {
+		if (stored) {
+			block->owner = NULL;
+		} else {
+			removeFromNameIndex(&storedBlocks, name);
+			free(block);
+		}
+	}
+	pthread_mutex_unlock(&storedBlocksMutex);
+}
@@ -0,0 +1,33 @@
+// Deduplication. With conf.dedup, blocks are stored under a keyed hash of
+// their plaintext rather than a random name, so the same data is stored once,
+// and new files are chunked: their blocks are cut where the content says
+// (FastCDC), so inserted or shifted data still ends up in the same blocks.
+// The names of the blocks known to be stored are kept, storing a block under
+// such a name again is skipped.
+
+#define DEDUP_CHUNK_MIN_SIZE (256 * 1024)
+#define DEDUP_CHUNK_AVG_SIZE (1024 * 1024)
+#define DEDUP_CHUNK_MAX_SIZE (4 * 1024 * 1024)
+
+// call once the repository key is loaded, before any action is added
+int dedupInit();
+void dedupCleanup();
+
+// the length of the chunk that starts buf; size is less than
+// DEDUP_CHUNK_MAX_SIZE only at the end of the file
+size_t dedupChunkSize(const char* buf, size_t size);
+
+// the storage name of a block, name needs MAX_STORAGE_NAME_LEN bytes
+int dedupBlockName(const char* buf, size_t size, char* name);
+
+// records the blocks of an action as stored
+void dedupAddStored(const char* content, int contentLen);
+
+typedef enum {
+	DedupStored, // stored already, or being stored by the same owner
+	DedupClaimed, // the caller stores it and calls dedupFinish()
+	DedupBusy, // being stored by another owner, store it under another name
+} DedupClaim;
+
+DedupClaim dedupClaim(const char* name, void* owner);
+void dedupFinish(const char* name, int stored);
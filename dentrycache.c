@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "log.h"
+#include "dynarray.h"
+#include "nameindex.h"
+#include "dirtymap.h"
+#include "filesystem.h"
+
+#include "dentrycache.h"
+
+// the cache is dropped as a whole when it grows beyond this
+#define DENTRY_CACHE_MAX_ENTRIES 65536
+
+static NameIndex dentries;
+
+static atomic_ullong dentryCacheHits;
+static atomic_ullong dentryCacheMisses;
+static uint64_t dentryCacheInvalidations;
+
+// lookups run concurrently under a shared tree lock, so the cache needs its
+// own lock; they only read it, so they share it too
+static pthread_rwlock_t dentryCacheLock = PTHREAD_RWLOCK_INITIALIZER;
+
+static void dropEntries()
+{
+	for (int i=0; i<dentries.size; i++) {
+		if (dentries.entries[i].name != NULL) {
+			free((char*)dentries.entries[i].name);
+		}
+	}
+	freeNameIndex(&dentries);
+}
+
+FilesystemDir* dentryCacheGet(const char* path, size_t len)
+{
+	pthread_rwlock_rdlock(&dentryCacheLock);
+	FilesystemDir* dir = findInNameIndexLen(&dentries, path, len);
+	pthread_rwlock_unlock(&dentryCacheLock);
+
+	if (dir != NULL) {
+		atomic_fetch_add_explicit(&dentryCacheHits, 1, memory_order_relaxed);
+	} else {
+		atomic_fetch_add_explicit(&dentryCacheMisses, 1, memory_order_relaxed);
+	}
+
+	return dir;
+}
+
+void dentryCachePut(const char* path, size_t len, FilesystemDir* dir)
+{
+	char* key = strndup(path, len);
+	if (key == NULL) {
+		logPrintf(LOG_ERROR, "dentryCachePut: strndup(): %s\n", strerror(errno));
+		return;
+	}
+
+	pthread_rwlock_wrlock(&dentryCacheLock);
+
+	// another thread could have added it in the meantime
+	if (findInNameIndexLen(&dentries, path, len) != NULL) {
+		pthread_rwlock_unlock(&dentryCacheLock);
+		free(key);
+		return;
+	}
+
+	if (dentries.len >= DENTRY_CACHE_MAX_ENTRIES) {
+		dropEntries();
+	}
+
+	if (addToNameIndex(&dentries, key, dir) != 0) {
+		logPrintf(LOG_ERROR, "dentryCachePut: addToNameIndex() failed\n");
+		free(key);
+	}
+
+	pthread_rwlock_unlock(&dentryCacheLock);
+}
+
+void dentryCacheInvalidate()
+{
+	pthread_rwlock_wrlock(&dentryCacheLock);
+	if (dentries.len > 0) {
+		dropEntries();
+		dentryCacheInvalidations++;
+	}
+	pthread_rwlock_unlock(&dentryCacheLock);
+}
+
+void dentryCacheCleanup()
+{
+	pthread_rwlock_wrlock(&dentryCacheLock);
+	logPrintf(LOG_NOTE, "dentry cache: %llu hits, %llu misses, %llu invalidations\n",
+		atomic_load(&dentryCacheHits),
+		atomic_load(&dentryCacheMisses),
+		(unsigned long long)dentryCacheInvalidations);
+	dropEntries();
+	pthread_rwlock_unlock(&dentryCacheLock);
+}
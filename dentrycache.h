@@ -0,0 +1,16 @@
+// The dentry cache maps full dir paths (relative to root, without the leading
+// and the trailing slash) to dirs, so that findContainingDir() doesn't need to
+// walk the tree from root for every lookup. Only existing dirs are cached,
+// files are looked up in their dir's name index.
+
+// returns the cached dir for the first len bytes of path, or NULL on a miss
+FilesystemDir* dentryCacheGet(const char* path, size_t len);
+
+// caches dir under the first len bytes of path, the path is copied
+void dentryCachePut(const char* path, size_t len, FilesystemDir* dir);
+
+// drops all entries. Needs to be called whenever a dir is removed from the tree.
+void dentryCacheInvalidate();
+
+// frees the cache and logs its hit/miss counters
+void dentryCacheCleanup();
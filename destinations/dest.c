@@ -11,6 +11,7 @@
 #include <stdlib.h>
 
 #include "../log.h"
+#include "../random.h"
 
 #include "dest.h"
 
@@ -19,23 +20,13 @@ extern Destination destinationSsh;
 
 int getRandomStorageFileName(char* filename)
 {
-	FILE* f = fopen("/dev/urandom", "rb");
-	if (f == NULL) {
-		logPrintf(LOG_ERROR, "getRandomStorageFileName: fopen(): %s\n", strerror(errno));
+	unsigned char buf[20];
+	if (getRandomBytes(buf, sizeof(buf)) != 0) {
+		logPrintf(LOG_ERROR, "getRandomStorageFileName: getRandomBytes failed\n");
 		filename[0] = 0;
 		return 1;
 	}
 
-	unsigned char buf[20];
-	size_t got = fread(buf, 20, 1, f);
-	if (got == 0) {
-		logPrintf(LOG_ERROR, "getRandomStorageFileName: fread failed\n");
-		fclose(f);
-		return 2;
-	}
-
-	fclose(f);
-
 	for (int i=0; i<20; i++) {
 		sprintf(filename + 2*i, "%02x", buf[i]);
 	}
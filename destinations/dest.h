@@ -19,6 +19,10 @@
 #define MAX_ACTION_LEN (1024 * 1024)
 #define MAX_ACTION_NAME_LEN 64
 
+// putStorageFile() returns it when a file of that name is stored already; the
+// stored file is left as it is, a put never rewrites one
+#define DEST_STORAGE_FILE_EXISTS -1
+
 typedef void (*ActionAddedCallback)(char* actionName, char* buf, size_t size, int moreInThisBatch);
 
 typedef struct {
@@ -28,13 +32,21 @@ typedef struct {
 	int (*createDirs)();
 	int (*putStorageFile)(const char* filename, char *buf, size_t size);
 	int (*getStorageFile)(const char* filename, char *buf, size_t *size);
+	// reads up to *size bytes from offset, *size is set to the bytes read,
+	// which is less only at the end of the file. Optional, may be NULL.
+	int (*getStorageFileRange)(const char* filename, size_t offset, char *buf, size_t *size);
 	int (*addActionFile)(char* filename, char *buf, size_t size);
+	// makes the files put so far durable. Optional, may be NULL when a put
+	// is durable once it returns.
+	int (*sync)();
 	int (*putRepositoryJsonFile)(char *buf, size_t size);
 	int (*getRepositoryJsonFile)(char *buf, size_t *size);
 	int (*putRepositoryFile)(char *buf, size_t size);
 	int (*getRepositoryFile)(char *buf, size_t *size);
 	int (*setCallbackActionAdded)(ActionAddedCallback callback);
 	int (*isTickable)();
+	// passes new actions to the action added callback, which takes the tree
+	// lock itself, so no lock may be held while calling it
 	int (*tick)();
 } Destination;
 
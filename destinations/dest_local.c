@@ -5,6 +5,7 @@
  * files in the filesystem.
  */
 
+#define _GNU_SOURCE
 #include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -13,6 +14,9 @@
 #include <sys/types.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include <json.h>
 
@@ -93,6 +97,8 @@ static int findAction(Actions *actions, char* actionNameToFound)
 }
 
 static Actions handledActions;
+// actions can be added by concurrent flushes while tick() reads them
+static pthread_mutex_t handledActionsMutex = PTHREAD_MUTEX_INITIALIZER;
 
 int destLocalInit(char* repository)
 {
@@ -226,21 +232,38 @@ int destLocalCreateDirs()
 	return 0;
 }
 
+// The file is written under a temporary name and renamed when it's complete,
+// so a stored file is never seen half written, even after a crash.
 int destLocalPutStorageFile(const char* filename, char *buf, size_t size)
 {
-	char* storageFilePath = malloc(MAX_FILEPATH_LEN);
+	char* storageFilePath = malloc(2 * MAX_FILEPATH_LEN);
 	if (storageFilePath == NULL) {
 		logPrintf(LOG_ERROR, "destLocalPutStorageFile: malloc(): %s\n", strerror(errno));
 
 		return 1;
 	}
+	char* tmpFilePath = storageFilePath + MAX_FILEPATH_LEN;
 
 	snprintf(storageFilePath, MAX_FILEPATH_LEN, "%s/%s", repositoryStoragePath, filename);
 
-	FILE* file = fopen(storageFilePath, "wb");
-	free(storageFilePath);
+	// blocks named by their content may be stored by another mount already
+	struct stat s;
+	if (stat(storageFilePath, &s) == 0) {
+		free(storageFilePath);
+		return DEST_STORAGE_FILE_EXISTS;
+	}
+
+	char tmpName[MAX_ACTION_NAME_LEN];
+	if (getRandomStorageFileName(tmpName) != 0) {
+		free(storageFilePath);
+		return 4;
+	}
+	snprintf(tmpFilePath, MAX_FILEPATH_LEN, "%s/%s.tmp", repositoryStoragePath, tmpName);
+
+	FILE* file = fopen(tmpFilePath, "wbx");
 	if (file == NULL) {
 		logPrintf(LOG_ERROR, "destLocalPutStorageFile: fopen(): %s\n", strerror(errno));
+		free(storageFilePath);
 		return 2;
 	}
 
@@ -251,9 +274,24 @@ int destLocalPutStorageFile(const char* filename, char *buf, size_t size)
 	if (ferror(file)) {
 		logPrintf(LOG_ERROR, "destLocalPutStorageFile: ferror() returned a non-zero value\n");
 		fclose(file);
+		unlink(tmpFilePath);
+		free(storageFilePath);
+		return 3;
+	}
+	if (fclose(file) != 0) {
+		logPrintf(LOG_ERROR, "destLocalPutStorageFile: fclose(): %s\n", strerror(errno));
+		unlink(tmpFilePath);
+		free(storageFilePath);
 		return 3;
 	}
-	fclose(file);
+
+	if (rename(tmpFilePath, storageFilePath) != 0) {
+		logPrintf(LOG_ERROR, "destLocalPutStorageFile: rename(): %s\n", strerror(errno));
+		unlink(tmpFilePath);
+		free(storageFilePath);
+		return 5;
+	}
+	free(storageFilePath);
 
 	return 0;
 }
@@ -299,6 +337,47 @@ int destLocalGetStorageFile(const char* filename, char *buf, size_t *size)
 	return 0;
 }
 
+int destLocalGetStorageFileRange(const char* filename, size_t offset, char *buf, size_t *size)
+{
+	char* storageFilePath = malloc(MAX_FILEPATH_LEN);
+	if (storageFilePath == NULL) {
+		logPrintf(LOG_ERROR, "destLocalGetStorageFileRange: malloc(): %s\n", strerror(errno));
+
+		return 1;
+	}
+
+	snprintf(storageFilePath, MAX_FILEPATH_LEN, "%s/%s", repositoryStoragePath, filename);
+
+	int fd = open(storageFilePath, O_RDONLY);
+	free(storageFilePath);
+
+	if (fd < 0) {
+		logPrintf(LOG_ERROR, "destLocalGetStorageFileRange: open(): %s\n", strerror(errno));
+		return 2;
+	}
+
+	size_t bytesRead = 0;
+	while (bytesRead < *size) {
+		ssize_t res = pread(fd, buf + bytesRead, *size - bytesRead, offset + bytesRead);
+		if (res < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			logPrintf(LOG_ERROR, "destLocalGetStorageFileRange: pread(): %s\n", strerror(errno));
+			close(fd);
+			return 3;
+		}
+		if (res == 0) {
+			break;
+		}
+		bytesRead += res;
+	}
+	close(fd);
+
+	*size = bytesRead;
+	return 0;
+}
+
 int destLocalAddActionFile(char* filename, char *buf, size_t size)
 {
 	char* actionFilePath = malloc(MAX_FILEPATH_LEN);
@@ -328,7 +407,9 @@ int destLocalAddActionFile(char* filename, char *buf, size_t size)
 	}
 	fclose(file);
 
+	pthread_mutex_lock(&handledActionsMutex);
 	addAction(&handledActions, filename);
+	pthread_mutex_unlock(&handledActionsMutex);
 	return 0;
 }
 
@@ -486,7 +567,10 @@ int destLocalTick()
 		// TODO: consider optimizing by keeping handledActions sorted and searching with binary search
 		
 		// is the action not already handled?
-		if (findAction(&handledActions, actionDir->d_name) == -1) {
+		pthread_mutex_lock(&handledActionsMutex);
+		int found = findAction(&handledActions, actionDir->d_name);
+		pthread_mutex_unlock(&handledActionsMutex);
+		if (found == -1) {
 			addAction(&newActions, actionDir->d_name);
 		}
 	}
@@ -561,9 +645,11 @@ int destLocalTick()
 	}
 	free(actionFilePath);
 	
+	pthread_mutex_lock(&handledActionsMutex);
 	for (int i=0; i<newActions.len; i++) {
 		addAction(&handledActions, getAction(&newActions, i));
 	}
+	pthread_mutex_unlock(&handledActionsMutex);
 
 
 	freeActions(&newActions);
@@ -576,6 +662,23 @@ int destLocalPostInit()
 	return destLocalTick();
 }
 
+static int destLocalSync()
+{
+	// the storage and action files are written through the page cache
+	int fd = open(repositoryPath, O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		logPrintf(LOG_ERROR, "destLocalSync: open(): %s\n", strerror(errno));
+		return 1;
+	}
+	if (syncfs(fd) != 0) {
+		logPrintf(LOG_ERROR, "destLocalSync: syncfs(): %s\n", strerror(errno));
+		close(fd);
+		return 2;
+	}
+	close(fd);
+	return 0;
+}
+
 Destination destinationLocal = {
 	.init = destLocalInit,
 	.postInit = destLocalPostInit,
@@ -583,7 +686,9 @@ Destination destinationLocal = {
 	.createDirs = destLocalCreateDirs,
 	.putStorageFile = destLocalPutStorageFile,
 	.getStorageFile = destLocalGetStorageFile,
+	.getStorageFileRange = destLocalGetStorageFileRange,
 	.addActionFile = destLocalAddActionFile,
+	.sync = destLocalSync,
 	.putRepositoryJsonFile = destLocalPutRepositoryJsonFile,
 	.getRepositoryJsonFile = destLocalGetRepositoryJsonFile,
 	.putRepositoryFile = destLocalPutRepositoryFile,
@@ -7,6 +7,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <pthread.h>
 
 #include <json.h>
 
@@ -92,7 +93,9 @@ static int findAction(Actions *actions, char* actionNameToFound)
 	return -1;
 }
 
+// handledActions is written by the tick and by addActionFile
 static Actions handledActions;
+static pthread_mutex_t handledActionsMutex = PTHREAD_MUTEX_INITIALIZER;
 
 /*
  * copy-paste from https://api.libssh.org/stable/libssh_tutor_guided_tour.html
@@ -221,8 +224,27 @@ static ssize_t sftp_read_multiple_calls(sftp_file file, void* buf, size_t size)
 	return receivedBytes;
 }
 
-static ssh_session bucseSshSession;
-static sftp_session bucseSftpSession;
+typedef struct {
+	ssh_session ssh;
+	sftp_session sftp;
+	int busy;
+} SshConnection;
+
+// An ssh session must not be used by multiple threads at once, so every
+// sftp call is made on a connection taken from this pool, and the blocks are
+// transferred over several connections in parallel. Init opens the first
+// one, the others are opened when all are busy, up to SSH_MAX_CONNECTIONS,
+// or fewer when the server refuses them.
+#define SSH_MAX_CONNECTIONS 4
+static SshConnection connections[SSH_MAX_CONNECTIONS];
+static int connectionsLen;
+static int connectionsOpening;
+static int connectionsLimit = SSH_MAX_CONNECTIONS;
+static pthread_mutex_t connectionsMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t connectionsCond = PTHREAD_COND_INITIALIZER;
+// whether the server can flush a file to its disk (fsync@openssh.com)
+static int fsyncSupported;
+static int port; // for the connections opened later
 static void invalidDestination() {
 	logPrintf(LOG_ERROR, "Invalid destination. Expected format ssh://[host]{:[port]}/[path]\n");
 }
@@ -244,11 +266,138 @@ static void cleanupStrings() {
 	cleanupString(&repositoryStoragePath);
 }
 
+static void closeConnection(SshConnection* connection)
+{
+	if (connection->sftp != NULL) {
+		sftp_free(connection->sftp);
+		connection->sftp = NULL;
+	}
+	if (connection->ssh != NULL) {
+		ssh_disconnect(connection->ssh);
+		ssh_free(connection->ssh);
+		connection->ssh = NULL;
+	}
+}
+
+// connects to the repository host, authenticates and starts sftp
+static int openConnection(SshConnection* connection)
+{
+	memset(connection, 0, sizeof(SshConnection));
+
+	connection->ssh = ssh_new();
+	if (connection->ssh == NULL) {
+		return 1;
+	}
+	if (repositoryUser) {
+		ssh_options_set(connection->ssh, SSH_OPTIONS_USER, repositoryUser);
+	}
+	ssh_options_set(connection->ssh, SSH_OPTIONS_HOST, repositoryHost);
+	ssh_options_set(connection->ssh, SSH_OPTIONS_PORT, &port);
+
+	// Connect to server
+	int rc = ssh_connect(connection->ssh);
+	if (rc != SSH_OK)
+	{
+		logPrintf(LOG_ERROR, "Error connecting to localhost: %s\n",
+			ssh_get_error(connection->ssh));
+		ssh_free(connection->ssh);
+		connection->ssh = NULL;
+		return 2;
+	}
+
+	// Verify the server's identity
+	// For the source code of verify_knownhost(), check previous example
+	if (verify_knownhost(connection->ssh) < 0)
+	{
+		closeConnection(connection);
+		return 3;
+	}
+
+	// Authenticate ourselves
+	rc = ssh_userauth_publickey_auto(connection->ssh, NULL, NULL);
+
+	if (rc == SSH_AUTH_ERROR)
+	{
+		logPrintf(LOG_ERROR, "Authentication failed: %s\n",
+			ssh_get_error(connection->ssh));
+		closeConnection(connection);
+		return 4;
+	}
+
+	// sftp
+	connection->sftp = sftp_new(connection->ssh);
+	if (connection->sftp == NULL)
+	{
+		logPrintf(LOG_ERROR, "Error allocating SFTP session: %s\n",
+			ssh_get_error(connection->ssh));
+		closeConnection(connection);
+		return 5;
+	}
+
+	rc = sftp_init(connection->sftp);
+	if (rc != SSH_OK)
+	{
+		logPrintf(LOG_ERROR, "Error initializing SFTP session: code %d.\n",
+			sftp_get_error(connection->sftp));
+		closeConnection(connection);
+		return 6;
+	}
+
+	return 0;
+}
+
+// takes an idle connection from the pool, opening one if all are busy
+static SshConnection* acquireConnection()
+{
+	pthread_mutex_lock(&connectionsMutex);
+	for (;;) {
+		for (int i=0; i<connectionsLen; i++) {
+			if (!connections[i].busy) {
+				connections[i].busy = 1;
+				pthread_mutex_unlock(&connectionsMutex);
+				return &connections[i];
+			}
+		}
+
+		if (connectionsLen + connectionsOpening < connectionsLimit) {
+			// the others keep using the pool while it connects
+			connectionsOpening++;
+			pthread_mutex_unlock(&connectionsMutex);
+			SshConnection connection;
+			int result = openConnection(&connection);
+			pthread_mutex_lock(&connectionsMutex);
+			connectionsOpening--;
+
+			if (result == 0) {
+				SshConnection* newConnection = &connections[connectionsLen++];
+				*newConnection = connection;
+				newConnection->busy = 1;
+				pthread_mutex_unlock(&connectionsMutex);
+				return newConnection;
+			}
+			logPrintf(LOG_WARNING, "destSsh: no more connections than %d: %d\n",
+				connectionsLen, result);
+			connectionsLimit = connectionsLen;
+			continue;
+		}
+
+		pthread_cond_wait(&connectionsCond, &connectionsMutex);
+	}
+}
+
+static void releaseConnection(SshConnection* connection)
+{
+	pthread_mutex_lock(&connectionsMutex);
+	connection->busy = 0;
+	pthread_cond_signal(&connectionsCond);
+	pthread_mutex_unlock(&connectionsMutex);
+}
+
 int destSshInit(char* repository)
 {
 	char* firstSlash = strstr(repository, "/");
 	char* firstColon = strstr(repository, ":");
-	int port = 22;
+	port = 22;
 
 	if (firstSlash == NULL) {
 		invalidDestination();
@@ -361,81 +510,31 @@ int destSshInit(char* repository)
 	snprintf(repositoryActionsPath, MAX_FILEPATH_LEN, "%s/actions", repositoryPath);
 	snprintf(repositoryStoragePath, MAX_FILEPATH_LEN, "%s/storage", repositoryPath);
 
-	bucseSshSession = ssh_new();
-	if (bucseSshSession == NULL) {
+	int result = openConnection(&connections[0]);
+	if (result != 0) {
 		cleanupStrings();
-		return 13;
+		return 12 + result;
 	}
-	if (repositoryUser) {
-		ssh_options_set(bucseSshSession, SSH_OPTIONS_USER, repositoryUser);
-	}
-	ssh_options_set(bucseSshSession, SSH_OPTIONS_HOST, repositoryHost);
-	ssh_options_set(bucseSshSession, SSH_OPTIONS_PORT, &port);
-
-	// Connect to server
-	int rc = ssh_connect(bucseSshSession);
-	if (rc != SSH_OK)
-	{
-		logPrintf(LOG_ERROR, "Error connecting to localhost: %s\n",
-			ssh_get_error(bucseSshSession));
-		ssh_free(bucseSshSession);
-		bucseSshSession = NULL;
-		cleanupStrings();
-		return 14;
-	}
-
-	// Verify the server's identity
-	// For the source code of verify_knownhost(), check previous example
-	if (verify_knownhost(bucseSshSession) < 0)
-	{
-		ssh_disconnect(bucseSshSession);
-		ssh_free(bucseSshSession);
-		bucseSshSession = NULL;
-		cleanupStrings();
-		return 15;
-	}
-
-	// Authenticate ourselves
-	rc = ssh_userauth_publickey_auto(bucseSshSession, NULL, NULL);
+	connectionsLen = 1;
 
-	if (rc == SSH_AUTH_ERROR)
-	{
-		logPrintf(LOG_ERROR, "Authentication failed: %s\n",
-			ssh_get_error(bucseSshSession));
-		ssh_disconnect(bucseSshSession);
-		ssh_free(bucseSshSession);
-		bucseSshSession = NULL;
-		cleanupStrings();
-		return 16;
+	fsyncSupported = sftp_extension_supported(connections[0].sftp, "fsync@openssh.com", "1");
+	if (!fsyncSupported) {
+		logPrintf(LOG_WARNING, "destSshInit: the server doesn't support fsync@openssh.com, "
+			"written files are not durable before the server flushes them itself\n");
 	}
 
-	// sftp
-	bucseSftpSession = sftp_new(bucseSshSession);
-	if (bucseSftpSession == NULL)
-	{
-		logPrintf(LOG_ERROR, "Error allocating SFTP session: %s\n",
-			ssh_get_error(bucseSshSession));
-		ssh_disconnect(bucseSshSession);
-		ssh_free(bucseSshSession);
-		bucseSshSession = NULL;
-		cleanupStrings();
-		return 17;
-	}
+	return 0;
+}
 
-	rc = sftp_init(bucseSftpSession);
-	if (rc != SSH_OK)
-	{
-		logPrintf(LOG_ERROR, "Error initializing SFTP session: code %d.\n",
-			sftp_get_error(bucseSftpSession));
-		sftp_free(bucseSftpSession);
-		bucseSftpSession = NULL;
-		ssh_disconnect(bucseSshSession);
-		ssh_free(bucseSshSession);
-		bucseSshSession = NULL;
-		cleanupStrings();
-		return 18;
+// a written file reaches the server's disk before it's closed, so a put is
+// durable once it returns
+static int syncFile(SshConnection* connection, sftp_file file)
+{
+	if (fsyncSupported && sftp_fsync(file) != 0) {
+		logPrintf(LOG_ERROR, "destSsh: sftp_fsync(): %d\n",
+			sftp_get_error(connection->sftp));
+		return 1;
 	}
-
 	return 0;
 }
 
@@ -445,37 +544,33 @@ void destSshShutdown()
 
 	freeActions(&handledActions);
 
-	if (bucseSftpSession != NULL) {
-		sftp_free(bucseSftpSession);
-		bucseSftpSession = NULL;
-	}
-	if (bucseSshSession != NULL) {
-		ssh_disconnect(bucseSshSession);
-		ssh_free(bucseSshSession);	
-		bucseSshSession = NULL;
+	for (int i=0; i<connectionsLen; i++) {
+		closeConnection(&connections[i]);
 	}
+	connectionsLen = 0;
+	connectionsLimit = SSH_MAX_CONNECTIONS;
 }
 
-int destSshCreateDirs()
+static int destSshCreateDirsConnected(SshConnection* connection)
 {
-	if (sftp_mkdir(bucseSftpSession, repositoryPath, S_IRUSR | S_IWUSR | S_IXUSR
+	if (sftp_mkdir(connection->sftp, repositoryPath, S_IRUSR | S_IWUSR | S_IXUSR
 		| S_IRGRP | S_IXGRP
 		| S_IROTH | S_IXOTH) != 0) {
-		logPrintf(LOG_ERROR, "destSshCreateDirs: sftp_mkdir(): %d\n", sftp_get_error(bucseSftpSession));
+		logPrintf(LOG_ERROR, "destSshCreateDirs: sftp_mkdir(): %d\n", sftp_get_error(connection->sftp));
 		return 1;
 	}
 
-	if (sftp_mkdir(bucseSftpSession, repositoryActionsPath, S_IRUSR | S_IWUSR | S_IXUSR
+	if (sftp_mkdir(connection->sftp, repositoryActionsPath, S_IRUSR | S_IWUSR | S_IXUSR
 		| S_IRGRP | S_IXGRP
 		| S_IROTH | S_IXOTH) != 0) {
-		logPrintf(LOG_ERROR, "destSshCreateDirs: sftp_mkdir(): %d\n", sftp_get_error(bucseSftpSession));
+		logPrintf(LOG_ERROR, "destSshCreateDirs: sftp_mkdir(): %d\n", sftp_get_error(connection->sftp));
 		return 2;
 	}
 
-	if (sftp_mkdir(bucseSftpSession, repositoryStoragePath, S_IRUSR | S_IWUSR | S_IXUSR
+	if (sftp_mkdir(connection->sftp, repositoryStoragePath, S_IRUSR | S_IWUSR | S_IXUSR
 		| S_IRGRP | S_IXGRP
 		| S_IROTH | S_IXOTH) != 0) {
-		logPrintf(LOG_ERROR, "destSshCreateDirs: sftp_mkdir(): %d\n", sftp_get_error(bucseSftpSession));
+		logPrintf(LOG_ERROR, "destSshCreateDirs: sftp_mkdir(): %d\n", sftp_get_error(connection->sftp));
 		return 3;
 	}
 
@@ -483,8 +578,8 @@ int destSshCreateDirs()
 	int err;
 
 	// check if repository json file already exists
-	s = sftp_stat(bucseSftpSession, repositoryJsonFilePath);
-	err = sftp_get_error(bucseSftpSession);
+	s = sftp_stat(connection->sftp, repositoryJsonFilePath);
+	err = sftp_get_error(connection->sftp);
 	if (s == NULL && err != SSH_FX_NO_SUCH_FILE) {
 		logPrintf(LOG_ERROR, "destSshCreateDirs: sftp_stat(): %d\n", err);
 		return 4;
@@ -496,8 +591,8 @@ int destSshCreateDirs()
 	}
 
 	// check if repository file already exists
-	s = sftp_stat(bucseSftpSession, repositoryFilePath);
-	err = sftp_get_error(bucseSftpSession);
+	s = sftp_stat(connection->sftp, repositoryFilePath);
+	err = sftp_get_error(connection->sftp);
 	if (s == NULL && err != SSH_FX_NO_SUCH_FILE ) {
 		logPrintf(LOG_ERROR, "destSshCreateDirs: sftp_stat(): %d\n", err);
 		return 6;
@@ -511,38 +606,103 @@ int destSshCreateDirs()
 	return 0;
 }
 
-int destSshPutStorageFile(const char* filename, char *buf, size_t size)
+int destSshCreateDirs()
 {
-	char* storageFilePath = malloc(MAX_FILEPATH_LEN);
+	SshConnection* connection = acquireConnection();
+	int result = destSshCreateDirsConnected(connection);
+	releaseConnection(connection);
+	return result;
+}
+
+static int storageFileExists(SshConnection* connection, const char* storageFilePath)
+{
+	sftp_attributes attributes = sftp_stat(connection->sftp, storageFilePath);
+	if (attributes == NULL) {
+		return 0;
+	}
+	sftp_attributes_free(attributes);
+	return 1;
+}
+
+// The file is written under a temporary name and renamed when it's complete,
+// so a stored file is never seen half written, even after a crash.
+static int destSshPutStorageFileConnected(SshConnection* connection, const char* filename, char *buf, size_t size)
+{
+	char* storageFilePath = malloc(2 * MAX_FILEPATH_LEN);
 	if (storageFilePath == NULL) {
 		logPrintf(LOG_ERROR, "destSshPutStorageFile: malloc(): %s\n", strerror(errno));
 
 		return 1;
 	}
+	char* tmpFilePath = storageFilePath + MAX_FILEPATH_LEN;
 
 	snprintf(storageFilePath, MAX_FILEPATH_LEN, "%s/%s", repositoryStoragePath, filename);
 
-	sftp_file file = sftp_open(bucseSftpSession, storageFilePath, O_WRONLY | O_CREAT | O_EXCL, 0644);
-	free(storageFilePath);
+	// blocks named by their content may be stored by another mount already
+	if (storageFileExists(connection, storageFilePath)) {
+		free(storageFilePath);
+		return DEST_STORAGE_FILE_EXISTS;
+	}
+
+	char tmpName[MAX_ACTION_NAME_LEN];
+	if (getRandomStorageFileName(tmpName) != 0) {
+		free(storageFilePath);
+		return 5;
+	}
+	snprintf(tmpFilePath, MAX_FILEPATH_LEN, "%s/%s.tmp", repositoryStoragePath, tmpName);
+
+	sftp_file file = sftp_open(connection->sftp, tmpFilePath, O_WRONLY | O_CREAT | O_EXCL, 0644);
 	if (file == NULL) {
 		logPrintf(LOG_ERROR, "destSshPutStorageFile: sftp_open(): %d\n",
-			sftp_get_error(bucseSftpSession));
+			sftp_get_error(connection->sftp));
+		free(storageFilePath);
 		return 2;
 	}
 
 	int bytesWritten = sftp_write_multiple_calls(file, buf, size);
 	if (bytesWritten < 0) {
 		logPrintf(LOG_ERROR, "destSshPutStorageFile: sftp_write_multiple_calls(): %d\n",
-			sftp_get_error(bucseSftpSession));
+			sftp_get_error(connection->sftp));
 		sftp_close(file);
+		sftp_unlink(connection->sftp, tmpFilePath);
+		free(storageFilePath);
 		return 3;
 	}
+	if (syncFile(connection, file) != 0) {
+		sftp_close(file);
+		sftp_unlink(connection->sftp, tmpFilePath);
+		free(storageFilePath);
+		return 4;
+	}
 	sftp_close(file);
 
+	// an sftp rename may refuse to replace a file, which another mount may
+	// have stored meanwhile
+	if (sftp_rename(connection->sftp, tmpFilePath, storageFilePath) != 0) {
+		int result = DEST_STORAGE_FILE_EXISTS;
+		if (!storageFileExists(connection, storageFilePath)) {
+			logPrintf(LOG_ERROR, "destSshPutStorageFile: sftp_rename(): %d\n",
+				sftp_get_error(connection->sftp));
+			result = 6;
+		}
+		sftp_unlink(connection->sftp, tmpFilePath);
+		free(storageFilePath);
+		return result;
+	}
+	free(storageFilePath);
+
 	return 0;
 }
 
-int destSshGetStorageFile(const char* filename, char *buf, size_t *size)
+int destSshPutStorageFile(const char* filename, char *buf, size_t size)
+{
+	SshConnection* connection = acquireConnection();
+	int result = destSshPutStorageFileConnected(connection, filename, buf, size);
+	releaseConnection(connection);
+	return result;
+}
+
+static int destSshGetStorageFileConnected(SshConnection* connection, const char* filename, char *buf, size_t *size)
 {
 	char* storageFilePath = malloc(MAX_FILEPATH_LEN);
 	if (storageFilePath == NULL) {
@@ -553,12 +713,12 @@ int destSshGetStorageFile(const char* filename, char *buf, size_t *size)
 
 	snprintf(storageFilePath, MAX_FILEPATH_LEN, "%s/%s", repositoryStoragePath, filename);
 
-	sftp_file file = sftp_open(bucseSftpSession, storageFilePath, O_RDONLY, 0);
+	sftp_file file = sftp_open(connection->sftp, storageFilePath, O_RDONLY, 0);
 	free(storageFilePath);
 
 	if (file == NULL) {
 		logPrintf(LOG_ERROR, "destSshGetStorageFile: sftp_open(): %d\n",
-			sftp_get_error(bucseSftpSession));
+			sftp_get_error(connection->sftp));
 
 		return 2;
 	}
@@ -577,7 +737,66 @@ int destSshGetStorageFile(const char* filename, char *buf, size_t *size)
 	return 0;
 }
 
-int destSshAddActionFile(char* filename, char *buf, size_t size)
+int destSshGetStorageFile(const char* filename, char *buf, size_t *size)
+{
+	SshConnection* connection = acquireConnection();
+	int result = destSshGetStorageFileConnected(connection, filename, buf, size);
+	releaseConnection(connection);
+	return result;
+}
+
+static int destSshGetStorageFileRangeConnected(SshConnection* connection, const char* filename, size_t offset, char *buf, size_t *size)
+{
+	char* storageFilePath = malloc(MAX_FILEPATH_LEN);
+	if (storageFilePath == NULL) {
+		logPrintf(LOG_ERROR, "destSshGetStorageFileRange: malloc(): %s\n", strerror(errno));
+
+		return 1;
+	}
+
+	snprintf(storageFilePath, MAX_FILEPATH_LEN, "%s/%s", repositoryStoragePath, filename);
+
+	sftp_file file = sftp_open(connection->sftp, storageFilePath, O_RDONLY, 0);
+	free(storageFilePath);
+
+	if (file == NULL) {
+		logPrintf(LOG_ERROR, "destSshGetStorageFileRange: sftp_open(): %d\n",
+			sftp_get_error(connection->sftp));
+
+		return 2;
+	}
+
+	if (sftp_seek64(file, offset) != 0) {
+		logPrintf(LOG_ERROR, "destSshGetStorageFileRange: sftp_seek64(): %d\n",
+			sftp_get_error(connection->sftp));
+		sftp_close(file);
+
+		return 3;
+	}
+
+	ssize_t bytesRead = sftp_read_multiple_calls(file, buf, *size);
+	sftp_close(file);
+
+	if (bytesRead < 0) {
+		logPrintf(LOG_ERROR, "destSshGetStorageFileRange: sftp_read(): %d\n",
+			sftp_get_error(connection->sftp));
+
+		return 4;
+	}
+
+	*size = bytesRead;
+	return 0;
+}
+
+int destSshGetStorageFileRange(const char* filename, size_t offset, char *buf, size_t *size)
+{
+	SshConnection* connection = acquireConnection();
+	int result = destSshGetStorageFileRangeConnected(connection, filename, offset, buf, size);
+	releaseConnection(connection);
+	return result;
+}
+
+static int destSshAddActionFileConnected(SshConnection* connection, char* filename, char *buf, size_t size)
 {
 	char* actionFilePath = malloc(MAX_FILEPATH_LEN);
 	if (actionFilePath == NULL) {
@@ -588,40 +807,54 @@ int destSshAddActionFile(char* filename, char *buf, size_t size)
 
 	snprintf(actionFilePath, MAX_FILEPATH_LEN, "%s/%s", repositoryActionsPath, filename);
 
-	sftp_file file = sftp_open(bucseSftpSession, actionFilePath, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	sftp_file file = sftp_open(connection->sftp, actionFilePath, O_WRONLY | O_CREAT | O_EXCL, 0644);
 	free(actionFilePath);
 	if (file == NULL) {
 		logPrintf(LOG_ERROR, "destSshAddActionFile: sftp_open(): %d\n",
-			sftp_get_error(bucseSftpSession));
+			sftp_get_error(connection->sftp));
 		return 2;
 	}
 
 	int bytesWritten = sftp_write_multiple_calls(file, buf, size);
 	if (bytesWritten < 0) {
 		logPrintf(LOG_ERROR, "destSshAddActionFile: sftp_write_multiple_calls(): %d\n",
-			sftp_get_error(bucseSftpSession));
+			sftp_get_error(connection->sftp));
 		sftp_close(file);
 		return 3;
 	}
+	if (syncFile(connection, file) != 0) {
+		sftp_close(file);
+		return 4;
+	}
 	sftp_close(file);
 
+	pthread_mutex_lock(&handledActionsMutex);
 	addAction(&handledActions, filename);
+	pthread_mutex_unlock(&handledActionsMutex);
 	return 0;
 }
 
-int destSshPutRepositoryJsonFile(char *buf, size_t size)
+int destSshAddActionFile(char* filename, char *buf, size_t size)
+{
+	SshConnection* connection = acquireConnection();
+	int result = destSshAddActionFileConnected(connection, filename, buf, size);
+	releaseConnection(connection);
+	return result;
+}
+
+static int destSshPutRepositoryJsonFileConnected(SshConnection* connection, char *buf, size_t size)
 {
-	sftp_file file = sftp_open(bucseSftpSession, repositoryJsonFilePath, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	sftp_file file = sftp_open(connection->sftp, repositoryJsonFilePath, O_WRONLY | O_CREAT | O_EXCL, 0644);
 	if (file == NULL) {
 		logPrintf(LOG_ERROR, "destSshPutRepositoryJsonFile: sftp_open(): %d\n",
-			sftp_get_error(bucseSftpSession));
+			sftp_get_error(connection->sftp));
 		return 1;
 	}
 
 	int bytesWritten = sftp_write_multiple_calls(file, buf, size);
 	if (bytesWritten < 0) {
 		logPrintf(LOG_ERROR, "destSshPutRepositoryJsonFile: sftp_write_multiple_calls(): %d\n",
-			sftp_get_error(bucseSftpSession));
+			sftp_get_error(connection->sftp));
 		sftp_close(file);
 		return 2;
 	}
@@ -630,12 +863,20 @@ int destSshPutRepositoryJsonFile(char *buf, size_t size)
 	return 0;
 }
 
-int destSshGetRepositoryJsonFile(char *buf, size_t *size)
+int destSshPutRepositoryJsonFile(char *buf, size_t size)
 {
-	sftp_file file = sftp_open(bucseSftpSession, repositoryJsonFilePath, O_RDONLY, 0);
+	SshConnection* connection = acquireConnection();
+	int result = destSshPutRepositoryJsonFileConnected(connection, buf, size);
+	releaseConnection(connection);
+	return result;
+}
+
+static int destSshGetRepositoryJsonFileConnected(SshConnection* connection, char *buf, size_t *size)
+{
+	sftp_file file = sftp_open(connection->sftp, repositoryJsonFilePath, O_RDONLY, 0);
 	if (file == NULL) {
 		logPrintf(LOG_ERROR, "destSshGetRepositoryJsonFile: sftp_open(): %d\n",
-			sftp_get_error(bucseSftpSession));
+			sftp_get_error(connection->sftp));
 
 		return 1;
 	}
@@ -654,19 +895,27 @@ int destSshGetRepositoryJsonFile(char *buf, size_t *size)
 	return 0;
 }
 
-int destSshPutRepositoryFile(char *buf, size_t size)
+int destSshGetRepositoryJsonFile(char *buf, size_t *size)
+{
+	SshConnection* connection = acquireConnection();
+	int result = destSshGetRepositoryJsonFileConnected(connection, buf, size);
+	releaseConnection(connection);
+	return result;
+}
+
+static int destSshPutRepositoryFileConnected(SshConnection* connection, char *buf, size_t size)
 {
-	sftp_file file = sftp_open(bucseSftpSession, repositoryFilePath, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	sftp_file file = sftp_open(connection->sftp, repositoryFilePath, O_WRONLY | O_CREAT | O_EXCL, 0644);
 	if (file == NULL) {
 		logPrintf(LOG_ERROR, "destSshPutRepositoryFile: sftp_open(): %d\n",
-			sftp_get_error(bucseSftpSession));
+			sftp_get_error(connection->sftp));
 		return 1;
 	}
 
 	int bytesWritten = sftp_write_multiple_calls(file, buf, size);
 	if (bytesWritten < 0) {
 		logPrintf(LOG_ERROR, "destSshPutRepositoryFile: sftp_write_multiple_calls(): %d\n",
-			sftp_get_error(bucseSftpSession));
+			sftp_get_error(connection->sftp));
 		sftp_close(file);
 		return 2;
 	}
@@ -675,12 +924,20 @@ int destSshPutRepositoryFile(char *buf, size_t size)
 	return 0;
 }
 
-int destSshGetRepositoryFile(char *buf, size_t *size)
+int destSshPutRepositoryFile(char *buf, size_t size)
 {
-	sftp_file file = sftp_open(bucseSftpSession, repositoryFilePath, O_RDONLY, 0);
+	SshConnection* connection = acquireConnection();
+	int result = destSshPutRepositoryFileConnected(connection, buf, size);
+	releaseConnection(connection);
+	return result;
+}
+
+static int destSshGetRepositoryFileConnected(SshConnection* connection, char *buf, size_t *size)
+{
+	sftp_file file = sftp_open(connection->sftp, repositoryFilePath, O_RDONLY, 0);
 	if (file == NULL) {
 		logPrintf(LOG_ERROR, "destSshGetRepositoryFile: sftp_open(): %d\n",
-			sftp_get_error(bucseSftpSession));
+			sftp_get_error(connection->sftp));
 
 		return 1;
 	}
@@ -699,6 +956,14 @@ int destSshGetRepositoryFile(char *buf, size_t *size)
 	return 0;
 }
 
+int destSshGetRepositoryFile(char *buf, size_t *size)
+{
+	SshConnection* connection = acquireConnection();
+	int result = destSshGetRepositoryFileConnected(connection, buf, size);
+	releaseConnection(connection);
+	return result;
+}
+
 int destSshSetCallbackActionAdded(ActionAddedCallback callback)
 {
 	cachedActionAddedCallback = callback;
@@ -710,29 +975,19 @@ int destSshIsTickable()
 	return 1;
 }
 
-int destSshTick()
+// lists the actions that are not handled yet
+static int listNewActions(SshConnection* connection, Actions *newActions)
 {
-#define TICK_PERIOD_SECONDS 10
-
-	static int counter = 0;
-	if (--counter > 0) {
-		return 0;
-	}
-	counter = TICK_PERIOD_SECONDS;
-
-	sftp_dir actionsDir = sftp_opendir(bucseSftpSession, repositoryActionsPath);
+	sftp_dir actionsDir = sftp_opendir(connection->sftp, repositoryActionsPath);
 	if (actionsDir == NULL) {
 		logPrintf(LOG_ERROR, "warning: destSshTick(): sftp_opendir(): %s\n",
-			ssh_get_error(bucseSshSession));
-		return 0;
+			ssh_get_error(connection->ssh));
+		return 1;
 	}
 
-	Actions newActions;
-	memset(&newActions, 0, sizeof(Actions));
-
 	for (;;) {
 		errno = 0;
-		sftp_attributes actionDir = sftp_readdir(bucseSftpSession, actionsDir);
+		sftp_attributes actionDir = sftp_readdir(connection->sftp, actionsDir);
 		if (actionDir == NULL) {
 			break;
 		}
@@ -744,19 +999,90 @@ int destSshTick()
 		// TODO: consider optimizing by keeping handledActions sorted and searching with binary search
 		
 		// is the action not already handled?
-		if (findAction(&handledActions, actionDir->name) == -1) {
-			addAction(&newActions, actionDir->name);
+		pthread_mutex_lock(&handledActionsMutex);
+		int handled = findAction(&handledActions, actionDir->name) != -1;
+		pthread_mutex_unlock(&handledActionsMutex);
+		if (!handled) {
+			addAction(newActions, actionDir->name);
 		}
 
 		sftp_attributes_free(actionDir);
 	}
 	sftp_closedir(actionsDir);
+	return 0;
+}
+
+// downloads an action file to a new buffer
+static char* readActionFile(SshConnection* connection, const char* actionFilePath,
+	size_t *size)
+{
+	sftp_file file = sftp_open(connection->sftp, actionFilePath, O_RDONLY, 0);
+	if (file == NULL) {
+		logPrintf(LOG_ERROR, "destSshTick: sftp_open(): %s\n",
+			ssh_get_error(connection->ssh));
+		return NULL;
+	}
+
+	// get file size, handle errors if any
+	sftp_attributes attr = sftp_fstat(file);
+	if (attr == NULL) {
+		logPrintf(LOG_ERROR, "destSshTick: sftp_fstat(): %s\n",
+			ssh_get_error(connection->ssh));
+		sftp_close(file);
+		return NULL;
+	}
+	size_t actionFileSize = attr->size;
+	sftp_attributes_free(attr);
+
+	char* actionFileBuf = malloc(actionFileSize);
+	if (actionFileBuf == NULL) {
+		logPrintf(LOG_ERROR, "destSshTick: malloc(): %s\n", strerror(errno));
+		sftp_close(file);
+		return NULL;
+	}
+
+	ssize_t bytesRead = sftp_read_multiple_calls(file, actionFileBuf, actionFileSize);
+	sftp_close(file);
+	if (bytesRead < 0) {
+		logPrintf(LOG_ERROR, "destSshTick: sftp_read(): %d\n",
+			sftp_get_error(connection->sftp));
+		free(actionFileBuf);
+		return NULL;
+	}
+
+	*size = bytesRead;
+	return actionFileBuf;
+}
+
+// A connection is held only for each sftp call and never while the callback
+// replays an action, which takes the tree lock itself.
+int destSshTick()
+{
+#define TICK_PERIOD_SECONDS 10
+
+	// only the tick thread (or postInit before it's started) gets here
+	static int counter = 0;
+	if (--counter > 0) {
+		return 0;
+	}
+	counter = TICK_PERIOD_SECONDS;
+
+	Actions newActions;
+	memset(&newActions, 0, sizeof(Actions));
+
+	SshConnection* connection = acquireConnection();
+	int listResult = listNewActions(connection, &newActions);
+	releaseConnection(connection);
+	if (listResult != 0) {
+		return 0;
+	}
 
 	logPrintf(LOG_DEBUG, "new actions count: %d\n", newActions.len);
 
 	char* actionFilePath = malloc(MAX_FILEPATH_LEN);
 	if (actionFilePath == NULL) {
 		logPrintf(LOG_ERROR, "destSshTick: malloc(): %s\n", strerror(errno));
+		freeActions(&newActions);
 
 		return 1;
 	}
@@ -766,36 +1092,16 @@ int destSshTick()
 
 		snprintf(actionFilePath, MAX_FILEPATH_LEN, "%s/%s", repositoryActionsPath, getAction(&newActions, i));
 
-		sftp_file file = sftp_open(bucseSftpSession, actionFilePath, O_RDONLY, 0);
-		if (file == NULL) {
-			logPrintf(LOG_ERROR, "destSshTick: sftp_open(): %s\n",
-				ssh_get_error(bucseSshSession));
-			continue;
-		}
-
-		// get file size, handle errors if any
-		sftp_attributes attr = sftp_fstat(file);
-		if (attr == NULL) {
-			logPrintf(LOG_ERROR, "destSshTick: sftp_fstat(): %s\n",
-				ssh_get_error(bucseSshSession));
-			sftp_close(file);
-			continue;
-		}
-		size_t actionFileSize = attr->size;
-		sftp_attributes_free(attr);
-
-		char* actionFileBuf = malloc(actionFileSize);
+		size_t actionFileSize = 0;
+		connection = acquireConnection();
+		char* actionFileBuf = readActionFile(connection, actionFilePath, &actionFileSize);
+		releaseConnection(connection);
 		if (actionFileBuf == NULL) {
-			logPrintf(LOG_ERROR, "destSshTick: malloc(): %s\n", strerror(errno));
-			sftp_close(file);
 			continue;
 		}
 
-		int bytesRead = sftp_read_multiple_calls(file, actionFileBuf, actionFileSize);
-		sftp_close(file);
-
 		if (cachedActionAddedCallback) {
-			cachedActionAddedCallback(getAction(&newActions, i), actionFileBuf, bytesRead, newActions.len - i - 1);
+			cachedActionAddedCallback(getAction(&newActions, i), actionFileBuf, actionFileSize, newActions.len - i - 1);
 		} else {
 			logPrintf(LOG_ERROR, "destSshTick: no action added callback\n");
 		}
@@ -803,9 +1109,11 @@ int destSshTick()
 	}
 	free(actionFilePath);
 	
+	pthread_mutex_lock(&handledActionsMutex);
 	for (int i=0; i<newActions.len; i++) {
 		addAction(&handledActions, getAction(&newActions, i));
 	}
+	pthread_mutex_unlock(&handledActionsMutex);
 
 
 	freeActions(&newActions);
@@ -825,6 +1133,7 @@ Destination destinationSsh = {
 	.createDirs = destSshCreateDirs,
 	.putStorageFile = destSshPutStorageFile,
 	.getStorageFile = destSshGetStorageFile,
+	.getStorageFileRange = destSshGetStorageFileRange,
 	.addActionFile = destSshAddActionFile,
 	.putRepositoryJsonFile = destSshPutRepositoryJsonFile,
 	.getRepositoryJsonFile = destSshGetRepositoryJsonFile,
@@ -0,0 +1,231 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "log.h"
+
+#include "dirtymap.h"
+
+// index of the first page that doesn't end before offset
+static int findPage(DirtyMap* map, off_t offset)
+{
+	int low = 0;
+	int high = map->len;
+	while (low < high) {
+		int mid = (low + high) / 2;
+		if (map->pages[mid]->offset + DIRTY_PAGE_SIZE <= offset) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return low;
+}
+
+static DirtyPage* getPage(DirtyMap* map, off_t pageOffset)
+{
+	int i = findPage(map, pageOffset);
+	if (i < map->len && map->pages[i]->offset == pageOffset) {
+		return map->pages[i];
+	}
+
+	if (map->len == map->size) {
+		int newSize = map->size == 0 ? 16 : map->size * 2;
+		DirtyPage** newPages = realloc(map->pages, newSize * sizeof(DirtyPage*));
+		if (newPages == NULL) {
+			logPrintf(LOG_ERROR, "dirtyMapWrite: realloc(): %s\n", strerror(errno));
+			return NULL;
+		}
+		map->pages = newPages;
+		map->size = newSize;
+	}
+
+	DirtyPage* page = calloc(1, sizeof(DirtyPage));
+	if (page == NULL) {
+		logPrintf(LOG_ERROR, "dirtyMapWrite: calloc(): %s\n", strerror(errno));
+		return NULL;
+	}
+	page->buf = malloc(DIRTY_PAGE_SIZE);
+	if (page->buf == NULL) {
+		logPrintf(LOG_ERROR, "dirtyMapWrite: malloc(): %s\n", strerror(errno));
+		free(page);
+		return NULL;
+	}
+	page->offset = pageOffset;
+
+	memmove(map->pages + i + 1, map->pages + i, (map->len - i) * sizeof(DirtyPage*));
+	map->pages[i] = page;
+	map->len++;
+	return page;
+}
+
+// merges [start, end) with the runs it overlaps or touches
+static int addRun(DirtyPage* page, int start, int end)
+{
+	int first = 0;
+	while (first < page->runsLen && page->runs[first].end < start) {
+		first++;
+	}
+	int last = first;
+	while (last < page->runsLen && page->runs[last].start <= end) {
+		if (page->runs[last].start < start) {
+			start = page->runs[last].start;
+		}
+		if (page->runs[last].end > end) {
+			end = page->runs[last].end;
+		}
+		last++;
+	}
+
+	if (first == last) {
+		if (page->runsLen == page->runsSize) {
+			int newSize = page->runsSize == 0 ? 4 : page->runsSize * 2;
+			DirtyRun* newRuns = realloc(page->runs, newSize * sizeof(DirtyRun));
+			if (newRuns == NULL) {
+				logPrintf(LOG_ERROR, "dirtyMapWrite: realloc(): %s\n", strerror(errno));
+				return 1;
+			}
+			page->runs = newRuns;
+			page->runsSize = newSize;
+		}
+		memmove(page->runs + first + 1, page->runs + first,
+			(page->runsLen - first) * sizeof(DirtyRun));
+		page->runsLen++;
+	} else {
+		// the merged runs are replaced by the one at first
+		memmove(page->runs + first + 1, page->runs + last,
+			(page->runsLen - last) * sizeof(DirtyRun));
+		page->runsLen -= last - first - 1;
+	}
+	page->runs[first].start = start;
+	page->runs[first].end = end;
+	return 0;
+}
+
+int dirtyMapWrite(DirtyMap* map, const char* buf, size_t size, off_t offset)
+{
+	while (size > 0) {
+		off_t pageOffset = offset - (offset % DIRTY_PAGE_SIZE);
+		int start = offset - pageOffset;
+		size_t len = DIRTY_PAGE_SIZE - start;
+		if (len > size) {
+			len = size;
+		}
+
+		DirtyPage* page = getPage(map, pageOffset);
+		if (page == NULL) {
+			return 1;
+		}
+		if (addRun(page, start, start + len) != 0) {
+			return 2;
+		}
+		memcpy(page->buf + start, buf, len);
+		if (map->end < (size_t)(offset + len)) {
+			map->end = offset + len;
+		}
+
+		buf += len;
+		offset += len;
+		size -= len;
+	}
+	return 0;
+}
+
+void dirtyMapExtend(DirtyMap* map, size_t end)
+{
+	if (map->end < end) {
+		map->end = end;
+	}
+}
+
+void dirtyMapApply(DirtyMap* map, char* buf, off_t offset, size_t size)
+{
+	off_t end = offset + size;
+	for (int i = findPage(map, offset); i < map->len; i++) {
+		DirtyPage* page = map->pages[i];
+		if (page->offset >= end) {
+			break;
+		}
+		for (int j=0; j<page->runsLen; j++) {
+			off_t runStart = page->offset + page->runs[j].start;
+			off_t runEnd = page->offset + page->runs[j].end;
+			if (runStart < offset) {
+				runStart = offset;
+			}
+			if (runEnd > end) {
+				runEnd = end;
+			}
+			if (runStart >= runEnd) {
+				continue;
+			}
+			memcpy(buf + (runStart - offset),
+				page->buf + (runStart - page->offset),
+				runEnd - runStart);
+		}
+	}
+}
+
+int dirtyMapCovers(DirtyMap* map, off_t offset, size_t size)
+{
+	off_t end = offset + size;
+	// everything before covered is dirty
+	off_t covered = offset;
+	for (int i = findPage(map, offset); i < map->len && covered < end; i++) {
+		DirtyPage* page = map->pages[i];
+		if (page->offset > covered) {
+			return 0;
+		}
+		for (int j=0; j<page->runsLen && covered < end; j++) {
+			off_t runStart = page->offset + page->runs[j].start;
+			off_t runEnd = page->offset + page->runs[j].end;
+			if (runEnd <= covered) {
+				continue;
+			}
+			if (runStart > covered) {
+				return 0;
+			}
+			covered = runEnd;
+		}
+		if (covered < end && covered < page->offset + DIRTY_PAGE_SIZE) {
+			return 0;
+		}
+	}
+	return covered >= end;
+}
+
+int dirtyMapMerge(DirtyMap* map, DirtyMap* from)
+{
+	int result = 0;
+	for (int i=0; i<from->len && result == 0; i++) {
+		DirtyPage* page = from->pages[i];
+		for (int j=0; j<page->runsLen && result == 0; j++) {
+			int start = page->runs[j].start;
+			result = dirtyMapWrite(map, page->buf + start,
+				page->runs[j].end - start, page->offset + start);
+		}
+	}
+	dirtyMapExtend(map, from->end);
+	freeDirtyMap(from);
+	return result;
+}
+
+size_t dirtyMapBytes(DirtyMap* map)
+{
+	return (size_t)map->len * DIRTY_PAGE_SIZE;
+}
+
+void freeDirtyMap(DirtyMap* map)
+{
+	for (int i=0; i<map->len; i++) {
+		free(map->pages[i]->buf);
+		free(map->pages[i]->runs);
+		free(map->pages[i]);
+	}
+	if (map->pages != NULL) {
+		free(map->pages);
+	}
+	map->pages = NULL;
+	map->len = map->size = 0;
+	map->end = 0;
+}
@@ -0,0 +1,38 @@
+// DirtyMap holds the data written to a file and not flushed yet. The written
+// bytes go to fixed size pages, ordered by offset. Overlapping and adjacent
+// writes are merged into runs of dirty bytes within a page, so the memory
+// used depends on the dirty bytes rather than on the number of writes.
+#define DIRTY_PAGE_SIZE (64 * 1024)
+
+typedef struct {
+	int start;
+	int end; // exclusive
+} DirtyRun;
+
+typedef struct {
+	off_t offset; // a multiple of DIRTY_PAGE_SIZE
+	char* buf;
+	DirtyRun* runs; // sorted, neither overlapping nor adjacent
+	int runsLen;
+	int runsSize;
+} DirtyPage;
+
+typedef struct {
+	DirtyPage** pages; // sorted by offset
+	int len;
+	int size;
+	size_t end; // the file size implied by the writes, 0 when nothing is dirty
+} DirtyMap;
+
+int dirtyMapWrite(DirtyMap* map, const char* buf, size_t size, off_t offset);
+// extends the file with zeros up to end, without using any pages
+void dirtyMapExtend(DirtyMap* map, size_t end);
+// copies the dirty bytes of [offset, offset + size) over buf
+void dirtyMapApply(DirtyMap* map, char* buf, off_t offset, size_t size);
+// whether every byte of [offset, offset + size) is dirty
+int dirtyMapCovers(DirtyMap* map, off_t offset, size_t size);
+// writes the dirty bytes of from over map and frees from
+int dirtyMapMerge(DirtyMap* map, DirtyMap* from);
+// memory held by the pages
+size_t dirtyMapBytes(DirtyMap* map);
+void freeDirtyMap(DirtyMap* map);
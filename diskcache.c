@@ -0,0 +1,433 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "log.h"
+#include "dynarray.h"
+#include "nameindex.h"
+#include "conf.h"
+#include "destinations/dest.h"
+
+#include "diskcache.h"
+
+// temporary files are written under this prefix and renamed into place, so
+// a crash never leaves a truncated block behind
+#define DISK_CACHE_TMP_PREFIX ".tmp-"
+
+typedef struct _DiskCacheEntry {
+	struct _DiskCacheEntry *prev; // more recently used
+	struct _DiskCacheEntry *next; // less recently used
+	char* key;
+	size_t size;
+	int64_t mtime; // only used to order the entries found on init
+} DiskCacheEntry;
+
+static int diskCacheEnabled;
+static NameIndex diskCacheEntries;
+static DiskCacheEntry *first;
+static DiskCacheEntry *last;
+static size_t diskCacheBytes;
+static unsigned long diskCacheTmpId;
+
+static uint64_t diskCacheHits;
+static uint64_t diskCacheMisses;
+static uint64_t diskCacheEvictions;
+
+// guards the index and the list, the files are read and written without it
+static pthread_mutex_t diskCacheMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void unlinkEntry(DiskCacheEntry* entry)
+{
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		first = entry->next;
+	}
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		last = entry->prev;
+	}
+	entry->prev = entry->next = NULL;
+}
+
+static void linkEntryFirst(DiskCacheEntry* entry)
+{
+	entry->prev = NULL;
+	entry->next = first;
+	if (first) {
+		first->prev = entry;
+	}
+	first = entry;
+	if (last == NULL) {
+		last = entry;
+	}
+}
+
+static void getBlockPath(char* path, const char* block)
+{
+	snprintf(path, MAX_FILEPATH_LEN, "%s/%s", conf.diskCache, block);
+}
+
+// block names come from the repository, don't let them escape the directory
+static int isValidBlockName(const char* block)
+{
+	return block[0] != 0 && block[0] != '.' && strchr(block, '/') == NULL;
+}
+
+static void freeEntry(DiskCacheEntry* entry)
+{
+	free(entry->key);
+	free(entry);
+}
+
+// removes entry from the index and the list, diskCacheMutex needs to be held
+static void removeEntryLocked(DiskCacheEntry* entry)
+{
+	unlinkEntry(entry);
+	removeFromNameIndex(&diskCacheEntries, entry->key);
+	diskCacheBytes -= entry->size;
+}
+
+// evicts least recently used entries until the cache fits its limit; the
+// evicted entries are moved to evicted, so their files can be removed
+// without the lock held
+static void evictEntriesLocked(DynArray* evicted)
+{
+	while (diskCacheBytes > conf.diskCacheBytes && last != NULL) {
+		DiskCacheEntry* entry = last;
+		removeEntryLocked(entry);
+		diskCacheEvictions++;
+		addToDynArray(evicted, entry);
+	}
+}
+
+static void removeEvicted(DynArray* evicted)
+{
+	char path[MAX_FILEPATH_LEN];
+	for (int i=0; i<evicted->len; i++) {
+		DiskCacheEntry* entry = evicted->objects[i];
+		getBlockPath(path, entry->key);
+		if (unlink(path) != 0 && errno != ENOENT) {
+			logPrintf(LOG_WARNING, "diskCache: unlink(): %s\n", strerror(errno));
+		}
+		logPrintf(LOG_VERBOSE_DEBUG, "diskCache: item removed: %s\n", entry->key);
+		freeEntry(entry);
+	}
+	freeDynArray(evicted);
+}
+
+static DiskCacheEntry* newEntry(const char* block, size_t size, int64_t mtime)
+{
+	DiskCacheEntry* entry = malloc(sizeof(DiskCacheEntry));
+	if (entry == NULL) {
+		logPrintf(LOG_ERROR, "diskCache: malloc(): %s\n", strerror(errno));
+		return NULL;
+	}
+	memset(entry, 0, sizeof(DiskCacheEntry));
+	entry->key = strdup(block);
+	if (entry->key == NULL) {
+		logPrintf(LOG_ERROR, "diskCache: strdup(): %s\n", strerror(errno));
+		free(entry);
+		return NULL;
+	}
+	entry->size = size;
+	entry->mtime = mtime;
+	return entry;
+}
+
+// most recently used first
+static int compareEntriesByMtime(const void* a, const void* b)
+{
+	const DiskCacheEntry* entryA = *(const DiskCacheEntry**)a;
+	const DiskCacheEntry* entryB = *(const DiskCacheEntry**)b;
+	if (entryA->mtime > entryB->mtime) {
+		return -1;
+	}
+	if (entryA->mtime < entryB->mtime) {
+		return 1;
+	}
+	return 0;
+}
+
+// picks up the blocks cached by the previous mounts, the file modification
+// times are their last use
+static int loadEntries()
+{
+	DIR* dir = opendir(conf.diskCache);
+	if (dir == NULL) {
+		logPrintf(LOG_ERROR, "diskCacheInit: opendir(): %s\n", strerror(errno));
+		return 1;
+	}
+
+	DynArray found;
+	memset(&found, 0, sizeof(DynArray));
+
+	char path[MAX_FILEPATH_LEN];
+	struct dirent* dirent;
+	while ((dirent = readdir(dir)) != NULL) {
+		if (strncmp(dirent->d_name, DISK_CACHE_TMP_PREFIX, strlen(DISK_CACHE_TMP_PREFIX)) == 0) {
+			// left behind by an interrupted write
+			getBlockPath(path, dirent->d_name);
+			unlink(path);
+			continue;
+		}
+		if (!isValidBlockName(dirent->d_name)) {
+			continue;
+		}
+
+		struct stat st;
+		getBlockPath(path, dirent->d_name);
+		if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+			continue;
+		}
+
+		DiskCacheEntry* entry = newEntry(dirent->d_name, st.st_size, st.st_mtime);
+		if (entry == NULL) {
+			break;
+		}
+		addToDynArray(&found, entry);
+	}
+	closedir(dir);
+
+	qsort(found.objects, found.len, sizeof(void*), compareEntriesByMtime);
+	for (int i=0; i<found.len; i++) {
+		DiskCacheEntry* entry = found.objects[i];
+		if (addToNameIndex(&diskCacheEntries, entry->key, entry) != 0) {
+			freeEntry(entry);
+			continue;
+		}
+		// sorted from the most recent, so append
+		entry->prev = last;
+		if (last) {
+			last->next = entry;
+		} else {
+			first = entry;
+		}
+		last = entry;
+		diskCacheBytes += entry->size;
+	}
+	freeDynArray(&found);
+
+	logPrintf(LOG_DEBUG, "diskCacheInit: %d blocks, %zu bytes\n",
+		diskCacheEntries.len, diskCacheBytes);
+	return 0;
+}
+
+int diskCacheInit()
+{
+	diskCacheEnabled = 0;
+	if (conf.diskCache == NULL) {
+		return 0;
+	}
+
+	if (mkdir(conf.diskCache, 0700) != 0 && errno != EEXIST) {
+		logPrintf(LOG_ERROR, "diskCacheInit: mkdir(): %s\n", strerror(errno));
+		return 1;
+	}
+
+	if (loadEntries() != 0) {
+		return 2;
+	}
+
+	// the limit could have been lowered since the last mount
+	DynArray evicted;
+	memset(&evicted, 0, sizeof(DynArray));
+	evictEntriesLocked(&evicted);
+	removeEvicted(&evicted);
+
+	diskCacheEnabled = 1;
+	return 0;
+}
+
+int diskCacheGet(const char* block, char* buf, size_t *size)
+{
+	if (!diskCacheEnabled || !isValidBlockName(block)) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&diskCacheMutex);
+	DiskCacheEntry* entry = findInNameIndex(&diskCacheEntries, block);
+	if (entry == NULL) {
+		diskCacheMisses++;
+		pthread_mutex_unlock(&diskCacheMutex);
+		return -1;
+	}
+	if (entry != first) {
+		unlinkEntry(entry);
+		linkEntryFirst(entry);
+	}
+	diskCacheHits++;
+	pthread_mutex_unlock(&diskCacheMutex);
+
+	// the file may be evicted by now, then it's a miss
+	char path[MAX_FILEPATH_LEN];
+	getBlockPath(path, block);
+	FILE* file = fopen(path, "rb");
+	if (file == NULL) {
+		return -1;
+	}
+
+	size_t bytesRead = 0;
+	while (!feof(file) && !ferror(file) && bytesRead < *size) {
+		bytesRead += fread(buf + bytesRead, 1, *size - bytesRead, file);
+	}
+	if (ferror(file) || bytesRead >= *size) {
+		logPrintf(LOG_WARNING, "diskCacheGet: cannot read %s\n", block);
+		fclose(file);
+		diskCacheRemove(block);
+		return -1;
+	}
+	fclose(file);
+
+	// keep the order for the next mount
+	utimensat(AT_FDCWD, path, NULL, 0);
+
+	*size = bytesRead;
+	logPrintf(LOG_VERBOSE_DEBUG, "diskCacheGet: hit: %s\n", block);
+	return 0;
+}
+
+int diskCacheContains(const char* block)
+{
+	if (!diskCacheEnabled || !isValidBlockName(block)) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&diskCacheMutex);
+	int found = (findInNameIndex(&diskCacheEntries, block) != NULL);
+	pthread_mutex_unlock(&diskCacheMutex);
+	return found;
+}
+
+int diskCachePut(const char* block, const char* buf, size_t size)
+{
+	if (!diskCacheEnabled || !isValidBlockName(block)) {
+		return 0;
+	}
+	if (size > conf.diskCacheBytes) {
+		return 0;
+	}
+
+	// the same block could be written by two threads at once
+	pthread_mutex_lock(&diskCacheMutex);
+	unsigned long tmpId = diskCacheTmpId++;
+	pthread_mutex_unlock(&diskCacheMutex);
+
+	char path[MAX_FILEPATH_LEN];
+	char tmpPath[MAX_FILEPATH_LEN];
+	getBlockPath(path, block);
+	snprintf(tmpPath, MAX_FILEPATH_LEN, "%s/%s%lu-%s",
+		conf.diskCache, DISK_CACHE_TMP_PREFIX, tmpId, block);
+
+	FILE* file = fopen(tmpPath, "wb");
+	if (file == NULL) {
+		logPrintf(LOG_ERROR, "diskCachePut: fopen(): %s\n", strerror(errno));
+		return 1;
+	}
+	size_t bytesWritten = 0;
+	while (!ferror(file) && bytesWritten < size) {
+		bytesWritten += fwrite(buf + bytesWritten, 1, size - bytesWritten, file);
+	}
+	int writeError = ferror(file);
+	if (fclose(file) != 0) {
+		writeError = 1;
+	}
+	if (writeError) {
+		logPrintf(LOG_ERROR, "diskCachePut: cannot write %s\n", block);
+		unlink(tmpPath);
+		return 2;
+	}
+
+	DiskCacheEntry* entry = newEntry(block, size, 0);
+	if (entry == NULL) {
+		unlink(tmpPath);
+		return 3;
+	}
+
+	DynArray evicted;
+	memset(&evicted, 0, sizeof(DynArray));
+
+	pthread_mutex_lock(&diskCacheMutex);
+	// another thread could have put it in the meantime
+	if (findInNameIndex(&diskCacheEntries, block) != NULL) {
+		pthread_mutex_unlock(&diskCacheMutex);
+		unlink(tmpPath);
+		freeEntry(entry);
+		return 0;
+	}
+	if (rename(tmpPath, path) != 0) {
+		logPrintf(LOG_ERROR, "diskCachePut: rename(): %s\n", strerror(errno));
+		pthread_mutex_unlock(&diskCacheMutex);
+		unlink(tmpPath);
+		freeEntry(entry);
+		return 4;
+	}
+	if (addToNameIndex(&diskCacheEntries, entry->key, entry) != 0) {
+		logPrintf(LOG_ERROR, "diskCachePut: addToNameIndex() failed\n");
+		pthread_mutex_unlock(&diskCacheMutex);
+		unlink(path);
+		freeEntry(entry);
+		return 5;
+	}
+	linkEntryFirst(entry);
+	diskCacheBytes += size;
+	evictEntriesLocked(&evicted);
+	pthread_mutex_unlock(&diskCacheMutex);
+
+	removeEvicted(&evicted);
+
+	logPrintf(LOG_VERBOSE_DEBUG, "diskCachePut: item saved: %s\n", block);
+	return 0;
+}
+
+void diskCacheRemove(const char* block)
+{
+	if (!diskCacheEnabled || !isValidBlockName(block)) {
+		return;
+	}
+
+	DynArray evicted;
+	memset(&evicted, 0, sizeof(DynArray));
+
+	pthread_mutex_lock(&diskCacheMutex);
+	DiskCacheEntry* entry = findInNameIndex(&diskCacheEntries, block);
+	if (entry != NULL) {
+		removeEntryLocked(entry);
+		addToDynArray(&evicted, entry);
+	}
+	pthread_mutex_unlock(&diskCacheMutex);
+
+	removeEvicted(&evicted);
+}
+
+void diskCacheCleanup()
+{
+	pthread_mutex_lock(&diskCacheMutex);
+	if (diskCacheEnabled) {
+		logPrintf(LOG_NOTE, "disk cache: %llu hits, %llu misses, %llu evictions\n",
+			(unsigned long long)diskCacheHits,
+			(unsigned long long)diskCacheMisses,
+			(unsigned long long)diskCacheEvictions);
+	}
+
+	// the files stay for the next mount
+	while (first) {
+		DiskCacheEntry* entry = first;
+		first = entry->next;
+		freeEntry(entry);
+	}
+	last = NULL;
+	freeNameIndex(&diskCacheEntries);
+	diskCacheBytes = 0;
+	diskCacheEnabled = 0;
+	pthread_mutex_unlock(&diskCacheMutex);
+}
@@ -0,0 +1,54 @@
+/*
+ * An optional second cache tier on local disk, in the conf.diskCache
+ * directory. It keeps blocks as they were fetched from the destination, that
+ * is still encrypted, and survives remounts. Block names are random and never
+ * reused for different content, so the entries never need invalidation.
+ * The cache is limited by conf.diskCacheBytes, least recently used blocks are
+ * evicted first.
+ */
+
+/*
+ * Prepares the disk cache, picking up the blocks cached by previous mounts.
+ * Does nothing if conf.diskCache is not set.
+ *
+ * @return 0 on success, error code on error
+ */
+int diskCacheInit();
+
+/*
+ * Gets a block from the disk cache.
+ *
+ * @param block A block to get.
+ * @param buf Buffer where data should be written to.
+ * @param size Pointer to a variable that stores size of the buffer. If the block is found, the value will be set to the block size.
+ * @return 0 when found, -1 when not found
+ */
+int diskCacheGet(const char* block, char* buf, size_t *size);
+
+/*
+ * Checks whether a block is in the disk cache, without counting it as a use.
+ *
+ * @param block A block to look for.
+ * @return 1 when cached, 0 otherwise
+ */
+int diskCacheContains(const char* block);
+
+/*
+ * Puts a block to the disk cache.
+ *
+ * @param block A block to put.
+ * @param buf Buffer that holds the data.
+ * @param size Block size.
+ * @return 0 on success, error code on error
+ */
+int diskCachePut(const char* block, const char* buf, size_t size);
+
+/*
+ * Removes a block from the disk cache, e.g. when it turned out to be corrupted.
+ */
+void diskCacheRemove(const char* block);
+
+/*
+ * Cleans up the disk cache, the cached files are kept.
+ */
+void diskCacheCleanup();
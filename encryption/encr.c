@@ -8,10 +8,15 @@
 
 extern Encryption encryptionNone;
 extern Encryption encryptionAes;
+extern Encryption encryptionAesHkdf;
+extern Encryption encryptionAead;
+
+extern Encryption *encryption;
 
 size_t getMaxEncryptedBlockSize(size_t blockSize)
 {
-	blockSize *= 2;
+	// the destinations need a byte more than the file to tell it's complete
+	blockSize += encryption->getMaxOverhead(blockSize) + 1;
 	if (blockSize < 256) {
 		blockSize = 256;
 	}
@@ -24,6 +29,10 @@ Encryption* getEncryptionByName(char* name)
 		return &encryptionNone;
 	} else if (strcmp(name, "aes") == 0) {
 		return &encryptionAes;
+	} else if (strcmp(name, "aes-hkdf") == 0) {
+		return &encryptionAesHkdf;
+	} else if (strcmp(name, "aead") == 0) {
+		return &encryptionAead;
 	} else {
 		logPrintf(LOG_ERROR, "getEncryptionByName:() Unsupported encryption: %s\n", name);
 		return NULL;
@@ -13,8 +13,37 @@ typedef struct {
 	int (*decrypt)(char *inBuf, size_t inSize, char *outBuf, size_t *outSize, char *passphrase);
 
 	int (*needsPassphrase)();
+
+	// how many bytes encrypt() adds to size bytes at most
+	size_t (*getMaxOverhead)(size_t size);
+
+	// Optional, for decrypting a part of a block without fetching all of it.
+	// getRange() tells what the decrypted bytes from offset to offset+size
+	// need: *headerSize bytes from the start of the encrypted block and
+	// *encryptedSize bytes from *encryptedOffset. decryptRange() decrypts
+	// them, its output starts at *decryptedOffset of the decrypted block and
+	// may end with bytes past the end of the block, e.g. padding.
+	void (*getRange)(size_t offset, size_t size, size_t *headerSize,
+		size_t *encryptedOffset, size_t *encryptedSize, size_t *decryptedOffset);
+	int (*decryptRange)(char *header, char *inBuf, size_t inSize, size_t decryptedOffset,
+		char *outBuf, size_t *outSize, char *passphrase);
+
+	// Optional, for encryptions with a key stored in repository.json as the
+	// 'key' field, see masterkey.h. createKey() makes a new one for a new
+	// repository, loadKey() loads it at mount, before anything is encrypted
+	// or decrypted. The passphrase argument of the other functions is
+	// ignored then.
+	int (*createKey)(char *passphrase, char **keyJson);
+	int (*loadKey)(const char *keyJson, char *passphrase);
 } Encryption;
 
+// for the encryption in use
 size_t getMaxEncryptedBlockSize(size_t blockSize);
 
+// "aes" and "aes-hkdf" store blocks the same way: a 16 byte header, then
+// the CBC cipher blocks
+size_t encrAesGetMaxOverhead(size_t size);
+void encrAesGetRange(size_t offset, size_t size, size_t *headerSize,
+	size_t *encryptedOffset, size_t *encryptedSize, size_t *decryptedOffset);
+
 Encryption* getEncryptionByName(char* name);
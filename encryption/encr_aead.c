@@ -0,0 +1,407 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#if defined(__aarch64__)
+#include <sys/auxv.h>
+#endif
+
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+
+#include "../log.h"
+#include "../random.h"
+
+#include "encr.h"
+#include "masterkey.h"
+
+// Authenticated encryption with a key derived from the master key, see
+// masterkey.h. AES-256-GCM is used where the CPU accelerates it and
+// ChaCha20-Poly1305 elsewhere; the algorithm is recorded in every buffer, so
+// both can be decrypted everywhere.
+//
+// The data is split into chunks that are sealed separately, so a range can be
+// decrypted and verified without the rest of the buffer:
+//   header: algorithm (1 byte), random salt (16 bytes)
+//   chunks: ciphertext (up to AEAD_CHUNK_SIZE bytes), tag (16 bytes)
+// Every buffer is sealed with its own key, derived with HKDF from the key of
+// the algorithm and the salt, so nonces never repeat under a key however many
+// buffers are written. The nonce of a chunk is its index. The last chunk is
+// marked in its associated data, so a buffer can't be truncated at a chunk
+// boundary unnoticed.
+
+#define AEAD_CHUNK_SIZE (64 * 1024)
+#define AEAD_TAG_SIZE 16
+#define AEAD_SALT_SIZE 16
+#define AEAD_KEY_SIZE 32
+#define AEAD_NONCE_SIZE 12
+#define AEAD_HEADER_SIZE (1 + AEAD_SALT_SIZE)
+#define AEAD_SEALED_CHUNK_SIZE (AEAD_CHUNK_SIZE + AEAD_TAG_SIZE)
+
+#define AEAD_ALG_AES_GCM 1
+#define AEAD_ALG_CHACHA20_POLY1305 2
+#define AEAD_ALGS_COUNT 3
+
+static unsigned char keys[AEAD_ALGS_COUNT][AEAD_KEY_SIZE];
+static int keysLoaded;
+static int preferredAlg;
+
+typedef struct {
+	EVP_CIPHER_CTX* encryptCtx[AEAD_ALGS_COUNT];
+	EVP_CIPHER_CTX* decryptCtx[AEAD_ALGS_COUNT];
+	// the salt of the buffer the decryption context has the key of, a range
+	// of a buffer is often followed by the next one
+	unsigned char decryptSalt[AEAD_ALGS_COUNT][AEAD_SALT_SIZE];
+	int decryptKeyed[AEAD_ALGS_COUNT];
+} CipherContexts;
+
+static pthread_key_t contextsKey;
+static pthread_once_t contextsKeyOnce = PTHREAD_ONCE_INIT;
+
+size_t encrAeadGetMaxOverhead(size_t size)
+{
+	return AEAD_HEADER_SIZE + AEAD_TAG_SIZE * (size / AEAD_CHUNK_SIZE + 1);
+}
+
+static const EVP_CIPHER* getCipher(int alg)
+{
+	if (alg == AEAD_ALG_AES_GCM) {
+		return EVP_aes_256_gcm();
+	} else if (alg == AEAD_ALG_CHACHA20_POLY1305) {
+		return EVP_chacha20_poly1305();
+	}
+	return NULL;
+}
+
+// GCM is only fast with instructions for AES and carry-less multiplication,
+// ChaCha20-Poly1305 is faster without them
+static int detectPreferredAlg()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul")) {
+		return AEAD_ALG_AES_GCM;
+	}
+#elif defined(__aarch64__)
+	unsigned long hwcaps = getauxval(AT_HWCAP);
+	if ((hwcaps & HWCAP_AES) && (hwcaps & HWCAP_PMULL)) {
+		return AEAD_ALG_AES_GCM;
+	}
+#endif
+	return AEAD_ALG_CHACHA20_POLY1305;
+}
+
+static void freeContexts(void* ptr)
+{
+	CipherContexts* contexts = ptr;
+	for (int alg=1; alg<AEAD_ALGS_COUNT; alg++) {
+		EVP_CIPHER_CTX_free(contexts->encryptCtx[alg]);
+		EVP_CIPHER_CTX_free(contexts->decryptCtx[alg]);
+	}
+	free(contexts);
+}
+
+static void createContextsKey()
+{
+	pthread_key_create(&contextsKey, freeContexts);
+}
+
+static CipherContexts* getContexts()
+{
+	if (!keysLoaded) {
+		logPrintf(LOG_ERROR, "encrAead: no key loaded\n");
+		return NULL;
+	}
+
+	pthread_once(&contextsKeyOnce, createContextsKey);
+	CipherContexts* contexts = pthread_getspecific(contextsKey);
+	if (contexts) {
+		return contexts;
+	}
+
+	contexts = malloc(sizeof(CipherContexts));
+	if (contexts == NULL) {
+		logPrintf(LOG_ERROR, "encrAead: malloc failed\n");
+		return NULL;
+	}
+	memset(contexts, 0, sizeof(CipherContexts));
+	for (int alg=1; alg<AEAD_ALGS_COUNT; alg++) {
+		contexts->encryptCtx[alg] = EVP_CIPHER_CTX_new();
+		contexts->decryptCtx[alg] = EVP_CIPHER_CTX_new();
+		if (contexts->encryptCtx[alg] == NULL || contexts->decryptCtx[alg] == NULL
+				|| EVP_EncryptInit_ex(contexts->encryptCtx[alg], getCipher(alg), NULL, NULL, NULL) != 1
+				|| EVP_DecryptInit_ex(contexts->decryptCtx[alg], getCipher(alg), NULL, NULL, NULL) != 1) {
+			logPrintf(LOG_ERROR, "encrAead: creating cipher contexts failed\n");
+			freeContexts(contexts);
+			return NULL;
+		}
+	}
+	pthread_setspecific(contextsKey, contexts);
+	return contexts;
+}
+
+static int deriveBufferKey(int alg, const unsigned char* salt, unsigned char* key)
+{
+	EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+	if (ctx == NULL) {
+		return 1;
+	}
+	size_t derivedSize = AEAD_KEY_SIZE;
+	int res = 0;
+	if (EVP_PKEY_derive_init(ctx) <= 0
+			|| EVP_PKEY_CTX_set_hkdf_md(ctx, EVP_sha256()) <= 0
+			|| EVP_PKEY_CTX_set1_hkdf_key(ctx, keys[alg], AEAD_KEY_SIZE) <= 0
+			|| EVP_PKEY_CTX_set1_hkdf_salt(ctx, salt, AEAD_SALT_SIZE) <= 0
+			|| EVP_PKEY_derive(ctx, key, &derivedSize) <= 0
+			|| derivedSize != AEAD_KEY_SIZE) {
+		res = 2;
+	}
+	EVP_PKEY_CTX_free(ctx);
+	return res;
+}
+
+static void getChunkNonce(uint32_t chunk, unsigned char* nonce)
+{
+	memset(nonce, 0, AEAD_NONCE_SIZE - 4);
+	nonce[8] = chunk >> 24;
+	nonce[9] = chunk >> 16;
+	nonce[10] = chunk >> 8;
+	nonce[11] = chunk;
+}
+
+// encrypts len bytes of in to out, followed by the tag
+static int sealChunk(EVP_CIPHER_CTX* ctx, const unsigned char* nonce, unsigned char last,
+	const unsigned char* in, size_t len, unsigned char* out)
+{
+	int outLen = 0;
+	int tmpLen = 0;
+	if (EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, nonce) != 1
+			|| EVP_EncryptUpdate(ctx, NULL, &tmpLen, &last, 1) != 1
+			|| (len > 0 && EVP_EncryptUpdate(ctx, out, &outLen, in, len) != 1)
+			|| EVP_EncryptFinal_ex(ctx, out + outLen, &tmpLen) != 1
+			|| EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, AEAD_TAG_SIZE, out + len) != 1) {
+		return 1;
+	}
+	return 0;
+}
+
+// decrypts a chunk of len bytes followed by the tag, fails if it was modified
+static int openChunk(EVP_CIPHER_CTX* ctx, const unsigned char* nonce, unsigned char last,
+	const unsigned char* in, size_t len, unsigned char* out)
+{
+	int outLen = 0;
+	int tmpLen = 0;
+	if (EVP_DecryptInit_ex(ctx, NULL, NULL, NULL, nonce) != 1
+			|| EVP_DecryptUpdate(ctx, NULL, &tmpLen, &last, 1) != 1
+			|| (len > 0 && EVP_DecryptUpdate(ctx, out, &outLen, in, len) != 1)
+			|| EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, AEAD_TAG_SIZE, (void*)(in + len)) != 1
+			|| EVP_DecryptFinal_ex(ctx, out + outLen, &tmpLen) <= 0) {
+		return 1;
+	}
+	return 0;
+}
+
+int encrAeadEncrypt(char *inBuf, size_t inSize, char *outBuf, size_t *outSize, char *passphrase)
+{
+	(void) passphrase;
+	if (*outSize < inSize + encrAeadGetMaxOverhead(inSize)) {
+		logPrintf(LOG_ERROR, "encrAeadEncrypt: output buffer too small\n");
+		return 1;
+	}
+	CipherContexts* contexts = getContexts();
+	if (contexts == NULL) {
+		return 2;
+	}
+	EVP_CIPHER_CTX* ctx = contexts->encryptCtx[preferredAlg];
+
+	unsigned char* header = (unsigned char*)outBuf;
+	header[0] = preferredAlg;
+	if (getRandomBytes(header + 1, AEAD_SALT_SIZE) != 0) {
+		logPrintf(LOG_ERROR, "encrAeadEncrypt: getRandomBytes failed\n");
+		return 3;
+	}
+	unsigned char key[AEAD_KEY_SIZE];
+	int res = deriveBufferKey(preferredAlg, header + 1, key);
+	if (res == 0 && EVP_EncryptInit_ex(ctx, NULL, NULL, key, NULL) != 1) {
+		res = 1;
+	}
+	memset(key, 0, sizeof(key));
+	if (res != 0) {
+		logPrintf(LOG_ERROR, "encrAeadEncrypt: deriving the buffer key failed\n");
+		return 5;
+	}
+
+	// an empty buffer still gets a chunk, for the tag
+	size_t inPos = 0;
+	size_t outPos = AEAD_HEADER_SIZE;
+	uint32_t chunk = 0;
+	do {
+		size_t len = inSize - inPos;
+		if (len > AEAD_CHUNK_SIZE) {
+			len = AEAD_CHUNK_SIZE;
+		}
+		unsigned char nonce[AEAD_NONCE_SIZE];
+		getChunkNonce(chunk, nonce);
+		if (sealChunk(ctx, nonce, inPos + len == inSize,
+				(unsigned char*)inBuf + inPos, len, (unsigned char*)outBuf + outPos) != 0) {
+			logPrintf(LOG_ERROR, "encrAeadEncrypt: encryption failed\n");
+			return 4;
+		}
+		inPos += len;
+		outPos += len + AEAD_TAG_SIZE;
+		chunk++;
+	} while (inPos < inSize);
+
+	*outSize = outPos;
+	return 0;
+}
+
+// decrypts whole sealed chunks; if lastKnown is not set, the last chunk of the
+// input may or may not be the last chunk of the buffer
+static int openChunks(const unsigned char* header, uint32_t firstChunk,
+	const unsigned char* inBuf, size_t inSize, int lastKnown,
+	unsigned char* outBuf, size_t *outSize)
+{
+	int alg = header[0];
+	if (getCipher(alg) == NULL) {
+		return 1;
+	}
+	CipherContexts* contexts = getContexts();
+	if (contexts == NULL) {
+		return 2;
+	}
+	EVP_CIPHER_CTX* ctx = contexts->decryptCtx[alg];
+	const unsigned char* salt = header + 1;
+	if (!contexts->decryptKeyed[alg]
+			|| memcmp(contexts->decryptSalt[alg], salt, AEAD_SALT_SIZE) != 0) {
+		contexts->decryptKeyed[alg] = 0;
+		unsigned char key[AEAD_KEY_SIZE];
+		int res = deriveBufferKey(alg, salt, key);
+		if (res == 0 && EVP_DecryptInit_ex(ctx, NULL, NULL, key, NULL) != 1) {
+			res = 1;
+		}
+		memset(key, 0, sizeof(key));
+		if (res != 0) {
+			logPrintf(LOG_ERROR, "encrAead: deriving the buffer key failed\n");
+			return 5;
+		}
+		memcpy(contexts->decryptSalt[alg], salt, AEAD_SALT_SIZE);
+		contexts->decryptKeyed[alg] = 1;
+	}
+
+	size_t inPos = 0;
+	size_t outPos = 0;
+	uint32_t chunk = firstChunk;
+	do {
+		size_t sealedLen = inSize - inPos;
+		if (sealedLen > AEAD_SEALED_CHUNK_SIZE) {
+			sealedLen = AEAD_SEALED_CHUNK_SIZE;
+		}
+		if (sealedLen < AEAD_TAG_SIZE || outPos + sealedLen - AEAD_TAG_SIZE > *outSize) {
+			return 3;
+		}
+		size_t len = sealedLen - AEAD_TAG_SIZE;
+
+		unsigned char nonce[AEAD_NONCE_SIZE];
+		getChunkNonce(chunk, nonce);
+		int last = (inPos + sealedLen == inSize);
+		int res = openChunk(ctx, nonce, last && (lastKnown || len < AEAD_CHUNK_SIZE),
+			inBuf + inPos, len, outBuf + outPos);
+		if (res != 0 && last && !lastKnown && len == AEAD_CHUNK_SIZE) {
+			// a full chunk at the end of a range, it may be the last one
+			res = openChunk(ctx, nonce, 1, inBuf + inPos, len, outBuf + outPos);
+		}
+		if (res != 0) {
+			// a wrong key or damaged data, not worth an error message here
+			return 4;
+		}
+		inPos += sealedLen;
+		outPos += len;
+		chunk++;
+	} while (inPos < inSize);
+
+	*outSize = outPos;
+	return 0;
+}
+
+int encrAeadDecrypt(char *inBuf, size_t inSize, char *outBuf, size_t *outSize, char *passphrase)
+{
+	(void) passphrase;
+	if (inSize < AEAD_HEADER_SIZE + AEAD_TAG_SIZE) {
+		return 5;
+	}
+	return openChunks((unsigned char*)inBuf, 0,
+		(unsigned char*)inBuf + AEAD_HEADER_SIZE, inSize - AEAD_HEADER_SIZE, 1,
+		(unsigned char*)outBuf, outSize);
+}
+
+void encrAeadGetRange(size_t offset, size_t size, size_t *headerSize,
+	size_t *encryptedOffset, size_t *encryptedSize, size_t *decryptedOffset)
+{
+	size_t firstChunk = offset / AEAD_CHUNK_SIZE;
+	size_t lastChunk = (size > 0) ? (offset + size - 1) / AEAD_CHUNK_SIZE : firstChunk;
+
+	*headerSize = AEAD_HEADER_SIZE;
+	*encryptedOffset = AEAD_HEADER_SIZE + firstChunk * AEAD_SEALED_CHUNK_SIZE;
+	*encryptedSize = (lastChunk - firstChunk + 1) * AEAD_SEALED_CHUNK_SIZE;
+	*decryptedOffset = firstChunk * AEAD_CHUNK_SIZE;
+}
+
+int encrAeadDecryptRange(char *header, char *inBuf, size_t inSize, size_t decryptedOffset,
+	char *outBuf, size_t *outSize, char *passphrase)
+{
+	(void) passphrase;
+	if (decryptedOffset % AEAD_CHUNK_SIZE != 0) {
+		return 5;
+	}
+	// the range may end before the buffer does, so the last chunk isn't known
+	return openChunks((unsigned char*)header, decryptedOffset / AEAD_CHUNK_SIZE,
+		(unsigned char*)inBuf, inSize, 0,
+		(unsigned char*)outBuf, outSize);
+}
+
+static int deriveKeys()
+{
+	if (masterKeyDerive("bucse aes-256-gcm", keys[AEAD_ALG_AES_GCM], AEAD_KEY_SIZE) != 0
+			|| masterKeyDerive("bucse chacha20-poly1305", keys[AEAD_ALG_CHACHA20_POLY1305], AEAD_KEY_SIZE) != 0) {
+		return 1;
+	}
+	preferredAlg = detectPreferredAlg();
+	logPrintf(LOG_DEBUG, "encrAead: encrypting with %s\n",
+		preferredAlg == AEAD_ALG_AES_GCM ? "AES-256-GCM" : "ChaCha20-Poly1305");
+	keysLoaded = 1;
+	return 0;
+}
+
+int encrAeadCreateKey(char* passphrase, char** keyJson)
+{
+	if (masterKeyCreate(passphrase, keyJson) != 0) {
+		return 1;
+	}
+	return deriveKeys();
+}
+
+int encrAeadLoadKey(const char* keyJson, char* passphrase)
+{
+	if (masterKeyLoad(keyJson, passphrase) != 0) {
+		return 1;
+	}
+	return deriveKeys();
+}
+
+int encrAeadNeedsPassphrase()
+{
+	return 1;
+}
+
+Encryption encryptionAead = {
+	.encrypt = encrAeadEncrypt,
+	.decrypt = encrAeadDecrypt,
+	.needsPassphrase = encrAeadNeedsPassphrase,
+	.getMaxOverhead = encrAeadGetMaxOverhead,
+	.getRange = encrAeadGetRange,
+	.decryptRange = encrAeadDecryptRange,
+	.createKey = encrAeadCreateKey,
+	.loadKey = encrAeadLoadKey
+};
@@ -5,6 +5,7 @@
 #include <openssl/evp.h>
 
 #include "../log.h"
+#include "../random.h"
 
 #include "encr.h"
 
@@ -23,23 +24,12 @@ int encrAesEncrypt(char *inBuf, size_t inSize, char *outBuf, size_t *outSize, ch
 	unsigned char key[32];
 	unsigned char iv[32];
 	
-	FILE* f = fopen("/dev/urandom", "rb");
-	if (f == NULL) {
-		logPrintf(LOG_ERROR, "encrAesEncrypt: fopen(): %s\n", strerror(errno));
+	if (getRandomBytes(salt, 8) != 0) {
+		logPrintf(LOG_ERROR, "encrAesEncrypt: getRandomBytes failed\n");
 		EVP_CIPHER_CTX_free(ctx);
 		return 2;
 	}
 
-	size_t got = fread(salt, 8, 1, f);
-	if (got == 0) {
-		logPrintf(LOG_ERROR, "encrAesEncrypt: fread failed\n");
-		fclose(f);
-		EVP_CIPHER_CTX_free(ctx);
-		return 3;
-	}
-
-	fclose(f);
-
 	unsigned char keyiv[64];
 	PKCS5_PBKDF2_HMAC_SHA1((const char*)pass, strlen(pass),
 		salt, 8, 1, sizeof(keyiv), keyiv);
@@ -137,6 +127,89 @@ int encrAesDecrypt(char *inBuf, size_t inSize, char *outBuf, size_t *outSize, ch
 	return 0;
 }
 
+// CBC decryption of a cipher block only needs the previous one as its IV, so
+// any range aligned to cipher blocks can be decrypted on its own. The key and
+// the IV of the first cipher block come from the salt in the header.
+#define AES_HEADER_SIZE 16
+#define AES_CIPHER_BLOCK_SIZE 16
+
+// the header and up to a cipher block of padding
+size_t encrAesGetMaxOverhead(size_t size)
+{
+	(void) size;
+	return AES_HEADER_SIZE + AES_CIPHER_BLOCK_SIZE;
+}
+
+void encrAesGetRange(size_t offset, size_t size, size_t *headerSize,
+	size_t *encryptedOffset, size_t *encryptedSize, size_t *decryptedOffset)
+{
+	size_t from = offset & ~(size_t)(AES_CIPHER_BLOCK_SIZE - 1);
+	size_t to = (offset + size + AES_CIPHER_BLOCK_SIZE - 1) & ~(size_t)(AES_CIPHER_BLOCK_SIZE - 1);
+
+	*headerSize = AES_HEADER_SIZE;
+	*decryptedOffset = from;
+	if (from == 0) {
+		*encryptedOffset = AES_HEADER_SIZE;
+		*encryptedSize = to;
+	} else {
+		// the previous cipher block is needed as the IV
+		*encryptedOffset = AES_HEADER_SIZE + from - AES_CIPHER_BLOCK_SIZE;
+		*encryptedSize = to - from + AES_CIPHER_BLOCK_SIZE;
+	}
+}
+
+int encrAesDecryptRange(char *header, char *inBuf, size_t inSize, size_t decryptedOffset,
+	char *outBuf, size_t *outSize, char *pass)
+{
+	if (strncmp((const char*)header, "Salted__", 8) != 0) {
+		return 1;
+	}
+
+	unsigned char keyiv[64];
+	PKCS5_PBKDF2_HMAC_SHA1((const char*)pass, strlen(pass),
+		(unsigned char*)header + 8, 8, 1, sizeof(keyiv), keyiv);
+	unsigned char* key = keyiv;
+	unsigned char* iv = keyiv + 32;
+
+	if (decryptedOffset != 0) {
+		if (inSize < AES_CIPHER_BLOCK_SIZE) {
+			return 2;
+		}
+		iv = (unsigned char*)inBuf;
+		inBuf += AES_CIPHER_BLOCK_SIZE;
+		inSize -= AES_CIPHER_BLOCK_SIZE;
+	}
+	// a short read at the end of the block
+	inSize &= ~(size_t)(AES_CIPHER_BLOCK_SIZE - 1);
+
+	EVP_CIPHER_CTX *ctx;
+	if (!(ctx = EVP_CIPHER_CTX_new())) {
+		logPrintf(LOG_ERROR, "encrAesDecryptRange: EVP_CIPHER_CTX_new failed\n");
+		return 3;
+	}
+
+	if (EVP_DecryptInit(ctx, EVP_aes_256_cbc(), key, iv) != 1) {
+		logPrintf(LOG_ERROR, "encrAesDecryptRange: EVP_DecryptInit failed\n");
+		EVP_CIPHER_CTX_free(ctx);
+		return 4;
+	}
+
+	// the padding is left in the output, the caller knows the block size
+	EVP_CIPHER_CTX_set_padding(ctx, 0);
+
+	int len = 0;
+	if (EVP_DecryptUpdate(ctx, (unsigned char*)outBuf, &len, (unsigned char*)inBuf, inSize) != 1) {
+		logPrintf(LOG_ERROR, "encrAesDecryptRange: EVP_DecryptUpdate failed\n");
+		EVP_CIPHER_CTX_free(ctx);
+		return 5;
+	}
+	*outSize = len;
+
+	EVP_CIPHER_CTX_free(ctx);
+
+	return 0;
+}
+
 int encrAesNeedsPassphrase()
 {
 	return 1;
@@ -145,6 +218,9 @@ int encrAesNeedsPassphrase()
 Encryption encryptionAes = {
 	.encrypt = encrAesEncrypt,
 	.decrypt = encrAesDecrypt,
-	.needsPassphrase = encrAesNeedsPassphrase
+	.needsPassphrase = encrAesNeedsPassphrase,
+	.getMaxOverhead = encrAesGetMaxOverhead,
+	.getRange = encrAesGetRange,
+	.decryptRange = encrAesDecryptRange
 };
 
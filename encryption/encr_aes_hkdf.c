@@ -0,0 +1,214 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <openssl/evp.h>
+
+#include "../log.h"
+#include "../random.h"
+
+#include "encr.h"
+#include "masterkey.h"
+
+// AES-256-CBC with a key derived from the master key, see masterkey.h. Every
+// encrypted buffer starts with its random IV, followed by the ciphertext.
+// Unlike "aes", there's no key derivation per block, and the cipher contexts
+// are kept per thread, so the key schedule is computed once per thread too.
+
+#define IV_SIZE 16
+#define AES_CIPHER_BLOCK_SIZE 16
+
+static unsigned char blockKey[32];
+static int blockKeyLoaded;
+
+typedef struct {
+	EVP_CIPHER_CTX* encryptCtx;
+	EVP_CIPHER_CTX* decryptCtx;
+} CipherContexts;
+
+static pthread_key_t contextsKey;
+static pthread_once_t contextsKeyOnce = PTHREAD_ONCE_INIT;
+
+static void freeContexts(void* ptr)
+{
+	CipherContexts* contexts = ptr;
+	EVP_CIPHER_CTX_free(contexts->encryptCtx);
+	EVP_CIPHER_CTX_free(contexts->decryptCtx);
+	free(contexts);
+}
+
+static void createContextsKey()
+{
+	pthread_key_create(&contextsKey, freeContexts);
+}
+
+static CipherContexts* getContexts()
+{
+	if (!blockKeyLoaded) {
+		logPrintf(LOG_ERROR, "encrAesHkdf: no key loaded\n");
+		return NULL;
+	}
+
+	pthread_once(&contextsKeyOnce, createContextsKey);
+	CipherContexts* contexts = pthread_getspecific(contextsKey);
+	if (contexts) {
+		return contexts;
+	}
+
+	contexts = malloc(sizeof(CipherContexts));
+	if (contexts == NULL) {
+		logPrintf(LOG_ERROR, "encrAesHkdf: malloc failed\n");
+		return NULL;
+	}
+	contexts->encryptCtx = EVP_CIPHER_CTX_new();
+	contexts->decryptCtx = EVP_CIPHER_CTX_new();
+	if (contexts->encryptCtx == NULL || contexts->decryptCtx == NULL
+			|| EVP_EncryptInit_ex(contexts->encryptCtx, EVP_aes_256_cbc(), NULL, blockKey, NULL) != 1
+			|| EVP_DecryptInit_ex(contexts->decryptCtx, EVP_aes_256_cbc(), NULL, blockKey, NULL) != 1) {
+		logPrintf(LOG_ERROR, "encrAesHkdf: creating cipher contexts failed\n");
+		freeContexts(contexts);
+		return NULL;
+	}
+	pthread_setspecific(contextsKey, contexts);
+	return contexts;
+}
+
+int encrAesHkdfEncrypt(char *inBuf, size_t inSize, char *outBuf, size_t *outSize, char *passphrase)
+{
+	(void) passphrase;
+	CipherContexts* contexts = getContexts();
+	if (contexts == NULL) {
+		return 1;
+	}
+	EVP_CIPHER_CTX* ctx = contexts->encryptCtx;
+
+	unsigned char* iv = (unsigned char*)outBuf;
+	if (getRandomBytes(iv, IV_SIZE) != 0) {
+		logPrintf(LOG_ERROR, "encrAesHkdfEncrypt: getRandomBytes failed\n");
+		return 2;
+	}
+
+	// only the IV changes, the key schedule is kept
+	if (EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, iv) != 1) {
+		logPrintf(LOG_ERROR, "encrAesHkdfEncrypt: EVP_EncryptInit_ex failed\n");
+		return 3;
+	}
+	EVP_CIPHER_CTX_set_padding(ctx, 1);
+
+	int len = 0;
+	if (EVP_EncryptUpdate(ctx, (unsigned char*)outBuf + IV_SIZE, &len, (unsigned char*)inBuf, inSize) != 1) {
+		logPrintf(LOG_ERROR, "encrAesHkdfEncrypt: EVP_EncryptUpdate failed\n");
+		return 4;
+	}
+	int tmpLen = 0;
+	if (EVP_EncryptFinal_ex(ctx, (unsigned char*)outBuf + IV_SIZE + len, &tmpLen) != 1) {
+		logPrintf(LOG_ERROR, "encrAesHkdfEncrypt: EVP_EncryptFinal_ex failed\n");
+		return 5;
+	}
+
+	*outSize = IV_SIZE + len + tmpLen;
+	return 0;
+}
+
+static int decryptCbc(unsigned char* iv, char *inBuf, size_t inSize,
+	char *outBuf, size_t *outSize, int padding)
+{
+	CipherContexts* contexts = getContexts();
+	if (contexts == NULL) {
+		return 1;
+	}
+	EVP_CIPHER_CTX* ctx = contexts->decryptCtx;
+
+	if (EVP_DecryptInit_ex(ctx, NULL, NULL, NULL, iv) != 1) {
+		logPrintf(LOG_ERROR, "encrAesHkdfDecrypt: EVP_DecryptInit_ex failed\n");
+		return 3;
+	}
+	EVP_CIPHER_CTX_set_padding(ctx, padding);
+
+	int len = 0;
+	if (EVP_DecryptUpdate(ctx, (unsigned char*)outBuf, &len, (unsigned char*)inBuf, inSize) != 1) {
+		logPrintf(LOG_ERROR, "encrAesHkdfDecrypt: EVP_DecryptUpdate failed\n");
+		return 4;
+	}
+	int tmpLen = 0;
+	if (padding && EVP_DecryptFinal_ex(ctx, (unsigned char*)outBuf + len, &tmpLen) != 1) {
+		// a wrong key or damaged data, not worth an error message here
+		return 5;
+	}
+
+	*outSize = len + tmpLen;
+	return 0;
+}
+
+int encrAesHkdfDecrypt(char *inBuf, size_t inSize, char *outBuf, size_t *outSize, char *passphrase)
+{
+	(void) passphrase;
+	if (inSize < IV_SIZE) {
+		return 2;
+	}
+	return decryptCbc((unsigned char*)inBuf, inBuf + IV_SIZE, inSize - IV_SIZE,
+		outBuf, outSize, 1);
+}
+
+int encrAesHkdfDecryptRange(char *header, char *inBuf, size_t inSize, size_t decryptedOffset,
+	char *outBuf, size_t *outSize, char *passphrase)
+{
+	(void) passphrase;
+	unsigned char* iv = (unsigned char*)header;
+	if (decryptedOffset != 0) {
+		// the previous cipher block is the IV
+		if (inSize < AES_CIPHER_BLOCK_SIZE) {
+			return 2;
+		}
+		iv = (unsigned char*)inBuf;
+		inBuf += AES_CIPHER_BLOCK_SIZE;
+		inSize -= AES_CIPHER_BLOCK_SIZE;
+	}
+	// a short read at the end of the block
+	inSize &= ~(size_t)(AES_CIPHER_BLOCK_SIZE - 1);
+
+	// the padding is left in the output, the caller knows the block size
+	return decryptCbc(iv, inBuf, inSize, outBuf, outSize, 0);
+}
+
+static int deriveBlockKey()
+{
+	if (masterKeyDerive("bucse aes-256-cbc", blockKey, sizeof(blockKey)) != 0) {
+		return 1;
+	}
+	blockKeyLoaded = 1;
+	return 0;
+}
+
+int encrAesHkdfCreateKey(char* passphrase, char** keyJson)
+{
+	if (masterKeyCreate(passphrase, keyJson) != 0) {
+		return 1;
+	}
+	return deriveBlockKey();
+}
+
+int encrAesHkdfLoadKey(const char* keyJson, char* passphrase)
+{
+	if (masterKeyLoad(keyJson, passphrase) != 0) {
+		return 1;
+	}
+	return deriveBlockKey();
+}
+
+int encrAesHkdfNeedsPassphrase()
+{
+	return 1;
+}
+
+Encryption encryptionAesHkdf = {
+	.encrypt = encrAesHkdfEncrypt,
+	.decrypt = encrAesHkdfDecrypt,
+	.needsPassphrase = encrAesHkdfNeedsPassphrase,
+	.getMaxOverhead = encrAesGetMaxOverhead,
+	.getRange = encrAesGetRange,
+	.decryptRange = encrAesHkdfDecryptRange,
+	.createKey = encrAesHkdfCreateKey,
+	.loadKey = encrAesHkdfLoadKey
+};
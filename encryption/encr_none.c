@@ -19,6 +19,29 @@ int encrNoneDecrypt(char *inBuf, size_t inSize, char *outBuf, size_t *outSize, c
 	return 0;
 }
 
+void encrNoneGetRange(size_t offset, size_t size, size_t *headerSize,
+	size_t *encryptedOffset, size_t *encryptedSize, size_t *decryptedOffset)
+{
+	*headerSize = 0;
+	*encryptedOffset = offset;
+	*encryptedSize = size;
+	*decryptedOffset = offset;
+}
+
+int encrNoneDecryptRange(char *header, char *inBuf, size_t inSize, size_t decryptedOffset,
+	char *outBuf, size_t *outSize, char *passphrase)
+{
+	(void) header;
+	(void) decryptedOffset;
+	return encrNoneDecrypt(inBuf, inSize, outBuf, outSize, passphrase);
+}
+
+size_t encrNoneGetMaxOverhead(size_t size)
+{
+	(void) size;
+	return 0;
+}
+
 int encrNoneNeedsPassphrase()
 {
 	return 0;
@@ -27,5 +50,8 @@ int encrNoneNeedsPassphrase()
 Encryption encryptionNone = {
 	.encrypt = encrNoneEncrypt,
 	.decrypt = encrNoneDecrypt,
-	.needsPassphrase = encrNoneNeedsPassphrase
+	.needsPassphrase = encrNoneNeedsPassphrase,
+	.getMaxOverhead = encrNoneGetMaxOverhead,
+	.getRange = encrNoneGetRange,
+	.decryptRange = encrNoneDecryptRange
 };
@@ -0,0 +1,233 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <json.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+
+#include "../log.h"
+#include "../random.h"
+
+#include "masterkey.h"
+
+#define KDF_SALT_SIZE 16
+// AES key wrap adds an 8 byte integrity check value
+#define WRAPPED_KEY_SIZE (MASTER_KEY_SIZE + 8)
+
+// scrypt parameters for new repositories, about 32 MiB and 0.1 s
+#define SCRYPT_N 32768
+#define SCRYPT_R 8
+#define SCRYPT_P 1
+#define SCRYPT_MAX_MEM (256 * 1024 * 1024)
+
+static unsigned char masterKey[MASTER_KEY_SIZE];
+static int masterKeyLoaded;
+
+static void toHex(const unsigned char* data, size_t size, char* hex)
+{
+	for (size_t i=0; i<size; i++) {
+		snprintf(hex + 2*i, 3, "%02x", data[i]);
+	}
+}
+
+static int fromHex(const char* hex, unsigned char* data, size_t size)
+{
+	if (strlen(hex) != 2*size) {
+		return 1;
+	}
+	for (size_t i=0; i<size; i++) {
+		unsigned int byte;
+		if (sscanf(hex + 2*i, "%2x", &byte) != 1) {
+			return 2;
+		}
+		data[i] = byte;
+	}
+	return 0;
+}
+
+// AES key wrap (RFC 3394) with the key derived from the passphrase
+static int wrapKey(const unsigned char* kek, const unsigned char* in, size_t inSize,
+	unsigned char* out, int* outSize, int wrap)
+{
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	if (ctx == NULL) {
+		logPrintf(LOG_ERROR, "wrapKey: EVP_CIPHER_CTX_new failed\n");
+		return 1;
+	}
+	EVP_CIPHER_CTX_set_flags(ctx, EVP_CIPHER_CTX_FLAG_WRAP_ALLOW);
+
+	int tmpLen = 0;
+	if (EVP_CipherInit_ex(ctx, EVP_aes_256_wrap(), NULL, kek, NULL, wrap) != 1
+			|| EVP_CipherUpdate(ctx, out, outSize, in, inSize) != 1
+			|| EVP_CipherFinal_ex(ctx, out + *outSize, &tmpLen) != 1) {
+		EVP_CIPHER_CTX_free(ctx);
+		return 2;
+	}
+	*outSize += tmpLen;
+
+	EVP_CIPHER_CTX_free(ctx);
+	return 0;
+}
+
+static int deriveKek(char* passphrase, const unsigned char* salt,
+	uint64_t n, uint64_t r, uint64_t p, unsigned char* kek)
+{
+	if (EVP_PBE_scrypt(passphrase, strlen(passphrase), salt, KDF_SALT_SIZE,
+			n, r, p, SCRYPT_MAX_MEM, kek, MASTER_KEY_SIZE) != 1) {
+		logPrintf(LOG_ERROR, "deriveKek: EVP_PBE_scrypt failed\n");
+		return 1;
+	}
+	return 0;
+}
+
+int masterKeyCreate(char* passphrase, char** keyJson)
+{
+	unsigned char salt[KDF_SALT_SIZE];
+	if (getRandomBytes(masterKey, MASTER_KEY_SIZE) != 0 || getRandomBytes(salt, KDF_SALT_SIZE) != 0) {
+		logPrintf(LOG_ERROR, "masterKeyCreate: getRandomBytes failed\n");
+		return 1;
+	}
+
+	unsigned char kek[MASTER_KEY_SIZE];
+	if (deriveKek(passphrase, salt, SCRYPT_N, SCRYPT_R, SCRYPT_P, kek) != 0) {
+		return 2;
+	}
+
+	unsigned char wrappedKey[WRAPPED_KEY_SIZE + 16];
+	int wrappedKeySize = 0;
+	int res = wrapKey(kek, masterKey, MASTER_KEY_SIZE, wrappedKey, &wrappedKeySize, 1);
+	memset(kek, 0, sizeof(kek));
+	if (res != 0 || wrappedKeySize != WRAPPED_KEY_SIZE) {
+		logPrintf(LOG_ERROR, "masterKeyCreate: wrapping the key failed: %d\n", res);
+		return 3;
+	}
+
+	char saltHex[2*KDF_SALT_SIZE + 1];
+	char wrappedKeyHex[2*WRAPPED_KEY_SIZE + 1];
+	toHex(salt, KDF_SALT_SIZE, saltHex);
+	toHex(wrappedKey, WRAPPED_KEY_SIZE, wrappedKeyHex);
+
+	json_object* key = json_object_new_object();
+	if (key == NULL) {
+		return 4;
+	}
+	json_object_object_add(key, "kdf", json_object_new_string("scrypt"));
+	json_object_object_add(key, "n", json_object_new_int64(SCRYPT_N));
+	json_object_object_add(key, "r", json_object_new_int64(SCRYPT_R));
+	json_object_object_add(key, "p", json_object_new_int64(SCRYPT_P));
+	json_object_object_add(key, "salt", json_object_new_string(saltHex));
+	json_object_object_add(key, "wrappedKey", json_object_new_string(wrappedKeyHex));
+
+	*keyJson = strdup(json_object_to_json_string(key));
+	json_object_put(key);
+	if (*keyJson == NULL) {
+		return 5;
+	}
+
+	masterKeyLoaded = 1;
+	return 0;
+}
+
+static const char* getStringField(json_object* obj, const char* name)
+{
+	json_object* field;
+	if (json_object_object_get_ex(obj, name, &field) == 0
+			|| json_object_get_type(field) != json_type_string) {
+		return NULL;
+	}
+	return json_object_get_string(field);
+}
+
+static int64_t getIntField(json_object* obj, const char* name)
+{
+	json_object* field;
+	if (json_object_object_get_ex(obj, name, &field) == 0
+			|| json_object_get_type(field) != json_type_int) {
+		return -1;
+	}
+	return json_object_get_int64(field);
+}
+
+int masterKeyLoad(const char* keyJson, char* passphrase)
+{
+	if (keyJson == NULL) {
+		logPrintf(LOG_ERROR, "masterKeyLoad: repository.json doesn't have 'key' field\n");
+		return 1;
+	}
+
+	json_object* key = json_tokener_parse(keyJson);
+	if (key == NULL) {
+		logPrintf(LOG_ERROR, "masterKeyLoad: 'key' field is not valid\n");
+		return 2;
+	}
+
+	const char* kdf = getStringField(key, "kdf");
+	const char* saltHex = getStringField(key, "salt");
+	const char* wrappedKeyHex = getStringField(key, "wrappedKey");
+	int64_t n = getIntField(key, "n");
+	int64_t r = getIntField(key, "r");
+	int64_t p = getIntField(key, "p");
+
+	unsigned char salt[KDF_SALT_SIZE];
+	unsigned char wrappedKey[WRAPPED_KEY_SIZE];
+	if (kdf == NULL || strcmp(kdf, "scrypt") != 0 || n <= 0 || r <= 0 || p <= 0
+			|| saltHex == NULL || fromHex(saltHex, salt, KDF_SALT_SIZE) != 0
+			|| wrappedKeyHex == NULL || fromHex(wrappedKeyHex, wrappedKey, WRAPPED_KEY_SIZE) != 0) {
+		logPrintf(LOG_ERROR, "masterKeyLoad: 'key' field is not valid\n");
+		json_object_put(key);
+		return 3;
+	}
+	json_object_put(key);
+
+	unsigned char kek[MASTER_KEY_SIZE];
+	if (deriveKek(passphrase, salt, n, r, p, kek) != 0) {
+		return 4;
+	}
+
+	// the key wrap has an integrity check, so a wrong passphrase fails here
+	unsigned char unwrappedKey[WRAPPED_KEY_SIZE + 16];
+	int unwrappedKeySize = 0;
+	int res = wrapKey(kek, wrappedKey, WRAPPED_KEY_SIZE, unwrappedKey, &unwrappedKeySize, 0);
+	memset(kek, 0, sizeof(kek));
+	if (res != 0 || unwrappedKeySize != MASTER_KEY_SIZE) {
+		logPrintf(LOG_ERROR, "masterKeyLoad: unwrapping the key failed\n");
+		return 5;
+	}
+
+	memcpy(masterKey, unwrappedKey, MASTER_KEY_SIZE);
+	memset(unwrappedKey, 0, sizeof(unwrappedKey));
+	masterKeyLoaded = 1;
+	return 0;
+}
+
+int masterKeyDerive(const char* purpose, unsigned char* key, size_t keySize)
+{
+	if (!masterKeyLoaded) {
+		logPrintf(LOG_ERROR, "masterKeyDerive: no master key\n");
+		return 1;
+	}
+
+	EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+	if (ctx == NULL) {
+		logPrintf(LOG_ERROR, "masterKeyDerive: EVP_PKEY_CTX_new_id failed\n");
+		return 2;
+	}
+
+	size_t derivedSize = keySize;
+	if (EVP_PKEY_derive_init(ctx) <= 0
+			|| EVP_PKEY_CTX_set_hkdf_md(ctx, EVP_sha256()) <= 0
+			|| EVP_PKEY_CTX_set1_hkdf_key(ctx, masterKey, MASTER_KEY_SIZE) <= 0
+			|| EVP_PKEY_CTX_add1_hkdf_info(ctx, (const unsigned char*)purpose, strlen(purpose)) <= 0
+			|| EVP_PKEY_derive(ctx, key, &derivedSize) <= 0
+			|| derivedSize != keySize) {
+		logPrintf(LOG_ERROR, "masterKeyDerive: HKDF failed\n");
+		EVP_PKEY_CTX_free(ctx);
+		return 3;
+	}
+
+	EVP_PKEY_CTX_free(ctx);
+	return 0;
+}
@@ -0,0 +1,18 @@
+// A master key for the encryptions that don't derive a key from the
+// passphrase for every block. The master key is random, it's stored in
+// repository.json wrapped with a key that scrypt derives from the passphrase,
+// so the expensive derivation runs once per mount. The keys that encrypt the
+// data are derived from the master key with HKDF, one per purpose.
+
+#define MASTER_KEY_SIZE 32
+
+// creates a new master key, *keyJson is set to the JSON text to be stored in
+// repository.json, allocated with malloc
+int masterKeyCreate(char* passphrase, char** keyJson);
+
+// unwraps the master key from the JSON text stored in repository.json, fails
+// when the passphrase is wrong
+int masterKeyLoad(const char* keyJson, char* passphrase);
+
+// derives a key for the given purpose from the loaded master key
+int masterKeyDerive(const char* purpose, unsigned char* key, size_t keySize);
@@ -3,102 +3,220 @@
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
 
 #include "log.h"
 #include "dynarray.h"
+#include "nameindex.h"
 
+#include "dirtymap.h"
 #include "filesystem.h"
+#include "dentrycache.h"
+#include "inodetable.h"
+#include "writeback.h"
 
 FilesystemDir* root;
 
-FilesystemFile* findFile(FilesystemDir* dir, const char* fileName)
+static uint64_t nextIno = 1;
+
+FilesystemFile* newFilesystemFile(const char* name, FilesystemDir* parentDir)
 {
-	for (int i=0; i<dir->files.len; i++) {
-		FilesystemFile* f = dir->files.objects[i];
-		if (strcmp(f->name, fileName) == 0) {
-			return f;
-		}
+	FilesystemFile* file = malloc(sizeof(FilesystemFile));
+	if (file == NULL) {
+		logPrintf(LOG_ERROR, "newFilesystemFile: malloc(): %s\n", strerror(errno));
+		return NULL;
 	}
+	memset(file, 0, sizeof(FilesystemFile));
 
-	return NULL;
+	if (pthread_mutex_init(&file->mutex, NULL) != 0) {
+		logPrintf(LOG_ERROR, "newFilesystemFile: pthread_mutex_init failed\n");
+		free(file);
+		return NULL;
+	}
+	file->name = name;
+	file->parentDir = parentDir;
+	file->ino = nextIno++;
+
+	return file;
 }
 
-FilesystemDir* findDir(FilesystemDir* dir, const char* dirName)
+void freeFilesystemFile(FilesystemFile* file)
 {
-	for (int i=0; i<dir->dirs.len; i++) {
-		FilesystemDir* d = dir->dirs.objects[i];
-		if (strcmp(d->name, dirName) == 0) {
-			return d;
-		}
+	writeBackRemove(file);
+	freeDirtyMap(&file->dirtyMap);
+
+	if (file->ownedName) {
+		free(file->ownedName);
 	}
+	inodeTableDetach(file->ino);
+	pthread_mutex_destroy(&file->mutex);
+	free(file);
+}
 
-	return NULL;
+void dropFilesystemFile(FilesystemFile* file)
+{
+	if (!file->flushing) {
+		freeFilesystemFile(file);
+		return;
+	}
+
+	// nothing finds it anymore but the flush
+	file->removed = 1;
+	writeBackRemove(file);
+	inodeTableDetach(file->ino);
 }
 
-FilesystemDir* findContainingDir(DynArray *pathArray)
+FilesystemDir* newFilesystemDir(const char* name, FilesystemDir* parentDir)
 {
-	FilesystemDir* current = root;
-	for (int i=0; i<pathArray->len-1; i++) {
-		current = findDir(current, pathArray->objects[i]);
-		if (current == NULL) {
-			return NULL;
-		}
+	FilesystemDir* dir = malloc(sizeof(FilesystemDir));
+	if (dir == NULL) {
+		logPrintf(LOG_ERROR, "newFilesystemDir: malloc(): %s\n", strerror(errno));
+		return NULL;
 	}
-	return current;
+	memset(dir, 0, sizeof(FilesystemDir));
+
+	dir->name = name;
+	dir->parentDir = parentDir;
+	dir->ino = nextIno++;
+
+	return dir;
 }
 
-FilesystemDir* findDirByPath(DynArray *pathArray)
+void freeFilesystemDir(FilesystemDir* dir)
 {
-	FilesystemDir* current = root;
-	for (int i=0; i<pathArray->len; i++) {
-		current = findDir(current, pathArray->objects[i]);
-		if (current == NULL) {
-			return NULL;
-		}
+	freeDynArray(&dir->dirs);
+	freeDynArray(&dir->files);
+	freeNameIndex(&dir->dirsIndex);
+	freeNameIndex(&dir->filesIndex);
+	inodeTableDetach(dir->ino);
+	free(dir);
+}
+
+void swapFileInodes(FilesystemFile* a, FilesystemFile* b)
+{
+	uint64_t ino = a->ino;
+	a->ino = b->ino;
+	b->ino = ino;
+	inodeTableRebind(a->ino, a);
+	inodeTableRebind(b->ino, b);
+}
+
+void swapDirInodes(FilesystemDir* a, FilesystemDir* b)
+{
+	uint64_t ino = a->ino;
+	a->ino = b->ino;
+	b->ino = ino;
+	inodeTableRebind(a->ino, a);
+	inodeTableRebind(b->ino, b);
+}
+
+int addFileToDir(FilesystemDir* dir, FilesystemFile* file)
+{
+	if (addToNameIndex(&dir->filesIndex, file->name, file) != 0) {
+		return 1;
 	}
-	return current;
+	if (addToDynArray(&dir->files, file) != 0) {
+		removeFromNameIndex(&dir->filesIndex, file->name);
+		return 2;
+	}
+	return 0;
 }
 
-const char* path_split(const char* path, DynArray *result)
+int removeFileFromDir(FilesystemDir* dir, FilesystemFile* file)
 {
-	char* pathCopy = strdup(path);
-	if (pathCopy == NULL) {
-		logPrintf(LOG_ERROR, "splitPath: strdup(): %s\n", strerror(errno));
-		return NULL;
+	if (removeFromDynArrayUnordered(&dir->files, file) != 0) {
+		return 1;
+	}
+	if (removeFromNameIndex(&dir->filesIndex, file->name) != 0) {
+		logPrintf(LOG_ERROR, "removeFileFromDir: %s not indexed\n", file->name);
+		return 2;
 	}
+	return 0;
+}
 
-	char* last = pathCopy;
-	int len = strlen(pathCopy);
-	for (int i=0; i<len; i++) {
-		if (pathCopy[i] == '/') {
-			pathCopy[i] = 0;
-			addToDynArray(result, last);
-			last = pathCopy + i + 1;
-		}
+int addDirToDir(FilesystemDir* dir, FilesystemDir* subdir)
+{
+	if (addToNameIndex(&dir->dirsIndex, subdir->name, subdir) != 0) {
+		return 1;
 	}
-	addToDynArray(result, last);
-	return path + (last - pathCopy);
+	if (addToDynArray(&dir->dirs, subdir) != 0) {
+		removeFromNameIndex(&dir->dirsIndex, subdir->name);
+		return 2;
+	}
+	return 0;
+}
+
+int removeDirFromDir(FilesystemDir* dir, FilesystemDir* subdir)
+{
+	if (removeFromDynArrayUnordered(&dir->dirs, subdir) != 0) {
+		return 1;
+	}
+	if (removeFromNameIndex(&dir->dirsIndex, subdir->name) != 0) {
+		logPrintf(LOG_ERROR, "removeDirFromDir: %s not indexed\n", subdir->name);
+		return 2;
+	}
+	// the dentry cache can point to subdir or anything below it
+	dentryCacheInvalidate();
+	return 0;
+}
+
+FilesystemFile* findFile(FilesystemDir* dir, const char* fileName)
+{
+	return findInNameIndex(&dir->filesIndex, fileName);
+}
+
+FilesystemDir* findDir(FilesystemDir* dir, const char* dirName)
+{
+	return findInNameIndex(&dir->dirsIndex, dirName);
 }
 
-void path_free(DynArray *pathArray)
+FilesystemDir* findContainingDir(const char* path, const char** leafName)
 {
-	if (pathArray->len > 0 && pathArray->objects[0] != NULL) {
-		free(pathArray->objects[0]);
+	const char* lastSlash = strrchr(path, '/');
+	if (lastSlash == NULL) {
+		*leafName = path;
+		return root;
 	}
-	freeDynArray(pathArray);
+
+	size_t dirPathLen = lastSlash - path;
+	FilesystemDir* current = dentryCacheGet(path, dirPathLen);
+	if (current == NULL) {
+		current = root;
+		const char* component = path;
+		while (component <= lastSlash) {
+			const char* slash = strchr(component, '/');
+			current = findInNameIndexLen(&current->dirsIndex, component, slash - component);
+			if (current == NULL) {
+				*leafName = NULL;
+				return NULL;
+			}
+			component = slash + 1;
+		}
+		dentryCachePut(path, dirPathLen, current);
+	}
+
+	*leafName = lastSlash + 1;
+	return current;
 }
 
-char* path_getFilename(DynArray *pathArray)
+FilesystemDir* findDirByPath(const char* path)
 {
-	return pathArray->objects[pathArray->len-1];
+	const char* dirName;
+	FilesystemDir* containingDir = findContainingDir(path, &dirName);
+	if (containingDir == NULL) {
+		return NULL;
+	}
+	return findDir(containingDir, dirName);
 }
 
-void path_debugPrint(DynArray *pathArray)
+const char* path_getFilename(const char* path)
 {
-	logPrintf(LOG_DEBUG, "print debug path:\n");
-	for (int i=0; i<pathArray->len; i++) {
-		logPrintf(LOG_DEBUG, "\t%d: %s\n", i, pathArray->objects[i]);
+	const char* slash = strrchr(path, '/');
+	if (slash == NULL) {
+		return path;
 	}
+	return slash + 1;
 }
 
 static int getFullFilePathRecursion(char* result, int index, FilesystemDir* dir)
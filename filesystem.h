@@ -6,51 +6,86 @@ typedef enum {
 	DirtyFlagPendingTrunc = 4,
 } DirtyFlags;
 
-typedef struct {
-	char *buf;
-	size_t size;
-	off_t offset;
-} PendingWrite;
-
 typedef struct _FilesystemDir
 {
 	const char* name; // pointer to memory that is managed by actions
-	int64_t atime;
+	uint64_t ino;
+	_Atomic int64_t atime; // set by listings, which hold bucseTreeLock for reading only
 	int64_t mtime;
 	DynArray files;
 	DynArray dirs;
+	NameIndex filesIndex; // files by name, kept in sync with files
+	NameIndex dirsIndex; // dirs by name, kept in sync with dirs
 	struct _FilesystemDir* parentDir;
 } FilesystemDir;
 
 typedef struct
 {
-	const char* name; // pointer to memory that is managed by actions
+	const char* name; // pointer to memory that is managed by actions or ownedName
+	char* ownedName; // set when the file was created locally, freed with the file
+	pthread_mutex_t mutex; // see the locking scheme in operations/operations.h
+	uint64_t ino;
 	int64_t atime;
 	int64_t mtime;
 	char* content; // pointer to memory that is managed by actions
 	int contentLen;
+	const char* cachedContent; // content when the file was last opened, see openFile
 	size_t size;
 	int blockSize;
+	int tierBlocks; // see blocklayout.h
+	const size_t* chunkEnds; // managed by actions as content is
 	DirtyFlags dirtyFlags;
-	DynArray pendingWrites;
+	DirtyMap dirtyMap; // written data, not flushed yet
+	int64_t writeBackSince; // when it got dirty, 0 if clean, see writeback.h
+	size_t writeBackBytes; // its dirty bytes as counted by writeback.c
+	int writeBackClosed; // closed with conf.lazyClose, to be written out now
+	int flushing; // its blocks are being stored without the locks, see flush.h
+	int removed; // removed from the tree while flushing, the flush frees it
 	FilesystemDir* parentDir;
 	size_t truncSize;
 } FilesystemFile;
 
 extern FilesystemDir* root;
 
+// Files and dirs get an inode number when they are allocated; root is the
+// first dir, so it gets 1. They're allocated with bucseTreeLock held for
+// writing (or before fuse is started), which also guards the counter.
+
+// allocates a zeroed file with an initialized mutex
+FilesystemFile* newFilesystemFile(const char* name, FilesystemDir* parentDir);
+// frees the file, its dirty data and its owned name
+void freeFilesystemFile(FilesystemFile* file);
+// frees a file that has been removed from its dir, or leaves that to the
+// flush that runs, the caller needs to hold bucseTreeLock for writing
+void dropFilesystemFile(FilesystemFile* file);
+
+// allocates a zeroed dir
+FilesystemDir* newFilesystemDir(const char* name, FilesystemDir* parentDir);
+// frees the dir and its child arrays, but not the children themselves
+void freeFilesystemDir(FilesystemDir* dir);
+
+// exchange the inode numbers of two objects, so that an inode the kernel
+// knows keeps working when its object is replaced by another one
+void swapFileInodes(FilesystemFile* a, FilesystemFile* b);
+void swapDirInodes(FilesystemDir* a, FilesystemDir* b);
+
+// add/remove children, keeping the arrays and the name indexes in sync. The
+// child's name must not change while it is in the dir.
+int addFileToDir(FilesystemDir* dir, FilesystemFile* file);
+int removeFileFromDir(FilesystemDir* dir, FilesystemFile* file);
+int addDirToDir(FilesystemDir* dir, FilesystemDir* subdir);
+int removeDirFromDir(FilesystemDir* dir, FilesystemDir* subdir);
+
 FilesystemFile* findFile(FilesystemDir* dir, const char* fileName);
 FilesystemDir* findDir(FilesystemDir* dir, const char* dirName);
-FilesystemDir* findContainingDir(DynArray *pathArray);
-FilesystemDir* findDirByPath(DynArray *pathArray);
-
-// path_split splits path into directories and file names. It returns a const pointer
-// to the part of path string that corresponds to the file name
-const char* path_split(const char* path, DynArray *result);
+// findContainingDir walks path (relative to root, without the leading slash) in
+// place and returns the dir that contains its last component, or NULL if it
+// doesn't exist. leafName is set to the last component, a pointer into path.
+FilesystemDir* findContainingDir(const char* path, const char** leafName);
+FilesystemDir* findDirByPath(const char* path);
 
-void path_free(DynArray *pathArray);
-char* path_getFilename(DynArray *pathArray);
-void path_debugPrint(DynArray *pathArray);
+// returns the part of path after the last slash
+const char* path_getFilename(const char* path);
 
 char* getFullFilePath(FilesystemFile* file);
 char* getFullDirPath(FilesystemDir* dir);
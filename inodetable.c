@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "log.h"
+
+#include "inodetable.h"
+
+typedef struct {
+	uint64_t ino; // 0 for an empty slot
+	int isDir;
+	void* object; // NULL once the object has been freed
+	uint64_t nlookup;
+} Inode;
+
+// open addressing with linear probing, removal shifts the following entries
+// back, so no removed markers are needed
+static Inode* inodes;
+static int inodesLen;
+static int inodesSize;
+
+// lookups run concurrently under a shared tree lock and forgets come without
+// any tree lock, so the table needs its own lock
+static pthread_mutex_t inodeTableMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int inodeSlot(uint64_t ino)
+{
+	// Fibonacci hashing, inode numbers are sequential
+	return (int)((ino * 11400714819323198485ull) >> 32) & (inodesSize - 1);
+}
+
+static Inode* findInode(uint64_t ino)
+{
+	if (inodesSize == 0) {
+		return NULL;
+	}
+
+	for (int i = inodeSlot(ino); inodes[i].ino != 0; i = (i + 1) & (inodesSize - 1)) {
+		if (inodes[i].ino == ino) {
+			return &inodes[i];
+		}
+	}
+	return NULL;
+}
+
+static int growInodes()
+{
+	int oldSize = inodesSize;
+	Inode* oldInodes = inodes;
+
+	int newSize = oldSize == 0 ? 1024 : oldSize * 2;
+	Inode* newInodes = malloc(newSize * sizeof(Inode));
+	if (newInodes == NULL) {
+		logPrintf(LOG_ERROR, "growInodes: malloc(): %s\n", strerror(errno));
+		return 1;
+	}
+	memset(newInodes, 0, newSize * sizeof(Inode));
+
+	inodes = newInodes;
+	inodesSize = newSize;
+	for (int i=0; i<oldSize; i++) {
+		if (oldInodes[i].ino == 0) {
+			continue;
+		}
+		int j = inodeSlot(oldInodes[i].ino);
+		while (inodes[j].ino != 0) {
+			j = (j + 1) & (inodesSize - 1);
+		}
+		inodes[j] = oldInodes[i];
+	}
+
+	if (oldInodes != NULL) {
+		free(oldInodes);
+	}
+	return 0;
+}
+
+static void removeInode(Inode* inode)
+{
+	int mask = inodesSize - 1;
+	int i = inode - inodes;
+	inodes[i].ino = 0;
+	inodesLen--;
+
+	// move back the entries that would not be found past the new hole
+	for (int j = (i + 1) & mask; inodes[j].ino != 0; j = (j + 1) & mask) {
+		int k = inodeSlot(inodes[j].ino);
+		if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+			inodes[i] = inodes[j];
+			inodes[j].ino = 0;
+			i = j;
+		}
+	}
+}
+
+int inodeTableRef(uint64_t ino, int isDir, void* object)
+{
+	pthread_mutex_lock(&inodeTableMutex);
+
+	Inode* inode = findInode(ino);
+	if (inode == NULL) {
+		// keep the load factor at most 1/2
+		if ((inodesLen + 1) * 2 > inodesSize) {
+			if (growInodes() != 0) {
+				pthread_mutex_unlock(&inodeTableMutex);
+				return 1;
+			}
+		}
+
+		int i = inodeSlot(ino);
+		while (inodes[i].ino != 0) {
+			i = (i + 1) & (inodesSize - 1);
+		}
+		inode = &inodes[i];
+		inode->ino = ino;
+		inode->isDir = isDir;
+		inode->object = object;
+		inode->nlookup = 0;
+		inodesLen++;
+	}
+	inode->nlookup++;
+
+	pthread_mutex_unlock(&inodeTableMutex);
+	return 0;
+}
+
+void* inodeTableGet(uint64_t ino, int* isDir)
+{
+	void* object = NULL;
+
+	pthread_mutex_lock(&inodeTableMutex);
+	Inode* inode = findInode(ino);
+	if (inode != NULL) {
+		object = inode->object;
+		*isDir = inode->isDir;
+	}
+	pthread_mutex_unlock(&inodeTableMutex);
+
+	return object;
+}
+
+void inodeTableForget(uint64_t ino, uint64_t nlookup)
+{
+	pthread_mutex_lock(&inodeTableMutex);
+	Inode* inode = findInode(ino);
+	if (inode != NULL) {
+		if (inode->nlookup <= nlookup) {
+			removeInode(inode);
+		} else {
+			inode->nlookup -= nlookup;
+		}
+	}
+	pthread_mutex_unlock(&inodeTableMutex);
+}
+
+void inodeTableDetach(uint64_t ino)
+{
+	pthread_mutex_lock(&inodeTableMutex);
+	Inode* inode = findInode(ino);
+	if (inode != NULL) {
+		inode->object = NULL;
+	}
+	pthread_mutex_unlock(&inodeTableMutex);
+}
+
+void inodeTableRebind(uint64_t ino, void* object)
+{
+	pthread_mutex_lock(&inodeTableMutex);
+	Inode* inode = findInode(ino);
+	if (inode != NULL) {
+		inode->object = object;
+	}
+	pthread_mutex_unlock(&inodeTableMutex);
+}
+
+void inodeTableCleanup()
+{
+	pthread_mutex_lock(&inodeTableMutex);
+	if (inodes != NULL) {
+		free(inodes);
+	}
+	inodes = NULL;
+	inodesLen = inodesSize = 0;
+	pthread_mutex_unlock(&inodeTableMutex);
+}
@@ -0,0 +1,24 @@
+// The inode table maps the inode numbers that the kernel knows about (through
+// the low-level frontend) to files and dirs, and keeps their lookup counts.
+// An inode stays in the table until the kernel forgets it, even if its object
+// has been freed in the meantime; such stale inodes resolve to NULL.
+// Root (FUSE_ROOT_ID) is never added to the table.
+
+// increments the lookup count of ino, adding it to the table if needed
+int inodeTableRef(uint64_t ino, int isDir, void* object);
+
+// returns the object of ino and sets isDir, or returns NULL if ino is unknown
+// or stale. The caller needs to hold bucseTreeLock, so that the object is not
+// freed while it's used.
+void* inodeTableGet(uint64_t ino, int* isDir);
+
+// decrements the lookup count of ino, removing it from the table at zero
+void inodeTableForget(uint64_t ino, uint64_t nlookup);
+
+// called when the object of ino is freed, makes the inode stale
+void inodeTableDetach(uint64_t ino);
+
+// points ino to another object, used when inode numbers are swapped
+void inodeTableRebind(uint64_t ino, void* object);
+
+void inodeTableCleanup();
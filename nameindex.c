@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include "log.h"
+
+#include "nameindex.h"
+
+// FNV-1a
+static uint32_t hashName(const char* name, size_t len)
+{
+	uint32_t hash = 2166136261u;
+	for (size_t i=0; i<len; i++) {
+		hash ^= (unsigned char)name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+uint32_t nameIndexHash(const char* name, size_t len)
+{
+	return hashName(name, len);
+}
+
+// returns the slot that holds the name, or -1 if the name is not indexed
+static int findSlot(NameIndex *nameIndex, const char* name, size_t len, uint32_t hash)
+{
+	if (nameIndex->size == 0) {
+		return -1;
+	}
+
+	int mask = nameIndex->size - 1;
+	for (int i = hash & mask; ; i = (i + 1) & mask) {
+		NameIndexEntry* entry = &nameIndex->entries[i];
+		if (entry->name == NULL) {
+			return -1;
+		}
+		if (entry->object != NULL && entry->hash == hash
+				&& strncmp(entry->name, name, len) == 0 && entry->name[len] == 0) {
+			return i;
+		}
+	}
+}
+
+static int resizeNameIndex(NameIndex *nameIndex, int newSize)
+{
+	NameIndexEntry* newEntries = malloc(newSize * sizeof(NameIndexEntry));
+	if (newEntries == NULL) {
+		logPrintf(LOG_ERROR, "resizeNameIndex: malloc(): %s\n", strerror(errno));
+		return 1;
+	}
+	memset(newEntries, 0, newSize * sizeof(NameIndexEntry));
+
+	// reinsert live entries only, which also drops removed entries
+	int mask = newSize - 1;
+	for (int i=0; i<nameIndex->size; i++) {
+		NameIndexEntry* entry = &nameIndex->entries[i];
+		if (entry->name == NULL || entry->object == NULL) {
+			continue;
+		}
+		int j = entry->hash & mask;
+		while (newEntries[j].name != NULL) {
+			j = (j + 1) & mask;
+		}
+		newEntries[j] = *entry;
+	}
+
+	if (nameIndex->entries != NULL) {
+		free(nameIndex->entries);
+	}
+	nameIndex->entries = newEntries;
+	nameIndex->size = newSize;
+	nameIndex->used = nameIndex->len;
+	return 0;
+}
+
+int addToNameIndex(NameIndex *nameIndex, const char* name, void* object)
+{
+	// keep the load factor (including removed entries) below 3/4
+	if ((nameIndex->used + 1) * 4 > nameIndex->size * 3) {
+		int newSize = nameIndex->size == 0 ? 16 : nameIndex->size;
+		while ((nameIndex->len + 1) * 2 > newSize) {
+			newSize *= 2;
+		}
+		if (resizeNameIndex(nameIndex, newSize) != 0) {
+			return 1;
+		}
+	}
+
+	uint32_t hash = hashName(name, strlen(name));
+	int mask = nameIndex->size - 1;
+	int i = hash & mask;
+	while (nameIndex->entries[i].name != NULL) {
+		i = (i + 1) & mask;
+	}
+
+	nameIndex->entries[i].hash = hash;
+	nameIndex->entries[i].name = name;
+	nameIndex->entries[i].object = object;
+	nameIndex->len++;
+	nameIndex->used++;
+	return 0;
+}
+
+void* findInNameIndex(NameIndex *nameIndex, const char* name)
+{
+	return findInNameIndexLen(nameIndex, name, strlen(name));
+}
+
+void* findInNameIndexLen(NameIndex *nameIndex, const char* name, size_t len)
+{
+	int i = findSlot(nameIndex, name, len, hashName(name, len));
+	if (i < 0) {
+		return NULL;
+	}
+	return nameIndex->entries[i].object;
+}
+
+int removeFromNameIndex(NameIndex *nameIndex, const char* name)
+{
+	size_t len = strlen(name);
+	int i = findSlot(nameIndex, name, len, hashName(name, len));
+	if (i < 0) {
+		return 1;
+	}
+
+	// leave the name set, so that probing continues past this slot
+	nameIndex->entries[i].object = NULL;
+	nameIndex->len--;
+	return 0;
+}
+
+void freeNameIndex(NameIndex *nameIndex)
+{
+	if (nameIndex->entries != NULL) {
+		free(nameIndex->entries);
+	}
+	nameIndex->entries = NULL;
+	nameIndex->len = nameIndex->used = nameIndex->size = 0;
+}
@@ -0,0 +1,24 @@
+// NameIndex is an open addressing hash table that maps names to objects.
+// Names are not copied, they need to stay valid as long as they're indexed.
+typedef struct {
+	uint32_t hash;
+	const char* name; // NULL for an empty slot
+	void* object; // NULL (with name set) for a removed entry
+} NameIndexEntry;
+
+typedef struct {
+	NameIndexEntry* entries;
+	int len; // number of indexed objects
+	int used; // number of slots that are not empty, including removed entries
+	int size; // number of slots, a power of 2
+} NameIndex;
+
+// the hash used for the slots, for callers that shard several indexes
+uint32_t nameIndexHash(const char* name, size_t len);
+
+int addToNameIndex(NameIndex *nameIndex, const char* name, void* object);
+void* findInNameIndex(NameIndex *nameIndex, const char* name);
+// looks up the first len bytes of name, which doesn't need to be terminated there
+void* findInNameIndexLen(NameIndex *nameIndex, const char* name, size_t len);
+int removeFromNameIndex(NameIndex *nameIndex, const char* name);
+void freeNameIndex(NameIndex *nameIndex);
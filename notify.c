@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <fuse_lowlevel.h>
+#include <fuse.h>
+#include <pthread.h>
+
+#include "log.h"
+#include "dynarray.h"
+
+#include "notify.h"
+
+typedef struct {
+	uint64_t parentIno;
+	uint64_t ino;
+	char* path;
+} Change;
+
+static struct fuse* notifyFuse;
+static struct fuse_session* notifySession;
+
+static DynArray changes;
+static pthread_mutex_t changesMutex = PTHREAD_MUTEX_INITIALIZER;
+
+void notifySetFuse(struct fuse* fuse)
+{
+	pthread_mutex_lock(&changesMutex);
+	notifyFuse = fuse;
+	pthread_mutex_unlock(&changesMutex);
+}
+
+void notifySetSession(struct fuse_session* se)
+{
+	pthread_mutex_lock(&changesMutex);
+	notifySession = se;
+	pthread_mutex_unlock(&changesMutex);
+}
+
+void notifyChange(uint64_t parentIno, uint64_t ino, const char* path)
+{
+	pthread_mutex_lock(&changesMutex);
+
+	// nothing is cached before the filesystem is mounted
+	if (notifyFuse == NULL && notifySession == NULL) {
+		pthread_mutex_unlock(&changesMutex);
+		return;
+	}
+
+	Change* change = malloc(sizeof(Change));
+	if (change == NULL) {
+		logPrintf(LOG_ERROR, "notifyChange: malloc(): %s\n", strerror(errno));
+		pthread_mutex_unlock(&changesMutex);
+		return;
+	}
+
+	// the path is absolute for fuse_invalidate_path()
+	change->path = malloc(strlen(path) + 2);
+	if (change->path == NULL) {
+		logPrintf(LOG_ERROR, "notifyChange: malloc(): %s\n", strerror(errno));
+		free(change);
+		pthread_mutex_unlock(&changesMutex);
+		return;
+	}
+	change->path[0] = '/';
+	memcpy(change->path + 1, path, strlen(path) + 1);
+	change->parentIno = parentIno;
+	change->ino = ino;
+
+	if (addToDynArray(&changes, change) != 0) {
+		free(change->path);
+		free(change);
+	}
+
+	pthread_mutex_unlock(&changesMutex);
+}
+
+// the caller needs to hold changesMutex
+static void sendChange(Change* change)
+{
+	int result = 0;
+
+	if (notifySession) {
+		if (change->ino != 0) {
+			// drops cached attributes and data
+			result = fuse_lowlevel_notify_inval_inode(notifySession, change->ino, 0, 0);
+		}
+		const char* name = strrchr(change->path, '/') + 1;
+		int entryResult = fuse_lowlevel_notify_inval_entry(notifySession,
+			change->parentIno, name, strlen(name));
+		if (result == 0 || result == -ENOENT) {
+			result = entryResult;
+		}
+	} else if (notifyFuse) {
+		result = fuse_invalidate_path(notifyFuse, change->path);
+	}
+
+	// -ENOENT just means that the kernel doesn't know the entry
+	if (result != 0 && result != -ENOENT) {
+		logPrintf(LOG_DEBUG, "notify: invalidating %s failed: %d\n", change->path, result);
+	}
+}
+
+void notifyFlush()
+{
+	// the lock is held while sending, so that the filesystem can't be
+	// unset and destroyed in the meantime. Changes are only queued by the
+	// thread that flushes them, so this doesn't block anything else.
+	pthread_mutex_lock(&changesMutex);
+	for (int i=0; i<changes.len; i++) {
+		Change* change = changes.objects[i];
+		sendChange(change);
+		free(change->path);
+		free(change);
+	}
+	freeDynArray(&changes);
+	pthread_mutex_unlock(&changesMutex);
+}
+
+void notifyCleanup()
+{
+	pthread_mutex_lock(&changesMutex);
+	for (int i=0; i<changes.len; i++) {
+		Change* change = changes.objects[i];
+		free(change->path);
+		free(change);
+	}
+	freeDynArray(&changes);
+	notifyFuse = NULL;
+	notifySession = NULL;
+	pthread_mutex_unlock(&changesMutex);
+}
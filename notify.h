@@ -0,0 +1,21 @@
+// Changes made by remote actions need to be pushed to the kernel, which may
+// have cached the affected entries and attributes. doAction() queues them with
+// notifyChange() and they're sent by notifyFlush(), which must be called
+// without holding bucseTreeLock: the kernel may need to wait for requests
+// that are waiting for that lock.
+
+struct fuse;
+struct fuse_session;
+
+// sets the mounted filesystem to notify, only one of them is used
+void notifySetFuse(struct fuse* fuse);
+void notifySetSession(struct fuse_session* se);
+
+// queues a change of path (relative to root) in the dir parentIno; ino is the
+// affected file or dir, or 0 if the kernel can't know it yet
+void notifyChange(uint64_t parentIno, uint64_t ino, const char* path);
+
+// sends the queued changes to the kernel
+void notifyFlush();
+
+void notifyCleanup();
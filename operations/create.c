@@ -2,14 +2,18 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
 #include <fuse.h>
 #include <pthread.h>
 
 #include "../dynarray.h"
+#include "../nameindex.h"
+#include "../dirtymap.h"
 #include "../filesystem.h"
 #include "../actions.h"
 #include "../time.h"
 #include "../log.h"
+#include "../readahead.h"
 #include "../conf.h"
 
 #include "operations.h"
@@ -17,7 +21,7 @@
 
 #include "create.h"
 
-static int bucse_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+int bucse_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
 	logPrintf(LOG_DEBUG, "create %s, mode %d, access mode %d\n", path, mode, fi->flags);
 
@@ -36,17 +40,7 @@ static int bucse_create(const char *path, mode_t mode, struct fuse_file_info *fi
 	if (strcmp(path, "/") == 0) {
 		return -EACCES;
 	} else if (path[0] == '/') {
-		DynArray pathArray;
-		memset(&pathArray, 0, sizeof(DynArray));
-		fileName = path_split(path+1, &pathArray);
-		if (fileName == NULL) {
-			logPrintf(LOG_ERROR, "bucse_create: path_split() failed\n");
-			return -ENOMEM;
-		}
-		//path_debugPrint(&pathArray);
-
-		containingDir = findContainingDir(&pathArray);
-		path_free(&pathArray);
+		containingDir = findContainingDir(path+1, &fileName);
 		if (containingDir == NULL) {
 			logPrintf(LOG_ERROR, "bucse_create: path not found when creating file %s\n", path);
 			return -ENOENT;
@@ -57,7 +51,8 @@ static int bucse_create(const char *path, mode_t mode, struct fuse_file_info *fi
 			if ((fi->flags & O_CREAT) && (fi->flags & O_EXCL)) {
 				return -EEXIST;
 			}
-			return bucse_open_guarded(path, fi);
+			// already holding the tree lock for writing
+			return bucse_open(path, fi);
 		} else {
 			FilesystemDir* dir = findDir(containingDir, fileName);
 			if (dir) {
@@ -70,38 +65,39 @@ static int bucse_create(const char *path, mode_t mode, struct fuse_file_info *fi
 		return -ENOENT;
 	}
 
-	FilesystemFile* newFile = malloc(sizeof(FilesystemFile));
-	if (newFile == NULL) {
-		logPrintf(LOG_ERROR, "bucse_create: malloc(): %s\n", strerror(errno));
+	// strdup here, the name is owned by the file until it is freed,
+	// so that concurrent lookups never see it change
+	char* newFileName = strdup(fileName);
+	if (newFileName == NULL) {
+		logPrintf(LOG_ERROR, "bucse_create: strdup(): %s\n", strerror(errno));
 		return -ENOMEM;
 	}
-
-	// strdup here, will set DirtyFlagPendingCreate
-	// and clean up when flushing the file in flush.c
-	newFile->name = strdup(fileName);
-	if (newFile->name == NULL) {
-		logPrintf(LOG_ERROR, "splitPath: strdup(): %s\n", strerror(errno));
-		free(newFile);
+	FilesystemFile* newFile = newFilesystemFile(newFileName, containingDir);
+	if (newFile == NULL) {
+		logPrintf(LOG_ERROR, "bucse_create: newFilesystemFile() failed\n");
+		free(newFileName);
 		return -ENOMEM;
 	}
+	newFile->ownedName = newFileName;
 	newFile->atime = newFile->mtime = getCurrentTime();
-	newFile->content = NULL;
-	newFile->contentLen = 0;
-	newFile->size = 0;
-	newFile->blockSize = 0;
 	newFile->dirtyFlags = DirtyFlagPendingCreate;
-	memset(&newFile->pendingWrites, 0, sizeof(DynArray));
-	newFile->parentDir = containingDir;
 
-	addToDynArray(&containingDir->files, newFile);
+	if (addFileToDir(containingDir, newFile) != 0) {
+		logPrintf(LOG_ERROR, "bucse_create: addFileToDir() failed\n");
+		freeFilesystemFile(newFile);
+		return -ENOMEM;
+	}
 	return 0;
 }
 
 int bucse_create_guarded(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
-	pthread_mutex_lock(&bucseMutex);
+	pthread_rwlock_wrlock(&bucseTreeLock);
 	int result = bucse_create(path, mode, fi);
-	pthread_mutex_unlock(&bucseMutex);
+	pthread_rwlock_unlock(&bucseTreeLock);
+	if (result == 0) {
+		fi->fh = (uintptr_t)readAheadNew();
+	}
 	return result;
 }
 
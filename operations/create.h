@@ -1,2 +1,3 @@
+int bucse_create(const char *path, mode_t mode, struct fuse_file_info *fi);
 int bucse_create_guarded(const char *path, mode_t mode, struct fuse_file_info *fi);
 
@@ -2,16 +2,23 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
 #include <fuse.h>
 #include <pthread.h>
 
 #include "../dynarray.h"
+#include "../nameindex.h"
+#include "../dirtymap.h"
 #include "../filesystem.h"
 #include "../actions.h"
 #include "../time.h"
 
 #include "../log.h"
 #include "../conf.h"
+#include "../workpool.h"
+#include "../writeback.h"
+#include "../blocklayout.h"
+#include "../dedup.h"
 
 #include "../destinations/dest.h"
 #include "../encryption/encr.h"
@@ -23,11 +30,56 @@
 #define MIN_BLOCK_SIZE 512
 #define MAX_BLOCK_SIZE (128 * 1024 * 1024)
 
+// files written with uniform blocks are rewritten with tiers once they grow
+// past this many blocks, see blocklayout.h
 #define RESIZE_AT_BLOCKS_COUNT 32
+#define TIER_BLOCKS 16
+
+// the blocks being written at once take up to this much memory
+#define FLUSH_MAX_IN_FLIGHT_BYTES (256 * 1024 * 1024)
 
 extern Destination *destination;
 extern Encryption *encryption;
 
+struct _PendingFlush {
+	FilesystemFile* file; // NULL when it only waits for a running flush
+	uint64_t flushesEnded; // flushesEnded when the running flush was seen
+
+	// the file as the flush took it over, see flushFileStart()
+	const char* content;
+	int contentLen;
+	size_t size;
+	int blockSize;
+	int tierBlocks;
+	const size_t* chunkEnds;
+	DirtyMap dirtyMap;
+	DirtyFlags dirtyFlags;
+	size_t truncSize;
+	int64_t writeBackSince;
+
+	size_t oldSize; // the old data past it is gone
+	size_t newSize;
+
+	// the stored blocks, see storeFlush()
+	char* newContent;
+	int newContentLen;
+	int newBlockSize;
+	int newTierBlocks;
+	size_t* newChunkEnds;
+};
+
+// a flush that waits for a running one waits for flushesEnded to change
+static pthread_mutex_t flushesMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flushesCond = PTHREAD_COND_INITIALIZER;
+static uint64_t flushesEnded;
+
+// tiers only where the repository allows them, older versions read all
+// files as uniform blocks
+static int getTierBlocks()
+{
+	return conf.tieredBlocks ? TIER_BLOCKS : 0;
+}
+
 // determine block size using a file size
 static int getBlockSize(size_t size)
 {
@@ -58,314 +110,714 @@ static int getBlockSize(size_t size)
 	return result;
 }
 
-static int determineBlocksToWrite(char *blocksToWrite, off_t offset, size_t size, int fileBlockSize)
+static int determineBlocksToWrite(char *blocksToWrite, off_t offset, size_t size,
+	const BlockLayout* layout)
+{
+	if (size == 0) {
+		return 0;
+	}
+
+	int first = blockLayoutIndex(layout, offset);
+	int last = blockLayoutIndex(layout, offset + size - 1);
+	for (int i=first; i<=last; i++) {
+		blocksToWrite[i] = 1;
+	}
+
+	return 0;
+}
+
+// A new block to be built from the old ones and the dirty data, encrypted
+// and stored. The blocks of a flush are written in parallel, they only read
+// what the flush took over from the file, nothing changes that meanwhile.
+typedef struct {
+	PendingFlush* flush;
+	int index;
+	const BlockLayout* layout; // the new layout, shared by the writes of a flush
+	size_t oldSize; // the old data past it is gone
+	size_t newSize;
+	char* name; // where the name of the stored block goes
+	int result;
+	WorkGroup* group; // shared by the writes of a flush
+} BlockWrite;
+
+// copies the part of the old block i within [offset, end) to buf, which
+// starts at offset
+static int readOldBlock(PendingFlush* flush, const BlockLayout* layout, int i,
+	off_t offset, off_t end, char* buf)
 {
-	while (size > 0) {
-		int blockIndex = offset / fileBlockSize;
-		off_t blockOffset = (offset % fileBlockSize);
-		size_t blockLen = fileBlockSize - blockOffset;
-		if (blockLen > size) {
-			blockLen = size;
+	off_t blockStart = blockLayoutStart(layout, i);
+	size_t expectedReadSize = blockLayoutBytes(layout, i, flush->size);
+	const char* block = flush->content + (MAX_STORAGE_NAME_LEN * i);
+
+	size_t encryptedBlockBufSize = getMaxEncryptedBlockSize(blockLayoutSize(layout, i));
+	char* encryptedBlockBuf = malloc(encryptedBlockBufSize);
+	if (encryptedBlockBuf == NULL) {
+		logPrintf(LOG_ERROR, "flushFile: malloc(): %s\n", strerror(errno));
+		return 1;
+	}
+
+	// a block that fits is decrypted right into place
+	int inPlace = blockStart >= offset && blockStart + expectedReadSize <= end;
+	char* decryptedBlockBuf = buf + (blockStart - offset);
+	if (!inPlace) {
+		decryptedBlockBuf = malloc(expectedReadSize + DECRYPTED_BUFFER_MARGIN);
+		if (decryptedBlockBuf == NULL) {
+			logPrintf(LOG_ERROR, "flushFile: malloc(): %s\n", strerror(errno));
+			free(encryptedBlockBuf);
+			return 2;
 		}
+	}
+	size_t decryptedBlockBufSize = expectedReadSize;
 
-		blocksToWrite[blockIndex] = 1;
+	logPrintf(LOG_VERBOSE_DEBUG, "flush file: reading old block %d: %s\n", i, block);
+	int res = decryptBlock(block,
+		decryptedBlockBuf, &decryptedBlockBufSize,
+		encryptedBlockBuf, &encryptedBlockBufSize,
+		1, expectedReadSize);
+	free(encryptedBlockBuf);
 
-		offset += blockLen;
-		size -= blockLen;
+	if (!inPlace) {
+		if (res == 0) {
+			off_t from = blockStart > offset ? blockStart : offset;
+			off_t to = blockStart + (off_t)expectedReadSize;
+			if (to > end) {
+				to = end;
+			}
+			memcpy(buf + (from - offset), decryptedBlockBuf + (from - blockStart), to - from);
+		}
+		free(decryptedBlockBuf);
 	}
-	
-	return 0;
+	return res != 0 ? 3 : 0;
 }
 
-int flushFile(FilesystemFile* file)
+// reads [offset, offset + size) of the file as the flush leaves it into buf:
+// the old blocks up to oldSize, zeros past it, and the dirty data over them
+static int readFlushedContent(PendingFlush* flush, size_t oldSize,
+	off_t offset, size_t size, char* buf)
 {
-	if (file->dirtyFlags == DirtyFlagNotDirty) {
-		return 0;
+	memset(buf, 0, size);
+
+	off_t oldEnd = offset + size;
+	if (oldEnd > oldSize) {
+		oldEnd = oldSize;
 	}
-	// TODO: what if create only, no writes?
 
-	size_t newSize = file->size;
-	if (file->dirtyFlags & DirtyFlagPendingTrunc) {
-		newSize = file->truncSize;
-		file->truncSize = 0;
+	// the old data is only needed when it is not fully overwritten, which
+	// saves fetching it for sequential rewrites
+	if (oldEnd > offset && !dirtyMapCovers(&flush->dirtyMap, offset, oldEnd - offset)) {
+		BlockLayout oldLayout = {flush->blockSize, flush->tierBlocks, flush->chunkEnds, flush->contentLen};
+		for (int i=blockLayoutIndex(&oldLayout, offset); i<flush->contentLen; i++) {
+			if (blockLayoutStart(&oldLayout, i) >= oldEnd) {
+				break;
+			}
+			if (readOldBlock(flush, &oldLayout, i, offset, oldEnd, buf) != 0) {
+				return 1;
+			}
+		}
 	}
-	int newBlockSize = file->blockSize;
-	int newContentLen = file->contentLen;
-	char* newContent = NULL;
 
-	for (int i=0; i<file->pendingWrites.len; i++) {
-		PendingWrite* pw = file->pendingWrites.objects[i];
-		if (newSize < (pw->offset + pw->size)) {
-			newSize = (pw->offset + pw->size);
+	dirtyMapApply(&flush->dirtyMap, buf, offset, size);
+	return 0;
+}
+
+// encrypts and stores a block, its name goes to name. With conf.dedup, a
+// block that is stored already is not stored again, also when only the
+// destination knows it is.
+static int storeBlock(char* buf, size_t size, char* name, void* owner)
+{
+	char newStorageFileName[MAX_STORAGE_NAME_LEN];
+	int claimed = 0;
+	if (conf.dedup) {
+		if (dedupBlockName(buf, size, newStorageFileName) != 0) {
+			return 1;
 		}
+		DedupClaim claim = dedupClaim(newStorageFileName, owner);
+		if (claim == DedupStored) {
+			logPrintf(LOG_VERBOSE_DEBUG, "flush file: block %s is stored already\n",
+				newStorageFileName);
+			memcpy(name, newStorageFileName, MAX_STORAGE_NAME_LEN);
+			return 0;
+		}
+		claimed = (claim == DedupClaimed);
+	}
+	if (!claimed && getRandomStorageFileName(newStorageFileName) != 0) {
+		logPrintf(LOG_ERROR, "flushFile: getRandomStorageFileName failed\n");
+		return 2;
 	}
 
-	// block size may not be determined yet if the file hasn't been flushed
-	// with any data
-	if (file->blockSize == 0) {
-		newBlockSize = getBlockSize(newSize);
+	size_t encryptedBlockBufSize = getMaxEncryptedBlockSize(size);
+	char* encryptedBlockBuf = malloc(encryptedBlockBufSize);
+	if (encryptedBlockBuf == NULL) {
+		logPrintf(LOG_ERROR, "flushFile: malloc(): %s\n", strerror(errno));
+		if (claimed) {
+			dedupFinish(newStorageFileName, 0);
+		}
+		return 3;
 	}
 
-	if (newBlockSize == 0) {
-		newContentLen = 0;
+	// encrypt
+	int res = encryption->encrypt(buf, size,
+		encryptedBlockBuf, &encryptedBlockBufSize,
+		conf.passphrase);
+	if (res != 0) {
+		logPrintf(LOG_ERROR, "flushFile: encrypt failed: %d\n", res);
 	} else {
-		newContentLen = newSize / newBlockSize + (int)(newSize % newBlockSize != 0);
+		// save
+		res = destination->putStorageFile(newStorageFileName, encryptedBlockBuf, encryptedBlockBufSize);
+		if (res == DEST_STORAGE_FILE_EXISTS && claimed) {
+			// stored by another mount, or by a flush that failed later
+			logPrintf(LOG_VERBOSE_DEBUG, "flush file: block %s is stored already\n",
+				newStorageFileName);
+			res = 0;
+		} else if (res != 0) {
+			logPrintf(LOG_ERROR, "flushFile: putStorageFile failed: %d\n", res);
+		}
+	}
+	free(encryptedBlockBuf);
+	if (claimed) {
+		dedupFinish(newStorageFileName, res == 0);
+	}
+	if (res != 0) {
+		return 4;
 	}
 
-	// if nothing changed
-	if (file->pendingWrites.len == 0) {
-		if (newContentLen > 0) {
-			newContent = malloc(newContentLen * MAX_STORAGE_NAME_LEN);
-			if (newContent == NULL) {
-				logPrintf(LOG_ERROR, "flushFile: malloc(): %s\n", strerror(errno));
-				return 1;
+	memcpy(name, newStorageFileName, MAX_STORAGE_NAME_LEN);
+	return 0;
+}
+
+static int writeBlock(BlockWrite* write)
+{
+	int i = write->index;
+	off_t blockStart = blockLayoutStart(write->layout, i);
+	size_t expectedWriteSize = blockLayoutBytes(write->layout, i, write->newSize);
+
+	// every write has its own buffers, so they can run in parallel
+	char* decryptedBlockBuf = malloc(expectedWriteSize + DECRYPTED_BUFFER_MARGIN);
+	if (decryptedBlockBuf == NULL) {
+		logPrintf(LOG_ERROR, "flushFile: malloc(): %s\n", strerror(errno));
+		return 3;
+	}
+
+	if (readFlushedContent(write->flush, write->oldSize,
+			blockStart, expectedWriteSize, decryptedBlockBuf) != 0) {
+		free(decryptedBlockBuf);
+		return 5;
+	}
+
+	int res = storeBlock(decryptedBlockBuf, expectedWriteSize, write->name, write->group);
+	free(decryptedBlockBuf);
+	return res != 0 ? 5 : 0;
+}
+
+// the result is stored under the group mutex, the flushing thread checks it
+// for failures while other writes are still running
+static void finishBlockWrite(BlockWrite* write, int result)
+{
+	pthread_mutex_lock(&write->group->mutex);
+	write->result = result;
+	pthread_mutex_unlock(&write->group->mutex);
+	workGroupDone(write->group);
+}
+
+static void runBlockWrite(BlockWrite* write)
+{
+	finishBlockWrite(write, writeBlock(write));
+}
+
+static void blockWriteWork(void* arg, int cancelled)
+{
+	BlockWrite* write = arg;
+	if (cancelled) {
+		// the flushing thread is still waiting for it
+		finishBlockWrite(write, 5);
+		return;
+	}
+	runBlockWrite(write);
+}
+
+static int anyBlockWriteFailed(BlockWrite* writes, int count)
+{
+	for (int i=0; i<count; i++) {
+		if (writes[i].result != 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Writes the blocks in parallel: the pool workers and the flushing thread
+// build, encrypt and store them, as many at once as the memory limit allows.
+// The flushing thread takes back queued writes rather than wait for them.
+static int runBlockWrites(BlockWrite* writes, int count, int blockSize)
+{
+	int maxInFlight = FLUSH_MAX_IN_FLIGHT_BYTES / (2 * (size_t)blockSize);
+	if (maxInFlight > conf.fetchThreads + 1) {
+		maxInFlight = conf.fetchThreads + 1;
+	}
+	if (maxInFlight < 1) {
+		maxInFlight = 1;
+	}
+
+	WorkGroup group;
+	workGroupInit(&group);
+
+	int next = 0;
+	int failed = 0;
+	while (next < count && !failed) {
+		if (workGroupPending(&group) >= maxInFlight) {
+			int ranQueued = 0;
+			for (int i=0; i<next && !ranQueued; i++) {
+				if (workPoolTake(blockWriteWork, &writes[i])) {
+					runBlockWrite(&writes[i]);
+					ranQueued = 1;
+				}
+			}
+			if (!ranQueued) {
+				workGroupWait(&group, maxInFlight - 1);
 			}
-			memcpy(newContent, file->content, newContentLen * MAX_STORAGE_NAME_LEN);
+			// a failure seen early saves the rest of the uploads
+			pthread_mutex_lock(&group.mutex);
+			failed = anyBlockWriteFailed(writes, next);
+			pthread_mutex_unlock(&group.mutex);
+			continue;
 		}
 
-		goto constructAction;
+		BlockWrite* write = &writes[next++];
+		write->group = &group;
+		workGroupAdd(&group);
+		if (maxInFlight == 1 || workPoolSubmit(blockWriteWork, write, 1) != 0) {
+			runBlockWrite(write);
+		}
 	}
 
-	// if newContentLen is too big, change the blockSize and rewrite the whole file
-	int resizeContent = 0;
-	if (newContentLen > RESIZE_AT_BLOCKS_COUNT && newBlockSize < MAX_BLOCK_SIZE) {
-		logPrintf(LOG_DEBUG, "flushFile: resize blocks\n");
-		newBlockSize = getBlockSize(newSize);
-		newContentLen = (int)(newSize / (size_t)newBlockSize)
-			+ (int)(newSize % newBlockSize != 0);
-		resizeContent = 1;
+	for (int i=0; i<next; i++) {
+		if (workPoolTake(blockWriteWork, &writes[i])) {
+			runBlockWrite(&writes[i]);
+		}
 	}
+	workGroupWait(&group, 0);
+	workGroupDestroy(&group);
+
+	logPrintf(LOG_DEBUG, "flush file: %d of %d blocks written, %d at once\n",
+		next, count, maxInFlight);
+	return failed || next < count || anyBlockWriteFailed(writes, next);
+}
 
+// Plans the blocks of a file with a computed layout. The blocks with dirty
+// data are written, the others are kept. Returns the old block each new
+// block is copied from, -1 for the blocks to write.
+static int* planBlocks(PendingFlush* flush, const BlockLayout* layout, int count,
+	int rewriteAll, int truncated)
+{
 	// determine which blocks have been changed -- one byte per block
-	char* blocksToWrite = malloc(newContentLen);
+	char* blocksToWrite = malloc(count);
 	if (blocksToWrite == NULL) {
 		logPrintf(LOG_ERROR, "flushFile: malloc(): %s\n", strerror(errno));
-		return 1;
+		return NULL;
 	}
 
-	if (resizeContent) {
-		memset(blocksToWrite, 1, newContentLen);
+	if (rewriteAll) {
+		memset(blocksToWrite, 1, count);
 	} else {
-		memset(blocksToWrite, 0, newContentLen);
+		memset(blocksToWrite, 0, count);
 	}
 
-	for (int i=0; i<file->pendingWrites.len; i++) {
-		PendingWrite* pw = file->pendingWrites.objects[i];
-		determineBlocksToWrite(blocksToWrite, pw->offset, pw->size, newBlockSize);
+	for (int i=0; i<flush->dirtyMap.len; i++) {
+		DirtyPage* page = flush->dirtyMap.pages[i];
+		for (int j=0; j<page->runsLen; j++) {
+			determineBlocksToWrite(blocksToWrite,
+				page->offset + page->runs[j].start,
+				page->runs[j].end - page->runs[j].start,
+				layout);
+		}
 	}
 
 	// a special case where the last block was not touched, but there were
 	// writes afterwards that extend the file. In that case, we need to
 	// force that block to be reasaved (not copied over), because we need
 	// trailing zeroes
-	if (file->contentLen > 0 && file->contentLen < newContentLen) {
-		blocksToWrite[file->contentLen - 1] = 1;
+	if (flush->contentLen > 0 && flush->contentLen < count) {
+		blocksToWrite[flush->contentLen - 1] = 1;
 	}
 
-	// another special case? when truncating. TODO: See if this is realy needed
-	if (newContentLen > 0 && file->contentLen > newContentLen) {
-		blocksToWrite[newContentLen - 1] = 1;
-	}
-	
-	// debug: print number of blocks to be written
-	int blocksToWriteNum = 0;
-	for (int i=0; i<newContentLen; i++) {
-		blocksToWriteNum += blocksToWrite[i];
+	// when truncating, the last block is stored again shorter, its old
+	// length would not match the file size
+	if (count > 0 && (flush->contentLen > count || truncated)) {
+		blocksToWrite[count - 1] = 1;
 	}
-	logPrintf(LOG_DEBUG, "flush file: %d blocks to write\n", blocksToWriteNum);
 
-	// construct and save new blocks (with destination->putStorageFile() calls)
-	size_t maxEncryptedBlockSize = getMaxEncryptedBlockSize(newBlockSize);
-	char* encryptedBlockBuf = malloc(maxEncryptedBlockSize);
-	if (encryptedBlockBuf == NULL) {
+	int* sources = malloc(count * sizeof(int));
+	if (sources == NULL) {
 		logPrintf(LOG_ERROR, "flushFile: malloc(): %s\n", strerror(errno));
 		free(blocksToWrite);
-		return 2;
+		return NULL;
+	}
+	for (int i=0; i<count; i++) {
+		sources[i] = (blocksToWrite[i] == 0 && i < flush->contentLen) ? i : -1;
 	}
+	free(blocksToWrite);
+	return sources;
+}
 
-	size_t maxDecryptedBlockSize = newBlockSize;
-	char* decryptedBlockBuf = malloc(maxDecryptedBlockSize + DECRYPTED_BUFFER_MARGIN);
-	if (decryptedBlockBuf == NULL) {
-		logPrintf(LOG_ERROR, "flushFile: malloc(): %s\n", strerror(errno));
-		free(blocksToWrite);
-		free(encryptedBlockBuf);
-		return 3;
+// appends a chunk to the plan of planChunks()
+static int addChunk(size_t** chunkEnds, int** sources, int* count, int* size,
+	size_t end, int source)
+{
+	if (*count == *size) {
+		int newSize = *size == 0 ? 16 : *size * 2;
+		size_t* newChunkEnds = realloc(*chunkEnds, newSize * sizeof(size_t));
+		if (newChunkEnds == NULL) {
+			logPrintf(LOG_ERROR, "flushFile: realloc(): %s\n", strerror(errno));
+			return 1;
+		}
+		*chunkEnds = newChunkEnds;
+		int* newSources = realloc(*sources, newSize * sizeof(int));
+		if (newSources == NULL) {
+			logPrintf(LOG_ERROR, "flushFile: realloc(): %s\n", strerror(errno));
+			return 1;
+		}
+		*sources = newSources;
+		*size = newSize;
 	}
-	newContent = malloc(newContentLen * MAX_STORAGE_NAME_LEN);
-	if (newContent == NULL) {
-		free(blocksToWrite);
-		free(encryptedBlockBuf);
-		free(decryptedBlockBuf);
+	(*chunkEnds)[*count] = end;
+	(*sources)[*count] = source;
+	(*count)++;
+	return 0;
+}
+
+// Plans the blocks of a chunked file. The chunks from the first changed one
+// on are cut again by their content, until a cut meets the end of an old
+// chunk past the changed data, the old chunks from there on are kept. Returns
+// the chunk ends and the old block each new block is copied from, -1 for the
+// blocks to write.
+static int planChunks(PendingFlush* flush, size_t oldSize, size_t newSize,
+	size_t** chunkEndsPtr, int** sourcesPtr, int* countPtr)
+{
+	size_t* chunkEnds = NULL;
+	int* sources = NULL;
+	int count = 0;
+	int size = 0;
+
+	// the old chunks are only kept when the file was chunked already
+	int oldChunks = flush->chunkEnds != NULL ? flush->contentLen : 0;
+	BlockLayout oldLayout = {flush->blockSize, 0, flush->chunkEnds, oldChunks};
+
+	// the changed data, the old data is gone past oldSize
+	size_t changeStart = oldSize;
+	size_t changeEnd = newSize;
+	DirtyMap* map = &flush->dirtyMap;
+	if (map->len > 0) {
+		DirtyPage* firstPage = map->pages[0];
+		DirtyPage* lastPage = map->pages[map->len - 1];
+		size_t dirtyStart = firstPage->offset + firstPage->runs[0].start;
+		if (dirtyStart < changeStart) {
+			changeStart = dirtyStart;
+		}
+		if (oldSize == flush->size && newSize == flush->size) {
+			changeEnd = lastPage->offset + lastPage->runs[lastPage->runsLen - 1].end;
+		}
+	}
+
+	// the last chunk was cut by the end of the file, so it's cut again when
+	// the file grows
+	int first = 0;
+	if (oldChunks > 0) {
+		first = blockLayoutIndex(&oldLayout, changeStart);
+		if (first == oldChunks && newSize > flush->size) {
+			first--;
+		}
+	}
+	for (int i=0; i<first; i++) {
+		if (addChunk(&chunkEnds, &sources, &count, &size, flush->chunkEnds[i], i) != 0) {
+			goto error;
+		}
+	}
+
+	char* buf = malloc(DEDUP_CHUNK_MAX_SIZE);
+	if (buf == NULL) {
 		logPrintf(LOG_ERROR, "flushFile: malloc(): %s\n", strerror(errno));
-		return 4;
+		goto error;
 	}
-	int ioerror = 0;
-	for (int i=0; i<newContentLen; i++) {
-		if (blocksToWrite[i] == 0) {
-			if (i < file->contentLen) {
-				memcpy(newContent + (MAX_STORAGE_NAME_LEN * i),
-					file->content + (MAX_STORAGE_NAME_LEN * i),
-					MAX_STORAGE_NAME_LEN);
-				continue;
+	size_t filled = 0;
+	size_t offset = blockLayoutStart(&oldLayout, first);
+	while (offset < newSize) {
+		size_t chunkSize = newSize - offset;
+		if (chunkSize > DEDUP_CHUNK_MAX_SIZE) {
+			chunkSize = DEDUP_CHUNK_MAX_SIZE;
+		}
+		if (filled < chunkSize) {
+			if (readFlushedContent(flush, oldSize, offset + filled,
+					chunkSize - filled, buf + filled) != 0) {
+				free(buf);
+				goto error;
 			}
+			filled = chunkSize;
+		}
+		size_t cut = dedupChunkSize(buf, chunkSize);
+		offset += cut;
+		filled -= cut;
+		memmove(buf, buf + cut, filled);
+		if (addChunk(&chunkEnds, &sources, &count, &size, offset, -1) != 0) {
+			free(buf);
+			goto error;
 		}
 
-		memset(decryptedBlockBuf, 0, maxDecryptedBlockSize + DECRYPTED_BUFFER_MARGIN);
-		size_t encryptedBlockBufSize = maxEncryptedBlockSize;
-		size_t decryptedBlockBufSize = maxDecryptedBlockSize;
-
-		// special case when we need to resize blocks
-		if (resizeContent) {
-			logPrintf(LOG_VERBOSE_DEBUG, "content needs to be resized\n");
-			size_t toRead = newSize - (i * newBlockSize);
-			if (toRead > newBlockSize) {
-				toRead = newBlockSize;
-			}
-			// we are using the fact that the new block size is a multiple of the old block size
-			int sourceBlockIndex = (newBlockSize/file->blockSize)*i;
-			char* bufPtr = decryptedBlockBuf;
-			size_t bufSize = decryptedBlockBufSize;
-			while (toRead > 0) {
-				if (sourceBlockIndex >= file->contentLen) {
-					logPrintf(LOG_VERBOSE_DEBUG, "toRead fill with zeros: %d\n", toRead);
-					memset(bufPtr, 0, toRead);
-					toRead = 0;
-					break;
-				}
-				logPrintf(LOG_VERBOSE_DEBUG, "toRead: %d\n", toRead);
-				size_t expectedReadSize = file->size - (sourceBlockIndex * file->blockSize);
-				if (expectedReadSize > file->blockSize) {
-					expectedReadSize = file->blockSize;
+		// the same data from the same cut is cut the same way
+		if (oldChunks > 0 && offset >= changeEnd && offset < newSize) {
+			int i = blockLayoutIndex(&oldLayout, offset);
+			if (i > 0 && flush->chunkEnds[i - 1] == offset) {
+				for (; i<oldChunks; i++) {
+					if (addChunk(&chunkEnds, &sources, &count, &size,
+							flush->chunkEnds[i], i) != 0) {
+						free(buf);
+						goto error;
+					}
 				}
-				const char* block = file->content + (MAX_STORAGE_NAME_LEN * sourceBlockIndex);
-				logPrintf(LOG_VERBOSE_DEBUG, "expectedReadSize: %d\n", expectedReadSize);
-				logPrintf(LOG_VERBOSE_DEBUG, "bufSize: %d\n", bufSize);
-				logPrintf(LOG_VERBOSE_DEBUG, "sourceBlockIndex: %d\n", sourceBlockIndex);
-				logPrintf(LOG_VERBOSE_DEBUG, "block: %s\n", block);
-
-				size_t bufSizeCopy=bufSize;
-				size_t encryptedBlockBufSizeCopy = encryptedBlockBufSize;
-				if (decryptBlock(block,
-					bufPtr, &bufSizeCopy,
-					encryptedBlockBuf, &encryptedBlockBufSizeCopy,
-					1, expectedReadSize) != 0) {
-					ioerror = 1;
-					break;
-				}
-				bufPtr += expectedReadSize;
-				bufSize -= expectedReadSize;
-				toRead -= expectedReadSize;
-				sourceBlockIndex++;
-			}
-			if (ioerror) {
 				break;
 			}
 		}
-		else if (i < file->contentLen) {
-			size_t expectedReadSize = file->size - (i * file->blockSize);
-			if (expectedReadSize > file->blockSize) {
-				expectedReadSize = file->blockSize;
-			}
+	}
+	free(buf);
 
-			const char* block = file->content + (MAX_STORAGE_NAME_LEN * i);
-			
-			if (decryptBlock(block,
-				decryptedBlockBuf, &decryptedBlockBufSize,
-				encryptedBlockBuf, &encryptedBlockBufSize,
-				1, expectedReadSize) != 0) {
-				ioerror = 1;
-				break;
-			}
+	*chunkEndsPtr = chunkEnds;
+	*sourcesPtr = sources;
+	*countPtr = count;
+	return 0;
+
+error:
+	free(chunkEnds);
+	free(sources);
+	return 1;
+}
+
+// Takes over the dirty data of a file, see flush.h. The size is set to the
+// one the flush leaves, so that a stat sees it meanwhile.
+int flushFileStart(FilesystemFile* file, PendingFlush** flush)
+{
+	*flush = NULL;
+	if (!file->flushing && file->dirtyFlags == DirtyFlagNotDirty) {
+		return 0;
+	}
+
+	PendingFlush* newFlush = calloc(1, sizeof(PendingFlush));
+	if (newFlush == NULL) {
+		logPrintf(LOG_ERROR, "flushFile: calloc(): %s\n", strerror(errno));
+		return 1;
+	}
+
+	if (file->flushing) {
+		// the ends seen under file->mutex, the running flush can't end
+		// before it is read
+		pthread_mutex_lock(&flushesMutex);
+		newFlush->flushesEnded = flushesEnded;
+		pthread_mutex_unlock(&flushesMutex);
+		*flush = newFlush;
+		return 0;
+	}
 
+	newFlush->file = file;
+	newFlush->content = file->content;
+	newFlush->contentLen = file->contentLen;
+	newFlush->size = file->size;
+	newFlush->blockSize = file->blockSize;
+	newFlush->tierBlocks = file->tierBlocks;
+	newFlush->chunkEnds = file->chunkEnds;
+	newFlush->dirtyMap = file->dirtyMap;
+	newFlush->dirtyFlags = file->dirtyFlags;
+	newFlush->truncSize = file->truncSize;
+
+	newFlush->newSize = file->size;
+	// the old data past a truncation is gone, even if the file grows again
+	newFlush->oldSize = file->size;
+	if (file->dirtyFlags & DirtyFlagPendingTrunc) {
+		newFlush->newSize = file->truncSize;
+		if (newFlush->oldSize > file->truncSize) {
+			newFlush->oldSize = file->truncSize;
 		}
-		// right now we have data in decryptedBlockBuf
-		
-		// apply write operations
-		for (int j=0; j<file->pendingWrites.len; j++) {
-			PendingWrite* pw = file->pendingWrites.objects[j];
-			int relOffset = pw->offset - i * newBlockSize;
+	}
+	if (newFlush->newSize < file->dirtyMap.end) {
+		newFlush->newSize = file->dirtyMap.end;
+	}
 
-			if (relOffset >= newBlockSize) {
-				continue;
-			} else if (relOffset + (int)pw->size <= 0) {
-				continue;
-			}
+	memset(&file->dirtyMap, 0, sizeof(DirtyMap));
+	file->dirtyFlags = DirtyFlagNotDirty;
+	file->truncSize = 0;
+	file->size = newFlush->newSize;
+	file->flushing = 1;
+	newFlush->writeBackSince = writeBackRemove(file);
 
-			if (relOffset <= 0) {
-				int bytesToCopy = pw->size + relOffset;
-				if (bytesToCopy > newBlockSize) {
-					bytesToCopy = newBlockSize;
-				}
-				memcpy(decryptedBlockBuf, pw->buf - relOffset, bytesToCopy);
-			} else {
-				int bytesToCopy = pw->size;
-				if (bytesToCopy > newBlockSize - relOffset) {
-					bytesToCopy = newBlockSize - relOffset;
-				}
-				memcpy(decryptedBlockBuf + relOffset, pw->buf, bytesToCopy);
+	*flush = newFlush;
+	return 0;
+}
+
+// builds and stores the blocks, needs no locks
+static int storeFlush(PendingFlush* flush)
+{
+	size_t newSize = flush->newSize;
+	size_t oldSize = flush->oldSize;
+	int newBlockSize = flush->blockSize;
+	int newTierBlocks = flush->tierBlocks;
+	int newContentLen = flush->contentLen;
+	char* newContent = NULL;
+	size_t* newChunkEnds = NULL;
+
+	// block size may not be determined yet if the file hasn't been flushed
+	// with any data, such a file is chunked with conf.dedup
+	int chunked = (flush->chunkEnds != NULL);
+	if (flush->blockSize == 0) {
+		newBlockSize = getBlockSize(newSize);
+		newTierBlocks = getTierBlocks();
+		chunked = conf.dedup;
+	} else if (newTierBlocks == 0 && flush->contentLen <= TIER_BLOCKS) {
+		// the uniform blocks of a small file are the first tier already
+		newTierBlocks = getTierBlocks();
+	}
+
+	BlockLayout newLayout = {newBlockSize, newTierBlocks, NULL, 0};
+	if (!chunked) {
+		newContentLen = blockLayoutCount(&newLayout, newSize);
+	}
+
+	// if nothing changed
+	int truncated = (oldSize < flush->size);
+	if (flush->dirtyMap.end == 0 && !chunked && !truncated) {
+		if (newContentLen > 0) {
+			newContent = malloc(newContentLen * MAX_STORAGE_NAME_LEN);
+			if (newContent == NULL) {
+				logPrintf(LOG_ERROR, "flushFile: malloc(): %s\n", strerror(errno));
+				return 1;
 			}
+			memcpy(newContent, flush->content, newContentLen * MAX_STORAGE_NAME_LEN);
 		}
 
-		size_t expectedWriteSize = newSize - (i * newBlockSize);
-		if (expectedWriteSize > newBlockSize) {
-			expectedWriteSize = newBlockSize;
-		}
-		encryptedBlockBufSize = maxEncryptedBlockSize;
+		goto stored;
+	}
 
-		// encrypt
-		int res = encryption->encrypt(decryptedBlockBuf, expectedWriteSize,
-			encryptedBlockBuf, &encryptedBlockBufSize,
-			conf.passphrase);
-		if (res != 0) {
-			logPrintf(LOG_ERROR, "flushFile: encrypt failed: %d\n", res);
-			ioerror = 1;
-			break;
-		}
+	// if a file with uniform blocks got too big, change the blockSize and
+	// rewrite the whole file once, with tiers it doesn't need that again.
+	// With conf.dedup, it's chunked instead.
+	int resizeContent = 0;
+	if (!chunked && newTierBlocks == 0 && newContentLen > RESIZE_AT_BLOCKS_COUNT
+			&& newBlockSize < MAX_BLOCK_SIZE) {
+		logPrintf(LOG_DEBUG, "flushFile: resize blocks\n");
+		newBlockSize = getBlockSize(newSize);
+		newTierBlocks = getTierBlocks();
+		newLayout.blockSize = newBlockSize;
+		newLayout.tierBlocks = newTierBlocks;
+		newContentLen = blockLayoutCount(&newLayout, newSize);
+		resizeContent = 1;
+		chunked = conf.dedup;
+	}
 
-		// save
-		char newStorageFileName[MAX_STORAGE_NAME_LEN];
-		if (getRandomStorageFileName(newStorageFileName) != 0) {
-			logPrintf(LOG_ERROR, "flushFile: getRandomStorageFileName failed\n");
-			ioerror = 1;
-			break;
+	// the old block each new block is copied from, -1 for the blocks to write
+	int* sources = NULL;
+	if (chunked) {
+		newBlockSize = newSize > 0 ? DEDUP_CHUNK_MAX_SIZE : 0;
+		newTierBlocks = 0;
+		if (planChunks(flush, oldSize, newSize, &newChunkEnds, &sources, &newContentLen) != 0) {
+			return 1;
 		}
-		res = destination->putStorageFile(newStorageFileName, encryptedBlockBuf, encryptedBlockBufSize);
-		if (res != 0) {
-			logPrintf(LOG_ERROR, "flushFile: putStorageFile failed: %d\n", res);
-			ioerror = 1;
-			break;
+		newLayout.blockSize = newBlockSize;
+		newLayout.tierBlocks = newTierBlocks;
+		newLayout.chunkEnds = newChunkEnds;
+		newLayout.chunks = newContentLen;
+	} else {
+		sources = planBlocks(flush, &newLayout, newContentLen, resizeContent, truncated);
+		if (sources == NULL) {
+			return 1;
 		}
+	}
 
-		memcpy(newContent + (MAX_STORAGE_NAME_LEN * i),
-			newStorageFileName,
-			MAX_STORAGE_NAME_LEN);
+	// debug: print number of blocks to be written
+	int blocksToWriteNum = 0;
+	for (int i=0; i<newContentLen; i++) {
+		blocksToWriteNum += (sources[i] < 0);
 	}
+	logPrintf(LOG_DEBUG, "flush file: %d blocks to write\n", blocksToWriteNum);
 
-	free(encryptedBlockBuf);
-	free(decryptedBlockBuf);
-	free(blocksToWrite);
+	if (newContentLen == 0) {
+		free(sources);
+		free(newChunkEnds);
+		newChunkEnds = NULL;
+		goto stored;
+	}
+
+	newContent = malloc(newContentLen * MAX_STORAGE_NAME_LEN);
+	if (newContent == NULL) {
+		free(sources);
+		free(newChunkEnds);
+		logPrintf(LOG_ERROR, "flushFile: malloc(): %s\n", strerror(errno));
+		return 4;
+	}
 
+	// unchanged blocks are kept, the others are built by the worker pool
+	BlockWrite* writes = malloc(newContentLen * sizeof(BlockWrite));
+	if (writes == NULL) {
+		free(sources);
+		free(newChunkEnds);
+		free(newContent);
+		logPrintf(LOG_ERROR, "flushFile: malloc(): %s\n", strerror(errno));
+		return 2;
+	}
+	int writesCount = 0;
+	for (int i=0; i<newContentLen; i++) {
+		if (sources[i] >= 0) {
+			memcpy(newContent + (MAX_STORAGE_NAME_LEN * i),
+				flush->content + (MAX_STORAGE_NAME_LEN * sources[i]),
+				MAX_STORAGE_NAME_LEN);
+			continue;
+		}
+
+		BlockWrite* write = &writes[writesCount++];
+		write->flush = flush;
+		write->index = i;
+		write->layout = &newLayout;
+		write->oldSize = oldSize;
+		write->newSize = newSize;
+		write->name = newContent + (MAX_STORAGE_NAME_LEN * i);
+		write->result = 0;
+	}
+	free(sources);
+
+	// the last block of a computed layout is the biggest one
+	int maxBlockSize = chunked ? newBlockSize
+		: blockLayoutSize(&newLayout, newContentLen - 1);
+	int ioerror = runBlockWrites(writes, writesCount, maxBlockSize);
+	free(writes);
+
+	// the action is only committed once every block is stored
 	if (ioerror) {
+		free(newChunkEnds);
 		if (newContent) {
 			free(newContent);
 		}
 		return 5;
 	}
 
-constructAction:;
+stored:
+	flush->newContent = newContent;
+	flush->newContentLen = newContentLen;
+	flush->newBlockSize = newBlockSize;
+	flush->newTierBlocks = newTierBlocks;
+	flush->newChunkEnds = newChunkEnds;
+	return 0;
+}
+
+// adds the action of a stored flush and installs the new content, the
+// action takes over the new content
+static int addFlushAction(PendingFlush* flush)
+{
+	FilesystemFile* file = flush->file;
 
 	// construct new action, add it to actions
 	Action* newAction = malloc(sizeof(Action));
 	if (newAction == NULL) {
 		logPrintf(LOG_ERROR, "flushFile: malloc(): %s\n", strerror(errno));
-		if (newContent) {
-			free(newContent);
-		}
 		return 6;
 	}
 	newAction->time = getCurrentTime();
 
-	if (file->dirtyFlags & DirtyFlagPendingCreate) {
+	if (flush->dirtyFlags & DirtyFlagPendingCreate) {
 		newAction->actionType = ActionTypeAddFile;
 	}
 	else {
@@ -375,23 +827,19 @@ constructAction:;
 	newAction->path = getFullFilePath(file);
 	if (newAction->path == NULL) {
 		logPrintf(LOG_ERROR, "flushFile: getFullFilePath() failed: %s\n", strerror(errno));
-		if (newContent) {
-			free(newContent);
-		}
 		free(newAction);
 		return 7;
 	}
-	newAction->content = newContent;
-	newAction->contentLen = newContentLen;
-	newAction->size = newSize;
-	newAction->blockSize = newBlockSize;
+	newAction->content = flush->newContent;
+	newAction->contentLen = flush->newContentLen;
+	newAction->size = flush->newSize;
+	newAction->blockSize = flush->newBlockSize;
+	newAction->tierBlocks = flush->newTierBlocks;
+	newAction->chunkEnds = flush->newChunkEnds;
 
 	// write to json, encrypt call destination->addActionFile()
 	if (encryptAndAddActionFile(newAction) != 0) {
 		logPrintf(LOG_ERROR, "flushFile: encryptAndAddActionFile failed\n");
-		if (newContent) {
-			free(newContent);
-		}
 		free(newAction->path);
 		free(newAction);
 		return 10;
@@ -399,40 +847,158 @@ constructAction:;
 
 	// add to actions array
 	addAction(newAction);
-
-	// update file
-	if (file->dirtyFlags & DirtyFlagPendingCreate) {
-		// file->name was temporary created, now we need to set a proper
-		// pointer to a data from newAction->path
-		free((char*)file->name);
-		DynArray pathArray;
-		memset(&pathArray, 0, sizeof(DynArray));
-		file->name = path_split(newAction->path, &pathArray);
-		path_free(&pathArray);
+	flush->newContent = NULL;
+	flush->newChunkEnds = NULL;
+
+	// update file; the kernel has seen all the local writes, so its cached
+	// pages stay valid for the new content. Writes that came meanwhile are
+	// in the new dirty map, over the new content.
+	if (file->cachedContent == file->content) {
+		file->cachedContent = newAction->content;
 	}
 	file->mtime = newAction->time;
 	file->content = newAction->content;
 	file->contentLen = newAction->contentLen;
-	file->size = newAction->size;
 	file->blockSize = newAction->blockSize;
-	file->dirtyFlags = DirtyFlagNotDirty;
+	file->tierBlocks = newAction->tierBlocks;
+	file->chunkEnds = newAction->chunkEnds;
+	// a truncation that came meanwhile is applied by the next flush
+	file->size = newAction->size;
+
+	return 0;
+}
+
+// gives the dirty data of a failed flush back to the file, under the writes
+// that came meanwhile
+static void restoreFlush(PendingFlush* flush)
+{
+	FilesystemFile* file = flush->file;
+
+	// a remote action replaced what the flush started from, the dirty data
+	// goes as it does in doAction()
+	if (file->content != flush->content) {
+		return;
+	}
+	file->size = flush->size;
+
+	if (file->dirtyFlags & DirtyFlagPendingTrunc) {
+		// truncated by an open meanwhile, the old dirty data is gone
+		file->dirtyFlags |= (flush->dirtyFlags & DirtyFlagPendingCreate);
+	} else {
+		if (dirtyMapMerge(&flush->dirtyMap, &file->dirtyMap) != 0) {
+			logPrintf(LOG_ERROR, "flushFile: dirtyMapMerge failed, writes are lost\n");
+		}
+		file->dirtyMap = flush->dirtyMap;
+		memset(&flush->dirtyMap, 0, sizeof(DirtyMap));
+		file->dirtyFlags |= flush->dirtyFlags;
+		file->truncSize = flush->truncSize;
+	}
+	writeBackRestore(file, flush->writeBackSince);
+}
+
+// the last step of a flush, with the locks held as for flushFileStart()
+static int commitFlush(PendingFlush* flush, int result)
+{
+	FilesystemFile* file = flush->file;
+
+	if (file->removed) {
+		// removed by a remote action, the data goes with it
+		result = 0;
+	} else {
+		if (result == 0) {
+			result = addFlushAction(flush);
+		}
+		if (result != 0) {
+			restoreFlush(flush);
+		}
+	}
+
+	free(flush->newChunkEnds);
+	free(flush->newContent);
+	freeDirtyMap(&flush->dirtyMap);
+
+	file->flushing = 0;
+	pthread_mutex_lock(&flushesMutex);
+	flushesEnded++;
+	pthread_cond_broadcast(&flushesCond);
+	pthread_mutex_unlock(&flushesMutex);
+
+	return result;
+}
+
+int flushFileFinish(PendingFlush* flush)
+{
+	FilesystemFile* file = flush->file;
+	if (file == NULL) {
+		pthread_mutex_lock(&flushesMutex);
+		while (flushesEnded == flush->flushesEnded) {
+			pthread_cond_wait(&flushesCond, &flushesMutex);
+		}
+		pthread_mutex_unlock(&flushesMutex);
+		free(flush);
+		return 0;
+	}
+
+	int result = storeFlush(flush);
+
+	// the file is not freed while it is flushing
+	pthread_rwlock_rdlock(&bucseTreeLock);
+	pthread_mutex_lock(&file->mutex);
+	result = commitFlush(flush, result);
+	int removed = file->removed;
+	pthread_mutex_unlock(&file->mutex);
+	if (removed) {
+		freeFilesystemFile(file);
+	}
+	pthread_rwlock_unlock(&bucseTreeLock);
+
+	free(flush);
+	return result;
+}
 
-	for (int i=0; i<file->pendingWrites.len; i++) {
-		PendingWrite* pw = file->pendingWrites.objects[i];
-		free(pw->buf);
-		free(pw);
+int flushFile(FilesystemFile* file)
+{
+	PendingFlush* flush = NULL;
+	int result = flushFileStart(file, &flush);
+	if (result != 0 || flush == NULL) {
+		return result;
+	}
+	if (flush->file == NULL) {
+		// it can't be waited for with the locks held
+		logPrintf(LOG_ERROR, "flushFile: the file is flushing already\n");
+		free(flush);
+		return 11;
+	}
+
+	result = commitFlush(flush, storeFlush(flush));
+	free(flush);
+	return result;
+}
+
+int flushFileIfPendingWrite(FilesystemFile* file, PendingFlush** flush)
+{
+	*flush = NULL;
+	if ((file->dirtyFlags & DirtyFlagPendingWrite) || file->flushing) {
+		if (flushFileStart(file, flush) != 0) {
+			return -EIO;
+		}
 	}
-	freeDynArray(&file->pendingWrites);
 
 	return 0;
 }
 
-static int bucse_flush(const char *path, struct fuse_file_info *fi)
+static int bucse_flush(const char *path, struct fuse_file_info *fi,
+		PendingFlush** flush)
 {
 	(void) fi;
 
 	logPrintf(LOG_DEBUG, "flush %s\n", path);
 
+	// the file is written out once released
+	if (conf.lazyClose) {
+		return 0;
+	}
+
 	if (path == NULL) {
 		return -EIO;
 	}
@@ -442,17 +1008,8 @@ static int bucse_flush(const char *path, struct fuse_file_info *fi)
 	if (strcmp(path, "/") == 0) {
 		return -EACCES;
 	} else if (path[0] == '/') {
-		DynArray pathArray;
-		memset(&pathArray, 0, sizeof(DynArray));
-		const char *fileName = path_split(path+1, &pathArray);
-		if (fileName == NULL) {
-			logPrintf(LOG_ERROR, "bucse_flush: path_split() failed\n");
-			return -ENOMEM;
-		}
-		//path_debugPrint(&pathArray);
-
-		FilesystemDir *containingDir = findContainingDir(&pathArray);
-		path_free(&pathArray);
+		const char *fileName = NULL;
+		FilesystemDir *containingDir = findContainingDir(path+1, &fileName);
 
 		if (containingDir == NULL) {
 			logPrintf(LOG_ERROR, "bucse_flush: path not found when writing file %s\n", path);
@@ -473,20 +1030,26 @@ static int bucse_flush(const char *path, struct fuse_file_info *fi)
 		return -ENOENT;
 	}
 
-	if (file->dirtyFlags & DirtyFlagPendingWrite) {
-		if (flushFile(file) != 0) {
-			return -EIO;
-		}
-	}
-
-	return 0;
+	pthread_mutex_lock(&file->mutex);
+	int result = flushFileIfPendingWrite(file, flush);
+	pthread_mutex_unlock(&file->mutex);
+	return result;
 }
 
 int bucse_flush_guarded(const char *path, struct fuse_file_info *fi)
 {
-	pthread_mutex_lock(&bucseMutex);
-	int result = bucse_flush(path, fi);
-	pthread_mutex_unlock(&bucseMutex);
-	return result;
+	for (;;) {
+		PendingFlush* flush = NULL;
+		pthread_rwlock_rdlock(&bucseTreeLock);
+		int result = bucse_flush(path, fi, &flush);
+		pthread_rwlock_unlock(&bucseTreeLock);
+		if (flush == NULL) {
+			return result;
+		}
+		// the blocks are stored without the locks, then it's tried again
+		if (flushFileFinish(flush) != 0) {
+			return -EIO;
+		}
+	}
 }
 
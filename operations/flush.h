@@ -1,2 +1,25 @@
+// A flush runs in three steps, so that the destination is not waited for
+// with bucseTreeLock held:
+// - flushFileStart() takes over the dirty data of the file, with
+//   bucseTreeLock and file->mutex (or bucseTreeLock for writing) held, and
+//   sets file->flushing. A file that is flushing is not freed nor moved, and
+//   its new writes go to a new dirty map.
+// - flushFileFinish() builds and stores the blocks with no locks held, then
+//   takes the locks again to add the action and install the new content. If
+//   storing fails, the dirty data goes back to the file.
+// When the file is flushing already, flushFileStart() returns a flush that
+// only waits for the running one; the caller then tries again.
+typedef struct _PendingFlush PendingFlush;
+
+// returns 0 and leaves flush NULL when the file has nothing to flush
+int flushFileStart(FilesystemFile* file, PendingFlush** flush);
+// call without any locks held, frees flush
+int flushFileFinish(PendingFlush* flush);
+
+// flushes pending changes of a file to the destination in one go, with the
+// locks held as for flushFileStart(). Fails when the file is flushing.
 int flushFile(FilesystemFile* file);
+// starts flushing pending writes only, as flushFileStart(), returns -EIO on
+// failure
+int flushFileIfPendingWrite(FilesystemFile* file, PendingFlush** flush);
 int bucse_flush_guarded(const char *path, struct fuse_file_info *fi);
@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fuse.h>
+#include <pthread.h>
+
+#include "../dynarray.h"
+#include "../nameindex.h"
+#include "../dirtymap.h"
+#include "../filesystem.h"
+#include "../actions.h"
+#include "../log.h"
+
+#include "../destinations/dest.h"
+
+#include "operations.h"
+#include "flush.h"
+
+#include "fsync.h"
+
+extern Destination *destination;
+
+int fsyncFile(FilesystemFile* file, PendingFlush** flush)
+{
+	// also waits for a background flush of the file, if there's one running
+	pthread_mutex_lock(&file->mutex);
+	int result = flushFileStart(file, flush);
+	pthread_mutex_unlock(&file->mutex);
+	if (result != 0) {
+		return -EIO;
+	}
+	if (*flush != NULL) {
+		return 0;
+	}
+
+	// the blocks and the action have been put, possibly by an earlier flush
+	if (destination->sync != NULL && destination->sync() != 0) {
+		logPrintf(LOG_ERROR, "fsyncFile: destination->sync failed\n");
+		return -EIO;
+	}
+	return 0;
+}
+
+static int bucse_fsync(const char *path, int datasync, struct fuse_file_info *fi,
+		PendingFlush** flush)
+{
+	(void) datasync;
+	(void) fi;
+
+	logPrintf(LOG_DEBUG, "fsync %s\n", path);
+
+	if (path == NULL) {
+		return -EIO;
+	}
+
+	if (strcmp(path, "/") == 0) {
+		return -EACCES;
+	} else if (path[0] == '/') {
+		const char *fileName = NULL;
+		FilesystemDir *containingDir = findContainingDir(path+1, &fileName);
+
+		if (containingDir == NULL) {
+			logPrintf(LOG_ERROR, "bucse_fsync: path not found when syncing file %s\n", path);
+			return -ENOENT;
+		}
+
+		FilesystemFile *file = findFile(containingDir, fileName);
+		if (file == NULL) {
+			FilesystemDir* dir = findDir(containingDir, fileName);
+			if (dir) {
+				return -EACCES;
+			} else {
+				return -ENOENT;
+			}
+		}
+		return fsyncFile(file, flush);
+	}
+
+	return -ENOENT;
+}
+
+int bucse_fsync_guarded(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	for (;;) {
+		PendingFlush* flush = NULL;
+		pthread_rwlock_rdlock(&bucseTreeLock);
+		int result = bucse_fsync(path, datasync, fi, &flush);
+		pthread_rwlock_unlock(&bucseTreeLock);
+		if (flush == NULL) {
+			return result;
+		}
+		// the blocks are stored without the locks, then it's tried again
+		if (flushFileFinish(flush) != 0) {
+			return -EIO;
+		}
+	}
+}
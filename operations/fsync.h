@@ -0,0 +1,5 @@
+// flushes the file and makes the destination keep what was stored, the
+// caller needs to hold bucseTreeLock. As with releaseFile(), a started flush
+// is finished by the caller, which then calls this again.
+int fsyncFile(FilesystemFile* file, struct _PendingFlush** flush);
+int bucse_fsync_guarded(const char *path, int datasync, struct fuse_file_info *fi);
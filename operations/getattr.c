@@ -7,13 +7,14 @@
 #include <pthread.h>
 
 #include "../dynarray.h"
+#include "../nameindex.h"
+#include "../dirtymap.h"
 #include "../filesystem.h"
 #include "../actions.h"
 #include "../log.h"
 #include "../conf.h"
 
 #include "operations.h"
-#include "flush.h"
 #include "getattr.h"
 
 extern uid_t cachedUid;
@@ -27,6 +28,60 @@ static struct timespec microsecondsToNanoseconds(int64_t t)
 	return ts;
 }
 
+int getFileAttr(FilesystemFile* file, struct stat *stbuf)
+{
+	memset(stbuf, 0, sizeof(struct stat));
+
+	pthread_mutex_lock(&file->mutex);
+
+	if (confIsReadOnly()) {
+		//stbuf->st_mode = S_IFREG | 0444;
+		stbuf->st_mode = S_IFREG | 0555;
+	} else {
+		//stbuf->st_mode = S_IFREG | 0644;
+		stbuf->st_mode = S_IFREG | 0755;
+	}
+	stbuf->st_nlink = 1;
+	// the size the file will have once flushed, computed the same way as in
+	// flushFile, so a stat doesn't force a flush
+	size_t size = (file->dirtyFlags & DirtyFlagPendingTrunc)
+		? file->truncSize
+		: file->size;
+	if (size < file->dirtyMap.end) {
+		size = file->dirtyMap.end;
+	}
+	stbuf->st_size = size;
+	stbuf->st_ino = file->ino;
+	stbuf->st_atim = microsecondsToNanoseconds(file->atime);
+	stbuf->st_mtim = microsecondsToNanoseconds(file->mtime);
+	stbuf->st_ctim = microsecondsToNanoseconds(file->mtime);
+
+	stbuf->st_uid = cachedUid;
+	stbuf->st_gid = cachedGid;
+	pthread_mutex_unlock(&file->mutex);
+
+	return 0;
+}
+
+void getDirAttr(FilesystemDir* dir, struct stat *stbuf)
+{
+	memset(stbuf, 0, sizeof(struct stat));
+
+	if (confIsReadOnly()) {
+		stbuf->st_mode = S_IFDIR | 0555;
+	} else {
+		stbuf->st_mode = S_IFDIR | 0755;
+	}
+	stbuf->st_nlink = (dir == root) ? 2 : 1;
+	stbuf->st_ino = dir->ino;
+	stbuf->st_atim = microsecondsToNanoseconds(dir->atime);
+	stbuf->st_mtim = microsecondsToNanoseconds(dir->mtime);
+	stbuf->st_ctim = microsecondsToNanoseconds(dir->mtime);
+
+	stbuf->st_uid = cachedUid;
+	stbuf->st_gid = cachedGid;
+}
+
 static int bucse_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
 {
 	(void) fi;
@@ -35,33 +90,11 @@ static int bucse_getattr(const char *path, struct stat *stbuf, struct fuse_file_
 		return -EIO;
 	}
 
-	memset(stbuf, 0, sizeof(struct stat));
 	if (strcmp(path, "/") == 0) {
-		if (confIsReadOnly()) {
-			stbuf->st_mode = S_IFDIR | 0555;
-		} else {
-			stbuf->st_mode = S_IFDIR | 0755;
-		}
-		stbuf->st_nlink = 2;
-
-		stbuf->st_atim = microsecondsToNanoseconds(root->atime);
-		stbuf->st_mtim = microsecondsToNanoseconds(root->mtime);
-		stbuf->st_ctim = microsecondsToNanoseconds(root->mtime);
-
-		stbuf->st_uid = cachedUid;
-		stbuf->st_gid = cachedGid;
+		getDirAttr(root, stbuf);
 	} else if (path[0] == '/') {
-		DynArray pathArray;
-		memset(&pathArray, 0, sizeof(DynArray));
-		const char *fileName = path_split(path+1, &pathArray);
-		if (fileName == NULL) {
-			logPrintf(LOG_ERROR, "bucse_getattr: path_split() failed\n");
-			return -ENOMEM;
-		}
-		//path_debugPrint(&pathArray);
-
-		FilesystemDir *containingDir = findContainingDir(&pathArray);
-		path_free(&pathArray);
+		const char *fileName = NULL;
+		FilesystemDir *containingDir = findContainingDir(path+1, &fileName);
 
 		if (containingDir == NULL) {
 			return -ENOENT;
@@ -69,47 +102,11 @@ static int bucse_getattr(const char *path, struct stat *stbuf, struct fuse_file_
 
 		FilesystemFile *file = findFile(containingDir, fileName);
 		if (file) {
-			if (file->dirtyFlags & DirtyFlagPendingWrite) {
-				if (flushFile(file) != 0) {
-					return -EIO;
-				}
-			}
-
-			if (confIsReadOnly()) {
-				//stbuf->st_mode = S_IFREG | 0444;
-				stbuf->st_mode = S_IFREG | 0555;
-			} else {
-				//stbuf->st_mode = S_IFREG | 0644;
-				stbuf->st_mode = S_IFREG | 0755;
-			}
-			stbuf->st_nlink = 1;
-			stbuf->st_size = (file->dirtyFlags & DirtyFlagPendingTrunc)
-				? file->truncSize
-				: file->size;
-			//stbuf->st_ino = MurmurHash64(path, strlen(path), 0);
-			stbuf->st_atim = microsecondsToNanoseconds(file->atime);
-			stbuf->st_mtim = microsecondsToNanoseconds(file->mtime);
-			stbuf->st_ctim = microsecondsToNanoseconds(file->mtime);
-
-			stbuf->st_uid = cachedUid;
-			stbuf->st_gid = cachedGid;
-
+			return getFileAttr(file, stbuf);
 		} else {
 			FilesystemDir* dir = findDir(containingDir, fileName);
 			if (dir) {
-				if (confIsReadOnly()) {
-					stbuf->st_mode = S_IFDIR | 0555;
-				} else {
-					stbuf->st_mode = S_IFDIR | 0755;
-				}
-				stbuf->st_nlink = 1;
-				//stbuf->st_ino = MurmurHash64(path, strlen(path), 0);
-				stbuf->st_atim = microsecondsToNanoseconds(dir->atime);
-				stbuf->st_mtim = microsecondsToNanoseconds(dir->mtime);
-				stbuf->st_ctim = microsecondsToNanoseconds(dir->mtime);
-
-				stbuf->st_uid = cachedUid;
-				stbuf->st_gid = cachedGid;
+				getDirAttr(dir, stbuf);
 			} else {
 				return -ENOENT;
 			}
@@ -123,9 +120,9 @@ static int bucse_getattr(const char *path, struct stat *stbuf, struct fuse_file_
 
 int bucse_getattr_guarded(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
 {
-	pthread_mutex_lock(&bucseMutex);
+	pthread_rwlock_rdlock(&bucseTreeLock);
 	int result = bucse_getattr(path, stbuf, fi);
-	pthread_mutex_unlock(&bucseMutex);
+	pthread_rwlock_unlock(&bucseTreeLock);
 	return result;
 }
 
@@ -1,2 +1,7 @@
-int bucse_getattr_guarded(const char *path, struct stat *stbuf, struct fuse_file_info *fi);
+// fills stbuf for a file, counting its pending writes in the size. The caller
+// needs to hold bucseTreeLock, file->mutex is taken here.
+int getFileAttr(FilesystemFile* file, struct stat *stbuf);
+// fills stbuf for a dir, the caller needs to hold bucseTreeLock
+void getDirAttr(FilesystemDir* dir, struct stat *stbuf);
 
+int bucse_getattr_guarded(const char *path, struct stat *stbuf, struct fuse_file_info *fi);
@@ -2,24 +2,46 @@
 #include <pthread.h>
 
 #include "../actions.h"
+#include "../log.h"
+#include "../conf.h"
 
 #include "operations.h"
 
 #include "init.h"
 
+void initConnection(struct fuse_conn_info *conn)
+{
+	// the kernel batches small writes and owns size and mtime while the file
+	// is open; opt-in, since writes reach the repository only on flush
+	if (conf.writebackCache) {
+		if (conn->capable & FUSE_CAP_WRITEBACK_CACHE) {
+			conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+		} else {
+			logPrintf(LOG_ERROR, "initConnection: kernel doesn't support writeback cache\n");
+		}
+	}
+}
+
 static void* bucse_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
 {
-	//cfg->use_ino = 1;
+	cfg->use_ino = 1;
 	cfg->hard_remove = 1;
 
+	// remote changes are pushed to the kernel, see notify.h
+	cfg->attr_timeout = conf.attrTimeout;
+	cfg->entry_timeout = conf.entryTimeout;
+	cfg->negative_timeout = conf.negativeTimeout;
+
+	initConnection(conn);
+
 	return NULL;
 }
 
 void* bucse_init_guarded(struct fuse_conn_info *conn, struct fuse_config *cfg)
 {
-	pthread_mutex_lock(&bucseMutex);
+	pthread_rwlock_wrlock(&bucseTreeLock);
 	void* result = bucse_init(conn, cfg);
-	pthread_mutex_unlock(&bucseMutex);
+	pthread_rwlock_unlock(&bucseTreeLock);
 	return result;
 }
 
@@ -1,2 +1,4 @@
+// negotiates the connection capabilities, shared with the low-level frontend
+void initConnection(struct fuse_conn_info *conn);
 void* bucse_init_guarded(struct fuse_conn_info *conn, struct fuse_config *cfg);
 
@@ -0,0 +1,794 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <fuse_lowlevel.h>
+#include <fuse.h>
+#include <pthread.h>
+
+#include "../dynarray.h"
+#include "../nameindex.h"
+#include "../dirtymap.h"
+#include "../filesystem.h"
+#include "../inodetable.h"
+#include "../actions.h"
+#include "../time.h"
+#include "../log.h"
+#include "../readahead.h"
+#include "../conf.h"
+
+#include "operations.h"
+#include "init.h"
+#include "getattr.h"
+#include "open.h"
+#include "create.h"
+#include "release.h"
+#include "read.h"
+#include "write.h"
+#include "truncate.h"
+#include "flush.h"
+#include "fsync.h"
+#include "mkdir.h"
+#include "rmdir.h"
+#include "unlink.h"
+#include "rename.h"
+
+#include "lowlevel.h"
+
+// resolves an inode, the caller needs to hold bucseTreeLock
+static void* getInodeObject(fuse_ino_t ino, int* isDir)
+{
+	if (ino == FUSE_ROOT_ID) {
+		*isDir = 1;
+		return root;
+	}
+	return inodeTableGet(ino, isDir);
+}
+
+static FilesystemFile* getFile(fuse_ino_t ino, int* result)
+{
+	int isDir = 0;
+	void* object = getInodeObject(ino, &isDir);
+	if (object == NULL) {
+		*result = -ENOENT;
+		return NULL;
+	}
+	if (isDir) {
+		*result = -EISDIR;
+		return NULL;
+	}
+	return object;
+}
+
+static FilesystemDir* getDir(fuse_ino_t ino, int* result)
+{
+	int isDir = 0;
+	void* object = getInodeObject(ino, &isDir);
+	if (object == NULL) {
+		*result = -ENOENT;
+		return NULL;
+	}
+	if (!isDir) {
+		*result = -ENOTDIR;
+		return NULL;
+	}
+	return object;
+}
+
+// builds the path of name in dir, for the path based operations
+static char* getChildPath(FilesystemDir* dir, const char* name)
+{
+	char* dirPath = NULL;
+	size_t dirPathLen = 0;
+	if (dir != root) {
+		dirPath = getFullDirPath(dir);
+		if (dirPath == NULL) {
+			return NULL;
+		}
+		dirPathLen = strlen(dirPath);
+	}
+
+	size_t nameLen = strlen(name);
+	char* path = malloc(dirPathLen + nameLen + 3);
+	if (path == NULL) {
+		logPrintf(LOG_ERROR, "getChildPath: malloc(): %s\n", strerror(errno));
+		if (dirPath) {
+			free(dirPath);
+		}
+		return NULL;
+	}
+
+	size_t index = 0;
+	path[index++] = '/';
+	if (dirPath) {
+		memcpy(path + index, dirPath, dirPathLen);
+		index += dirPathLen;
+		path[index++] = '/';
+		free(dirPath);
+	}
+	memcpy(path + index, name, nameLen + 1);
+	return path;
+}
+
+// fills an entry for a child of dir and increments its lookup count, the
+// caller needs to hold bucseTreeLock
+static int fillEntry(FilesystemDir* dir, const char* name, struct fuse_entry_param *e)
+{
+	memset(e, 0, sizeof(struct fuse_entry_param));
+	e->attr_timeout = conf.attrTimeout;
+	e->entry_timeout = conf.entryTimeout;
+
+	FilesystemFile* file = findFile(dir, name);
+	if (file) {
+		int result = getFileAttr(file, &e->attr);
+		if (result != 0) {
+			return result;
+		}
+		if (inodeTableRef(file->ino, 0, file) != 0) {
+			return -ENOMEM;
+		}
+		e->ino = file->ino;
+		return 0;
+	}
+
+	FilesystemDir* subdir = findDir(dir, name);
+	if (subdir) {
+		getDirAttr(subdir, &e->attr);
+		if (inodeTableRef(subdir->ino, 1, subdir) != 0) {
+			return -ENOMEM;
+		}
+		e->ino = subdir->ino;
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+void bucse_ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+	(void) userdata;
+
+	initConnection(conn);
+}
+
+void bucse_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct fuse_entry_param e;
+	int result = 0;
+
+	pthread_rwlock_rdlock(&bucseTreeLock);
+	FilesystemDir* dir = getDir(parent, &result);
+	if (dir) {
+		result = fillEntry(dir, name, &e);
+	}
+	pthread_rwlock_unlock(&bucseTreeLock);
+
+	if (result == -ENOENT && dir && conf.negativeTimeout > 0) {
+		// an entry with inode 0 lets the kernel cache that the name doesn't exist
+		memset(&e, 0, sizeof(struct fuse_entry_param));
+		e.entry_timeout = conf.negativeTimeout;
+		fuse_reply_entry(req, &e);
+		return;
+	}
+	if (result != 0) {
+		fuse_reply_err(req, -result);
+		return;
+	}
+	fuse_reply_entry(req, &e);
+}
+
+void bucse_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+	inodeTableForget(ino, nlookup);
+	fuse_reply_none(req);
+}
+
+void bucse_ll_forget_multi(fuse_req_t req, size_t count,
+		struct fuse_forget_data *forgets)
+{
+	for (size_t i=0; i<count; i++) {
+		inodeTableForget(forgets[i].ino, forgets[i].nlookup);
+	}
+	fuse_reply_none(req);
+}
+
+void bucse_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void) fi;
+
+	struct stat stbuf;
+	int result = 0;
+	int isDir = 0;
+
+	pthread_rwlock_rdlock(&bucseTreeLock);
+	void* object = getInodeObject(ino, &isDir);
+	if (object == NULL) {
+		result = -ENOENT;
+	} else if (isDir) {
+		getDirAttr(object, &stbuf);
+	} else {
+		result = getFileAttr(object, &stbuf);
+	}
+	pthread_rwlock_unlock(&bucseTreeLock);
+
+	if (result != 0) {
+		fuse_reply_err(req, -result);
+		return;
+	}
+	fuse_reply_attr(req, &stbuf, conf.attrTimeout);
+}
+
+void bucse_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+		int to_set, struct fuse_file_info *fi)
+{
+	(void) fi;
+
+	// only the size can be changed, other attributes are not stored; the
+	// high-level frontend has no chmod, chown nor utimens either
+	if (to_set & ~FUSE_SET_ATTR_SIZE) {
+		fuse_reply_err(req, ENOSYS);
+		return;
+	}
+	if ((to_set & FUSE_SET_ATTR_SIZE) && confIsReadOnly()) {
+		logPrintf(LOG_ERROR, "bucse_ll_setattr: cannot do that in readOnly mode\n");
+		fuse_reply_err(req, EROFS);
+		return;
+	}
+
+	struct stat stbuf;
+	int result = 0;
+	PendingFlush* flush = NULL;
+
+	// a truncated file is flushed first, see bucse_truncate_guarded()
+	do {
+		if (flush != NULL && flushFileFinish(flush) != 0) {
+			fuse_reply_err(req, EIO);
+			return;
+		}
+		flush = NULL;
+		result = 0;
+		int isDir = 0;
+
+		pthread_rwlock_rdlock(&bucseTreeLock);
+		void* object = getInodeObject(ino, &isDir);
+		if (object == NULL) {
+			result = -ENOENT;
+		} else if (isDir) {
+			if (to_set & FUSE_SET_ATTR_SIZE) {
+				result = -EISDIR;
+			} else {
+				getDirAttr(object, &stbuf);
+			}
+		} else {
+			FilesystemFile* file = object;
+			if (to_set & FUSE_SET_ATTR_SIZE) {
+				pthread_mutex_lock(&file->mutex);
+				result = truncateFile(file, attr->st_size, &flush);
+				pthread_mutex_unlock(&file->mutex);
+			}
+			if (result == 0 && flush == NULL) {
+				result = getFileAttr(file, &stbuf);
+			}
+		}
+		pthread_rwlock_unlock(&bucseTreeLock);
+	} while (flush != NULL);
+
+	if (result != 0) {
+		fuse_reply_err(req, -result);
+		return;
+	}
+	fuse_reply_attr(req, &stbuf, conf.attrTimeout);
+}
+
+void bucse_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	if (confIsReadOnly() && (fi->flags & (O_WRONLY | O_RDWR))) {
+		logPrintf(LOG_ERROR, "bucse_ll_open: cannot do that in readOnly mode\n");
+		fuse_reply_err(req, EROFS);
+		return;
+	}
+
+	int result = 0;
+
+	pthread_rwlock_rdlock(&bucseTreeLock);
+	FilesystemFile* file = getFile(ino, &result);
+	if (file) {
+		result = openFile(file, fi);
+	}
+	pthread_rwlock_unlock(&bucseTreeLock);
+
+	if (result != 0) {
+		fuse_reply_err(req, -result);
+		return;
+	}
+	fi->fh = (uintptr_t)readAheadNew();
+	fuse_reply_open(req, fi);
+}
+
+void bucse_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+		mode_t mode, struct fuse_file_info *fi)
+{
+	struct fuse_entry_param e;
+	int result = 0;
+
+	pthread_rwlock_wrlock(&bucseTreeLock);
+	FilesystemDir* dir = getDir(parent, &result);
+	if (dir) {
+		char* path = getChildPath(dir, name);
+		if (path == NULL) {
+			result = -ENOMEM;
+		} else {
+			result = bucse_create(path, mode, fi);
+			free(path);
+		}
+		if (result == 0) {
+			result = fillEntry(dir, name, &e);
+		}
+	}
+	pthread_rwlock_unlock(&bucseTreeLock);
+
+	if (result != 0) {
+		fuse_reply_err(req, -result);
+		return;
+	}
+	fi->fh = (uintptr_t)readAheadNew();
+	fuse_reply_create(req, &e, fi);
+}
+
+void bucse_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	int result = 0;
+	PendingFlush* flush = NULL;
+
+	// the blocks are stored without the locks, see bucse_release_guarded()
+	do {
+		if (flush != NULL && flushFileFinish(flush) != 0) {
+			result = -EIO;
+			break;
+		}
+		flush = NULL;
+
+		pthread_rwlock_rdlock(&bucseTreeLock);
+		FilesystemFile* file = getFile(ino, &result);
+		if (file) {
+			result = releaseFile(file, fi, &flush);
+		} else {
+			// the file has been removed in the meantime, nothing to flush
+			result = 0;
+		}
+		pthread_rwlock_unlock(&bucseTreeLock);
+	} while (flush != NULL);
+	readAheadFree((ReadAheadState*)(uintptr_t)fi->fh);
+	fi->fh = 0;
+
+	fuse_reply_err(req, -result);
+}
+
+void bucse_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+		struct fuse_file_info *fi)
+{
+	DynArray blocksToRead;
+	memset(&blocksToRead, 0, sizeof(DynArray));
+	DynArray blocksToPrefetch;
+	memset(&blocksToPrefetch, 0, sizeof(DynArray));
+	int result = 0;
+	PendingFlush* flush = NULL;
+
+	// block names are resolved under the locks, see bucse_read_guarded()
+	do {
+		if (flush != NULL && flushFileFinish(flush) != 0) {
+			fuse_reply_err(req, EIO);
+			return;
+		}
+		flush = NULL;
+
+		pthread_rwlock_rdlock(&bucseTreeLock);
+		FilesystemFile* file = getFile(ino, &result);
+		if (file) {
+			pthread_mutex_lock(&file->mutex);
+			result = prepareRead(file, size, off, &blocksToRead,
+				(ReadAheadState*)(uintptr_t)fi->fh, &blocksToPrefetch, &flush);
+			pthread_mutex_unlock(&file->mutex);
+		}
+		pthread_rwlock_unlock(&bucseTreeLock);
+	} while (flush != NULL);
+	readAheadSubmit(&blocksToPrefetch);
+
+	if (result != 0) {
+		freeBlocksToRead(&blocksToRead);
+		fuse_reply_err(req, -result);
+		return;
+	}
+
+	char* buf = malloc(size);
+	if (buf == NULL) {
+		logPrintf(LOG_ERROR, "bucse_ll_read: malloc(): %s\n", strerror(errno));
+		freeBlocksToRead(&blocksToRead);
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	result = readBlocks(&blocksToRead, buf);
+	freeBlocksToRead(&blocksToRead);
+
+	if (result < 0) {
+		fuse_reply_err(req, -result);
+	} else {
+		fuse_reply_buf(req, buf, result);
+	}
+	free(buf);
+}
+
+void bucse_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+		size_t size, off_t off, struct fuse_file_info *fi)
+{
+	(void) fi;
+
+	if (confIsReadOnly()) {
+		logPrintf(LOG_ERROR, "bucse_ll_write: cannot do that in readOnly mode\n");
+		fuse_reply_err(req, EROFS);
+		return;
+	}
+
+	int result = 0;
+	PendingFlush* flush = NULL;
+
+	pthread_rwlock_rdlock(&bucseTreeLock);
+	FilesystemFile* file = getFile(ino, &result);
+	if (file) {
+		pthread_mutex_lock(&file->mutex);
+		result = writeFile(file, buf, size, off, &flush);
+		pthread_mutex_unlock(&file->mutex);
+	}
+	pthread_rwlock_unlock(&bucseTreeLock);
+
+	// the writer is throttled by storing the blocks, without the locks
+	if (flush != NULL && flushFileFinish(flush) != 0) {
+		result = -EIO;
+	}
+
+	if (result < 0) {
+		fuse_reply_err(req, -result);
+		return;
+	}
+	fuse_reply_write(req, result);
+}
+
+void bucse_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void) fi;
+
+	// the file is written out once released
+	if (conf.lazyClose) {
+		fuse_reply_err(req, 0);
+		return;
+	}
+
+	int result = 0;
+	PendingFlush* flush = NULL;
+
+	// the blocks are stored without the locks, see bucse_flush_guarded()
+	do {
+		if (flush != NULL && flushFileFinish(flush) != 0) {
+			result = -EIO;
+			break;
+		}
+		flush = NULL;
+
+		pthread_rwlock_rdlock(&bucseTreeLock);
+		FilesystemFile* file = getFile(ino, &result);
+		if (file) {
+			pthread_mutex_lock(&file->mutex);
+			result = flushFileIfPendingWrite(file, &flush);
+			pthread_mutex_unlock(&file->mutex);
+		}
+		pthread_rwlock_unlock(&bucseTreeLock);
+	} while (flush != NULL);
+
+	fuse_reply_err(req, -result);
+}
+
+void bucse_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+		struct fuse_file_info *fi)
+{
+	(void) datasync;
+	(void) fi;
+
+	int result = 0;
+	PendingFlush* flush = NULL;
+
+	// the blocks are stored without the locks, see bucse_fsync_guarded()
+	do {
+		if (flush != NULL && flushFileFinish(flush) != 0) {
+			result = -EIO;
+			break;
+		}
+		flush = NULL;
+
+		pthread_rwlock_rdlock(&bucseTreeLock);
+		FilesystemFile* file = getFile(ino, &result);
+		if (file) {
+			result = fsyncFile(file, &flush);
+		}
+		pthread_rwlock_unlock(&bucseTreeLock);
+	} while (flush != NULL);
+
+	fuse_reply_err(req, -result);
+}
+
+// adds a directory entry to buf, returns 0 when it doesn't fit
+static size_t addDirEntry(fuse_req_t req, char* buf, size_t size, size_t used,
+		const char* name, fuse_ino_t ino, mode_t mode, off_t nextOff)
+{
+	struct stat stbuf;
+	memset(&stbuf, 0, sizeof(struct stat));
+	stbuf.st_ino = ino;
+	stbuf.st_mode = mode;
+
+	size_t entrySize = fuse_add_direntry(req, buf + used, size - used, name, &stbuf, nextOff);
+	if (entrySize > size - used) {
+		return 0;
+	}
+	return entrySize;
+}
+
+// The entries of a dir as opendir found them, kept in fi->fh. Readdir uses
+// their indexes as offsets, which stay valid while the dir changes.
+typedef struct {
+	char* name;
+	fuse_ino_t ino;
+	mode_t mode;
+} DirSnapshotEntry;
+
+typedef struct {
+	DirSnapshotEntry* entries;
+	int len;
+} DirSnapshot;
+
+static void freeDirSnapshot(DirSnapshot* snapshot)
+{
+	if (snapshot == NULL) {
+		return;
+	}
+	for (int i=0; i<snapshot->len; i++) {
+		free(snapshot->entries[i].name);
+	}
+	free(snapshot->entries);
+	free(snapshot);
+}
+
+static int addSnapshotEntry(DirSnapshot* snapshot, const char* name,
+		fuse_ino_t ino, mode_t mode)
+{
+	DirSnapshotEntry* entry = &snapshot->entries[snapshot->len];
+	entry->name = strdup(name);
+	if (entry->name == NULL) {
+		logPrintf(LOG_ERROR, "bucse_ll_opendir: strdup(): %s\n", strerror(errno));
+		return 1;
+	}
+	entry->ino = ino;
+	entry->mode = mode;
+	snapshot->len++;
+	return 0;
+}
+
+// ".", "..", then the dirs and then the files, the caller needs to hold
+// bucseTreeLock
+static DirSnapshot* newDirSnapshot(FilesystemDir* dir)
+{
+	DirSnapshot* snapshot = calloc(1, sizeof(DirSnapshot));
+	if (snapshot == NULL) {
+		logPrintf(LOG_ERROR, "bucse_ll_opendir: calloc(): %s\n", strerror(errno));
+		return NULL;
+	}
+	snapshot->entries = malloc((2 + dir->dirs.len + dir->files.len) * sizeof(DirSnapshotEntry));
+	if (snapshot->entries == NULL) {
+		logPrintf(LOG_ERROR, "bucse_ll_opendir: malloc(): %s\n", strerror(errno));
+		free(snapshot);
+		return NULL;
+	}
+
+	FilesystemDir* parentDir = dir->parentDir ? dir->parentDir : dir;
+	int result = addSnapshotEntry(snapshot, ".", dir->ino, S_IFDIR);
+	if (result == 0) {
+		result = addSnapshotEntry(snapshot, "..", parentDir->ino, S_IFDIR);
+	}
+	for (int i=0; i<dir->dirs.len && result == 0; i++) {
+		FilesystemDir* d = dir->dirs.objects[i];
+		result = addSnapshotEntry(snapshot, d->name, d->ino, S_IFDIR);
+	}
+	for (int i=0; i<dir->files.len && result == 0; i++) {
+		FilesystemFile* f = dir->files.objects[i];
+		result = addSnapshotEntry(snapshot, f->name, f->ino, S_IFREG);
+	}
+	if (result != 0) {
+		freeDirSnapshot(snapshot);
+		return NULL;
+	}
+	return snapshot;
+}
+
+void bucse_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	int result = 0;
+	DirSnapshot* snapshot = NULL;
+
+	pthread_rwlock_rdlock(&bucseTreeLock);
+	FilesystemDir* dir = getDir(ino, &result);
+	if (dir) {
+		snapshot = newDirSnapshot(dir);
+		if (snapshot == NULL) {
+			result = -ENOMEM;
+		} else {
+			dir->atime = getCurrentTime();
+		}
+	}
+	pthread_rwlock_unlock(&bucseTreeLock);
+
+	if (result != 0) {
+		fuse_reply_err(req, -result);
+		return;
+	}
+	fi->fh = (uintptr_t)snapshot;
+	if (fuse_reply_open(req, fi) != 0) {
+		// the open was interrupted, releasedir won't come
+		freeDirSnapshot(snapshot);
+	}
+}
+
+void bucse_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+		struct fuse_file_info *fi)
+{
+	(void) ino;
+
+	DirSnapshot* snapshot = (DirSnapshot*)(uintptr_t)fi->fh;
+
+	char* buf = malloc(size);
+	if (buf == NULL) {
+		logPrintf(LOG_ERROR, "bucse_ll_readdir: malloc(): %s\n", strerror(errno));
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	// the offset of entry i is i+1, so that the next call continues after
+	// it; no locks are needed, the snapshot belongs to the open dir
+	size_t used = 0;
+	for (off_t i=off; i<snapshot->len; i++) {
+		DirSnapshotEntry* entry = &snapshot->entries[i];
+		size_t entrySize = addDirEntry(req, buf, size, used,
+			entry->name, entry->ino, entry->mode, i+1);
+		if (entrySize == 0) {
+			break;
+		}
+		used += entrySize;
+	}
+
+	fuse_reply_buf(req, buf, used);
+	free(buf);
+}
+
+void bucse_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void) ino;
+
+	freeDirSnapshot((DirSnapshot*)(uintptr_t)fi->fh);
+	fi->fh = 0;
+	fuse_reply_err(req, 0);
+}
+
+void bucse_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+	struct fuse_entry_param e;
+	int result = 0;
+
+	pthread_rwlock_wrlock(&bucseTreeLock);
+	FilesystemDir* dir = getDir(parent, &result);
+	if (dir) {
+		char* path = getChildPath(dir, name);
+		if (path == NULL) {
+			result = -ENOMEM;
+		} else {
+			result = bucse_mkdir(path, mode);
+			free(path);
+		}
+		if (result == 0) {
+			result = fillEntry(dir, name, &e);
+		}
+	}
+	pthread_rwlock_unlock(&bucseTreeLock);
+
+	if (result != 0) {
+		fuse_reply_err(req, -result);
+		return;
+	}
+	fuse_reply_entry(req, &e);
+}
+
+void bucse_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	int result = 0;
+	PendingFlush* flush = NULL;
+
+	// the blocks are stored without the lock, see bucse_unlink_guarded()
+	do {
+		if (flush != NULL && flushFileFinish(flush) != 0) {
+			result = -EIO;
+			break;
+		}
+		flush = NULL;
+
+		pthread_rwlock_wrlock(&bucseTreeLock);
+		FilesystemDir* dir = getDir(parent, &result);
+		if (dir) {
+			char* path = getChildPath(dir, name);
+			if (path == NULL) {
+				result = -ENOMEM;
+			} else {
+				result = bucse_unlink(path, &flush);
+				free(path);
+			}
+		}
+		pthread_rwlock_unlock(&bucseTreeLock);
+	} while (flush != NULL);
+
+	fuse_reply_err(req, -result);
+}
+
+void bucse_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	int result = 0;
+
+	pthread_rwlock_wrlock(&bucseTreeLock);
+	FilesystemDir* dir = getDir(parent, &result);
+	if (dir) {
+		char* path = getChildPath(dir, name);
+		if (path == NULL) {
+			result = -ENOMEM;
+		} else {
+			result = bucse_rmdir(path);
+			free(path);
+		}
+	}
+	pthread_rwlock_unlock(&bucseTreeLock);
+
+	fuse_reply_err(req, -result);
+}
+
+void bucse_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+		fuse_ino_t newparent, const char *newname, unsigned int flags)
+{
+	int result = 0;
+	PendingFlush* flush = NULL;
+
+	// the blocks are stored without the lock, see bucse_rename_guarded()
+	do {
+		if (flush != NULL && flushFileFinish(flush) != 0) {
+			result = -EIO;
+			break;
+		}
+		flush = NULL;
+
+		pthread_rwlock_wrlock(&bucseTreeLock);
+		FilesystemDir* srcDir = getDir(parent, &result);
+		FilesystemDir* dstDir = srcDir ? getDir(newparent, &result) : NULL;
+		if (srcDir && dstDir) {
+			char* srcPath = getChildPath(srcDir, name);
+			char* dstPath = getChildPath(dstDir, newname);
+			if (srcPath == NULL || dstPath == NULL) {
+				result = -ENOMEM;
+			} else {
+				result = bucse_rename(srcPath, dstPath, flags, &flush);
+			}
+			if (srcPath) {
+				free(srcPath);
+			}
+			if (dstPath) {
+				free(dstPath);
+			}
+		}
+		pthread_rwlock_unlock(&bucseTreeLock);
+	} while (flush != NULL);
+
+	fuse_reply_err(req, -result);
+}
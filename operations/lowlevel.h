@@ -0,0 +1,33 @@
+// Low-level frontend: operations keyed by inode numbers instead of paths, see
+// inodetable.h. Structural operations build a path and call the path based
+// implementations, everything else works on the objects directly.
+void bucse_ll_init(void *userdata, struct fuse_conn_info *conn);
+void bucse_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name);
+void bucse_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup);
+void bucse_ll_forget_multi(fuse_req_t req, size_t count,
+		struct fuse_forget_data *forgets);
+void bucse_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+void bucse_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+		int to_set, struct fuse_file_info *fi);
+void bucse_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+void bucse_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+		mode_t mode, struct fuse_file_info *fi);
+void bucse_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+void bucse_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+		struct fuse_file_info *fi);
+void bucse_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+		size_t size, off_t off, struct fuse_file_info *fi);
+void bucse_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+void bucse_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+		struct fuse_file_info *fi);
+// opendir snapshots the entries of the dir, readdir lists them and
+// releasedir frees them
+void bucse_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+void bucse_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+		struct fuse_file_info *fi);
+void bucse_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+void bucse_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode);
+void bucse_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name);
+void bucse_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name);
+void bucse_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+		fuse_ino_t newparent, const char *newname, unsigned int flags);
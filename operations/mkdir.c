@@ -6,6 +6,8 @@
 #include <pthread.h>
 
 #include "../dynarray.h"
+#include "../nameindex.h"
+#include "../dirtymap.h"
 #include "../filesystem.h"
 #include "../actions.h"
 #include "../time.h"
@@ -37,17 +39,7 @@ int bucse_mkdir(const char *path, mode_t mode)
 	if (strcmp(path, "/") == 0) {
 		return -EACCES;
 	} else if (path[0] == '/') {
-		DynArray pathArray;
-		memset(&pathArray, 0, sizeof(DynArray));
-		dirName = path_split(path+1, &pathArray);
-		if (dirName == NULL) {
-			logPrintf(LOG_ERROR, "bucse_mkdir: path_split() failed\n");
-			return -ENOMEM;
-		}
-		//path_debugPrint(&pathArray);
-
-		containingDir = findContainingDir(&pathArray);
-		path_free(&pathArray);
+		containingDir = findContainingDir(path+1, &dirName);
 
 		if (containingDir == NULL) {
 			logPrintf(LOG_ERROR, "bucse_mkdir: path not found when adding directory %s\n", path);
@@ -85,31 +77,28 @@ int bucse_mkdir(const char *path, mode_t mode)
 	newAction->contentLen = 0;
 	newAction->size = 0;
 	newAction->blockSize = 0;
+	newAction->tierBlocks = 0;
+	newAction->chunkEnds = NULL;
 
-	FilesystemDir* newDir = malloc(sizeof(FilesystemDir));
+	FilesystemDir* newDir = newFilesystemDir(NULL, containingDir);
 	if (newDir == NULL) {
-		logPrintf(LOG_ERROR, "bucse_mkdir: malloc(): %s\n", strerror(errno));
+		logPrintf(LOG_ERROR, "bucse_mkdir: newFilesystemDir() failed\n");
 		free(newAction->path);
 		free(newAction);
 		return -ENOMEM;
 	}
-	memset(newDir, 0, sizeof(FilesystemDir));
 
-	// funny way to find the const char* filename that's owned by the action
-	DynArray pathArray;
-	memset(&pathArray, 0, sizeof(DynArray));
-	newDir->name = path_split(newAction->path, &pathArray);
-	path_free(&pathArray);
+	// the const char* filename that's owned by the action
+	newDir->name = path_getFilename(newAction->path);
 
 	newDir->atime = newDir->mtime = newAction->time;
-	newDir->parentDir = containingDir;
 
 	// write to json, encrypt call destination->addActionFile()
 	if (encryptAndAddActionFile(newAction) != 0) {
 		logPrintf(LOG_ERROR, "bucse_mkdir: encryptAndAddActionFile failed\n");
 		free(newAction->path);
 		free(newAction);
-		free(newDir);
+		freeFilesystemDir(newDir);
 		return -EIO;
 	}
 
@@ -117,16 +106,20 @@ int bucse_mkdir(const char *path, mode_t mode)
 	addAction(newAction);
 
 	// update filesystem
-	addToDynArray(&containingDir->dirs, newDir);
+	if (addDirToDir(containingDir, newDir) != 0) {
+		logPrintf(LOG_ERROR, "bucse_mkdir: addDirToDir() failed\n");
+		freeFilesystemDir(newDir);
+		return -EIO;
+	}
 
 	return 0;
 }
 
 int bucse_mkdir_guarded(const char *path, mode_t mode)
 {
-	pthread_mutex_lock(&bucseMutex);
+	pthread_rwlock_wrlock(&bucseTreeLock);
 	int result = bucse_mkdir(path, mode);
-	pthread_mutex_unlock(&bucseMutex);
+	pthread_rwlock_unlock(&bucseTreeLock);
 	return result;
 }
 
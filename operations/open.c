@@ -2,21 +2,48 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
 #include <fuse.h>
 #include <pthread.h>
 
 #include "../dynarray.h"
+#include "../nameindex.h"
+#include "../dirtymap.h"
 #include "../filesystem.h"
 #include "../actions.h"
 #include "../time.h"
 #include "../log.h"
+#include "../readahead.h"
 #include "../conf.h"
 
 #include "operations.h"
 
 #include "open.h"
 
-static int bucse_open(const char *path, struct fuse_file_info *fi)
+int openFile(FilesystemFile* file, struct fuse_file_info *fi)
+{
+	if ((fi->flags & O_CREAT) && (fi->flags & O_EXCL)) {
+		return -EEXIST;
+	}
+
+	pthread_mutex_lock(&file->mutex);
+	if (fi->flags & O_TRUNC) {
+		file->truncSize = 0;
+		file->dirtyFlags |= DirtyFlagPendingTrunc;
+	}
+
+	// Content block lists are never freed or reused while mounted, so the
+	// same content pointer means that the pages the kernel cached since
+	// the last open are still valid. Remote edits replace the pointer.
+	fi->keep_cache = (file->content != NULL && file->content == file->cachedContent
+		&& !(fi->flags & O_TRUNC));
+	file->cachedContent = file->content;
+	pthread_mutex_unlock(&file->mutex);
+
+	return 0;
+}
+
+int bucse_open(const char *path, struct fuse_file_info *fi)
 {
 	logPrintf(LOG_DEBUG, "open %s, access mode %d\n", path, fi->flags);
 
@@ -32,17 +59,8 @@ static int bucse_open(const char *path, struct fuse_file_info *fi)
 	if (strcmp(path, "/") == 0) {
 		return -EACCES;
 	} else if (path[0] == '/') {
-		DynArray pathArray;
-		memset(&pathArray, 0, sizeof(DynArray));
-		const char *fileName = path_split(path+1, &pathArray);
-		if (fileName == NULL) {
-			logPrintf(LOG_ERROR, "bucse_open: path_split() failed\n");
-			return -ENOMEM;
-		}
-		//path_debugPrint(&pathArray);
-
-		FilesystemDir *containingDir = findContainingDir(&pathArray);
-		path_free(&pathArray);
+		const char *fileName = NULL;
+		FilesystemDir *containingDir = findContainingDir(path+1, &fileName);
 
 		if (containingDir == NULL) {
 			logPrintf(LOG_ERROR, "bucse_open: path not found when opening file %s\n", path);
@@ -51,46 +69,35 @@ static int bucse_open(const char *path, struct fuse_file_info *fi)
 
 		FilesystemFile *file = findFile(containingDir, fileName);
 		if (file) {
-			if ((fi->flags & O_CREAT) && (fi->flags & O_EXCL)) {
-				return -EEXIST;
-			}
-
-			if (fi->flags & O_TRUNC) {
-				file->truncSize = 0;
-				file->dirtyFlags |= DirtyFlagPendingTrunc;
-			}
-
-			return 0;
+			return openFile(file, fi);
 		} else {
 			FilesystemDir* dir = findDir(containingDir, fileName);
 			if (dir) {
 				return -EACCES;
 			} else {
 				if (fi->flags & O_CREAT) {
-					FilesystemFile* newFile = malloc(sizeof(FilesystemFile));
-					if (newFile == NULL) {
-						logPrintf(LOG_ERROR, "bucse_open: malloc(): %s\n", strerror(errno));
+					// strdup here, the name is owned by the file until it is freed,
+					// so that concurrent lookups never see it change
+					char* newFileName = strdup(fileName);
+					if (newFileName == NULL) {
+						logPrintf(LOG_ERROR, "bucse_open: strdup(): %s\n", strerror(errno));
 						return -ENOMEM;
 					}
-
-					// strdup here, will set DirtyFlagPendingCreate
-					// and clean up when flushing the file in flush.c
-					newFile->name = strdup(fileName);
-					if (newFile->name == NULL) {
-						logPrintf(LOG_ERROR, "bucse_open: strdup(): %s\n", strerror(errno));
-						free(newFile);
+					FilesystemFile* newFile = newFilesystemFile(newFileName, containingDir);
+					if (newFile == NULL) {
+						logPrintf(LOG_ERROR, "bucse_open: newFilesystemFile() failed\n");
+						free(newFileName);
 						return -ENOMEM;
 					}
+					newFile->ownedName = newFileName;
 					newFile->atime = newFile->mtime = getCurrentTime();
-					newFile->content = NULL;
-					newFile->contentLen = 0;
-					newFile->size = 0;
-					newFile->blockSize = 0;
 					newFile->dirtyFlags = DirtyFlagPendingCreate;
-					memset(&newFile->pendingWrites, 0, sizeof(DynArray));
-					newFile->parentDir = containingDir;
 
-					addToDynArray(&containingDir->files, newFile);
+					if (addFileToDir(containingDir, newFile) != 0) {
+						logPrintf(LOG_ERROR, "bucse_open: addFileToDir() failed\n");
+						freeFilesystemFile(newFile);
+						return -ENOMEM;
+					}
 					return 0;
 				}
 				return -ENOENT;
@@ -103,9 +110,17 @@ static int bucse_open(const char *path, struct fuse_file_info *fi)
 
 int bucse_open_guarded(const char *path, struct fuse_file_info *fi)
 {
-	pthread_mutex_lock(&bucseMutex);
+	// creating a file changes the tree structure
+	if (fi->flags & O_CREAT) {
+		pthread_rwlock_wrlock(&bucseTreeLock);
+	} else {
+		pthread_rwlock_rdlock(&bucseTreeLock);
+	}
 	int result = bucse_open(path, fi);
-	pthread_mutex_unlock(&bucseMutex);
+	pthread_rwlock_unlock(&bucseTreeLock);
+	if (result == 0) {
+		fi->fh = (uintptr_t)readAheadNew();
+	}
 	return result;
 }
 
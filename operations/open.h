@@ -1,2 +1,4 @@
+// opens an existing file, the caller needs to hold bucseTreeLock
+int openFile(FilesystemFile* file, struct fuse_file_info *fi);
+int bucse_open(const char *path, struct fuse_file_info *fi);
 int bucse_open_guarded(const char *path, struct fuse_file_info *fi);
-
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,20 +8,63 @@
 #include <stdint.h>
 #include <sys/time.h>
 
+#include "../dynarray.h"
 #include "../actions.h"
 #include "../destinations/dest.h"
 #include "../encryption/encr.h"
 #include "../log.h"
 #include "../conf.h"
 #include "../cache.h"
+#include "../diskcache.h"
 
 #include "operations.h"
 
-pthread_mutex_t bucseMutex;
+pthread_rwlock_t bucseTreeLock;
 
 extern Destination *destination;
 extern Encryption *encryption;
 
+// Blocks that are being fetched and decrypted right now. Concurrent requests
+// for the same block wait for the first one to finish and then read the
+// result from the cache instead of fetching the block again.
+typedef struct {
+	char block[MAX_STORAGE_NAME_LEN];
+	pthread_cond_t done;
+	int finished;
+	int waiters;
+} InFlightBlock;
+
+static DynArray inFlightBlocks;
+static pthread_mutex_t inFlightBlocksMutex = PTHREAD_MUTEX_INITIALIZER;
+
+int operationsInit()
+{
+	pthread_rwlockattr_t attr;
+	if (pthread_rwlockattr_init(&attr) != 0) {
+		logPrintf(LOG_ERROR, "operationsInit: pthread_rwlockattr_init failed\n");
+		return 1;
+	}
+
+	// prefer writers, so the tick thread replaying actions is not starved
+	// by a constant stream of readers. This means that the tree lock must
+	// never be taken recursively.
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+
+	int res = pthread_rwlock_init(&bucseTreeLock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+	if (res != 0) {
+		logPrintf(LOG_ERROR, "operationsInit: pthread_rwlock_init: %d\n", res);
+		return 2;
+	}
+	return 0;
+}
+
+void operationsCleanup()
+{
+	pthread_rwlock_destroy(&bucseTreeLock);
+	freeDynArray(&inFlightBlocks);
+}
+
 int encryptAndAddActionFile(Action* newAction)
 {
 	char* jsonData = serializeAction(newAction);
@@ -59,43 +104,295 @@ int encryptAndAddActionFile(Action* newAction)
 	return result;
 }
 
-int decryptBlock(const char* block,
-	char* decryptedBlockBuf, size_t* decryptedBlockBufSize,
+static InFlightBlock* findInFlightBlock(const char* block)
+{
+	for (int i=0; i<inFlightBlocks.len; i++) {
+		InFlightBlock* item = inFlightBlocks.objects[i];
+		if (strncmp(item->block, block, MAX_STORAGE_NAME_LEN) == 0) {
+			return item;
+		}
+	}
+	return NULL;
+}
+
+static int checkDecryptedSize(size_t size, int exactly, size_t expectedReadSize)
+{
+	if (exactly) {
+		if (size != expectedReadSize) {
+			logPrintf(LOG_ERROR, "decryptBlock: expected decrypted block size %d, got %d\n",
+					expectedReadSize, size);
+			return 3;
+		}
+	} else {
+		if (size < expectedReadSize) {
+			logPrintf(LOG_ERROR, "decryptBlock: expected decrypted block size at least %d, got %d\n",
+					expectedReadSize, size);
+			return 3;
+		}
+	}
+	return 0;
+}
+
+// a cached block is checked as a fetched one, it may have been cached by a
+// read that expected less of it
+static int getCheckedCachedBlock(const char* block, CacheBuffer** decryptedBlock,
+	int exactly, size_t expectedReadSize, int* result)
+{
+	if (cacheGet(block, decryptedBlock) != 0) {
+		return 0;
+	}
+	*result = checkDecryptedSize((*decryptedBlock)->size, exactly, expectedReadSize);
+	if (*result != 0) {
+		cacheBufferUnref(*decryptedBlock);
+		*decryptedBlock = NULL;
+	}
+	return 1;
+}
+
+static int fetchAndDecryptBlock(const char* block,
+	CacheBuffer** decryptedBlock, size_t maxDecryptedBlockSize,
 	char* encryptedBlockBuf, size_t* encryptedBlockBufSize,
 	int exactly,
 	size_t expectedReadSize)
 {
-	if (cacheGet(block, decryptedBlockBuf, decryptedBlockBufSize) != 0) {
+	// the disk cache sits in front of the destination
+	size_t maxEncryptedBlockSize = *encryptedBlockBufSize;
+	int fromDiskCache = (diskCacheGet(block, encryptedBlockBuf, encryptedBlockBufSize) == 0);
+	if (!fromDiskCache) {
 		int res = destination->getStorageFile(block, encryptedBlockBuf, encryptedBlockBufSize);
 		if (res != 0) {
 			logPrintf(LOG_ERROR, "decryptBlock: getStorageFile failed for %s: %d\n",
 					block, res);
 			return 1;
 		}
+		diskCachePut(block, encryptedBlockBuf, *encryptedBlockBufSize);
+	}
 
-		res = encryption->decrypt(encryptedBlockBuf, *encryptedBlockBufSize,
-				decryptedBlockBuf, decryptedBlockBufSize,
-				conf.passphrase);
-		if (res != 0) {
-			logPrintf(LOG_ERROR, "decryptBlock: decrypt failed: %d\n", res);
-			return 2;
+	// decrypted straight into the buffer that ends up in the cache
+	char* decryptedBlockBuf = malloc(maxDecryptedBlockSize + DECRYPTED_BUFFER_MARGIN);
+	if (decryptedBlockBuf == NULL) {
+		logPrintf(LOG_ERROR, "decryptBlock: malloc(): %s\n", strerror(errno));
+		return 5;
+	}
+	size_t decryptedBlockBufSize = maxDecryptedBlockSize;
+
+	int res = encryption->decrypt(encryptedBlockBuf, *encryptedBlockBufSize,
+			decryptedBlockBuf, &decryptedBlockBufSize,
+			conf.passphrase);
+	if (res != 0) {
+		free(decryptedBlockBuf);
+		if (fromDiskCache) {
+			// the local copy is damaged, drop it and ask the destination
+			logPrintf(LOG_WARNING, "decryptBlock: disk cached %s is corrupted\n", block);
+			diskCacheRemove(block);
+			*encryptedBlockBufSize = maxEncryptedBlockSize;
+			return fetchAndDecryptBlock(block,
+				decryptedBlock, maxDecryptedBlockSize,
+				encryptedBlockBuf, encryptedBlockBufSize,
+				exactly, expectedReadSize);
 		}
+		logPrintf(LOG_ERROR, "decryptBlock: decrypt failed: %d\n", res);
+		return 2;
+	}
 
-		if (exactly) {
-			if (*decryptedBlockBufSize != expectedReadSize) {
-				logPrintf(LOG_ERROR, "decryptBlock: expected decrypted block size %d, got %d\n",
-						expectedReadSize, *decryptedBlockBufSize);
-				return 3;
-			}
-		} else {
-			if (*decryptedBlockBufSize < expectedReadSize) {
-				logPrintf(LOG_ERROR, "decryptBlock: expected decrypted block size at least %d, got %d\n",
-						expectedReadSize, *decryptedBlockBufSize);
-				return 3;
+	if (checkDecryptedSize(decryptedBlockBufSize, exactly, expectedReadSize) != 0) {
+		free(decryptedBlockBuf);
+		return 3;
+	}
+
+	// the last block of a file may be much shorter than the block size
+	if (decryptedBlockBufSize > 0 && decryptedBlockBufSize < maxDecryptedBlockSize) {
+		char* shrunkBuf = realloc(decryptedBlockBuf, decryptedBlockBufSize);
+		if (shrunkBuf != NULL) {
+			decryptedBlockBuf = shrunkBuf;
+		}
+	}
+
+	*decryptedBlock = cacheBufferNew(decryptedBlockBuf, decryptedBlockBufSize);
+	if (*decryptedBlock == NULL) {
+		free(decryptedBlockBuf);
+		return 6;
+	}
+
+	cachePut(block, *decryptedBlock);
+	return 0;
+}
+
+int getDecryptedBlock(const char* block,
+	CacheBuffer** decryptedBlock, size_t maxDecryptedBlockSize,
+	char* encryptedBlockBuf, size_t* encryptedBlockBufSize,
+	int exactly,
+	size_t expectedReadSize)
+{
+	int result = 0;
+	if (getCheckedCachedBlock(block, decryptedBlock, exactly, expectedReadSize, &result)) {
+		return result;
+	}
+
+	pthread_mutex_lock(&inFlightBlocksMutex);
+	InFlightBlock* inFlight = findInFlightBlock(block);
+	if (inFlight) {
+		// somebody is already fetching this block, wait for the result
+		inFlight->waiters++;
+		while (!inFlight->finished) {
+			pthread_cond_wait(&inFlight->done, &inFlightBlocksMutex);
+		}
+		inFlight->waiters--;
+		if (inFlight->waiters == 0) {
+			pthread_cond_destroy(&inFlight->done);
+			free(inFlight);
+		}
+		pthread_mutex_unlock(&inFlightBlocksMutex);
+
+		if (getCheckedCachedBlock(block, decryptedBlock, exactly, expectedReadSize, &result)) {
+			return result;
+		}
+
+		// the fetch failed or the block has already been evicted, so
+		// fetch it without coalescing
+		return fetchAndDecryptBlock(block,
+			decryptedBlock, maxDecryptedBlockSize,
+			encryptedBlockBuf, encryptedBlockBufSize,
+			exactly, expectedReadSize);
+	}
+
+	inFlight = malloc(sizeof(InFlightBlock));
+	if (inFlight == NULL) {
+		logPrintf(LOG_ERROR, "decryptBlock: malloc(): %s\n", strerror(errno));
+		pthread_mutex_unlock(&inFlightBlocksMutex);
+		return 4;
+	}
+	snprintf(inFlight->block, MAX_STORAGE_NAME_LEN, "%s", block);
+	pthread_cond_init(&inFlight->done, NULL);
+	inFlight->finished = 0;
+	inFlight->waiters = 0;
+	addToDynArray(&inFlightBlocks, inFlight);
+	pthread_mutex_unlock(&inFlightBlocksMutex);
+
+	result = fetchAndDecryptBlock(block,
+		decryptedBlock, maxDecryptedBlockSize,
+		encryptedBlockBuf, encryptedBlockBufSize,
+		exactly, expectedReadSize);
+
+	pthread_mutex_lock(&inFlightBlocksMutex);
+	removeFromDynArrayUnordered(&inFlightBlocks, inFlight);
+	inFlight->finished = 1;
+	if (inFlight->waiters > 0) {
+		pthread_cond_broadcast(&inFlight->done);
+	} else {
+		pthread_cond_destroy(&inFlight->done);
+		free(inFlight);
+	}
+	pthread_mutex_unlock(&inFlightBlocksMutex);
+
+	return result;
+}
+
+int canGetDecryptedRange()
+{
+	return destination->getStorageFileRange != NULL
+		&& encryption->getRange != NULL && encryption->decryptRange != NULL;
+}
+
+int getDecryptedRange(const char* block, size_t offset, size_t size, char* dest)
+{
+	size_t headerSize = 0;
+	size_t encryptedOffset = 0;
+	size_t encryptedSize = 0;
+	size_t decryptedOffset = 0;
+	encryption->getRange(offset, size, &headerSize,
+		&encryptedOffset, &encryptedSize, &decryptedOffset);
+
+	char* encryptedBuf = malloc(headerSize + encryptedSize);
+	if (encryptedBuf == NULL) {
+		logPrintf(LOG_ERROR, "getDecryptedRange: malloc(): %s\n", strerror(errno));
+		return 1;
+	}
+	char* decryptedBuf = malloc(encryptedSize + DECRYPTED_BUFFER_MARGIN);
+	if (decryptedBuf == NULL) {
+		logPrintf(LOG_ERROR, "getDecryptedRange: malloc(): %s\n", strerror(errno));
+		free(encryptedBuf);
+		return 1;
+	}
+
+	// the header is fetched along with the range when they're adjacent
+	int res = 0;
+	size_t fetchedSize = 0;
+	if (encryptedOffset == headerSize) {
+		fetchedSize = headerSize + encryptedSize;
+		res = destination->getStorageFileRange(block, 0, encryptedBuf, &fetchedSize);
+		if (res == 0 && fetchedSize < headerSize) {
+			res = -1;
+		}
+		if (res == 0) {
+			fetchedSize -= headerSize;
+		}
+	} else {
+		if (headerSize > 0) {
+			fetchedSize = headerSize;
+			res = destination->getStorageFileRange(block, 0, encryptedBuf, &fetchedSize);
+			if (res == 0 && fetchedSize < headerSize) {
+				res = -1;
 			}
 		}
+		if (res == 0) {
+			fetchedSize = encryptedSize;
+			res = destination->getStorageFileRange(block, encryptedOffset,
+				encryptedBuf + headerSize, &fetchedSize);
+		}
+	}
+	if (res != 0) {
+		logPrintf(LOG_ERROR, "getDecryptedRange: getStorageFileRange failed for %s: %d\n",
+				block, res);
+		free(encryptedBuf);
+		free(decryptedBuf);
+		return 2;
+	}
+
+	size_t decryptedSize = encryptedSize;
+	res = encryption->decryptRange(encryptedBuf, encryptedBuf + headerSize, fetchedSize,
+			decryptedOffset, decryptedBuf, &decryptedSize, conf.passphrase);
+	free(encryptedBuf);
+	if (res != 0) {
+		logPrintf(LOG_ERROR, "getDecryptedRange: decryptRange failed for %s: %d\n",
+				block, res);
+		free(decryptedBuf);
+		return 3;
+	}
+
+	if (decryptedOffset + decryptedSize < offset + size) {
+		logPrintf(LOG_ERROR, "getDecryptedRange: block %s is too short\n", block);
+		free(decryptedBuf);
+		return 4;
+	}
+
+	memcpy(dest, decryptedBuf + (offset - decryptedOffset), size);
+	free(decryptedBuf);
+	return 0;
+}
+
+int decryptBlock(const char* block,
+	char* decryptedBlockBuf, size_t* decryptedBlockBufSize,
+	char* encryptedBlockBuf, size_t* encryptedBlockBufSize,
+	int exactly,
+	size_t expectedReadSize)
+{
+	CacheBuffer* decryptedBlock = NULL;
+	int result = getDecryptedBlock(block,
+		&decryptedBlock, *decryptedBlockBufSize,
+		encryptedBlockBuf, encryptedBlockBufSize,
+		exactly, expectedReadSize);
+	if (result != 0) {
+		return result;
+	}
 
-		cachePut(block, decryptedBlockBuf, *decryptedBlockBufSize);
+	if (decryptedBlock->size > *decryptedBlockBufSize) {
+		logPrintf(LOG_ERROR, "decryptBlock: block %s doesn't fit the buffer\n", block);
+		cacheBufferUnref(decryptedBlock);
+		return 7;
 	}
+	memcpy(decryptedBlockBuf, decryptedBlock->data, decryptedBlock->size);
+	*decryptedBlockBufSize = decryptedBlock->size;
+	cacheBufferUnref(decryptedBlock);
 	return 0;
 }
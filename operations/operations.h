@@ -1,8 +1,41 @@
-extern pthread_mutex_t bucseMutex;
+// Locking scheme:
+// - bucseTreeLock protects the structure of the filesystem tree. Operations
+//   that add, remove or move files and directories (and action replay) take
+//   it for writing, all other operations take it for reading.
+// - FilesystemFile.mutex protects the contents of a single file (pending
+//   writes, block list, size). It is taken while holding bucseTreeLock.
+// - No lock is held while a flush stores the blocks of a file, the file is
+//   kept in place by FilesystemFile.flushing meanwhile, see flush.h.
+extern pthread_rwlock_t bucseTreeLock;
+
+int operationsInit();
+void operationsCleanup();
 
 int encryptAndAddActionFile(Action* newAction);
 
-// auxiliary function that decrypts a block and verifies the read size
+struct _CacheBuffer;
+struct _PendingFlush;
+
+// auxiliary function that gets a decrypted block from the cache, or fetches,
+// decrypts and caches it, verifying the read size. The caller gets a
+// reference to the buffer, see cache.h. It doesn't need any locks to be
+// held; concurrent calls for the same block are coalesced into a single fetch.
+int getDecryptedBlock(const char* block,
+	struct _CacheBuffer** decryptedBlock, size_t maxDecryptedBlockSize,
+	char* encryptedBlockBuf, size_t* encryptedBlockBufSize,
+	int exactly,
+	size_t expectedReadSize);
+
+// whether the destination and the encryption allow getDecryptedRange()
+int canGetDecryptedRange();
+
+// auxiliary function that fetches and decrypts only the part of a block from
+// offset to offset+size, to dest. Nothing is cached, it's meant for small
+// reads from large blocks. It doesn't need any locks to be held.
+int getDecryptedRange(const char* block, size_t offset, size_t size, char* dest);
+
+// the same, but copies the block to decryptedBlockBuf, for callers that
+// modify it
 int decryptBlock(const char* block,
 	char* decryptedBlockBuf, size_t* decryptedBlockBufSize,
 	char* encryptedBlockBuf, size_t* encryptedBlockBufSize,
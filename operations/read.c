@@ -2,14 +2,22 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
 #include <fuse.h>
 #include <pthread.h>
 
 #include "../dynarray.h"
+#include "../nameindex.h"
+#include "../dirtymap.h"
 #include "../filesystem.h"
+#include "../blocklayout.h"
 #include "../actions.h"
 #include "../time.h"
 #include "../log.h"
+#include "../cache.h"
+#include "../diskcache.h"
+#include "../readahead.h"
+#include "../workpool.h"
 
 #include "../destinations/dest.h"
 #include "../encryption/encr.h"
@@ -23,11 +31,18 @@ extern Destination *destination;
 extern Encryption *encryption;
 
 typedef struct {
-	const char* block;
+	char block[MAX_STORAGE_NAME_LEN]; // copied, so it can be used without locks
 	off_t offset;
 	size_t len;
+	int blockSize; // how large the block can be, for the buffers
+	int ranged; // only the range is fetched, unless the block is cached
 } BlockOffsetLen;
 
+// Small random reads from large blocks fetch and decrypt only the range they
+// need. Sequential reads fetch whole blocks, they need the rest of them soon.
+#define RANGE_READ_MIN_BLOCK_SIZE (1024 * 1024)
+#define RANGE_READ_MAX_SHARE 16
+
 // use offset and size to determine which blocks contain the data that's needed
 static int determineBlocksToRead(DynArray *blocksToRead, off_t offset, size_t size, FilesystemFile* file)
 {
@@ -38,10 +53,12 @@ static int determineBlocksToRead(DynArray *blocksToRead, off_t offset, size_t si
 		size = file->size - offset;
 	}
 
+	BlockLayout layout = {file->blockSize, file->tierBlocks, file->chunkEnds, file->contentLen};
 	while (size > 0) {
-		int blockIndex = offset / file->blockSize;
-		off_t blockOffset = (offset % file->blockSize);
-		size_t blockLen = file->blockSize - blockOffset;
+		int blockIndex = blockLayoutIndex(&layout, offset);
+		int blockSize = blockLayoutSize(&layout, blockIndex);
+		off_t blockOffset = offset - blockLayoutStart(&layout, blockIndex);
+		size_t blockLen = blockSize - blockOffset;
 		if (blockLen > size) {
 			blockLen = size;
 		}
@@ -50,9 +67,12 @@ static int determineBlocksToRead(DynArray *blocksToRead, off_t offset, size_t si
 			logPrintf(LOG_ERROR, "determineBlocksToRead: malloc(): %s\n", strerror(errno));
 			return 1;
 		}
-		block->block = file->content + MAX_STORAGE_NAME_LEN * blockIndex;
+		memcpy(block->block, file->content + MAX_STORAGE_NAME_LEN * blockIndex,
+			MAX_STORAGE_NAME_LEN);
 		block->offset = blockOffset;
 		block->len = blockLen;
+		block->blockSize = blockSize;
+		block->ranged = 0;
 		addToDynArray(blocksToRead, block);
 
 		offset += blockLen;
@@ -62,11 +82,177 @@ static int determineBlocksToRead(DynArray *blocksToRead, off_t offset, size_t si
 	return 0;
 }
 
-static int bucse_read(const char *path, char *buf, size_t size, off_t offset,
-		struct fuse_file_info *fi)
+void freeBlocksToRead(DynArray *blocksToRead)
+{
+	for (int i=0; i<blocksToRead->len; i++) {
+		free(blocksToRead->objects[i]);
+	}
+	freeDynArray(blocksToRead);
+}
+
+int prepareRead(FilesystemFile* file, size_t size, off_t offset,
+		DynArray *blocksToRead,
+		ReadAheadState* readAhead, DynArray *blocksToPrefetch,
+		PendingFlush** flush)
+{
+	if (flushFileStart(file, flush) != 0) {
+		return -EIO;
+	}
+	if (*flush != NULL) {
+		return 0;
+	}
+
+	if (determineBlocksToRead(blocksToRead, offset, size, file) != 0) {
+		logPrintf(LOG_ERROR, "bucse_read: determineBlocksToRead failed\n");
+		return -ENOMEM;
+	}
+	readAheadPrepare(readAhead, file, offset, size, blocksToPrefetch);
+
+	if (canGetDecryptedRange() && !readAheadIsSequential(readAhead)) {
+		for (int i=0; i<blocksToRead->len; i++) {
+			BlockOffsetLen* block = blocksToRead->objects[i];
+			block->ranged = (block->blockSize >= RANGE_READ_MIN_BLOCK_SIZE
+				&& block->len <= block->blockSize / RANGE_READ_MAX_SHARE);
+		}
+	}
+
+	// the data is fetched after the locks are released, but the access
+	// time is set here, while the file is still known to exist
+	file->atime = getCurrentTime();
+	return 0;
+}
+
+// a block of a read, fetched and decrypted into its place in the output
+typedef struct {
+	BlockOffsetLen* block;
+	char* dest;
+	int result;
+	WorkGroup* group; // shared by the fetches of a read
+} BlockFetch;
+
+static int fetchBlock(BlockOffsetLen* block, char* dest)
+{
+	// a cached block is cheaper than any range
+	if (block->ranged && !cacheContains(block->block) && !diskCacheContains(block->block)) {
+		if (getDecryptedRange(block->block, block->offset, block->len, dest) != 0) {
+			return -EIO;
+		}
+		return 0;
+	}
+
+	// every fetch gets its own buffer, so they can run in parallel
+	size_t encryptedBlockBufSize = getMaxEncryptedBlockSize(block->blockSize);
+	char* encryptedBlockBuf = malloc(encryptedBlockBufSize);
+	if (encryptedBlockBuf == NULL) {
+		logPrintf(LOG_ERROR, "bucse_read: malloc(): %s\n", strerror(errno));
+		return -ENOMEM;
+	}
+
+	CacheBuffer* decryptedBlock = NULL;
+	int result = getDecryptedBlock(block->block,
+		&decryptedBlock, block->blockSize,
+		encryptedBlockBuf, &encryptedBlockBufSize,
+		0, block->offset + block->len);
+	free(encryptedBlockBuf);
+	if (result != 0) {
+		return -EIO;
+	}
+	if (decryptedBlock->size < block->offset + block->len) {
+		logPrintf(LOG_ERROR, "bucse_read: block %s is too short\n", block->block);
+		cacheBufferUnref(decryptedBlock);
+		return -EIO;
+	}
+
+	// only the requested range is copied, straight from the shared buffer
+	memcpy(dest, decryptedBlock->data + block->offset, block->len);
+	cacheBufferUnref(decryptedBlock);
+	return 0;
+}
+
+static void finishBlockFetch(BlockFetch* fetch, int result)
 {
-	(void) fi;
+	fetch->result = result;
+	workGroupDone(fetch->group);
+}
+
+static void runBlockFetch(BlockFetch* fetch)
+{
+	finishBlockFetch(fetch, fetchBlock(fetch->block, fetch->dest));
+}
+
+static void blockFetchWork(void* arg, int cancelled)
+{
+	BlockFetch* fetch = arg;
+	if (cancelled) {
+		// the reader is still waiting for it
+		finishBlockFetch(fetch, -EIO);
+		return;
+	}
+	runBlockFetch(fetch);
+}
 
+int readBlocks(DynArray *blocksToRead, char *buf)
+{
+	if (blocksToRead->len == 0) {
+		return 0;
+	}
+
+	BlockFetch* fetches = malloc(blocksToRead->len * sizeof(BlockFetch));
+	if (fetches == NULL) {
+		logPrintf(LOG_ERROR, "bucse_read: malloc(): %s\n", strerror(errno));
+		return -ENOMEM;
+	}
+
+	WorkGroup group;
+	workGroupInit(&group);
+
+	size_t copiedBytes = 0;
+	for (int i=0; i<blocksToRead->len; i++) {
+		BlockOffsetLen* block = blocksToRead->objects[i];
+		fetches[i].block = block;
+		fetches[i].dest = buf + copiedBytes;
+		fetches[i].result = 0;
+		fetches[i].group = &group;
+		workGroupAdd(&group);
+		copiedBytes += block->len;
+	}
+
+	// the other blocks go to the worker pool, the first one is fetched here
+	// meanwhile
+	for (int i=1; i<blocksToRead->len; i++) {
+		if (workPoolSubmit(blockFetchWork, &fetches[i], 1) != 0) {
+			runBlockFetch(&fetches[i]);
+		}
+	}
+	runBlockFetch(&fetches[0]);
+
+	// don't wait for busy workers, take back the blocks they haven't started
+	for (int i=1; i<blocksToRead->len; i++) {
+		if (workPoolTake(blockFetchWork, &fetches[i])) {
+			runBlockFetch(&fetches[i]);
+		}
+	}
+
+	workGroupWait(&group, 0);
+
+	int result = copiedBytes;
+	for (int i=0; i<blocksToRead->len; i++) {
+		if (fetches[i].result != 0) {
+			result = fetches[i].result;
+			break;
+		}
+	}
+
+	free(fetches);
+	workGroupDestroy(&group);
+	return result;
+}
+
+static int bucse_read(const char *path, size_t size, off_t offset,
+		DynArray *blocksToRead,
+		ReadAheadState* readAhead, DynArray *blocksToPrefetch,
+		PendingFlush** flush)
+{
 	logPrintf(LOG_DEBUG, "read %s, size: %zu, offset: %jd\n", path, size, (intmax_t)offset);
 
 	if (path == NULL) {
@@ -78,17 +264,8 @@ static int bucse_read(const char *path, char *buf, size_t size, off_t offset,
 	if (strcmp(path, "/") == 0) {
 		return -EACCES;
 	} else if (path[0] == '/') {
-		DynArray pathArray;
-		memset(&pathArray, 0, sizeof(DynArray));
-		const char *fileName = path_split(path+1, &pathArray);
-		if (fileName == NULL) {
-			logPrintf(LOG_ERROR, "bucse_read: path_split() failed\n");
-			return -ENOMEM;
-		}
-		//path_debugPrint(&pathArray);
-
-		FilesystemDir *containingDir = findContainingDir(&pathArray);
-		path_free(&pathArray);
+		const char *fileName = NULL;
+		FilesystemDir *containingDir = findContainingDir(path+1, &fileName);
 
 		if (containingDir == NULL) {
 			logPrintf(LOG_ERROR, "bucse_read: path not found when reading file %s\n", path);
@@ -109,80 +286,49 @@ static int bucse_read(const char *path, char *buf, size_t size, off_t offset,
 		return -ENOENT;
 	}
 
-	if (file->dirtyFlags != DirtyFlagNotDirty) {
-		if (flushFile(file) != 0) {
-			return -EIO;
-		}
-	}
+	pthread_mutex_lock(&file->mutex);
+	int result = prepareRead(file, size, offset, blocksToRead,
+		readAhead, blocksToPrefetch, flush);
+	pthread_mutex_unlock(&file->mutex);
+	return result;
+}
 
-	// determine which blocks should be read
+int bucse_read_guarded(const char *path, char *buf, size_t size, off_t offset,
+		struct fuse_file_info *fi)
+{
 	DynArray blocksToRead;
 	memset(&blocksToRead, 0, sizeof(DynArray));
-	if (determineBlocksToRead(&blocksToRead, offset, size, file) != 0) {
-		logPrintf(LOG_ERROR, "bucse_read: determineBlocksToRead failed\n");
-		for (int i=0; i<blocksToRead.len; i++) {
-			free(blocksToRead.objects[i]);
-		}
-		freeDynArray(&blocksToRead);
-		return -ENOMEM;
-	}
+	DynArray blocksToPrefetch;
+	memset(&blocksToPrefetch, 0, sizeof(DynArray));
 
-	size_t maxEncryptedBlockSize = getMaxEncryptedBlockSize(file->blockSize);
-	char* encryptedBlockBuf = malloc(maxEncryptedBlockSize);
-	if (encryptedBlockBuf == NULL) {
-		logPrintf(LOG_ERROR, "bucse_read: malloc(): %s\n", strerror(errno));
-		return -ENOMEM;
-	}
-
-	size_t maxDecryptedBlockSize = file->blockSize;
-	char* decryptedBlockBuf = malloc(maxDecryptedBlockSize + DECRYPTED_BUFFER_MARGIN);
-	if (decryptedBlockBuf == NULL) {
-		logPrintf(LOG_ERROR, "bucse_read: malloc(): %s\n", strerror(errno));
-		free(encryptedBlockBuf);
-		return -ENOMEM;
-	}
-
-	size_t copiedBytes = 0;
-	int ioerror = 0;
-	for (int i=0; i<blocksToRead.len; i++) {
-		BlockOffsetLen* block = blocksToRead.objects[i];
-		size_t encryptedBlockBufSize = maxEncryptedBlockSize;
-		size_t decryptedBlockBufSize = maxDecryptedBlockSize;
-
-		if (decryptBlock(block->block,
-			decryptedBlockBuf, &decryptedBlockBufSize,
-			encryptedBlockBuf, &encryptedBlockBufSize,
-			0, block->offset + block->len) != 0) {
-			ioerror = 1;
+	// block names are resolved under the locks...
+	int result;
+	for (;;) {
+		PendingFlush* flush = NULL;
+		pthread_rwlock_rdlock(&bucseTreeLock);
+		result = bucse_read(path, size, offset, &blocksToRead,
+			(ReadAheadState*)(uintptr_t)fi->fh, &blocksToPrefetch, &flush);
+		pthread_rwlock_unlock(&bucseTreeLock);
+		if (flush == NULL) {
 			break;
 		}
-
-		memcpy(buf + copiedBytes, decryptedBlockBuf + block->offset, block->len);
-		copiedBytes += block->len;
+		// a dirty file is flushed first, its blocks are stored without
+		// the locks too
+		if (flushFileFinish(flush) != 0) {
+			return -EIO;
+		}
 	}
 
-	free(encryptedBlockBuf);
-	free(decryptedBlockBuf);
-
-	for (int i=0; i<blocksToRead.len; i++) {
-		free(blocksToRead.objects[i]);
-	}
-	freeDynArray(&blocksToRead);
+	// the following blocks are fetched in the background meanwhile
+	readAheadSubmit(&blocksToPrefetch);
 
-	if (ioerror) {
-		return -EIO;
+	// ...and fetched without them, so that a slow destination doesn't
+	// stall other operations
+	if (result == 0) {
+		result = readBlocks(&blocksToRead, buf);
 	}
 
-	file->atime = getCurrentTime();
-	return copiedBytes;
-}
-
-int bucse_read_guarded(const char *path, char *buf, size_t size, off_t offset,
-		struct fuse_file_info *fi)
-{
-	pthread_mutex_lock(&bucseMutex);
-	int result = bucse_read(path, buf, size, offset, fi);
-	pthread_mutex_unlock(&bucseMutex);
+	freeBlocksToRead(&blocksToRead);
 	return result;
 }
 
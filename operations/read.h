@@ -1,3 +1,16 @@
+// A read is done in two steps: prepareRead() resolves which blocks need to be
+// read and copies their names to blocksToRead (the caller needs to hold
+// file->mutex), then readBlocks() fetches and decrypts them without holding
+// any locks. blocksToRead is freed with freeBlocksToRead(). The blocks to
+// read ahead are put to blocksToPrefetch, for readAheadSubmit(). A dirty file
+// is flushed first: prepareRead() only starts the flush, the caller finishes
+// it without the locks and calls prepareRead() again, see flush.h.
+int prepareRead(FilesystemFile* file, size_t size, off_t offset,
+		DynArray *blocksToRead,
+		ReadAheadState* readAhead, DynArray *blocksToPrefetch,
+		struct _PendingFlush** flush);
+int readBlocks(DynArray *blocksToRead, char *buf);
+void freeBlocksToRead(DynArray *blocksToRead);
+
 int bucse_read_guarded(const char *path, char *buf, size_t size, off_t offset,
 		struct fuse_file_info *fi);
-
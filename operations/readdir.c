@@ -6,6 +6,8 @@
 #include <pthread.h>
 
 #include "../dynarray.h"
+#include "../nameindex.h"
+#include "../dirtymap.h"
 #include "../filesystem.h"
 #include "../actions.h"
 #include "../time.h"
@@ -31,17 +33,7 @@ static int bucse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 	if (strcmp(path, "/") == 0) {
 		dir = root;
 	} else if (path[0] == '/') {
-		DynArray pathArray;
-		memset(&pathArray, 0, sizeof(DynArray));
-		const char *fileName = path_split(path+1, &pathArray);
-		if (fileName == NULL) {
-			logPrintf(LOG_ERROR, "bucse_readdir: path_split() failed\n");
-			return -ENOMEM;
-		}
-		//path_debugPrint(&pathArray);
-
-		dir = findDirByPath(&pathArray);
-		path_free(&pathArray);
+		dir = findDirByPath(path+1);
 	} else {
 		return -ENOENT;
 	}
@@ -69,9 +61,9 @@ static int bucse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 int bucse_readdir_guarded(const char *path, void *buf, fuse_fill_dir_t filler,
 		off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags)
 {
-	pthread_mutex_lock(&bucseMutex);
+	pthread_rwlock_rdlock(&bucseTreeLock);
 	int result = bucse_readdir(path, buf, filler, offset, fi, flags);
-	pthread_mutex_unlock(&bucseMutex);
+	pthread_rwlock_unlock(&bucseTreeLock);
 	return result;
 }
 
@@ -2,20 +2,48 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
 #include <fuse.h>
 #include <pthread.h>
 
 #include "../dynarray.h"
+#include "../nameindex.h"
+#include "../dirtymap.h"
 #include "../filesystem.h"
 #include "../actions.h"
 #include "../log.h"
+#include "../conf.h"
+#include "../readahead.h"
+#include "../writeback.h"
 
 #include "operations.h"
 #include "flush.h"
 
 #include "release.h"
 
-static int bucse_release(const char *path, struct fuse_file_info *fi)
+int releaseFile(FilesystemFile* file, struct fuse_file_info *fi,
+	PendingFlush** flush)
+{
+	if ((fi->flags & O_ACCMODE) == O_RDONLY) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&file->mutex);
+	int result = 0;
+	// with lazy_close the flusher writes it out, see writeback.h
+	if (!conf.lazyClose || writeBackClose(file) != 0) {
+		result = flushFileStart(file, flush);
+	}
+	pthread_mutex_unlock(&file->mutex);
+	if (result != 0) {
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static int bucse_release(const char *path, struct fuse_file_info *fi,
+		PendingFlush** flush)
 {
 	logPrintf(LOG_DEBUG, "release %s, access mode %d\n", path, fi->flags);
 
@@ -30,17 +58,8 @@ static int bucse_release(const char *path, struct fuse_file_info *fi)
 	if (strcmp(path, "/") == 0) {
 		return -EACCES;
 	} else if (path[0] == '/') {
-		DynArray pathArray;
-		memset(&pathArray, 0, sizeof(DynArray));
-		const char *fileName = path_split(path+1, &pathArray);
-		if (fileName == NULL) {
-			logPrintf(LOG_ERROR, "bucse_release: path_split() failed\n");
-			return -ENOMEM;
-		}
-		//path_debugPrint(&pathArray);
-
-		FilesystemDir *containingDir = findContainingDir(&pathArray);
-		path_free(&pathArray);
+		const char *fileName = NULL;
+		FilesystemDir *containingDir = findContainingDir(path+1, &fileName);
 
 		if (containingDir == NULL) {
 			logPrintf(LOG_ERROR, "bucse_release: path not found when releasing file %s\n", path);
@@ -49,9 +68,7 @@ static int bucse_release(const char *path, struct fuse_file_info *fi)
 
 		FilesystemFile *file = findFile(containingDir, fileName);
 		if (file) {
-			if (flushFile(file) != 0) {
-				return -EIO;
-			}
+			return releaseFile(file, fi, flush);
 		}
 	} else {
 		return -ENOENT;
@@ -62,8 +79,22 @@ static int bucse_release(const char *path, struct fuse_file_info *fi)
 
 int bucse_release_guarded(const char *path, struct fuse_file_info *fi)
 {
-	pthread_mutex_lock(&bucseMutex);
-	int result = bucse_release(path, fi);
-	pthread_mutex_unlock(&bucseMutex);
+	int result;
+	for (;;) {
+		PendingFlush* flush = NULL;
+		pthread_rwlock_rdlock(&bucseTreeLock);
+		result = bucse_release(path, fi, &flush);
+		pthread_rwlock_unlock(&bucseTreeLock);
+		if (flush == NULL) {
+			break;
+		}
+		// the blocks are stored without the locks, then it's tried again
+		if (flushFileFinish(flush) != 0) {
+			result = -EIO;
+			break;
+		}
+	}
+	readAheadFree((ReadAheadState*)(uintptr_t)fi->fh);
+	fi->fh = 0;
 	return result;
 }
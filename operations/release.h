@@ -1,2 +1,8 @@
+// flushes a file that was open for writing, or queues it for the flusher with
+// lazy_close, the caller needs to hold bucseTreeLock. A flush that is started
+// is finished by the caller without the lock, then it calls this again, see
+// flush.h.
+int releaseFile(FilesystemFile* file, struct fuse_file_info *fi,
+	struct _PendingFlush** flush);
 int bucse_release_guarded(const char *path, struct fuse_file_info *fi);
 
@@ -6,6 +6,8 @@
 #include <pthread.h>
 
 #include "../dynarray.h"
+#include "../nameindex.h"
+#include "../dirtymap.h"
 #include "../filesystem.h"
 #include "../actions.h"
 #include "../time.h"
@@ -28,15 +30,42 @@
 #define RENAME_EXCHANGE		(1 << 1)	/* Exchange source and dest */
 #endif
 
-static int renameFile(FilesystemFile *srcFile, FilesystemDir *srcContainingDir,
-	FilesystemFile *dstFile, FilesystemDir *dstContainingDir,
-	const char* dstPath)
+// starts flushing the first file under dir that has pending changes, see
+// bucse_rename()
+static int flushDirFiles(FilesystemDir *dir, PendingFlush** flush)
 {
-	// flush srcFile to be sure pending writes have been saved
-	if (srcFile->dirtyFlags != DirtyFlagNotDirty) {
-		if (flushFile(srcFile) != 0) {
+	for (int i=0; i<dir->files.len; i++) {
+		if (flushFileStart(dir->files.objects[i], flush) != 0) {
 			return -EIO;
 		}
+		if (*flush != NULL) {
+			return 0;
+		}
+	}
+	for (int i=0; i<dir->dirs.len; i++) {
+		int result = flushDirFiles(dir->dirs.objects[i], flush);
+		if (result != 0 || *flush != NULL) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+static int renameFile(FilesystemFile *srcFile, FilesystemDir *srcContainingDir,
+	FilesystemFile *dstFile, FilesystemDir *dstContainingDir,
+	const char* dstPath, PendingFlush** flush)
+{
+	// flush srcFile to be sure pending writes have been saved, and dstFile,
+	// so that no flush of it runs when it's replaced. The caller finishes
+	// the flush and tries again.
+	if (flushFileStart(srcFile, flush) != 0) {
+		return -EIO;
+	}
+	if (*flush == NULL && dstFile != NULL && flushFileStart(dstFile, flush) != 0) {
+		return -EIO;
+	}
+	if (*flush != NULL) {
+		return 0;
 	}
 
 	// construct new action for destination, add it to actions
@@ -62,14 +91,28 @@ static int renameFile(FilesystemFile *srcFile, FilesystemDir *srcContainingDir,
 		return -ENOMEM;
 	}
 	memcpy(newDstAction->content, srcFile->content, srcFile->contentLen * MAX_STORAGE_NAME_LEN);
+	newDstAction->chunkEnds = NULL;
+	if (srcFile->chunkEnds != NULL) {
+		newDstAction->chunkEnds = malloc(srcFile->contentLen * sizeof(size_t));
+		if (newDstAction->chunkEnds == NULL) {
+			logPrintf(LOG_ERROR, "bucse_rename: malloc(): %s\n", strerror(errno));
+			free(newDstAction->content);
+			free(newDstAction->path);
+			free(newDstAction);
+			return -ENOMEM;
+		}
+		memcpy(newDstAction->chunkEnds, srcFile->chunkEnds, srcFile->contentLen * sizeof(size_t));
+	}
 
 	newDstAction->contentLen = srcFile->contentLen;
 	newDstAction->size = srcFile->size;
 	newDstAction->blockSize = srcFile->blockSize;
+	newDstAction->tierBlocks = srcFile->tierBlocks;
 
 	// write to json, encrypt call destination->addActionFile()
 	if (encryptAndAddActionFile(newDstAction) != 0) {
 		logPrintf(LOG_ERROR, "bucse_rename: encryptAndAddActionFile failed\n");
+		free(newDstAction->chunkEnds);
 		free(newDstAction->content);
 		free(newDstAction->path);
 		free(newDstAction);
@@ -98,6 +141,8 @@ static int renameFile(FilesystemFile *srcFile, FilesystemDir *srcContainingDir,
 	newSrcAction->contentLen = 0;
 	newSrcAction->size = 0;
 	newSrcAction->blockSize = 0;
+	newSrcAction->tierBlocks = 0;
+	newSrcAction->chunkEnds = NULL;
 
 	// write to json, encrypt call destination->addActionFile()
 	if (encryptAndAddActionFile(newSrcAction) != 0) {
@@ -110,46 +155,48 @@ static int renameFile(FilesystemFile *srcFile, FilesystemDir *srcContainingDir,
 	// add to actions array
 	addAction(newSrcAction);
 
+	// get pointer to file name from newDstAction->path
+	const char *fileName = path_getFilename(newDstAction->path);
+
 	// update filesystem
-	if (removeFromDynArrayUnordered(&srcContainingDir->files, (void*)srcFile) != 0) {
-		logPrintf(LOG_ERROR, "bucse_rename: removeFromDynArrayUnordered() failed\n");
+	if (removeFileFromDir(srcContainingDir, srcFile) != 0) {
+		logPrintf(LOG_ERROR, "bucse_rename: removeFileFromDir() failed\n");
 		return -EIO;
 	}
 
 	if (dstFile == NULL) {
+		// the name is indexed, so it's changed while the file is in no dir
 		dstFile = srcFile;
-		addToDynArray(&dstContainingDir->files, dstFile);
+		dstFile->name = fileName;
+		dstFile->parentDir = dstContainingDir;
+		if (addFileToDir(dstContainingDir, dstFile) != 0) {
+			logPrintf(LOG_ERROR, "bucse_rename: addFileToDir() failed\n");
+			freeFilesystemFile(dstFile);
+			return -EIO;
+		}
 	} else {
 		// move file from src to dst
 		dstFile->content = newDstAction->content;
 		dstFile->contentLen = newDstAction->contentLen;
 		dstFile->size = newDstAction->size;
 		dstFile->blockSize = newDstAction->blockSize;
+		dstFile->tierBlocks = newDstAction->tierBlocks;
+		dstFile->chunkEnds = newDstAction->chunkEnds;
 
-		free(srcFile);
+		// after the rename the kernel expects the destination to have the
+		// inode of the source, the old destination inode goes away with srcFile
+		swapFileInodes(srcFile, dstFile);
+		freeFilesystemFile(srcFile);
 	}
 
 	dstFile->atime = dstFile->mtime = newDstAction->time;
-	dstFile->parentDir = dstContainingDir;
-
-	// get pointer to file name from newDstAction->path
-	DynArray pathArray;
-	memset(&pathArray, 0, sizeof(DynArray));
-	const char *fileName = path_split(newDstAction->path, &pathArray);
-	if (fileName == NULL) {
-		logPrintf(LOG_ERROR, "bucse_rename: path_split() failed\n");
-		return -EIO;
-	}
-	path_free(&pathArray);
-
-	dstFile->name = fileName;
 
 	return 0;
 }
 
 static int renameDir(FilesystemDir *srcDir, FilesystemDir *srcContainingDir,
 	FilesystemDir *dstDir, FilesystemDir *dstContainingDir,
-	const char* dstPath)
+	const char* dstPath, PendingFlush** flush)
 {
 	if (dstDir && (dstDir->files.len > 0 || dstDir->dirs.len > 0)) {
 		logPrintf(LOG_ERROR, "bucse_rename: dir not empty: %s\n", dstPath+1);
@@ -170,16 +217,7 @@ static int renameDir(FilesystemDir *srcDir, FilesystemDir *srcContainingDir,
 
 	// find dstDir
 	if (dstDir == NULL) {
-		DynArray pathArray;
-		memset(&pathArray, 0, sizeof(DynArray));
-		const char *dirName = path_split(dstPath+1, &pathArray);
-		path_free(&pathArray);
-		if (dirName == NULL) {
-			logPrintf(LOG_ERROR, "bucse_rename: path_split() failed\n");
-			return -ENOMEM;
-		}
-
-		dstDir = findDir(dstContainingDir, dirName);
+		dstDir = findDir(dstContainingDir, path_getFilename(dstPath));
 	}
 
 	if (dstDir == NULL) {
@@ -202,7 +240,7 @@ static int renameDir(FilesystemDir *srcDir, FilesystemDir *srcContainingDir,
 		newDstPath[dstPathLen] = '/';
 		memcpy(newDstPath+dstPathLen+1, f->name, fNameLen+1);
 
-		result = renameFile(f, srcDir, NULL, dstDir, newDstPath);
+		result = renameFile(f, srcDir, NULL, dstDir, newDstPath, flush);
 		free(newDstPath);
 
 		if (result != 0) {
@@ -224,7 +262,7 @@ static int renameDir(FilesystemDir *srcDir, FilesystemDir *srcContainingDir,
 		newDstPath[dstPathLen] = '/';
 		memcpy(newDstPath+dstPathLen+1, d->name, dNameLen+1);
 
-		result = renameDir(d, srcDir, NULL, dstDir, newDstPath);
+		result = renameDir(d, srcDir, NULL, dstDir, newDstPath, flush);
 		free(newDstPath);
 
 		if (result != 0) {
@@ -233,6 +271,9 @@ static int renameDir(FilesystemDir *srcDir, FilesystemDir *srcContainingDir,
 		}
 	}
 
+	// dstDir takes over the inode of srcDir, see renameFile()
+	swapDirInodes(srcDir, dstDir);
+
 	// find srcPath
 	char* srcPathWithoutFirstSlash = getFullDirPath(srcDir);
 	if (srcPathWithoutFirstSlash == NULL) {
@@ -261,8 +302,8 @@ static int renameDir(FilesystemDir *srcDir, FilesystemDir *srcContainingDir,
 	return 0;
 }
 
-static int bucse_rename(const char *srcPath, const char *dstPath,
-		unsigned int flags)
+int bucse_rename(const char *srcPath, const char *dstPath,
+		unsigned int flags, PendingFlush** flush)
 {
 	logPrintf(LOG_DEBUG, "rename %s %s\n", srcPath, dstPath);
 
@@ -282,17 +323,8 @@ static int bucse_rename(const char *srcPath, const char *dstPath,
 	if (strcmp(srcPath, "/") == 0) {
 		return -EACCES;
 	} else if (srcPath[0] == '/') {
-		DynArray pathArray;
-		memset(&pathArray, 0, sizeof(DynArray));
-		const char *fileName = path_split(srcPath+1, &pathArray);
-		if (fileName == NULL) {
-			logPrintf(LOG_ERROR, "bucse_rename: path_split() failed\n");
-			return -ENOMEM;
-		}
-		//path_debugPrint(&pathArray);
-
-		srcContainingDir = findContainingDir(&pathArray);
-		path_free(&pathArray);
+		const char *fileName = NULL;
+		srcContainingDir = findContainingDir(srcPath+1, &fileName);
 
 		if (srcContainingDir == NULL) {
 			logPrintf(LOG_ERROR, "bucse_rename: path not found when moving file %s\n", srcPath);
@@ -323,17 +355,8 @@ static int bucse_rename(const char *srcPath, const char *dstPath,
 	if (strcmp(dstPath, "/") == 0) {
 		return -EACCES;
 	} else if (dstPath[0] == '/') {
-		DynArray pathArray;
-		memset(&pathArray, 0, sizeof(DynArray));
-		const char *fileName = path_split(dstPath+1, &pathArray);
-		if (fileName == NULL) {
-			logPrintf(LOG_ERROR, "bucse_rename: path_split() failed\n");
-			return -ENOMEM;
-		}
-		//path_debugPrint(&pathArray);
-
-		dstContainingDir = findContainingDir(&pathArray);
-		path_free(&pathArray);
+		const char *fileName = NULL;
+		dstContainingDir = findContainingDir(dstPath+1, &fileName);
 
 		if (dstContainingDir == NULL) {
 			logPrintf(LOG_ERROR, "bucse_rename: path not found when moving file %s\n", dstPath);
@@ -397,9 +420,17 @@ static int bucse_rename(const char *srcPath, const char *dstPath,
 	}
 
 	if (srcFile != NULL) {
-		return renameFile(srcFile, srcContainingDir, dstFile, dstContainingDir, dstPath);
+		return renameFile(srcFile, srcContainingDir, dstFile, dstContainingDir, dstPath,
+			flush);
 	} else if (srcDir != NULL) {
-		return renameDir(srcDir, srcContainingDir, dstDir, dstContainingDir, dstPath);
+		// all the files are flushed before the first one is moved, the
+		// rename is tried again after each flush
+		int result = flushDirFiles(srcDir, flush);
+		if (result != 0 || *flush != NULL) {
+			return result;
+		}
+		return renameDir(srcDir, srcContainingDir, dstDir, dstContainingDir, dstPath,
+			flush);
 	} else {
 		logPrintf(LOG_ERROR, "bucse_rename: Unexpected state\n");
 		return -EIO;
@@ -410,9 +441,18 @@ static int bucse_rename(const char *srcPath, const char *dstPath,
 int bucse_rename_guarded(const char *srcPath, const char *dstPath,
 		unsigned int flags)
 {
-	pthread_mutex_lock(&bucseMutex);
-	int result = bucse_rename(srcPath, dstPath, flags);
-	pthread_mutex_unlock(&bucseMutex);
-	return result;
+	for (;;) {
+		PendingFlush* flush = NULL;
+		pthread_rwlock_wrlock(&bucseTreeLock);
+		int result = bucse_rename(srcPath, dstPath, flags, &flush);
+		pthread_rwlock_unlock(&bucseTreeLock);
+		if (flush == NULL) {
+			return result;
+		}
+		// the blocks are stored without the lock, then it's tried again
+		if (flushFileFinish(flush) != 0) {
+			return -EIO;
+		}
+	}
 }
 
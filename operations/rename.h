@@ -1,3 +1,6 @@
+// the files that are moved are flushed first, as in bucse_unlink()
+int bucse_rename(const char *srcPath, const char *dstPath,
+		unsigned int flags, struct _PendingFlush** flush);
 int bucse_rename_guarded(const char *srcPath, const char *dstPath,
 		unsigned int flags);
 
@@ -6,6 +6,8 @@
 #include <pthread.h>
 
 #include "../dynarray.h"
+#include "../nameindex.h"
+#include "../dirtymap.h"
 #include "../filesystem.h"
 #include "../actions.h"
 #include "../time.h"
@@ -36,17 +38,7 @@ int bucse_rmdir(const char *path)
 	if (strcmp(path, "/") == 0) {
 		return -EACCES;
 	} else if (path[0] == '/') {
-		DynArray pathArray;
-		memset(&pathArray, 0, sizeof(DynArray));
-		dirName = path_split(path+1, &pathArray);
-		if (dirName == NULL) {
-			logPrintf(LOG_ERROR, "bucse_rmdir: path_split() failed\n");
-			return -ENOMEM;
-		}
-		//path_debugPrint(&pathArray);
-
-		containingDir = findContainingDir(&pathArray);
-		path_free(&pathArray);
+		containingDir = findContainingDir(path+1, &dirName);
 
 		if (containingDir == NULL) {
 			logPrintf(LOG_ERROR, "bucse_rmdir: path not found when adding directory %s\n", path);
@@ -91,6 +83,8 @@ int bucse_rmdir(const char *path)
 	newAction->contentLen = 0;
 	newAction->size = 0;
 	newAction->blockSize = 0;
+	newAction->tierBlocks = 0;
+	newAction->chunkEnds = NULL;
 
 	// write to json, encrypt call destination->addActionFile()
 	if (encryptAndAddActionFile(newAction) != 0) {
@@ -104,22 +98,20 @@ int bucse_rmdir(const char *path)
 	addAction(newAction);
 
 	// update filesystem
-	if (removeFromDynArrayUnordered(&containingDir->dirs, (void*)dir) != 0) {
-		logPrintf(LOG_ERROR, "bucse_rmdir: removeFromDynArrayUnordered() failed\n");
+	if (removeDirFromDir(containingDir, dir) != 0) {
+		logPrintf(LOG_ERROR, "bucse_rmdir: removeDirFromDir() failed\n");
 		return -EIO;
 	}
-	freeDynArray(&dir->dirs);
-	freeDynArray(&dir->files);
-	free(dir);
+	freeFilesystemDir(dir);
 
 	return 0;
 }
 
 int bucse_rmdir_guarded(const char *path)
 {
-	pthread_mutex_lock(&bucseMutex);
+	pthread_rwlock_wrlock(&bucseTreeLock);
 	int result = bucse_rmdir(path);
-	pthread_mutex_unlock(&bucseMutex);
+	pthread_rwlock_unlock(&bucseTreeLock);
 	return result;
 }
 
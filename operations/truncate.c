@@ -6,17 +6,54 @@
 #include <pthread.h>
 
 #include "../dynarray.h"
+#include "../nameindex.h"
+#include "../dirtymap.h"
 #include "../filesystem.h"
 #include "../actions.h"
 #include "../log.h"
 #include "../conf.h"
+#include "../writeback.h"
 
 #include "operations.h"
 #include "flush.h"
 
 #include "truncate.h"
 
-static int bucse_truncate(const char *path, long int newSize, struct fuse_file_info *fi)
+int truncateFile(FilesystemFile* file, long int newSize, PendingFlush** flush)
+{
+	if (flushFileStart(file, flush) != 0) {
+		return -EIO;
+	}
+	if (*flush != NULL) {
+		return 0;
+	}
+
+	int size = file->size;
+	if (size < file->dirtyMap.end) {
+		size = file->dirtyMap.end;
+	}
+
+	if (newSize == size) {
+		return 0;
+	} else if (newSize > size) {
+		// flushFile fills the blocks past the old end with zeros
+		dirtyMapExtend(&file->dirtyMap, newSize);
+		file->dirtyFlags |= DirtyFlagPendingWrite;
+		writeBackMarkDirty(file);
+		return 0;
+	}
+
+	// (newSize < size), so
+	
+	file->truncSize = newSize;
+	file->dirtyFlags |= DirtyFlagPendingTrunc;
+	writeBackMarkDirty(file);
+
+	return 0;
+}
+
+static int bucse_truncate(const char *path, long int newSize, struct fuse_file_info *fi,
+		PendingFlush** flush)
 {
 	(void) fi;
 
@@ -36,17 +73,8 @@ static int bucse_truncate(const char *path, long int newSize, struct fuse_file_i
 	if (strcmp(path, "/") == 0) {
 		return -EACCES;
 	} else if (path[0] == '/') {
-		DynArray pathArray;
-		memset(&pathArray, 0, sizeof(DynArray));
-		const char *fileName = path_split(path+1, &pathArray);
-		if (fileName == NULL) {
-			logPrintf(LOG_ERROR, "bucse_truncate: path_split() failed\n");
-			return -ENOMEM;
-		}
-		//path_debugPrint(&pathArray);
-
-		FilesystemDir *containingDir = findContainingDir(&pathArray);
-		path_free(&pathArray);
+		const char *fileName = NULL;
+		FilesystemDir *containingDir = findContainingDir(path+1, &fileName);
 
 		if (containingDir == NULL) {
 			logPrintf(LOG_ERROR, "bucse_truncate: path not found when writing file %s\n", path);
@@ -67,55 +95,26 @@ static int bucse_truncate(const char *path, long int newSize, struct fuse_file_i
 		return -ENOENT;
 	}
 
-	if (file->dirtyFlags != DirtyFlagNotDirty) {
-		if (flushFile(file) != 0) {
-			return -EIO;
-		}
-	}
-
-	int size = file->size;
-	for (int i=0; i<file->pendingWrites.len; i++) {
-		PendingWrite* pw = file->pendingWrites.objects[i];
-		if (size < (pw->offset + pw->size)) {
-			size = (pw->offset + pw->size);
-		}
-	}
-
-	if (newSize == size) {
-		return 0;
-	} else if (newSize > size) {
-		PendingWrite* newPendingWrite = malloc(sizeof(PendingWrite));
-		if (newPendingWrite == NULL) {
-			logPrintf(LOG_ERROR, "bucse_truncate: malloc(): %s\n", strerror(errno));
-			return -ENOMEM;
-		}
-		newPendingWrite->size = newSize - size;
-		newPendingWrite->buf = malloc(newSize - size);
-		if (newPendingWrite->buf == NULL) {
-			logPrintf(LOG_ERROR, "bucse_truncate: malloc(): %s\n", strerror(errno));
-			free(newPendingWrite);
-			return -ENOMEM;
-		}
-		memset(newPendingWrite->buf, 0, newSize - size);
-		newPendingWrite->offset = size;
-		addToDynArray(&file->pendingWrites, newPendingWrite);
-		file->dirtyFlags |= DirtyFlagPendingWrite;
-		return 0;
-	}
-
-	// (newSize < size), so
-	
-	file->truncSize = newSize;
-	file->dirtyFlags |= DirtyFlagPendingTrunc;
-
-	return 0;
+	pthread_mutex_lock(&file->mutex);
+	int result = truncateFile(file, newSize, flush);
+	pthread_mutex_unlock(&file->mutex);
+	return result;
 }
 
 int bucse_truncate_guarded(const char *path, long int newSize, struct fuse_file_info *fi)
 {
-	pthread_mutex_lock(&bucseMutex);
-	int result = bucse_truncate(path, newSize, fi);
-	pthread_mutex_unlock(&bucseMutex);
-	return result;
+	for (;;) {
+		PendingFlush* flush = NULL;
+		pthread_rwlock_rdlock(&bucseTreeLock);
+		int result = bucse_truncate(path, newSize, fi, &flush);
+		pthread_rwlock_unlock(&bucseTreeLock);
+		if (flush == NULL) {
+			return result;
+		}
+		// the blocks are stored without the locks, then it's tried again
+		if (flushFileFinish(flush) != 0) {
+			return -EIO;
+		}
+	}
 }
 
@@ -1,2 +1,6 @@
-int bucse_truncate_guarded(const char *path, long int newSize, struct fuse_file_info *fi);
+// truncates a file, the caller needs to hold file->mutex. A dirty file is
+// flushed first, as in prepareRead().
+int truncateFile(FilesystemFile* file, long int newSize,
+	struct _PendingFlush** flush);
 
+int bucse_truncate_guarded(const char *path, long int newSize, struct fuse_file_info *fi);
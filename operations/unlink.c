@@ -6,6 +6,8 @@
 #include <pthread.h>
 
 #include "../dynarray.h"
+#include "../nameindex.h"
+#include "../dirtymap.h"
 #include "../filesystem.h"
 #include "../actions.h"
 #include "../time.h"
@@ -17,7 +19,7 @@
 
 #include "unlink.h"
 
-static int bucse_unlink(const char *path)
+int bucse_unlink(const char *path, PendingFlush** flush)
 {
 	logPrintf(LOG_DEBUG, "unlink %s\n", path);
 
@@ -36,17 +38,8 @@ static int bucse_unlink(const char *path)
 	if (strcmp(path, "/") == 0) {
 		return -EACCES;
 	} else if (path[0] == '/') {
-		DynArray pathArray;
-		memset(&pathArray, 0, sizeof(DynArray));
-		const char *fileName = path_split(path+1, &pathArray);
-		if (fileName == NULL) {
-			logPrintf(LOG_ERROR, "bucse_unlink: path_split() failed\n");
-			return -ENOMEM;
-		}
-		//path_debugPrint(&pathArray);
-
-		containingDir = findContainingDir(&pathArray);
-		path_free(&pathArray);
+		const char *fileName = NULL;
+		containingDir = findContainingDir(path+1, &fileName);
 
 		if (containingDir == NULL) {
 			logPrintf(LOG_ERROR, "bucse_unlink: path not found when deleting file %s\n", path);
@@ -67,11 +60,13 @@ static int bucse_unlink(const char *path)
 		return -ENOENT;
 	}
 
-	// flush file to be sure pending writes have been saved
-	if (file->dirtyFlags != DirtyFlagNotDirty) {
-		if (flushFile(file) != 0) {
-			return -EIO;
-		}
+	// flush file to be sure pending writes have been saved, the caller
+	// finishes the flush and tries again
+	if (flushFileStart(file, flush) != 0) {
+		return -EIO;
+	}
+	if (*flush != NULL) {
+		return 0;
 	}
 
 	// construct new action, add it to actions
@@ -93,6 +88,8 @@ static int bucse_unlink(const char *path)
 	newAction->contentLen = 0;
 	newAction->size = 0;
 	newAction->blockSize = 0;
+	newAction->tierBlocks = 0;
+	newAction->chunkEnds = NULL;
 
 	// write to json, encrypt call destination->addActionFile()
 	if (encryptAndAddActionFile(newAction) != 0) {
@@ -102,32 +99,33 @@ static int bucse_unlink(const char *path)
 		return -EIO;
 	}
 
-	// clear file's pending writes
-	for (int i=0; i<file->pendingWrites.len; i++) {
-		PendingWrite* pw = file->pendingWrites.objects[i];
-		free(pw->buf);
-		free(pw);
-	}
-	freeDynArray(&file->pendingWrites);
-
 	// add to actions array
 	addAction(newAction);
 
 	// update filesystem
-	if (removeFromDynArrayUnordered(&containingDir->files, (void*)file) != 0) {
-		logPrintf(LOG_ERROR, "bucse_unlink: removeFromDynArrayUnordered() failed\n");
+	if (removeFileFromDir(containingDir, file) != 0) {
+		logPrintf(LOG_ERROR, "bucse_unlink: removeFileFromDir() failed\n");
 		return -EIO;
 	}
-	free(file);
+	freeFilesystemFile(file);
 
 	return 0;
 }
 
 int bucse_unlink_guarded(const char *path)
 {
-	pthread_mutex_lock(&bucseMutex);
-	int result = bucse_unlink(path);
-	pthread_mutex_unlock(&bucseMutex);
-	return result;
+	for (;;) {
+		PendingFlush* flush = NULL;
+		pthread_rwlock_wrlock(&bucseTreeLock);
+		int result = bucse_unlink(path, &flush);
+		pthread_rwlock_unlock(&bucseTreeLock);
+		if (flush == NULL) {
+			return result;
+		}
+		// the blocks are stored without the lock, then it's tried again
+		if (flushFileFinish(flush) != 0) {
+			return -EIO;
+		}
+	}
 }
 
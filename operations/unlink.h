@@ -1,2 +1,5 @@
+// a dirty file is flushed first, the caller finishes the flush without the
+// lock and calls this again, see flush.h
+int bucse_unlink(const char *path, struct _PendingFlush** flush);
 int bucse_unlink_guarded(const char *path);
 
@@ -6,18 +6,41 @@
 #include <pthread.h>
 
 #include "../dynarray.h"
+#include "../nameindex.h"
+#include "../dirtymap.h"
 #include "../filesystem.h"
 #include "../actions.h"
 #include "../log.h"
 #include "../conf.h"
+#include "../writeback.h"
 
 #include "operations.h"
 #include "flush.h"
 
 #include "write.h"
 
+int writeFile(FilesystemFile* file, const char *buf, size_t size, off_t offset,
+	PendingFlush** flush)
+{
+	if (dirtyMapWrite(&file->dirtyMap, buf, size, offset) != 0) {
+		logPrintf(LOG_ERROR, "bucse_write: dirtyMapWrite failed\n");
+		return -ENOMEM;
+	}
+	file->dirtyFlags |= DirtyFlagPendingWrite;
+
+	// flush file if the flusher doesn't keep up with the dirty data
+	if (writeBackMarkDirty(file)) {
+		logPrintf(LOG_DEBUG, "bucse_write: too much dirty data, flushing\n");
+		if (flushFileStart(file, flush) != 0) {
+			return -EIO;
+		}
+	}
+
+	return size;
+}
+
 static int bucse_write(const char *path, const char *buf, size_t size, off_t offset,
-		struct fuse_file_info *fi)
+		struct fuse_file_info *fi, PendingFlush** flush)
 {
 	(void) fi;
 
@@ -37,17 +60,8 @@ static int bucse_write(const char *path, const char *buf, size_t size, off_t off
 	if (strcmp(path, "/") == 0) {
 		return -EACCES;
 	} else if (path[0] == '/') {
-		DynArray pathArray;
-		memset(&pathArray, 0, sizeof(DynArray));
-		const char *fileName = path_split(path+1, &pathArray);
-		if (fileName == NULL) {
-			logPrintf(LOG_ERROR, "bucse_write: path_split() failed\n");
-			return -ENOMEM;
-		}
-		//path_debugPrint(&pathArray);
-
-		FilesystemDir *containingDir = findContainingDir(&pathArray);
-		path_free(&pathArray);
+		const char *fileName = NULL;
+		FilesystemDir *containingDir = findContainingDir(path+1, &fileName);
 
 		if (containingDir == NULL) {
 			logPrintf(LOG_ERROR, "bucse_write: path not found when writing file %s\n", path);
@@ -68,40 +82,24 @@ static int bucse_write(const char *path, const char *buf, size_t size, off_t off
 		return -ENOENT;
 	}
 
-	PendingWrite* newPendingWrite = malloc(sizeof(PendingWrite));
-	if (newPendingWrite == NULL) {
-		logPrintf(LOG_ERROR, "bucse_write: malloc(): %s\n", strerror(errno));
-		return -ENOMEM;
-	}
-	newPendingWrite->size = size;
-	newPendingWrite->buf = malloc(size);
-	if (newPendingWrite->buf == NULL) {
-		logPrintf(LOG_ERROR, "bucse_write: malloc(): %s\n", strerror(errno));
-		free(newPendingWrite);
-		return -ENOMEM;
-	}
-	memcpy(newPendingWrite->buf, buf, size);
-	newPendingWrite->offset = offset;
-	addToDynArray(&file->pendingWrites, newPendingWrite);
-	file->dirtyFlags |= DirtyFlagPendingWrite;
-
-	// flush file if there is too many pendingWrites
-	if (file->pendingWrites.len > 10240) {
-		logPrintf(LOG_DEBUG, "bucse_write: too many pending writes, flushing\n");
-		if (flushFile(file) != 0) {
-			return -EIO;
-		}
-	}
-
-	return size;
+	pthread_mutex_lock(&file->mutex);
+	int result = writeFile(file, buf, size, offset, flush);
+	pthread_mutex_unlock(&file->mutex);
+	return result;
 }
 
 int bucse_write_guarded(const char *path, const char *buf, size_t size, off_t offset,
 		struct fuse_file_info *fi)
 {
-	pthread_mutex_lock(&bucseMutex);
-	int result = bucse_write(path, buf, size, offset, fi);
-	pthread_mutex_unlock(&bucseMutex);
+	PendingFlush* flush = NULL;
+	pthread_rwlock_rdlock(&bucseTreeLock);
+	int result = bucse_write(path, buf, size, offset, fi, &flush);
+	pthread_rwlock_unlock(&bucseTreeLock);
+
+	// the writer is throttled by storing the blocks, without the locks
+	if (flush != NULL && flushFileFinish(flush) != 0) {
+		return -EIO;
+	}
 	return result;
 }
 
@@ -1,3 +1,8 @@
+// adds the data to the dirty map of the file, the caller needs to hold file->mutex.
+// When there is too much dirty data, it starts flushing the file, the caller
+// finishes that without the locks, see flush.h.
+int writeFile(FilesystemFile* file, const char *buf, size_t size, off_t offset,
+	struct _PendingFlush** flush);
+
 int bucse_write_guarded(const char *path, const char *buf, size_t size, off_t offset,
 		struct fuse_file_info *fi);
-
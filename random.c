@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/random.h>
+
+#include "log.h"
+
+#include "random.h"
+
+// enough for a few dozen names or IVs per refill, larger requests bypass it
+#define RANDOM_BUFFER_SIZE 512
+#define RANDOM_BUFFERED_MAX (RANDOM_BUFFER_SIZE / 8)
+
+static __thread unsigned char randomBuffer[RANDOM_BUFFER_SIZE];
+static __thread size_t randomBufferPos = RANDOM_BUFFER_SIZE;
+
+static pthread_once_t atforkOnce = PTHREAD_ONCE_INIT;
+
+// the child of a fork (e.g. fuse_daemonize()) must not reuse the bytes its
+// parent may hand out too
+static void discardBufferInChild()
+{
+	randomBufferPos = RANDOM_BUFFER_SIZE;
+}
+
+static void registerAtfork()
+{
+	pthread_atfork(NULL, NULL, discardBufferInChild);
+}
+
+static int fillRandom(unsigned char* buf, size_t size)
+{
+	while (size > 0) {
+		ssize_t res = getrandom(buf, size, 0);
+		if (res < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			logPrintf(LOG_ERROR, "getRandomBytes: getrandom(): %s\n", strerror(errno));
+			return 1;
+		}
+		buf += res;
+		size -= res;
+	}
+	return 0;
+}
+
+int getRandomBytes(void* buf, size_t size)
+{
+	if (size > RANDOM_BUFFERED_MAX) {
+		return fillRandom(buf, size);
+	}
+
+	pthread_once(&atforkOnce, registerAtfork);
+	if (RANDOM_BUFFER_SIZE - randomBufferPos < size) {
+		if (fillRandom(randomBuffer, RANDOM_BUFFER_SIZE) != 0) {
+			return 1;
+		}
+		randomBufferPos = 0;
+	}
+
+	memcpy(buf, randomBuffer + randomBufferPos, size);
+	// the bytes are handed out once, and not kept around
+	memset(randomBuffer + randomBufferPos, 0, size);
+	randomBufferPos += size;
+	return 0;
+}
@@ -0,0 +1,5 @@
+// The randomness source for names, salts, IVs and keys. It's thread-safe,
+// small requests are served from a per-thread buffer filled by getrandom(2).
+
+// fills buf with size random bytes, returns 0 on success
+int getRandomBytes(void* buf, size_t size);
@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "dynarray.h"
+#include "nameindex.h"
+#include "dirtymap.h"
+#include "filesystem.h"
+#include "blocklayout.h"
+#include "actions.h"
+#include "time.h"
+#include "log.h"
+#include "conf.h"
+#include "cache.h"
+#include "encryption/encr.h"
+#include "operations/operations.h"
+#include "workpool.h"
+
+#include "readahead.h"
+
+struct _ReadAheadState {
+	pthread_mutex_t mutex;
+	off_t nextOffset; // where a sequential read continues
+	int sequentialReads;
+	const char* content; // the block list the requested blocks belong to
+	int nextBlock; // the first block that hasn't been requested yet
+	int64_t streamStart; // when the sequential reads started, for the read rate
+	size_t streamBytes;
+};
+
+typedef struct {
+	char block[MAX_STORAGE_NAME_LEN];
+	int blockSize;
+	size_t expectedReadSize;
+} ReadAheadJob;
+
+static pthread_mutex_t statsMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// average time a worker needs to fetch and decrypt a block, in microseconds,
+// guarded by statsMutex
+static int64_t averageFetchTime;
+
+static uint64_t readAheadFetched;
+static uint64_t readAheadDropped;
+
+ReadAheadState* readAheadNew()
+{
+	if (conf.readAheadBlocks <= 0 || conf.fetchThreads <= 0) {
+		return NULL;
+	}
+
+	ReadAheadState* state = malloc(sizeof(ReadAheadState));
+	if (state == NULL) {
+		logPrintf(LOG_ERROR, "readAheadNew: malloc(): %s\n", strerror(errno));
+		return NULL;
+	}
+	memset(state, 0, sizeof(ReadAheadState));
+	pthread_mutex_init(&state->mutex, NULL);
+	return state;
+}
+
+void readAheadFree(ReadAheadState* state)
+{
+	if (state == NULL) {
+		return;
+	}
+	pthread_mutex_destroy(&state->mutex);
+	free(state);
+}
+
+// The window is the number of blocks that need to be in flight so that the
+// reader never waits: the read rate times the time a fetch takes, in blocks,
+// doubled for the variance.
+static int getWindow(ReadAheadState* state, int blockSize)
+{
+	int64_t elapsed = getCurrentTime() - state->streamStart;
+	if (elapsed <= 0) {
+		elapsed = 1;
+	}
+
+	pthread_mutex_lock(&statsMutex);
+	int64_t fetchTime = averageFetchTime;
+	pthread_mutex_unlock(&statsMutex);
+
+	double bytesInFlight = (double)state->streamBytes / elapsed * fetchTime;
+	int window = 2 * ((int)(bytesInFlight / blockSize) + 1);
+	if (window > conf.readAheadBlocks) {
+		window = conf.readAheadBlocks;
+	}
+	return window;
+}
+
+void readAheadPrepare(ReadAheadState* state, FilesystemFile* file,
+		off_t offset, size_t size, DynArray* blocksToPrefetch)
+{
+	if (state == NULL || file->blockSize == 0 || size == 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&state->mutex);
+	if (offset == state->nextOffset && file->content == state->content) {
+		state->sequentialReads++;
+	} else {
+		state->sequentialReads = 0;
+		state->content = file->content;
+		state->nextBlock = 0;
+		state->streamStart = getCurrentTime();
+		state->streamBytes = 0;
+	}
+	state->nextOffset = offset + size;
+	state->streamBytes += size;
+
+	// a single read is not a pattern yet
+	if (state->sequentialReads == 0) {
+		pthread_mutex_unlock(&state->mutex);
+		return;
+	}
+
+	BlockLayout layout = {file->blockSize, file->tierBlocks, file->chunkEnds, file->contentLen};
+	int lastBlock = blockLayoutIndex(&layout, offset + size - 1);
+	int fromBlock = lastBlock + 1;
+	if (fromBlock < state->nextBlock) {
+		fromBlock = state->nextBlock;
+	}
+	// blocks of a tiered file grow, the window is counted in the next ones
+	int toBlock = lastBlock + getWindow(state,
+		blockLayoutSize(&layout, lastBlock + 1));
+	if (toBlock >= file->contentLen) {
+		toBlock = file->contentLen - 1;
+	}
+
+	for (int i = fromBlock; i <= toBlock; i++) {
+		ReadAheadJob* job = malloc(sizeof(ReadAheadJob));
+		if (job == NULL) {
+			logPrintf(LOG_ERROR, "readAheadPrepare: malloc(): %s\n", strerror(errno));
+			break;
+		}
+		memcpy(job->block, file->content + MAX_STORAGE_NAME_LEN * i, MAX_STORAGE_NAME_LEN);
+		job->blockSize = blockLayoutSize(&layout, i);
+		job->expectedReadSize = blockLayoutBytes(&layout, i, file->size);
+		addToDynArray(blocksToPrefetch, job);
+		state->nextBlock = i + 1;
+	}
+	pthread_mutex_unlock(&state->mutex);
+}
+
+int readAheadIsSequential(ReadAheadState* state)
+{
+	if (state == NULL) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&state->mutex);
+	int sequential = (state->sequentialReads > 0);
+	pthread_mutex_unlock(&state->mutex);
+	return sequential;
+}
+
+static void fetchBlock(ReadAheadJob* job)
+{
+	// don't measure blocks that are cached already
+	if (cacheContains(job->block)) {
+		return;
+	}
+
+	size_t encryptedBlockBufSize = getMaxEncryptedBlockSize(job->blockSize);
+	char* encryptedBlockBuf = malloc(encryptedBlockBufSize);
+	if (encryptedBlockBuf == NULL) {
+		logPrintf(LOG_ERROR, "readAhead: malloc(): %s\n", strerror(errno));
+		return;
+	}
+
+	int64_t start = getCurrentTime();
+	CacheBuffer* decryptedBlock = NULL;
+	int result = getDecryptedBlock(job->block,
+		&decryptedBlock, job->blockSize,
+		encryptedBlockBuf, &encryptedBlockBufSize,
+		0, job->expectedReadSize);
+	int64_t fetchTime = getCurrentTime() - start;
+	free(encryptedBlockBuf);
+
+	if (result != 0) {
+		logPrintf(LOG_DEBUG, "readAhead: getDecryptedBlock failed for %s: %d\n", job->block, result);
+		return;
+	}
+	// it's in the cache now, that's all we wanted
+	cacheBufferUnref(decryptedBlock);
+
+	pthread_mutex_lock(&statsMutex);
+	if (averageFetchTime == 0) {
+		averageFetchTime = fetchTime;
+	} else {
+		averageFetchTime = (averageFetchTime * 7 + fetchTime) / 8;
+	}
+	readAheadFetched++;
+	pthread_mutex_unlock(&statsMutex);
+}
+
+static void readAheadWork(void* arg, int cancelled)
+{
+	ReadAheadJob* job = arg;
+	if (!cancelled) {
+		fetchBlock(job);
+	}
+	free(job);
+}
+
+void readAheadSubmit(DynArray* blocksToPrefetch)
+{
+	for (int i=0; i<blocksToPrefetch->len; i++) {
+		ReadAheadJob* job = blocksToPrefetch->objects[i];
+		// the blocks are fetched on demand when the pool is too busy
+		if (workPoolSubmit(readAheadWork, job, 0) != 0) {
+			pthread_mutex_lock(&statsMutex);
+			readAheadDropped++;
+			pthread_mutex_unlock(&statsMutex);
+			free(job);
+		}
+	}
+
+	freeDynArray(blocksToPrefetch);
+}
+
+void readAheadCleanup()
+{
+	if (readAheadFetched > 0 || readAheadDropped > 0) {
+		logPrintf(LOG_NOTE, "read ahead: %llu blocks fetched, %llu dropped, %lld us per block\n",
+			(unsigned long long)readAheadFetched,
+			(unsigned long long)readAheadDropped,
+			(long long)averageFetchTime);
+	}
+}
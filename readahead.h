@@ -0,0 +1,26 @@
+// Read-ahead: sequential reads of an open file are detected and the blocks
+// that follow are fetched into the block cache by the worker pool, see
+// workpool.h. The number of blocks requested ahead adapts to the read rate
+// and the time a fetch takes, up to conf.readAheadBlocks.
+
+// state of an open file, kept in fuse_file_info.fh
+typedef struct _ReadAheadState ReadAheadState;
+
+// logs the statistics, call after workPoolCleanup()
+void readAheadCleanup();
+
+// returns NULL if read-ahead is disabled, which the other functions accept
+ReadAheadState* readAheadNew();
+void readAheadFree(ReadAheadState* state);
+
+// records a read and copies the names of the blocks to fetch ahead to
+// blocksToPrefetch. The caller needs to hold file->mutex.
+void readAheadPrepare(ReadAheadState* state, FilesystemFile* file,
+		off_t offset, size_t size, DynArray* blocksToPrefetch);
+
+// whether the last read recorded by readAheadPrepare() continued a sequence
+int readAheadIsSequential(ReadAheadState* state);
+
+// queues the blocks for the worker pool and frees blocksToPrefetch, it doesn't
+// need any locks to be held
+void readAheadSubmit(DynArray* blocksToPrefetch);
@@ -3,8 +3,9 @@
 REPO_PATH="."
 #REPO_PATH="ssh://example.com/~/bucseTests"
 
-#ENCRYPTION="none"
-ENCRYPTION="aes"
+# every test runs with each of these
+#ENCRYPTIONS="none"
+ENCRYPTIONS="aes aes-hkdf aead"
 
 PASSWORD="12345"
 
@@ -14,19 +15,36 @@ VALGRIND="--valgrind"
 #DEBUG="--debug"
 DEBUG=""
 
-echo "========== test 1 =========="
-./test1.py -r $REPO_PATH -e $ENCRYPTION -p $PASSWORD $VALGRIND $DEBUG
-echo "========== test 2 =========="
-./test2.py -r $REPO_PATH -e $ENCRYPTION -p $PASSWORD $VALGRIND $DEBUG
-echo "========== test 3 =========="
-./test3.py -r $REPO_PATH -e $ENCRYPTION -p $PASSWORD $VALGRIND $DEBUG
-echo "========== test 4 =========="
-./test4.py -r $REPO_PATH -e $ENCRYPTION -p $PASSWORD $VALGRIND $DEBUG
-echo "========== test 5 =========="
-./test5.py -r $REPO_PATH -e $ENCRYPTION -p $PASSWORD $VALGRIND $DEBUG
-echo "========== test 6 =========="
-./test6.py -r $REPO_PATH -e $ENCRYPTION -p $PASSWORD $VALGRIND $DEBUG
-echo "========== test 7 =========="
-./test7.py -r $REPO_PATH -e $ENCRYPTION -p $PASSWORD $VALGRIND $DEBUG
-echo "========== test 8 =========="
-./test8.py -r $REPO_PATH -e $ENCRYPTION -p $PASSWORD $VALGRIND $DEBUG
+for ENCRYPTION in $ENCRYPTIONS
+do
+	echo "========== test 1, $ENCRYPTION =========="
+	./test1.py -r $REPO_PATH -e $ENCRYPTION -p $PASSWORD $VALGRIND $DEBUG
+	echo "========== test 2, $ENCRYPTION =========="
+	./test2.py -r $REPO_PATH -e $ENCRYPTION -p $PASSWORD $VALGRIND $DEBUG
+	echo "========== test 3, $ENCRYPTION =========="
+	./test3.py -r $REPO_PATH -e $ENCRYPTION -p $PASSWORD $VALGRIND $DEBUG
+	echo "========== test 4, $ENCRYPTION =========="
+	./test4.py -r $REPO_PATH -e $ENCRYPTION -p $PASSWORD $VALGRIND $DEBUG
+	echo "========== test 5, $ENCRYPTION =========="
+	./test5.py -r $REPO_PATH -e $ENCRYPTION -p $PASSWORD $VALGRIND $DEBUG
+	echo "========== test 6, $ENCRYPTION =========="
+	./test6.py -r $REPO_PATH -e $ENCRYPTION -p $PASSWORD $VALGRIND $DEBUG
+	echo "========== test 7, $ENCRYPTION =========="
+	./test7.py -r $REPO_PATH -e $ENCRYPTION -p $PASSWORD $VALGRIND $DEBUG
+	echo "========== test 8, $ENCRYPTION =========="
+	./test8.py -r $REPO_PATH -e $ENCRYPTION -p $PASSWORD $VALGRIND $DEBUG
+	echo "========== test 12, $ENCRYPTION =========="
+	./test12.py -r $REPO_PATH -e $ENCRYPTION -p $PASSWORD $VALGRIND $DEBUG
+	echo "========== test 13, $ENCRYPTION =========="
+	./test13.py -r $REPO_PATH -e $ENCRYPTION -p $PASSWORD $VALGRIND $DEBUG
+	echo "========== test 14, $ENCRYPTION =========="
+	./test14.py -r $REPO_PATH -e $ENCRYPTION -p $PASSWORD $VALGRIND $DEBUG
+	echo "========== test 15, $ENCRYPTION =========="
+	./test15.py -r $REPO_PATH -e $ENCRYPTION -p $PASSWORD $VALGRIND $DEBUG
+	echo "========== test 16, $ENCRYPTION =========="
+	./test16.py -r $REPO_PATH -e $ENCRYPTION -p $PASSWORD $VALGRIND $DEBUG
+	echo "========== test 17, $ENCRYPTION =========="
+	./test17.py -r $REPO_PATH -e $ENCRYPTION -p $PASSWORD $VALGRIND $DEBUG
+	echo "========== test 18, $ENCRYPTION =========="
+	./test18.py -r $REPO_PATH -e $ENCRYPTION -p $PASSWORD $VALGRIND $DEBUG
+done
@@ -19,6 +19,10 @@ valgrindProc = None
 
 failOnError = False
 
+# extra arguments of bucse-init, and of every bucse-mount run
+initArgs = []
+mountArgs = []
+
 
 def parseArgs():
     global argDebug
@@ -38,7 +42,7 @@ def parseArgs():
     parser.add_argument("--repo-path", "-r",
         help="Path where the repository will be placed.")
     parser.add_argument("--encryption", "-e",
-        help="Encryption to be used. \"none\" or \"aes\".")
+        help="Encryption to be used. \"none\", \"aes\", \"aes-hkdf\" or \"aead\".")
     parser.add_argument("--passphrase", "-p",
         help="Passphrase to be used.")
     args = parser.parse_args()
@@ -89,10 +93,10 @@ def mountDirs():
     p = subprocess.run(["mkdir", "test_%d" % pid])
     p.check_returncode()
 
-    p = subprocess.run(["../bucse-init", "-e", argEncryption, "-p", argPassphrase, "%s/test_%d_repo" % (argRepoPath, pid)])
+    p = subprocess.run(["../bucse-init", "-e", argEncryption, "-p", argPassphrase] + initArgs + ["%s/test_%d_repo" % (argRepoPath, pid)])
     p.check_returncode()
 
-    argsList = ["../bucse-mount", "-p", argPassphrase, "-r", "%s/test_%d_repo" % (argRepoPath, pid), "test_%d" % pid]
+    argsList = ["../bucse-mount", "-p", argPassphrase, "-r", "%s/test_%d_repo" % (argRepoPath, pid)] + mountArgs + ["test_%d" % pid]
 
     if failOnError:
         argsList += ["-f", "-v 4"]
@@ -150,7 +154,7 @@ def verifyWithMirror():
         if valgrindProc.returncode != 0:
             raise Exception("bucse-mount returned %d" % valgrindProc.returncode)
 
-    p = subprocess.run(["../bucse-mount", "-p", argPassphrase, "-r", "%s/test_%d_repo" % (argRepoPath, pid), "test_%d" % pid])
+    p = subprocess.run(["../bucse-mount", "-p", argPassphrase, "-r", "%s/test_%d_repo" % (argRepoPath, pid)] + mountArgs + ["test_%d" % pid])
     p.check_returncode()
 
     waitForRepoToBeMounted("test_%d" % pid)
@@ -177,7 +181,7 @@ def verifyFailOnError(printDebug = False):
     if printDebug:
         print(outputBytes.decode("utf-8"))
 
-    argsList = ["../bucse-mount", "-p", argPassphrase, "-r", "%s/test_%d_repo" % (argRepoPath, pid), "test_%d" % pid]
+    argsList = ["../bucse-mount", "-p", argPassphrase, "-r", "%s/test_%d_repo" % (argRepoPath, pid)] + mountArgs + ["test_%d" % pid]
     if printDebug:
         argsList = argsList + ["-v", "4"]
     p = subprocess.run(argsList)
@@ -391,6 +395,18 @@ def mirrorClose(filename, fd, fdMirror):
     os.close(fd)
     os.close(fdMirror)
 
+def countStorageFiles():
+    p = subprocess.run(["find", "test_%d_repo/storage" % pid, "-type", "f"], capture_output = True)
+    p.check_returncode()
+
+    return len(p.stdout.decode("UTF-8").split("\n")[:-1])
+
+def countActionFiles():
+    p = subprocess.run(["find", "test_%d_repo/actions" % pid, "-type", "f"], capture_output = True)
+    p.check_returncode()
+
+    return len(p.stdout.decode("UTF-8").split("\n")[:-1])
+
 def copyActions(actionsDir):
     p = subprocess.run(["cp -f %s/* test_%d_repo/actions/" % (actionsDir, pid)], shell=True)
     p.check_returncode()
@@ -0,0 +1,42 @@
+#!/bin/python3
+
+import bucseTests
+
+
+bucseTests.parseArgs()
+
+
+bucseTests.mountDirs()
+
+fileName = "__TESTDIR__/testfile.bin"
+
+fd, fdMirror = bucseTests.mirrorCreate(fileName)
+bucseTests.mirrorOp(fileName, fd, fdMirror, "write", 300*1024, 0)
+bucseTests.mirrorClose(fileName, fd, fdMirror)
+
+# shrink and extend again before the flush, the data past the cut reads as zeros
+fd, fdMirror = bucseTests.mirrorOpen(fileName)
+bucseTests.mirrorOp(fileName, fd, fdMirror, "truncate", 100*1024 + 123, 0)
+bucseTests.mirrorOp(fileName, fd, fdMirror, "truncate", 250*1024, 0)
+bucseTests.mirrorOp(fileName, fd, fdMirror, "read", 250*1024, 0)
+bucseTests.mirrorOp(fileName, fd, fdMirror, "flush", 0, 0)
+bucseTests.mirrorClose(fileName, fd, fdMirror)
+
+# a flush with nothing but a truncation, then extending the shorter last block
+fd, fdMirror = bucseTests.mirrorOpen(fileName)
+bucseTests.mirrorOp(fileName, fd, fdMirror, "truncate", 70000, 0)
+bucseTests.mirrorOp(fileName, fd, fdMirror, "flush", 0, 0)
+bucseTests.mirrorOp(fileName, fd, fdMirror, "write", 1000, 200000)
+bucseTests.mirrorOp(fileName, fd, fdMirror, "flush", 0, 0)
+bucseTests.mirrorOp(fileName, fd, fdMirror, "read", 201000, 0)
+bucseTests.mirrorClose(fileName, fd, fdMirror)
+
+# shrink in the middle of a block, then write past the old end
+fd, fdMirror = bucseTests.mirrorOpen(fileName)
+bucseTests.mirrorOp(fileName, fd, fdMirror, "truncate", 33333, 0)
+bucseTests.mirrorOp(fileName, fd, fdMirror, "write", 4096, 320*1024)
+bucseTests.mirrorClose(fileName, fd, fdMirror)
+
+
+bucseTests.verifyWithMirror()
+bucseTests.testCleanup()
@@ -0,0 +1,37 @@
+#!/bin/python3
+
+import bucseTests
+
+
+bucseTests.parseArgs()
+
+
+bucseTests.initArgs = ["-b", "tiered"]
+
+bucseTests.mountDirs()
+
+fileName = "__TESTDIR__/testfile.bin"
+
+# a small file starts with the smallest blocks, appending to it in many
+# flushes goes well past the 16 blocks of the first tier into several tiers
+fd, fdMirror = bucseTests.mirrorCreate(fileName)
+bucseTests.mirrorOp(fileName, fd, fdMirror, "write", 2000, 0)
+bucseTests.mirrorOp(fileName, fd, fdMirror, "flush", 0, 0)
+offset = 2000
+for i in range(60):
+    size = 3000 + i * 97
+    bucseTests.mirrorOp(fileName, fd, fdMirror, "write", size, offset)
+    bucseTests.mirrorOp(fileName, fd, fdMirror, "flush", 0, 0)
+    offset += size
+bucseTests.mirrorClose(fileName, fd, fdMirror)
+
+# rewrite across a tier boundary and a bit of the tail
+fd, fdMirror = bucseTests.mirrorOpen(fileName)
+bucseTests.mirrorOp(fileName, fd, fdMirror, "write", 4000, 6000)
+bucseTests.mirrorOp(fileName, fd, fdMirror, "write", 20000, offset - 10000)
+bucseTests.mirrorOp(fileName, fd, fdMirror, "read", offset + 10000, 0)
+bucseTests.mirrorClose(fileName, fd, fdMirror)
+
+
+bucseTests.verifyWithMirror()
+bucseTests.testCleanup()
@@ -0,0 +1,48 @@
+#!/bin/python3
+
+import bucseTests
+import subprocess
+import sys
+
+
+bucseTests.parseArgs()
+
+
+# dedup needs a repository key, which aes doesn't have
+if bucseTests.argEncryption == "aes":
+    print("skipped, dedup doesn't work with aes")
+    sys.exit(0)
+
+bucseTests.initArgs = ["-b", "chunked"]
+bucseTests.mountArgs = ["-o", "dedup"]
+
+fileName = bucseTests.makeRandomTmpFileKBytes(16384, False)
+headerName = bucseTests.makeRandomTmpFile(5000, False)
+
+p = subprocess.run(["sh", "-c", "cat tmp/%s tmp/%s > tmp/%s.shifted" % (headerName, fileName, fileName)])
+p.check_returncode()
+bucseTests.tmpFiles.append("%s.shifted" % fileName)
+
+bucseTests.mountDirs()
+
+bucseTests.mirrorCommand(["cp", "tmp/%s" % fileName, "__TESTDIR__/first.bin"])
+p = subprocess.run(["sync"])
+p.check_returncode()
+storageFiles = bucseTests.countStorageFiles() if bucseTests.argRepoPath == "." else 0
+
+# the same data again, as a whole and shifted by a few bytes
+bucseTests.mirrorCommand(["cp", "tmp/%s" % fileName, "__TESTDIR__/second.bin"])
+bucseTests.mirrorCommand(["cp", "tmp/%s.shifted" % fileName, "__TESTDIR__/shifted.bin"])
+bucseTests.mirrorCommand(["mkdir", "__TESTDIR__/d"])
+bucseTests.mirrorCommand(["cp", "tmp/%s" % fileName, "__TESTDIR__/d/third.bin"])
+p = subprocess.run(["sync"])
+p.check_returncode()
+
+# the copies add a few blocks at most, not another file's worth
+if bucseTests.argRepoPath == ".":
+    newStorageFiles = bucseTests.countStorageFiles() - storageFiles
+    if newStorageFiles > storageFiles / 2:
+        raise Exception("duplicate data took %d new blocks, the first copy %d" % (newStorageFiles, storageFiles))
+
+bucseTests.verifyWithMirror()
+bucseTests.testCleanup()
@@ -0,0 +1,43 @@
+#!/bin/python3
+
+import bucseTests
+
+
+bucseTests.parseArgs()
+
+
+bucseTests.mountArgs = ["-o", "lowlevel"]
+
+bucseTests.mountDirs()
+
+for _ in range(64):
+    bucseTests.mirrorCommand(["mkdir", bucseTests.getRandomNewFileName()])
+for _ in range(10):
+    fileName = bucseTests.makeRandomTmpFile()
+    targetDir = bucseTests.getRandomExistingDirName()
+    bucseTests.mirrorCommand(["cp", "tmp/%s"%fileName, "%s/"%targetDir])
+
+for _ in range(5):
+    fileName = bucseTests.getRandomExistingFileName()
+    fd, fdMirror = bucseTests.mirrorOpen(fileName)
+    for _ in range(20):
+        bucseTests.mirrorRandomOp(fileName, fd, fdMirror)
+    bucseTests.mirrorClose(fileName, fd, fdMirror)
+
+fileName = "__TESTDIR__/testfile.bin"
+fd, fdMirror = bucseTests.mirrorCreate(fileName)
+bucseTests.mirrorOp(fileName, fd, fdMirror, "write", 128*1024, 0)
+bucseTests.mirrorOp(fileName, fd, fdMirror, "truncate", 64*1024, 0)
+bucseTests.mirrorClose(fileName, fd, fdMirror)
+
+# renames and removals look the inodes up by their parents
+bucseTests.mirrorCommand(["mkdir", "__TESTDIR__/foo"])
+bucseTests.mirrorCommand(["mv", fileName, "__TESTDIR__/foo/moved.bin"])
+bucseTests.mirrorCommand(["cp", "__TESTDIR__/foo/moved.bin", "__TESTDIR__/copy.bin"])
+bucseTests.mirrorCommand(["mv", "-f", "__TESTDIR__/copy.bin", "__TESTDIR__/foo/moved.bin"])
+bucseTests.mirrorCommand(["mkdir", "__TESTDIR__/bar"])
+bucseTests.mirrorCommand(["rmdir", "__TESTDIR__/bar"])
+
+
+bucseTests.verifyWithMirror()
+bucseTests.testCleanup()
@@ -0,0 +1,37 @@
+#!/bin/python3
+
+import bucseTests
+
+
+bucseTests.parseArgs()
+
+
+# closed files are written out by the flusher, the unmount has to wait for
+# the ones still queued
+bucseTests.mountArgs = ["-o", "lazy_close"]
+
+bucseTests.mountDirs()
+
+for d in range(8):
+    bucseTests.mirrorCommand(["mkdir", "__TESTDIR__/d%d" % d])
+
+for i in range(400):
+    fileName = "__TESTDIR__/d%d/f%d.bin" % (i % 8, i)
+    fd, fdMirror = bucseTests.mirrorCreate(fileName)
+    bucseTests.mirrorOp(fileName, fd, fdMirror, "write", (i * 37) % 5000, 0)
+    bucseTests.mirrorClose(fileName, fd, fdMirror)
+
+# rewrites, renames and removals of files that may not be written out yet
+for i in range(0, 400, 7):
+    fileName = "__TESTDIR__/d%d/f%d.bin" % (i % 8, i)
+    fd, fdMirror = bucseTests.mirrorOpen(fileName)
+    bucseTests.mirrorOp(fileName, fd, fdMirror, "write", 100, 10)
+    bucseTests.mirrorClose(fileName, fd, fdMirror)
+for i in range(1, 400, 11):
+    bucseTests.mirrorCommand(["mv", "__TESTDIR__/d%d/f%d.bin" % (i % 8, i), "__TESTDIR__/d0/moved%d.bin" % i])
+for i in range(2, 400, 13):
+    bucseTests.mirrorCommand(["rm", "__TESTDIR__/d%d/f%d.bin" % (i % 8, i)])
+
+
+bucseTests.verifyWithMirror()
+bucseTests.testCleanup()
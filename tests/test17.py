@@ -0,0 +1,33 @@
+#!/bin/python3
+
+import bucseTests
+
+
+bucseTests.parseArgs()
+
+
+# with lazy_close only fsync() waits for the data to be written out
+bucseTests.mountArgs = ["-o", "lazy_close"]
+
+bucseTests.mountDirs()
+
+fileName = "__TESTDIR__/testfile.bin"
+
+fd, fdMirror = bucseTests.mirrorCreate(fileName)
+bucseTests.mirrorOp(fileName, fd, fdMirror, "write", 300*1024, 0)
+actionFiles = bucseTests.countActionFiles() if bucseTests.argRepoPath == "." else 0
+bucseTests.mirrorOp(fileName, fd, fdMirror, "flush", 0, 0)
+
+# the file is still open, so only the fsync could have added the action
+if bucseTests.argRepoPath == "." and bucseTests.countActionFiles() <= actionFiles:
+    raise Exception("fsync did not write the file out")
+
+bucseTests.mirrorOp(fileName, fd, fdMirror, "write", 5000, 100*1024)
+bucseTests.mirrorOp(fileName, fd, fdMirror, "truncate", 200*1024, 0)
+bucseTests.mirrorOp(fileName, fd, fdMirror, "flush", 0, 0)
+bucseTests.mirrorOp(fileName, fd, fdMirror, "write", 1000, 250*1024)
+bucseTests.mirrorClose(fileName, fd, fdMirror)
+
+
+bucseTests.verifyWithMirror()
+bucseTests.testCleanup()
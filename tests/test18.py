@@ -0,0 +1,46 @@
+#!/bin/python3
+
+import bucseTests
+import os
+
+
+bucseTests.parseArgs()
+
+
+# the mount runs in the background, in another directory
+diskCacheDir = "diskcache_%d" % bucseTests.pid
+os.mkdir("tmp/%s" % diskCacheDir)
+bucseTests.tmpFiles.append(diskCacheDir)
+diskCachePath = os.path.realpath("tmp/%s" % diskCacheDir)
+bucseTests.mountArgs = ["-o", "disk_cache=%s" % diskCachePath]
+
+bucseTests.mountDirs()
+
+for i in range(5):
+    fileName = bucseTests.makeRandomTmpFileKBytes(2048)
+    bucseTests.mirrorCommand(["cp", "tmp/%s" % fileName, "__TESTDIR__/f%d.bin" % i])
+
+# written blocks aren't cached on disk, the remount reads them all from the
+# destination
+bucseTests.verifyWithMirror()
+
+cachedBlocks = sorted(name for name in os.listdir(diskCachePath) if not name.startswith("."))
+if len(cachedBlocks) == 0:
+    raise Exception("nothing was cached in %s" % diskCachePath)
+
+# a damaged block is dropped from the disk cache and fetched again; with no
+# encryption it can't be told from a good one
+damagedBlock = "%s/%s" % (diskCachePath, cachedBlocks[0])
+damagedSize = os.path.getsize(damagedBlock)
+if bucseTests.argEncryption != "none":
+    with open(damagedBlock, "r+b") as f:
+        f.truncate(5)
+
+# the next remount reads everything from the disk cache
+bucseTests.verifyWithMirror()
+
+if bucseTests.argEncryption != "none" and os.path.getsize(damagedBlock) != damagedSize:
+    raise Exception("the damaged block %s was not fetched again" % damagedBlock)
+
+
+bucseTests.testCleanup()
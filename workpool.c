@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "log.h"
+
+#include "workpool.h"
+
+// background work beyond this is refused, urgent work is always queued
+#define WORK_POOL_MAX_QUEUED 256
+
+typedef struct _Work {
+	struct _Work* next;
+	WorkFunc func;
+	void* arg;
+	int urgent;
+} Work;
+
+// urgent work is queued in front of the background work, both in FIFO order
+static Work* firstWork;
+static Work* lastUrgentWork;
+static Work* lastWork;
+static int backgroundCount;
+
+static pthread_mutex_t workMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workCond = PTHREAD_COND_INITIALIZER;
+static int shutdownWorkers;
+
+static pthread_t* workers;
+static int workersCount;
+
+static void* workerFunc(void* param)
+{
+	pthread_mutex_lock(&workMutex);
+	for (;;) {
+		while (firstWork == NULL && !shutdownWorkers) {
+			pthread_cond_wait(&workCond, &workMutex);
+		}
+		if (shutdownWorkers) {
+			break;
+		}
+		Work* work = firstWork;
+		firstWork = work->next;
+		if (lastUrgentWork == work) {
+			lastUrgentWork = NULL;
+		}
+		if (lastWork == work) {
+			lastWork = NULL;
+		}
+		if (!work->urgent) {
+			backgroundCount--;
+		}
+		pthread_mutex_unlock(&workMutex);
+
+		work->func(work->arg, 0);
+		free(work);
+
+		pthread_mutex_lock(&workMutex);
+	}
+	pthread_mutex_unlock(&workMutex);
+	return NULL;
+}
+
+int workPoolInit(int threadsCount)
+{
+	shutdownWorkers = 0;
+	workersCount = 0;
+	if (threadsCount <= 0) {
+		return 0;
+	}
+
+	workers = malloc(threadsCount * sizeof(pthread_t));
+	if (workers == NULL) {
+		logPrintf(LOG_ERROR, "workPoolInit: malloc(): %s\n", strerror(errno));
+		return 1;
+	}
+	for (int i=0; i<threadsCount; i++) {
+		int ret = pthread_create(&workers[i], NULL, workerFunc, NULL);
+		if (ret != 0) {
+			logPrintf(LOG_ERROR, "workPoolInit: pthread_create: %d\n", ret);
+			workPoolCleanup();
+			return 2;
+		}
+		workersCount++;
+	}
+	return 0;
+}
+
+int workPoolSubmit(WorkFunc func, void* arg, int urgent)
+{
+	Work* work = malloc(sizeof(Work));
+	if (work == NULL) {
+		logPrintf(LOG_ERROR, "workPoolSubmit: malloc(): %s\n", strerror(errno));
+		return 1;
+	}
+	work->func = func;
+	work->arg = arg;
+	work->urgent = urgent;
+	work->next = NULL;
+
+	pthread_mutex_lock(&workMutex);
+	if (workersCount == 0 || shutdownWorkers
+			|| (!urgent && backgroundCount >= WORK_POOL_MAX_QUEUED)) {
+		pthread_mutex_unlock(&workMutex);
+		free(work);
+		return 2;
+	}
+
+	if (urgent) {
+		// after the other urgent work, before the background work
+		if (lastUrgentWork) {
+			work->next = lastUrgentWork->next;
+			lastUrgentWork->next = work;
+		} else {
+			work->next = firstWork;
+			firstWork = work;
+		}
+		lastUrgentWork = work;
+		if (work->next == NULL) {
+			lastWork = work;
+		}
+	} else {
+		if (lastWork) {
+			lastWork->next = work;
+		} else {
+			firstWork = work;
+		}
+		lastWork = work;
+		backgroundCount++;
+	}
+	pthread_cond_signal(&workCond);
+	pthread_mutex_unlock(&workMutex);
+	return 0;
+}
+
+int workPoolTake(WorkFunc func, void* arg)
+{
+	pthread_mutex_lock(&workMutex);
+	Work* prev = NULL;
+	for (Work* work = firstWork; work != NULL; prev = work, work = work->next) {
+		if (work->func != func || work->arg != arg) {
+			continue;
+		}
+
+		if (prev) {
+			prev->next = work->next;
+		} else {
+			firstWork = work->next;
+		}
+		if (lastUrgentWork == work) {
+			lastUrgentWork = (prev && prev->urgent) ? prev : NULL;
+		}
+		if (lastWork == work) {
+			lastWork = prev;
+		}
+		if (!work->urgent) {
+			backgroundCount--;
+		}
+		pthread_mutex_unlock(&workMutex);
+		free(work);
+		return 1;
+	}
+	pthread_mutex_unlock(&workMutex);
+	return 0;
+}
+
+void workGroupInit(WorkGroup* group)
+{
+	pthread_mutex_init(&group->mutex, NULL);
+	pthread_cond_init(&group->cond, NULL);
+	group->pending = 0;
+}
+
+void workGroupDestroy(WorkGroup* group)
+{
+	pthread_mutex_destroy(&group->mutex);
+	pthread_cond_destroy(&group->cond);
+}
+
+void workGroupAdd(WorkGroup* group)
+{
+	pthread_mutex_lock(&group->mutex);
+	group->pending++;
+	pthread_mutex_unlock(&group->mutex);
+}
+
+void workGroupDone(WorkGroup* group)
+{
+	pthread_mutex_lock(&group->mutex);
+	group->pending--;
+	pthread_cond_broadcast(&group->cond);
+	pthread_mutex_unlock(&group->mutex);
+}
+
+int workGroupPending(WorkGroup* group)
+{
+	pthread_mutex_lock(&group->mutex);
+	int pending = group->pending;
+	pthread_mutex_unlock(&group->mutex);
+	return pending;
+}
+
+void workGroupWait(WorkGroup* group, int maxPending)
+{
+	pthread_mutex_lock(&group->mutex);
+	while (group->pending > maxPending) {
+		pthread_cond_wait(&group->cond, &group->mutex);
+	}
+	pthread_mutex_unlock(&group->mutex);
+}
+
+void workPoolCleanup()
+{
+	pthread_mutex_lock(&workMutex);
+	shutdownWorkers = 1;
+	pthread_cond_broadcast(&workCond);
+	pthread_mutex_unlock(&workMutex);
+
+	for (int i=0; i<workersCount; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	if (workers) {
+		free(workers);
+		workers = NULL;
+	}
+	workersCount = 0;
+
+	// let the owners free what's left
+	while (firstWork) {
+		Work* work = firstWork;
+		firstWork = work->next;
+		work->func(work->arg, 1);
+		free(work);
+	}
+	lastUrgentWork = lastWork = NULL;
+	backgroundCount = 0;
+}
@@ -0,0 +1,34 @@
+// A pool of worker threads, shared by the code that fetches and decrypts
+// blocks: read-ahead queues background work, reads spanning several blocks
+// queue urgent work, which runs before any background work.
+
+// cancelled is set when the pool shuts down before the work ran, the
+// function only needs to free its argument then
+typedef void (*WorkFunc)(void* arg, int cancelled);
+
+// threadsCount 0 makes a pool that refuses all work
+int workPoolInit(int threadsCount);
+void workPoolCleanup();
+
+// returns 0 when queued, nonzero when the caller needs to do the work itself
+// (or drop it): no workers, or too much background work queued already
+int workPoolSubmit(WorkFunc func, void* arg, int urgent);
+
+// removes work that no worker has started yet, returns 1 if it was removed,
+// so the caller can do it itself instead of waiting
+int workPoolTake(WorkFunc func, void* arg);
+
+// counts the work of one caller that hasn't finished yet
+typedef struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int pending;
+} WorkGroup;
+
+void workGroupInit(WorkGroup* group);
+void workGroupDestroy(WorkGroup* group);
+void workGroupAdd(WorkGroup* group);
+void workGroupDone(WorkGroup* group);
+int workGroupPending(WorkGroup* group);
+// waits until no more than maxPending work is left
+void workGroupWait(WorkGroup* group, int maxPending);
@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <fuse.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "dynarray.h"
+#include "nameindex.h"
+#include "dirtymap.h"
+#include "filesystem.h"
+#include "actions.h"
+#include "time.h"
+#include "log.h"
+#include "conf.h"
+#include "operations/operations.h"
+#include "operations/flush.h"
+
+#include "writeback.h"
+
+// Lock order: bucseTreeLock, file->mutex, writeBackMutex. The flusher takes
+// bucseTreeLock before it picks a file, and starts its flush before letting
+// go of it, a file that is flushing is not freed, see flush.h.
+static pthread_mutex_t writeBackMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writeBackCond = PTHREAD_COND_INITIALIZER;
+
+// files with dirty data and the sum of their dirty bytes, guarded by
+// writeBackMutex, as are the writeBack fields of the files
+static DynArray dirtyFiles;
+static size_t dirtyBytes;
+
+static pthread_t flusherThread;
+static int flusherStarted;
+static int shutdownFlusher;
+
+static uint64_t writeBackFlushed;
+static uint64_t writeBackFailed;
+
+// adds the file to dirtyFiles, the caller needs to hold writeBackMutex
+static int addDirtyFile(FilesystemFile* file)
+{
+	if (file->writeBackSince != 0) {
+		return 0;
+	}
+	if (addToDynArray(&dirtyFiles, file) != 0) {
+		return 1;
+	}
+	file->writeBackSince = getCurrentTime();
+	file->writeBackBytes = 0;
+	file->writeBackClosed = 0;
+	return 0;
+}
+
+int writeBackMarkDirty(FilesystemFile* file)
+{
+	size_t bytes = dirtyMapBytes(&file->dirtyMap);
+
+	pthread_mutex_lock(&writeBackMutex);
+	if (addDirtyFile(file) != 0) {
+		// without the flusher, the writer takes care of it
+		pthread_mutex_unlock(&writeBackMutex);
+		return 1;
+	}
+	dirtyBytes += bytes - file->writeBackBytes;
+	file->writeBackBytes = bytes;
+
+	if (dirtyBytes > conf.dirtyBytes) {
+		pthread_cond_signal(&writeBackCond);
+	}
+	int throttle = dirtyBytes > 2 * (size_t)conf.dirtyBytes;
+	pthread_mutex_unlock(&writeBackMutex);
+	return throttle;
+}
+
+int writeBackClose(FilesystemFile* file)
+{
+	if (file->dirtyFlags == DirtyFlagNotDirty) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&writeBackMutex);
+	if (addDirtyFile(file) != 0) {
+		pthread_mutex_unlock(&writeBackMutex);
+		return 1;
+	}
+	file->writeBackClosed = 1;
+	pthread_cond_signal(&writeBackCond);
+	pthread_mutex_unlock(&writeBackMutex);
+	return 0;
+}
+
+int64_t writeBackRemove(FilesystemFile* file)
+{
+	pthread_mutex_lock(&writeBackMutex);
+	int64_t since = file->writeBackSince;
+	if (file->writeBackSince != 0) {
+		removeFromDynArrayUnordered(&dirtyFiles, file);
+		dirtyBytes -= file->writeBackBytes;
+		file->writeBackSince = 0;
+		file->writeBackBytes = 0;
+		file->writeBackClosed = 0;
+	}
+	pthread_mutex_unlock(&writeBackMutex);
+	return since;
+}
+
+void writeBackRestore(FilesystemFile* file, int64_t since)
+{
+	size_t bytes = dirtyMapBytes(&file->dirtyMap);
+
+	pthread_mutex_lock(&writeBackMutex);
+	if (addDirtyFile(file) == 0) {
+		// so that it's retried on the next round
+		if (since != 0 && since < file->writeBackSince) {
+			file->writeBackSince = since;
+		}
+		dirtyBytes += bytes - file->writeBackBytes;
+		file->writeBackBytes = bytes;
+	}
+	pthread_mutex_unlock(&writeBackMutex);
+}
+
+// a closed file, or the oldest dirty file if it's due, or any if all is set,
+// the caller needs to hold writeBackMutex
+static FilesystemFile* pickDirtyFile(int all)
+{
+	FilesystemFile* oldest = NULL;
+	for (int i=0; i<dirtyFiles.len; i++) {
+		FilesystemFile* file = dirtyFiles.objects[i];
+		if (file->writeBackClosed) {
+			return file;
+		}
+		if (oldest == NULL || file->writeBackSince < oldest->writeBackSince) {
+			oldest = file;
+		}
+	}
+	if (oldest == NULL || all || dirtyBytes > conf.dirtyBytes) {
+		return oldest;
+	}
+	if (conf.dirtyExpire > 0 && getCurrentTime() - oldest->writeBackSince
+			>= (int64_t)conf.dirtyExpire * 1000000) {
+		return oldest;
+	}
+	return NULL;
+}
+
+// flushes the files that are due, one at a time. The blocks are stored
+// without bucseTreeLock, so that the other operations don't wait for the
+// destination. Stops at the first failure.
+static int writeBackRun(int all)
+{
+	for (;;) {
+		pthread_rwlock_rdlock(&bucseTreeLock);
+		pthread_mutex_lock(&writeBackMutex);
+		FilesystemFile* file = pickDirtyFile(all);
+		pthread_mutex_unlock(&writeBackMutex);
+		if (file == NULL) {
+			pthread_rwlock_unlock(&bucseTreeLock);
+			return 0;
+		}
+
+		pthread_mutex_lock(&file->mutex);
+		PendingFlush* flush = NULL;
+		int result = flushFileStart(file, &flush);
+		if (result == 0 && flush == NULL) {
+			// the file may have had nothing to flush, e.g. when it was
+			// replaced by a remote action
+			writeBackRemove(file);
+		}
+		pthread_mutex_unlock(&file->mutex);
+		pthread_rwlock_unlock(&bucseTreeLock);
+
+		if (flush != NULL) {
+			result = flushFileFinish(flush);
+		}
+
+		pthread_mutex_lock(&writeBackMutex);
+		if (result != 0) {
+			writeBackFailed++;
+			pthread_mutex_unlock(&writeBackMutex);
+			// the file stays dirty, it's retried on the next round
+			logPrintf(LOG_ERROR, "writeBackRun: flushFile failed: %d\n", result);
+			return 1;
+		}
+		writeBackFlushed++;
+		pthread_mutex_unlock(&writeBackMutex);
+	}
+}
+
+static void* flusherThreadFunc(void* param)
+{
+	int failed = 0;
+	pthread_mutex_lock(&writeBackMutex);
+	while (!shutdownFlusher) {
+		// look at the dirty files every second, or once there are too many
+		// dirty bytes or a file is closed, but don't retry failed flushes
+		// right away
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += 1;
+		if (failed || dirtyBytes <= conf.dirtyBytes) {
+			pthread_cond_timedwait(&writeBackCond, &writeBackMutex, &until);
+		}
+		if (shutdownFlusher) {
+			break;
+		}
+		pthread_mutex_unlock(&writeBackMutex);
+
+		failed = writeBackRun(0);
+
+		pthread_mutex_lock(&writeBackMutex);
+	}
+	pthread_mutex_unlock(&writeBackMutex);
+	return NULL;
+}
+
+int writeBackInit()
+{
+	shutdownFlusher = 0;
+	int ret = pthread_create(&flusherThread, NULL, flusherThreadFunc, NULL);
+	if (ret != 0) {
+		logPrintf(LOG_ERROR, "writeBackInit: pthread_create: %d\n", ret);
+		return 1;
+	}
+	flusherStarted = 1;
+	return 0;
+}
+
+void writeBackCleanup()
+{
+	if (flusherStarted) {
+		pthread_mutex_lock(&writeBackMutex);
+		shutdownFlusher = 1;
+		pthread_cond_signal(&writeBackCond);
+		pthread_mutex_unlock(&writeBackMutex);
+
+		int ret = pthread_join(flusherThread, NULL);
+		if (ret != 0) {
+			logPrintf(LOG_ERROR, "writeBackCleanup: pthread_join: %d\n", ret);
+		}
+		flusherStarted = 0;
+	}
+
+	// released files are flushed already, this catches the failed ones
+	writeBackRun(1);
+	if (dirtyFiles.len > 0) {
+		// they're forgotten when the filesystem is freed
+		logPrintf(LOG_ERROR, "writeBackCleanup: %d files could not be flushed\n", dirtyFiles.len);
+	} else {
+		freeDynArray(&dirtyFiles);
+	}
+
+	logPrintf(LOG_DEBUG, "write-behind: %lu files flushed, %lu flushes failed\n",
+		(unsigned long)writeBackFlushed, (unsigned long)writeBackFailed);
+}
@@ -0,0 +1,26 @@
+// Write-behind: files with dirty data are written out by a flusher thread,
+// once their data is older than conf.dirtyExpire seconds, or, oldest first,
+// while all the dirty data takes more than conf.dirtyBytes. Writers only
+// flush their own file when the dirty data grows past twice that. With
+// conf.lazyClose, closed files are written out by the flusher too.
+
+// starts the flusher thread, call after workPoolInit()
+int writeBackInit();
+// stops the flusher thread and writes out what's left, call before
+// workPoolCleanup()
+void writeBackCleanup();
+
+// records that the file got dirty data, the caller needs to hold
+// file->mutex. Returns 1 when the caller should flush the file itself.
+int writeBackMarkDirty(FilesystemFile* file);
+// queues a file closed with conf.lazyClose to be written out right away, the
+// caller needs to hold file->mutex. Returns 1 when the caller should flush
+// the file itself.
+int writeBackClose(FilesystemFile* file);
+// forgets the file once its flush starts or it is freed, the caller needs to
+// hold file->mutex or bucseTreeLock for writing. Returns when the file got
+// dirty, 0 if it wasn't.
+int64_t writeBackRemove(FilesystemFile* file);
+// records the file again after its flush failed, as dirty since the time
+// writeBackRemove() returned, the caller needs to hold file->mutex
+void writeBackRestore(FilesystemFile* file, int64_t since);